@@ -1,6 +1,11 @@
+import os
+
 from django.db import models
+from django.db.models.signals import post_save, post_delete
 from django.contrib.auth.models import User as AuthUser
 
+from acm_soda.settings import SODA_PRODUCTS
+
 class Client(models.Model):
     auth_key = models.CharField(max_length=200)
     name = models.CharField(max_length=200, primary_key=True)
@@ -95,4 +100,28 @@ class Inventory(models.Model):
     def getInventoryForSlot(slot):
         return Inventory.returnQs(Inventory.objects.select_related(depth=1).filter(slot=slot).all())
 
+def write_product_map(sender, **kwargs):
+    """Tells sodaDaemon which slots hold each soda, so that it can pick the
+    slot to vend from itself. Written whole and renamed into place, since
+    the daemon reloads it as soon as it changes."""
+    slots = {}
+    for inventory in Inventory.objects.filter(soda__disabled=False):
+        slots.setdefault(inventory.soda_id, []).append(str(inventory.slot))
+
+    temporary = SODA_PRODUCTS + '.new'
+    try:
+        products = open(temporary, 'w')
+        for name in sorted(slots):
+            products.write('%s %s\n' % (name, ' '.join(slots[name])))
+        products.close()
+        os.rename(temporary, SODA_PRODUCTS)
+    except (IOError, OSError):
+        # No daemon here (e.g. development); it keeps its last map otherwise
+        pass
+
+post_save.connect(write_product_map, sender=Inventory)
+post_delete.connect(write_product_map, sender=Inventory)
+post_save.connect(write_product_map, sender=Soda)
+post_delete.connect(write_product_map, sender=Soda)
+
 adminable = (Inventory, MachineUser, Soda, Transaction, SodaTransaction, Client)
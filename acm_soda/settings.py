@@ -4,8 +4,12 @@ import socket
 DEBUG = True
 TEMPLATE_DEBUG = DEBUG
 
-SODA_FIFO_IN = '/tmp/vendsodain'
-SODA_FIFO_OUT = '/tmp/vendsodaout'
+SODA_SOCKET = '/pipes/vendsoda.sock'
+# Which slots hold which soda, for sodaDaemon's product vends
+SODA_PRODUCTS = '/pipes/vendsoda.products'
+# Seconds to wait for one vend answer, and for a vend in all
+SODA_VEND_TIMEOUT = 5
+SODA_VEND_PATIENCE = 30
 
 ADMINS = (
     ('Josh Bohde', 'josh.bohde@gmail.com'),
@@ -21,3 +21,87 @@ Another way to test that 1 + 1 is equal to 2.
 True
 """}
 
+
+import os
+import shutil
+import socket
+import tempfile
+import threading
+
+from acm_soda.web import views
+
+class FakeDaemon(threading.Thread):
+    """Answers one connection per answer on a Unix socket, as sodaDaemon
+    would, and keeps the request lines it read. An answer of None reads
+    the line and never answers it, so the client times out."""
+    def __init__(self, path, answers):
+        threading.Thread.__init__(self)
+        self.daemon = True
+        self.answers = answers
+        self.lines = []
+        self.listener = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.listener.bind(path)
+        self.listener.listen(1)
+
+    def run(self):
+        for answer in self.answers:
+            connection = self.listener.accept()[0]
+            self.lines.append(connection.makefile('rb').readline()
+                              .decode('ascii').strip())
+            if answer is None:
+                # Held until the client gives up and closes its end
+                connection.recv(1)
+            else:
+                connection.sendall(('%s\n' % answer).encode('ascii'))
+            connection.close()
+        self.listener.close()
+
+    def key(self, line):
+        return [word for word in line.split() if word.startswith('key=')][0]
+
+class VendRequestTest(TestCase):
+    """vend_request() against a fake daemon socket"""
+    def setUp(self):
+        self.directory = tempfile.mkdtemp()
+        self.saved = (views.SODA_SOCKET, views.SODA_VEND_TIMEOUT)
+        views.SODA_SOCKET = os.path.join(self.directory, 'vendsoda.sock')
+        views.SODA_VEND_TIMEOUT = 0.5
+
+    def tearDown(self):
+        views.SODA_SOCKET, views.SODA_VEND_TIMEOUT = self.saved
+        shutil.rmtree(self.directory)
+
+    def vend(self, answers, client='web'):
+        daemon = FakeDaemon(views.SODA_SOCKET, answers)
+        daemon.start()
+        try:
+            return daemon, views.vend_request('P cola', client)
+        finally:
+            daemon.join(5)
+
+    def test_vended(self):
+        daemon, answer = self.vend(['0 slot=3'])
+        self.assertEqual(answer, '0 slot=3')
+        self.assertEqual(len(daemon.lines), 1)
+        self.assertTrue(daemon.lines[0].startswith('P cola client=web key='))
+
+    def test_user_name_as_client(self):
+        daemon, answer = self.vend(['0 slot=3'], 'jane.doe+soda@x')
+        self.assertTrue(daemon.lines[0].startswith(
+            'P cola client=jane.doe_soda_x key='))
+
+    def test_sold_out(self):
+        self.assertRaises(Exception, self.vend, ['1'])
+
+    def test_busy_retries_with_the_same_key(self):
+        daemon, answer = self.vend(['BUSY 10', '0 slot=4'])
+        self.assertEqual(answer, '0 slot=4')
+        self.assertEqual(len(daemon.lines), 2)
+        self.assertEqual(daemon.key(daemon.lines[0]),
+                         daemon.key(daemon.lines[1]))
+
+    def test_timeout_retries_with_the_same_key(self):
+        daemon, answer = self.vend([None, '0 slot=5'])
+        self.assertEqual(answer, '0 slot=5')
+        self.assertEqual(len(daemon.lines), 2)
+        self.assertEqual(daemon.lines[0], daemon.lines[1])
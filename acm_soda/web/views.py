@@ -1,12 +1,18 @@
 from datetime import datetime
+import re
+import socket
+import time
+import uuid
 
+from django.db.models import F
 from django.shortcuts import render_to_response
 from django.contrib.auth.decorators import login_required
 from django.contrib.auth.views import logout
 from django.contrib.auth.models import User
 
 from acm_soda.api.models import *
-from acm_soda.settings import SODA_FIFO_IN, SODA_FIFO_OUT
+from acm_soda.settings import SODA_SOCKET, SODA_VEND_TIMEOUT, \
+    SODA_VEND_PATIENCE
 
 def external(request):
     inventories = Inventory.getEntireInventory()
@@ -70,8 +76,8 @@ def purchase(request): #TODO: Add exception handling!
         # Check that the user has enough money for the purchase
         machine_user = MachineUser.objects.get(user=request.user)
         if machine_user.balance >= soda.cost:
-            avail_soda = Inventory.objects.filter(soda=soda, amount__gte=1)[0]
-            vend_soda(avail_soda.slot)
+            # The daemon picks the slot, from its own inventory
+            slot = vend_product(soda.short_name, request.user.username)
             #TODO: figure out a better way to bail out
             
             # Don't record the transaction and deduct the account until everything else works
@@ -79,31 +85,64 @@ def purchase(request): #TODO: Add exception handling!
                 date_time=datetime.now(), description="Purchased a %s" % (soda.description),
                 soda=soda)
             purchase_trans.save()
-            avail_soda.amount -= 1
-            avail_soda.save()
+            Inventory.objects.filter(slot=slot, amount__gte=1).update(
+                amount=F('amount') - 1)
             machine_user.balance -= soda.cost
             machine_user.save()
             success = True
     return render_to_response('purchase.html', {'request': request,
         'soda': soda, 'success': success})
 
-def vend_soda(slot_number):
-    #Tell controller to vend
-    if slot_number >= 0 and slot_number <= 7:
-        fifo = open(SODA_FIFO_IN, 'w')
-        fifo.write('%s' % slot_number)
-        fifo.close()
-    else:
-        raise Exception('Invalid Soda Slot Number!')
+def vend_product(short_name, client='web'):
+    """Vends a soda from whichever slot the daemon picks; returns the slot"""
+    answer = vend_request('P %s' % short_name, client)
+    return int(answer.split('slot=')[1])
 
-    # Check w/ the controller that there was success
-    fifo = open(SODA_FIFO_OUT, 'r')
-    output = fifo.read(1)
-    if int(output) == 1:
-        fifo.close()
-    else:
-        fifo.close()
-        raise Exception('Controller failed to vend!')
+def vend_request(command, client='web'):
+    """Sends a vend request line to the daemon until it is answered, and
+    returns the answer if it vended"""
+    # The daemon rate limits the web server's uid, and each client= name
+    # under it, so every user gets a share of their own; a name may only
+    # hold [A-Za-z0-9_.-]
+    client = re.sub(r'[^A-Za-z0-9_.-]', '_', client) or 'web'
+    # The same key on every attempt: a retry after a timeout waits for
+    # (or reads back) the first attempt's vend instead of vending again
+    key = uuid.uuid4().hex
+    give_up = time.time() + SODA_VEND_PATIENCE
+    while time.time() < give_up:
+        answer = None
+        sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        reader = sock.makefile('rb')
+        try:
+            sock.settimeout(SODA_VEND_TIMEOUT)
+            sock.connect(SODA_SOCKET)
+            sock.sendall(('%s client=%s key=%s\n' % (command, client, key))
+                         .encode('ascii'))
+            answer = reader.readline().decode('ascii').strip()
+        except socket.error:
+            # Includes timeouts; the daemon may just be slow or restarting
+            pass
+        # Both, or the connection stays open behind the reader
+        reader.close()
+        sock.close()
+        if not answer:
+            time.sleep(0.5)
+            continue
+
+        # Check w/ the controller that there was success
+        if answer.split()[0] == '0':
+            return answer
+        if answer.split()[0] == '1':
+            raise Exception('Sold out!')
+        if answer.startswith('BUSY'):
+            try:
+                time.sleep(int(answer.split()[1]) / 1000.0)
+            except (IndexError, ValueError):
+                time.sleep(0.5)
+            continue
+        raise Exception('Controller failed to vend! (%s)' % answer)
+
+    raise Exception('Controller did not answer!')
 
 def profile_logout(request):
     return logout(request, '/web')
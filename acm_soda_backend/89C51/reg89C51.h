@@ -1,81 +1,133 @@
 #ifndef REG89C51_H
 #define REG89C51_H
 
-/* For a byte register: sfr <name> = 0x00;
- * For a bit register: sbit <name> = 0x00;
+/* For a byte register: SFR( <name>, 0x00 );
+ * For a bit register: SBIT( <name>, 0x00 );
+ * For a variable only reached indirectly: IDATA <type> <name>; on an
+ *  89C52 this is the upper 128 bytes of RAM
+ *
+ * These expand to SDCC's __sfr/__sbit/__idata or to Keil C51's
+ *  sfr/sbit/idata, so the firmware builds with either.
  */
 
+#if defined(SDCC) || defined(__SDCC)
+#define SFR( name, address ) __sfr __at( address ) name
+#define SBIT( name, address ) __sbit __at( address ) name
+#define INTERRUPT( number ) __interrupt( number )
+#define IDATA __idata
+#else
+#define SFR( name, address ) sfr name = address
+#define SBIT( name, address ) sbit name = address
+#define INTERRUPT( number ) interrupt number
+#define IDATA idata
+#endif
+
 // bank 0
-sfr R0 = 0x00;
-sfr R1 = 0x01;
-sfr R2 = 0x02;
-sfr R3 = 0x03;
-sfr R4 = 0x04;
-sfr R5 = 0x05;
-sfr R6 = 0x06;
-sfr R7 = 0x07;
+SFR( R0, 0x00 );
+SFR( R1, 0x01 );
+SFR( R2, 0x02 );
+SFR( R3, 0x03 );
+SFR( R4, 0x04 );
+SFR( R5, 0x05 );
+SFR( R6, 0x06 );
+SFR( R7, 0x07 );
 
 // bank 1
-sfr R0b1 = 0x08;
-sfr R1b1 = 0x09;
-sfr R2b1 = 0x0A;
-sfr R3b1 = 0x0B;
-sfr R4b1 = 0x0C;
-sfr R5b1 = 0x0D;
-sfr R6b1 = 0x0E;
-sfr R7b1 = 0x0F;
+SFR( R0b1, 0x08 );
+SFR( R1b1, 0x09 );
+SFR( R2b1, 0x0A );
+SFR( R3b1, 0x0B );
+SFR( R4b1, 0x0C );
+SFR( R5b1, 0x0D );
+SFR( R6b1, 0x0E );
+SFR( R7b1, 0x0F );
 
 // bank 2
-sfr R0b2 = 0x10;
-sfr R1b2 = 0x11;
-sfr R2b2 = 0x12;
-sfr R3b2 = 0x13;
-sfr R4b2 = 0x14;
-sfr R5b2 = 0x15;
-sfr R6b2 = 0x16;
-sfr R7b2 = 0x17;
+SFR( R0b2, 0x10 );
+SFR( R1b2, 0x11 );
+SFR( R2b2, 0x12 );
+SFR( R3b2, 0x13 );
+SFR( R4b2, 0x14 );
+SFR( R5b2, 0x15 );
+SFR( R6b2, 0x16 );
+SFR( R7b2, 0x17 );
 
 
 // bank 3
-sfr R0b3 = 0x18;
-sfr R1b3 = 0x19;
-sfr R2b3 = 0x1A;
-sfr R3b3 = 0x1B;
-sfr R4b3 = 0x1C;
-sfr R5b3 = 0x1D;
-sfr R6b3 = 0x1E;
-sfr R7b3 = 0x1F;
-
-sfr ACC = 0xE0; // Accumulator
-sfr B   = 0xF0; // B register
-sfr PSW = 0xD0; // Program status word
-
-sfr DPL = 0x82; // DPTR low byte
-sfr DPH = 0x83; // DPTR high byte
+SFR( R0b3, 0x18 );
+SFR( R1b3, 0x19 );
+SFR( R2b3, 0x1A );
+SFR( R3b3, 0x1B );
+SFR( R4b3, 0x1C );
+SFR( R5b3, 0x1D );
+SFR( R6b3, 0x1E );
+SFR( R7b3, 0x1F );
+
+SFR( ACC, 0xE0 ); // Accumulator
+SFR( B, 0xF0 ); // B register
+SFR( PSW, 0xD0 ); // Program status word
+
+SFR( DPL, 0x82 ); // DPTR low byte
+SFR( DPH, 0x83 ); // DPTR high byte
 
 /* IO pins */
-sfr P0 = 0x80;
-sfr P1 = 0x90;
-sfr P2 = 0xA0;
-sfr P3 = 0xB0;
-
-sfr IP = 0xB8; // Interrupt priority register
-sfr IE = 0xA8; // Interrupt enable register
-
-sfr TMOD  = 0x89; // Timer mode register
-sfr TCON  = 0x88; // Timer control register
-sfr T2MOD = 0xC9; // Timer 2 mode register
-sfr T2CON = 0xC8; // Timer 2 control register
-
-sfr TH0 = 0x8C; // timer 0
-sfr TL0 = 0x8A;
-sfr TH1 = 0x8D; // timer 1
-sfr TL1 = 0x8B;
-sfr TH2 = 0xCD; // timer 2
-sfr TL2 = 0xCC;
-
-sfr SCON = 0x98; // serial control
-sfr SBUF = 0x99; // serial buffer
-sfr PCON = 0x87; // power control
+SFR( P0, 0x80 );
+SFR( P1, 0x90 );
+SFR( P2, 0xA0 );
+SFR( P3, 0xB0 );
+
+SFR( IP, 0xB8 ); // Interrupt priority register
+SFR( IE, 0xA8 ); // Interrupt enable register
+
+SFR( TMOD, 0x89 ); // Timer mode register
+SFR( TCON, 0x88 ); // Timer control register
+SFR( T2MOD, 0xC9 ); // Timer 2 mode register
+SFR( T2CON, 0xC8 ); // Timer 2 control register
+
+SFR( TH0, 0x8C ); // timer 0
+SFR( TL0, 0x8A );
+SFR( TH1, 0x8D ); // timer 1
+SFR( TL1, 0x8B );
+SFR( TH2, 0xCD ); // timer 2
+SFR( TL2, 0xCC );
+
+SFR( SCON, 0x98 ); // serial control
+SFR( SBUF, 0x99 ); // serial buffer
+SFR( PCON, 0x87 ); // power control
+
+/* Bit registers */
+SBIT( IT0, 0x88 ); // TCON
+SBIT( IE0, 0x89 );
+SBIT( IT1, 0x8A );
+SBIT( IE1, 0x8B );
+SBIT( TR0, 0x8C );
+SBIT( TF0, 0x8D );
+SBIT( TR1, 0x8E );
+SBIT( TF1, 0x8F );
+
+SBIT( RI,  0x98 ); // SCON
+SBIT( TI,  0x99 );
+SBIT( RB8, 0x9A );
+SBIT( TB8, 0x9B );
+SBIT( REN, 0x9C );
+SBIT( SM2, 0x9D );
+SBIT( SM1, 0x9E );
+SBIT( SM0, 0x9F );
+
+SBIT( EX0, 0xA8 ); // IE
+SBIT( ET0, 0xA9 );
+SBIT( EX1, 0xAA );
+SBIT( ET1, 0xAB );
+SBIT( ES,  0xAC );
+SBIT( ET2, 0xAD );
+SBIT( EA,  0xAF );
+
+/* Interrupt numbers, vector = 8 * number + 3 */
+#define INT_EXTERNAL0 0
+#define INT_TIMER0    1
+#define INT_EXTERNAL1 2
+#define INT_TIMER1    3
+#define INT_SERIAL    4
+#define INT_TIMER2    5
 
 #endif
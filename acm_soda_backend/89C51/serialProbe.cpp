@@ -1,52 +1,558 @@
+/* serialProbe.cpp
+ *
+ * Link profiler for the MCU's serial port.
+ *
+ * For every combination of command, baud rate and VMIN/VTIME setting the
+ *  probe sends the command -n times and times each response:
+ *
+ *  - write:  write() returning, i.e. the command is in the kernel's queue
+ *  - drain:  TIOCOUTQ empty and tcdrain() returned, i.e. the command has
+ *             left the UART. Before this the time is kernel queueing and
+ *             the wire, not the MCU
+ *  - first:  the first read() that returned reply bytes
+ *  - last:   the read() that completed the reply
+ *  - think:  first - drain - one byte time on the wire, an estimate of
+ *             how long the MCU took to start answering
+ *
+ *  All times are microseconds from just before write(). One CSV row per
+ *  response goes to stdout (or -o), and a histogram of the first and last
+ *  byte times per combination goes to stderr.
+ *
+ * With -e the probe runs against an emulated MCU on a pty instead of a
+ *  serial port, paced at the pty's baud rate, so the numbers can be
+ *  compared with hardware and sodaMachine's timeouts tuned from them.
+ *
+ * Usage: serialProbe [-d device | -e] [-c commands] [-b bauds]
+ *                    [-v vmin:vtime,...] [-n count] [-T timeout ms]
+ *                    [-s slots] [-t think us] [-m motor ms] [-o csv] [-f]
+ *
+ *  e.g. serialProbe -e -c SV -b 4800,9600 -v 1:0,0:1,3:0 -n 20 -o link.csv
+ *
+ * 'B' waits for someone to press a button, and 'V' vends a can: on real
+ *  hardware both need -f.
+ */
+
 #include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <stdint.h>
 #include <termios.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <sys/wait.h>
 
 using namespace std;
 
-int main()
+#define DEVICE "/dev/ttyS0"
+#define SLOTS 8
+#define REPLY_TIMEOUT 2000   // milliseconds
+#define THINK_TIME 2000      // emulated MCU, microseconds per command
+#define MOTOR_TIME 1200      // emulated MCU, milliseconds per vend
+#define HISTOGRAM_WIDTH 50
+
+struct baudRate
+{
+  unsigned bits;
+  speed_t speed;
+};
+
+static const baudRate BAUDRATES[] =
+{
+  { 1200, B1200 }, { 2400, B2400 }, { 4800, B4800 }, { 9600, B9600 },
+  { 19200, B19200 }, { 38400, B38400 }, { 57600, B57600 }, { 115200, B115200 }
+};
+
+struct readSetting
+{
+  unsigned vmin;
+  unsigned vtime;            // tenths of a second
+};
+
+struct sample
 {
-  /* Opening the serial port */
-  
-  int fileDes = open("/dev/ttyS0", O_RDWR | O_NOCTTY );
-  
-  if (fileDes < 0)
+  int64_t write;
+  int64_t drain;
+  int64_t first;
+  int64_t last;
+  int bytes;
+  int reads;                 // read() calls that returned, including empty
+};
+
+int64_t now();
+bool lookupBaud( const unsigned bits, speed_t &speed );
+unsigned speedBits( const speed_t speed );
+void configure( const int fd, const speed_t speed, const readSetting &setting );
+int replyLength( const char command, const unsigned slots );
+sample probe( const int fd, const char command, const int expected,
+              const int timeout );
+void histogram( const char *title, vector<int64_t> &values );
+pid_t emulate( int &slave, const unsigned slots, const int64_t think,
+               const int64_t motor );
+void emulator( const int master, const unsigned slots, const int64_t think,
+               const int64_t motor );
+void onAlarm( int ) {}
+
+int main( int argc, char *argv[] )
+{
+  const char *device = DEVICE;
+  string commands = "S";
+  vector<unsigned> bauds;
+  vector<readSetting> settings;
+  int count = 20;
+  int timeout = REPLY_TIMEOUT;
+  unsigned slots = SLOTS;
+  int64_t think = THINK_TIME;
+  int64_t motor = MOTOR_TIME * 1000LL;
+  bool emulated = false;
+  bool force = false;
+  const char *csvName = NULL;
+  ofstream csvFile;
+  pid_t child = 0;
+  int fileDes;
+  int option;
+
+  while( ( option = getopt( argc, argv, "d:ec:b:v:n:T:s:t:m:o:f" ) ) != -1 )
   {
-    perror( "Error establishing connection with open()" );
-    exit(1);
+    switch( option )
+    {
+      case 'd': device = optarg; break;
+      case 'e': emulated = true; break;
+      case 'c': commands = optarg; break;
+      case 'b':
+        for( char *p = strtok( optarg, "," ); p; p = strtok( NULL, "," ) )
+          bauds.push_back( atoi( p ) );
+        break;
+      case 'v':
+        for( char *p = strtok( optarg, "," ); p; p = strtok( NULL, "," ) )
+        {
+          readSetting setting;
+          if( sscanf( p, "%u:%u", &setting.vmin, &setting.vtime ) != 2 ||
+              setting.vmin > 255 || setting.vtime > 255 )
+          {
+            cerr << "Bad VMIN:VTIME setting " << p << endl;
+            exit(1);
+          }
+          settings.push_back( setting );
+        }
+        break;
+      case 'n': count = atoi( optarg ); break;
+      case 'T': timeout = atoi( optarg ); break;
+      case 's': slots = atoi( optarg ); break;
+      case 't': think = atoll( optarg ); break;
+      case 'm': motor = atoll( optarg ) * 1000LL; break;
+      case 'o': csvName = optarg; break;
+      case 'f': force = true; break;
+      default:
+        cerr << "Usage: serialProbe [-d device | -e] [-c commands] "
+             << "[-b bauds] [-v vmin:vtime,...] [-n count] [-T timeout ms] "
+             << "[-s slots] [-t think us] [-m motor ms] [-o csv] [-f]"
+             << endl;
+        exit(1);
+    }
   }
-  
-  if( flock( fileDes, LOCK_EX | LOCK_NB) != 0 )
+
+  if( bauds.empty() )
+    bauds.push_back( 4800 );
+  if( settings.empty() )
   {
-    perror( "Error locking serial port connection with flock()");
+    readSetting setting = { 1, 0 };
+    settings.push_back( setting );
+  }
+
+  for( size_t i = 0; i < commands.size(); i++ )
+    if( replyLength( commands[i], slots ) < 0 )
+    {
+      cerr << "Unknown command " << commands[i] << endl;
+      exit(1);
+    }
+
+  if( !emulated && !force && commands.find_first_of( "BV" ) != string::npos )
+  {
+    cerr << "'B' and 'V' need someone at the machine and vend cans: "
+         << "use -f to send them to real hardware" << endl;
     exit(1);
   }
-  
+
+  /* Opening the serial port, or the emulated one */
+
+  if( emulated )
+    child = emulate( fileDes, slots, think, motor );
+  else
+  {
+    fileDes = open( device, O_RDWR | O_NOCTTY );
+
+    if (fileDes < 0)
+    {
+      perror( "Error establishing connection with open()" );
+      exit(1);
+    }
+
+    if( flock( fileDes, LOCK_EX | LOCK_NB) != 0 )
+    {
+      perror( "Error locking serial port connection with flock()");
+      exit(1);
+    }
+  }
+
+  /* read() is interrupted by SIGALRM when a reply never completes */
+  struct sigaction action;
+  memset( &action, 0x00, sizeof(action) );
+  action.sa_handler = onAlarm;
+  sigaction( SIGALRM, &action, NULL );
+
+  if( csvName != NULL )
+  {
+    csvFile.open( csvName );
+    if( !csvFile )
+    {
+      perror( "Error opening the CSV file" );
+      exit(1);
+    }
+  }
+  ostream &csv = csvName != NULL ? csvFile : cout;
+
+  csv << "command,baud,vmin,vtime,n,write_us,drain_us,first_us,last_us,"
+      << "think_us,bytes,expected,reads" << endl;
+
+  /* Gathering info about the microcontroller reponses */
+
+  for( size_t c = 0; c < commands.size(); c++ )
+    for( size_t b = 0; b < bauds.size(); b++ )
+      for( size_t s = 0; s < settings.size(); s++ )
+      {
+        speed_t speed;
+        char command = commands[c];
+        int expected = replyLength( command, slots );
+        vector<int64_t> firsts, lasts;
+        int64_t byteTime = 10000000LL / bauds[b];
+        int incomplete = 0;
+
+        if( !lookupBaud( bauds[b], speed ) )
+        {
+          cerr << "Unsupported baud rate " << bauds[b] << endl;
+          continue;
+        }
+        configure( fileDes, speed, settings[s] );
+
+        for( int n = 0; n < count; n++ )
+        {
+          sample result = probe( fileDes, command, expected, timeout );
+
+          csv << command << ',' << bauds[b] << ',' << settings[s].vmin << ','
+              << settings[s].vtime << ',' << n << ',' << result.write << ','
+              << result.drain << ',';
+          if( result.bytes > 0 )
+          {
+            csv << result.first << ',' << result.last << ','
+                << max<int64_t>( 0, result.first - result.drain - byteTime );
+            firsts.push_back( result.first );
+          }
+          else
+            csv << ",,";
+          csv << ',' << result.bytes << ',' << expected << ','
+              << result.reads << endl;
+
+          if( result.bytes == expected )
+            lasts.push_back( result.last );
+          else
+            incomplete++;
+        }
+
+        cerr << endl << "'" << command << "' at " << bauds[b] << " baud, VMIN "
+             << settings[s].vmin << " VTIME " << settings[s].vtime << ": "
+             << count << " sent, " << incomplete << " incomplete, "
+             << byteTime << " us per byte" << endl;
+        histogram( "first byte", firsts );
+        histogram( "last byte", lasts );
+      }
+
+  close( fileDes );
+
+  if( child > 0 )
+  {
+    kill( child, SIGTERM );
+    waitpid( child, NULL, 0 );
+  }
+
+  return 0;
+}
+
+/* now: monotonic microseconds */
+int64_t now()
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+bool lookupBaud( const unsigned bits, speed_t &speed )
+{
+  for( size_t i = 0; i < sizeof(BAUDRATES) / sizeof(BAUDRATES[0]); i++ )
+    if( BAUDRATES[i].bits == bits )
+    {
+      speed = BAUDRATES[i].speed;
+      return true;
+    }
+  return false;
+}
+
+unsigned speedBits( const speed_t speed )
+{
+  for( size_t i = 0; i < sizeof(BAUDRATES) / sizeof(BAUDRATES[0]); i++ )
+    if( BAUDRATES[i].speed == speed )
+      return BAUDRATES[i].bits;
+  return 0;
+}
+
+/* configure: sodaMachine's termios settings, with the speed and read
+ *  setting under test. The port is left blocking so that VMIN and VTIME
+ *  decide when read() returns.
+ */
+void configure( const int fd, const speed_t speed, const readSetting &setting )
+{
   struct termios termAttribs;
-  
+
+  memset( &termAttribs, 0x00, sizeof(termAttribs) );
   termAttribs.c_cflag = CS8 | CLOCAL | CREAD; // control flags
-  termAttribs.c_iflag = IGNPAR | IGNBRK;                 // input flags
-  termAttribs.c_oflag = 0;                               // output flags
-  termAttribs.c_lflag = 0;                               // local flags
+  termAttribs.c_iflag = IGNPAR | IGNBRK;      // input flags
+  termAttribs.c_oflag = 0;                    // output flags
+  termAttribs.c_lflag = 0;                    // local flags
+
+  termAttribs.c_cc[VTIME]    = setting.vtime; // special input
+  termAttribs.c_cc[VMIN]     = setting.vmin;  //  characters
 
-  termAttribs.c_cc[VTIME]    = 0;   // special input
-  termAttribs.c_cc[VMIN]     = 1;   //  characters
-  
-  
-  if( cfsetospeed(&termAttribs, BAUDRATE) != 0 || // setting input & output baud
-      cfsetispeed(&termAttribs, BAUDRATE) != 0 )
+  if( cfsetospeed(&termAttribs, speed) != 0 || // setting input & output baud
+      cfsetispeed(&termAttribs, speed) != 0 )
   {
     perror( "Error setting serial port baud rate" );
     exit(1);
   }
-  
-  if ( tcsetattr(fd,TCSANOW,&newtio) != 0 )
+
+  if ( tcsetattr(fd,TCSANOW,&termAttribs) != 0 )
   {
     perror( "Error finalizing serial port attributes" );
     exit(1);
   }
-  
-  /* Finished opening serial port */
-  
-  /* Gathering info about the microcontroller reponses */
-  
-  
\ No newline at end of file
+
+  fcntl( fd, F_SETFL, fcntl( fd, F_GETFL ) & ~O_NONBLOCK );
+}
+
+/* replyLength: bytes the MCU answers a command with, -1 if unknown.
+ *  'S' is a byte then a hex digit per four slots, as sodaMachine expects.
+ */
+int replyLength( const char command, const unsigned slots )
+{
+  switch( command )
+  {
+    case 'S': return 1 + ( slots + 3 ) / 4;
+    case 'B': return 1;
+    case 'V': return 1;
+    default:  return -1;
+  }
+}
+
+/* probe: sends one command and times its reply */
+sample probe( const int fd, const char command, const int expected,
+              const int timeout )
+{
+  char request[2] = { command, 0 };  // 'V' is followed by slot 0
+  char reply[64];
+  struct itimerval timer;
+  sample result;
+  int outstanding;
+
+  memset( &result, 0x00, sizeof(result) );
+  memset( &timer, 0x00, sizeof(timer) );
+
+  tcflush( fd, TCIOFLUSH );
+
+  int64_t start = now();
+  if( write( fd, request, command == 'V' ? 2 : 1 ) < 0 )
+  {
+    perror( "Error writing the command" );
+    exit(1);
+  }
+  result.write = now() - start;
+
+  /* Kernel queueing ends when the output queue is empty */
+  while( ioctl( fd, TIOCOUTQ, &outstanding ) == 0 && outstanding > 0 &&
+         now() - start < timeout * 1000LL )
+    usleep( 100 );
+  tcdrain( fd );
+  result.drain = now() - start;
+
+  timer.it_value.tv_sec = timeout / 1000;
+  timer.it_value.tv_usec = ( timeout % 1000 ) * 1000;
+  setitimer( ITIMER_REAL, &timer, NULL );
+
+  while( result.bytes < expected && now() - start < timeout * 1000LL )
+  {
+    ssize_t got = read( fd, reply + result.bytes,
+                        min<int>( sizeof(reply), expected ) - result.bytes );
+    if( got < 0 && errno == EINTR )
+      break;
+    if( got < 0 )
+    {
+      perror( "Error reading the reply" );
+      exit(1);
+    }
+
+    result.reads++;
+    if( got == 0 )
+      continue;
+    if( result.bytes == 0 )
+      result.first = now() - start;
+    result.bytes += got;
+    result.last = now() - start;
+  }
+
+  memset( &timer, 0x00, sizeof(timer) );
+  setitimer( ITIMER_REAL, &timer, NULL );
+
+  return result;
+}
+
+/* histogram: power of two buckets of microseconds */
+void histogram( const char *title, vector<int64_t> &values )
+{
+  unsigned buckets[64];
+  unsigned most = 0;
+  int low = 63, high = 0;
+
+  cerr << "  " << title << ":";
+  if( values.empty() )
+  {
+    cerr << " no replies" << endl;
+    return;
+  }
+  cerr << endl;
+
+  memset( buckets, 0x00, sizeof(buckets) );
+  for( size_t i = 0; i < values.size(); i++ )
+  {
+    int bucket = 0;
+    while( bucket < 63 && ( values[i] >> ( bucket + 1 ) ) > 0 )
+      bucket++;
+    buckets[bucket]++;
+    low = min( low, bucket );
+    high = max( high, bucket );
+    most = max( most, buckets[bucket] );
+  }
+
+  for( int bucket = low; bucket <= high; bucket++ )
+  {
+    char range[48];
+    snprintf( range, sizeof(range), "%10lld - %-10lld",
+              1LL << bucket, ( 1LL << ( bucket + 1 ) ) - 1 );
+    cerr << "    " << range << " |"
+         << string( buckets[bucket] * HISTOGRAM_WIDTH / most, '#' )
+         << " " << buckets[bucket] << endl;
+  }
+}
+
+/* emulate: starts an emulated MCU on a new pty, returning its pid and the
+ *  slave end for the probe to open as the serial port
+ */
+pid_t emulate( int &slave, const unsigned slots, const int64_t think,
+               const int64_t motor )
+{
+  int master = posix_openpt( O_RDWR | O_NOCTTY );
+  pid_t pid;
+
+  if( master < 0 || grantpt( master ) != 0 || unlockpt( master ) != 0 )
+  {
+    perror( "Error creating a pty" );
+    exit(1);
+  }
+
+  slave = open( ptsname( master ), O_RDWR | O_NOCTTY );
+  if( slave < 0 )
+  {
+    perror( "Error opening the pty" );
+    exit(1);
+  }
+
+  if( ( pid = fork() ) < 0 )
+  {
+    perror( "Error starting the emulator" );
+    exit(1);
+  }
+
+  if( pid == 0 )
+  {
+    close( slave );
+    emulator( master, slots, think, motor );
+    exit(0);
+  }
+
+  close( master );
+  return pid;
+}
+
+/* emulator: answers the legacy protocol on the pty master
+ *
+ * - 'S': '?' then a hex digit per four slots, every slot full
+ * - 'B': button 0 after a short random wait
+ * - 'V' <slot>: 'Y' after the motor time
+ *
+ * Each byte in either direction takes its time on the wire at the baud
+ *  rate the probe set on the pty, and each command takes think
+ *  microseconds before the answer starts.
+ */
+void emulator( const int master, const unsigned slots, const int64_t think,
+               const int64_t motor )
+{
+  unsigned char command;
+  string reply;
+
+  while( read( master, &command, 1 ) == 1 )
+  {
+    struct termios settings;
+    int64_t byteTime = 10000000LL / 4800;
+
+    if( tcgetattr( master, &settings ) == 0 && speedBits(
+        cfgetospeed( &settings ) ) != 0 )
+      byteTime = 10000000LL / speedBits( cfgetospeed( &settings ) );
+
+    usleep( byteTime );
+
+    switch( command )
+    {
+      case 'S':
+        reply = "?" + string( ( slots + 3 ) / 4, 'F' );
+        usleep( think );
+        break;
+      case 'B':
+        reply = string( 1, (char)0 );
+        usleep( think + rand() % 200000 );
+        break;
+      case 'V':
+        if( read( master, &command, 1 ) != 1 )
+          return;
+        usleep( byteTime );
+        reply = "Y";
+        usleep( think + motor );
+        break;
+      default:
+        continue;
+    }
+
+    for( size_t i = 0; i < reply.size(); i++ )
+    {
+      if( write( master, &reply[i], 1 ) != 1 )
+        return;
+      usleep( byteTime );
+    }
+  }
+}
@@ -1,22 +1,47 @@
 #ifndef SODA89C51_H
 #define SODA89C51_H
 
-#define SLOT_0 PX^X
-#define SLOT_1 PX^X
-#define SLOT_2 PX^X
-#define SLOT_3 PX^X
-#define SLOT_4 PX^X
-#define SLOT_5 PX^X
-#define SLOT_6 PX^X
-#define SLOT_7 PX^X
+/* How the 89C51 is wired to the machine
+ *
+ * - P0: one can sensor per slot, pulled low while the slot has a can
+ * - P1: one vend motor per slot, active low
+ * - P2: the front buttons, active low
+ * - P3.0/P3.1: the serial link to the host (RXD/TXD)
+ *
+ * This is the wiring the firmware assumes until the real harness is
+ *  traced; only the *_PORT definitions need to change if it differs by
+ *  port.
+ */
 
-#define BUTTON_0 PX^X
-#define BUTTON_1 PX^X
-#define BUTTON_2 PX^X
-#define BUTTON_3 PX^X
-#define BUTTON_4 PX^X
-#define BUTTON_5 PX^X
-#define BUTTON_6 PX^X
-#define BUTTON_7 PX^X
+#define SENSE_PORT  P0
+#define MOTOR_PORT  P1
+#define BUTTON_PORT P2
 
-#endif
\ No newline at end of file
+SBIT( SLOT_0, 0x90 ); // P1.0, vend motors
+SBIT( SLOT_1, 0x91 );
+SBIT( SLOT_2, 0x92 );
+SBIT( SLOT_3, 0x93 );
+SBIT( SLOT_4, 0x94 );
+SBIT( SLOT_5, 0x95 );
+SBIT( SLOT_6, 0x96 );
+SBIT( SLOT_7, 0x97 );
+
+SBIT( BUTTON_0, 0xA0 ); // P2.0, front buttons
+SBIT( BUTTON_1, 0xA1 );
+SBIT( BUTTON_2, 0xA2 );
+SBIT( BUTTON_3, 0xA3 );
+SBIT( BUTTON_4, 0xA4 );
+SBIT( BUTTON_5, 0xA5 );
+SBIT( BUTTON_6, 0xA6 );
+SBIT( BUTTON_7, 0xA7 );
+
+#define SLOTS 8
+#define BUTTONS 8
+
+/* Clock: an 11.0592 MHz crystal gives exact standard baud rates */
+#define CRYSTAL 11059200UL
+#define BAUD 4800
+#define BAUD_RELOAD ( 256 - CRYSTAL / ( 384UL * BAUD ) )  // timer 1, mode 2
+#define TICK_RELOAD ( 65536 - CRYSTAL / 12 / 1000 )       // timer 0, 1 ms
+
+#endif
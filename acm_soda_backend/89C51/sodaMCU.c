@@ -1,8 +1,772 @@
+/* sodaMCU.c
+ *
+ * Firmware for the soda machine's MCU. Build with SDCC:
+ *
+ *    sdcc -mmcs51 --model-small --iram-size 256 sodaMCU.c  (or make firmware)
+ *
+ * It needs an 89C52 (or 89S52), the 89C51's pin-compatible successor with
+ *  256 bytes of RAM: the rings alone are 40 bytes, and the 89C51's 128,
+ *  less register bank 0, do not hold them with the rest of the state,
+ *  the parameters SDCC cannot overlay and the stack. The rings are IDATA,
+ *  only reached indirectly, so they can go above 0x7F and leave the
+ *  directly addressed half to the rest. Check sodaMCU.mem after a build.
+ *
+ * The UART is interrupt driven: the serial ISR fills an RX ring and drains
+ *  a TX ring, so bytes keep arriving while a vend motor runs. A full TX
+ *  ring holds up the main loop until the line takes the next byte, a few
+ *  milliseconds at most. Timer 0 ticks every millisecond for motor times,
+ *  debouncing and the parser's inter-byte timeout.
+ *
+ * Two protocols share the line, told apart by the first byte:
+ *
+ * Framed (what new host code should use):
+ *
+ *    FRAME_START <length> <seq> <command> <payload...> <check>
+ *
+ *  length counts seq, command and payload; check makes the bytes from
+ *  length to check sum to 0 (mod 256). A frame with a bad length or
+ *  checksum is dropped without an answer: the host resends it. Every
+ *  good frame is answered in order with a frame carrying the same seq
+ *  and command:
+ *
+ *    'S'         -> inventory byte, bit n set if slot n has a can
+ *    'V' <slot>  -> 'Y' vended or 'N' empty. The seq of the last vend is
+ *                   remembered; the same seq again is answered again
+ *                   without vending, so a lost answer can be retried.
+ *    'B'         -> first button pressed since the last 'B', or NO_BUTTON.
+ *                   Never waits, so it cannot hold up the commands queued
+ *                   behind it.
+ *    'R'         -> (empty) forgets the last vend seq
+ *    'P'         -> RX overruns, bad frames: link health counters
+ *    'C'         -> free bytes in the RX ring: the host's credits
+ *    'E' <mask>  -> mask: which events to push (see below)
+ *    other       -> '!' with the unknown command
+ *
+ *  Frames can be sent back to back: up to RX_SIZE - 1 bytes queue while a
+ *  vend runs. A whole frame is FRAME_MAX + 3 bytes at most (start, length,
+ *  body, check), so a host keeping at most PIPELINE_DEPTH frames
+ *  unanswered can never overrun the ring, whatever their size. Shorter
+ *  frames leave room for more: a framed 'V' is 6 bytes, so five of them
+ *  fit; a host that counts bytes against 'C' needs no frame limit.
+ *
+ * Legacy (single bytes, as sodaMachine speaks it today):
+ *
+ *    'S' -> '?' and two hex digits;  'V' <slot> -> 'Y'/'N';
+ *    'B' -> the next button pressed (any other byte ends the wait);
+ *    'W' <seq> <slot> -> 'Y'/'N' <seq>, retryable like framed 'V'; not
+ *                        answered, like 'M', if seq or slot is lost
+ *    'R' -> 'K';  'E' <mask> -> 'K';  'C' -> 'K' and the RX ring's free bytes
+ *    'L' <n> -> 'K' and the motors 'M' may run at once: n, but at least 1
+ *               and at most MOTOR_MAX (the supply's limit); 1 until set
+ *    'M' <seq> <slot> -> 'Y'/'N' <seq>, once the motor has run
+ *
+ *  'M' does not wait for the motor: it starts it and the main loop
+ *  answers when it stops, so up to the 'L' limit of slots vend at once
+ *  and their answers come back in the order they finish. A slot that is
+ *  already running, or a vend over the limit, is answered 'L' <seq> at
+ *  once and not run; a slot the machine does not have is not answered,
+ *  since 'M' commands come back to back and that is the next one's first
+ *  byte after a lost slot. Each slot keeps the seq of its last answered
+ *  'M', so a retried 'M' is answered again without vending (the host does
+ *  not start a slot again until its last 'M' is answered), and one still
+ *  running is answered when it stops. 'V' and 'W' wait for every 'M' motor to
+ *  stop before they start theirs.
+ *
+ *  A host that counts the bytes it has sent against 'C's answer, and
+ *  gets a command's bytes back when it is answered, can send legacy
+ *  commands back to back without overrunning the ring either.
+ *
+ * Pushed events: once 'E' has set PUSH_BUTTONS or PUSH_INVENTORY, the MCU
+ *  sends a frame of its own whenever a button is pressed or a slot fills
+ *  or empties, so the host need not poll:
+ *
+ *    FRAME_START 5 <event seq> 'b' <button> <time high> <time low> <check>
+ *    FRAME_START 5 <event seq> 's' <inventory> <time high> <time low> <check>
+ *
+ *  The time is the tick count (milliseconds, wrapping) when the change was
+ *  first seen, before debouncing. Event seqs count up by one, so the host
+ *  can tell that it missed one. Turning on PUSH_INVENTORY pushes the
+ *  current inventory at once. Events never split an answer: they go out
+ *  between them, and 0xA5 is never the first byte of a legacy answer.
+ *
+ * A command left unfinished, with nothing more received for PARSE_GAP
+ *  milliseconds, is abandoned, so a lost byte never turns the start of
+ *  the next command into an argument.
+ *
+ */
+
 #include "reg89C51.h"
 #include "soda89C51.h"
 
-void main()
+#define RX_SIZE 32               // powers of two
+#define TX_SIZE 8
+#define RX_MASK ( RX_SIZE - 1 )
+#define TX_MASK ( TX_SIZE - 1 )
+
+#define FRAME_START 0xA5
+#define FRAME_MAX 6              // seq, command and up to 4 payload bytes
+#define PIPELINE_DEPTH 3         // ( RX_SIZE - 1 ) / ( FRAME_MAX + 3 )
+
+#define PARSE_GAP 20             // milliseconds, ten bytes at 4800 baud
+#define VEND_TIME 1200           // milliseconds of motor per vend
+#define MOTOR_SHIFT 3            // motorStart counts 8 ms: VEND_TIME >> 3 < 256
+#define MOTOR_MAX 4              // motors the supply can run at once
+#define DEBOUNCE 10              // milliseconds a button must stay down
+#define SENSE_DEBOUNCE 50        // milliseconds a can sensor must settle
+#define NO_BUTTON 0xFF
+
+#define PUSH_BUTTONS 0x01        // 'E' mask bits
+#define PUSH_INVENTORY 0x02
+#define EVENT_BUTTON 'b'
+#define EVENT_INVENTORY 's'
+
+enum parseState
+{
+  PARSE_COMMAND,
+  PARSE_SLOT,                    // legacy 'V' received
+  PARSE_SEQUENCE,                // legacy 'W' received
+  PARSE_SEQUENCED_SLOT,          // legacy 'W' <seq> received
+  PARSE_EVENTS,                  // legacy 'E' received
+  PARSE_LIMIT,                   // legacy 'L' received
+  PARSE_MOTOR_SEQUENCE,          // legacy 'M' received
+  PARSE_MOTOR_SLOT,              // legacy 'M' <seq> received
+  PARSE_LENGTH,                  // FRAME_START received
+  PARSE_BODY,
+  PARSE_CHECK
+};
+
+/* Shared with the interrupt handlers */
+static volatile IDATA unsigned char rxBuf[RX_SIZE];
+static volatile unsigned char rxHead, rxTail;
+static volatile IDATA unsigned char txBuf[TX_SIZE];
+static volatile unsigned char txHead, txTail;
+static volatile unsigned char txBusy;
+static volatile unsigned int ticks;               // milliseconds, wraps
+static volatile unsigned char rxQuiet;            // ms since a byte; stops at 255
+static volatile unsigned char overruns;
+
+static void pushEvent( const unsigned char kind, const unsigned char value,
+                       const unsigned int when );
+
+/* Main loop only */
+static unsigned char parse;
+static unsigned char frame[FRAME_MAX];
+static unsigned char frameLength, frameGot, frameSum;
+static unsigned char legacySequence;
+static unsigned char badFrames;
+static unsigned char haveLastVend, lastVendSeq, lastVendResult;
+static unsigned char buttonWait;
+static unsigned char latched;                     // button not yet reported
+static unsigned char buttonsDown, buttonsStable;
+static unsigned int buttonsChanged;
+static unsigned char pushed;                      // 'E' mask
+static unsigned char eventSeq;
+static unsigned char sensorsSeen, sensorsStable;
+static unsigned int sensorsChanged;
+static unsigned char motorLimit;
+static unsigned char motorCount;
+static unsigned char motorSeq[MOTOR_MAX];         // of each running 'M'
+static unsigned char motorSlot[MOTOR_MAX];
+static unsigned char motorStart[MOTOR_MAX];       // motorTicks()
+static unsigned char slotSeq[SLOTS];              // last 'M' answered; 0: none
+static unsigned char slotVended;                  // bit n: slotSeq[n] was 'Y'
+
+
+/* serialIsr: one byte in, one byte out
+ *
+ * A byte that finds the RX ring full is counted and lost; the frame it
+ *  belonged to then fails its checksum and the host resends it.
+ */
+void serialIsr( void ) INTERRUPT( INT_SERIAL )
+{
+  unsigned char next;
+
+  if( RI )
+  {
+    RI = 0;
+    next = ( rxHead + 1 ) & RX_MASK;
+    if( next == rxTail )
+      overruns++;
+    else
+    {
+      rxBuf[rxHead] = SBUF;
+      rxHead = next;
+    }
+    rxQuiet = 0;
+  }
+
+  if( TI )
+  {
+    TI = 0;
+    if( txTail != txHead )
+    {
+      SBUF = txBuf[txTail];
+      txTail = ( txTail + 1 ) & TX_MASK;
+    }
+    else
+      txBusy = 0;
+  }
+}
+
+/* tickIsr: timer 0, every millisecond */
+void tickIsr( void ) INTERRUPT( INT_TIMER0 )
+{
+  TH0 = TICK_RELOAD >> 8;
+  TL0 = TICK_RELOAD & 0xFF;
+  ticks++;
+  if( rxQuiet != 0xFF )
+    rxQuiet++;
+}
+
+/* now: ticks, read with the timer interrupt held off (two bytes) */
+static unsigned int now( void )
+{
+  unsigned int t;
+
+  ET0 = 0;
+  t = ticks;
+  ET0 = 1;
+  return t;
+}
+
+/* motorTicks: now() in motorStart's 8 ms units. They wrap after 2 s, but
+ *  runMotors() is never held up that long while a motor runs: vend()
+ *  waits for them first.
+ */
+static unsigned char motorTicks( void )
+{
+  return (unsigned char)( now() >> MOTOR_SHIFT );
+}
+
+static void wait( const unsigned int milliseconds )
+{
+  unsigned int start = now();
+
+  while( (unsigned int)( now() - start ) < milliseconds )
+    ;
+}
+
+/* putByte: queues a byte, waiting only if the TX ring is full. Setting TI
+ *  starts the ISR when the line is idle.
+ */
+static void putByte( const unsigned char byte )
+{
+  unsigned char next = ( txHead + 1 ) & TX_MASK;
+
+  while( next == txTail )
+    ;
+  txBuf[txHead] = byte;
+  txHead = next;
+
+  if( !txBusy )
+  {
+    txBusy = 1;
+    TI = 1;
+  }
+}
+
+/* getByte: the next received byte, if any */
+static unsigned char getByte( unsigned char *byte )
+{
+  if( rxTail == rxHead )
+    return 0;
+
+  *byte = rxBuf[rxTail];
+  rxTail = ( rxTail + 1 ) & RX_MASK;
+  return 1;
+}
+
+/* rxFree: bytes the RX ring can take before the next one is an overrun */
+static unsigned char rxFree( void )
+{
+  return ( rxTail - rxHead - 1 ) & RX_MASK;
+}
+
+/* inventory: bit n set if slot n has a can */
+static unsigned char inventory( void )
+{
+  return ~SENSE_PORT;
+}
+
+static void runMotors( void );
+
+/* vend: runs the slot's motor if it has a can, once no 'M' motor runs.
+ *  Returns 'Y' or 'N'.
+ */
+static unsigned char vend( const unsigned char slot )
+{
+  unsigned char bit;
+
+  while( motorCount > 0 )
+    runMotors();
+
+  if( slot >= SLOTS || !( inventory() & ( 1 << slot ) ) )
+    return 'N';
+
+  bit = 1 << slot;
+  MOTOR_PORT &= ~bit;
+  wait( VEND_TIME );
+  MOTOR_PORT |= bit;
+  return 'Y';
+}
+
+/* vendOnce: a vend that a repeat of seq does not run twice */
+static unsigned char vendOnce( const unsigned char seq, const unsigned char slot )
+{
+  if( haveLastVend && seq == lastVendSeq )
+    return lastVendResult;
+
+  lastVendResult = vend( slot );
+  lastVendSeq = seq;
+  haveLastVend = 1;
+  return lastVendResult;
+}
+
+/* remember: keeps a slot's 'M' answer for a retry of its seq */
+static void remember( const unsigned char slot, const unsigned char seq,
+                      const unsigned char result )
+{
+  slotSeq[slot] = seq;
+  if( result == 'Y' )
+    slotVended |= 1 << slot;
+  else
+    slotVended &= ~( 1 << slot );
+}
+
+/* startMotor: 'M' <seq> <slot>. Answers at once unless a motor starts;
+ *  a seq already running says nothing, its answer is coming.
+ */
+static void startMotor( const unsigned char seq, const unsigned char slot )
+{
+  unsigned char i;
+
+  /* A seq below 0x80 is the slot, after the seq was lost; a slot past
+   *  SLOTS is most likely the next command's first byte, after the slot
+   *  was lost. No answer, so the host sends the whole command again */
+  if( seq < 0x80 || slot >= SLOTS )
+    return;
+
+  for( i = 0; i < motorCount; i++ )
+    if( motorSeq[i] == seq )
+      return;
+  if( slotSeq[slot] == seq )
+  {
+    putByte( ( slotVended >> slot ) & 1 ? 'Y' : 'N' );
+    putByte( seq );
+    return;
+  }
+
+  if( !( inventory() & ( 1 << slot ) ) )
+  {
+    remember( slot, seq, 'N' );
+    putByte( 'N' );
+    putByte( seq );
+    return;
+  }
+  for( i = 0; i < motorCount; i++ )
+    if( motorSlot[i] == slot )
+      break;
+  if( i < motorCount || motorCount >= motorLimit )
+  {
+    putByte( 'L' );
+    putByte( seq );
+    return;
+  }
+
+  MOTOR_PORT &= ~( 1 << slot );
+  motorSeq[motorCount] = seq;
+  motorSlot[motorCount] = slot;
+  motorStart[motorCount] = motorTicks();
+  motorCount++;
+}
+
+/* runMotors: stops the 'M' motors that have run VEND_TIME and answers
+ *  them, in the order they stop
+ */
+static void runMotors( void )
+{
+  unsigned char i = 0;
+
+  while( i < motorCount )
+  {
+    if( (unsigned char)( motorTicks() - motorStart[i] ) <
+        ( VEND_TIME >> MOTOR_SHIFT ) )
+    {
+      i++;
+      continue;
+    }
+
+    MOTOR_PORT |= 1 << motorSlot[i];
+    remember( motorSlot[i], motorSeq[i], 'Y' );
+    putByte( 'Y' );
+    putByte( motorSeq[i] );
+
+    motorCount--;
+    motorSeq[i] = motorSeq[motorCount];
+    motorSlot[i] = motorSlot[motorCount];
+    motorStart[i] = motorStart[motorCount];
+  }
+}
+
+/* forgetSequences: 'R'; the last vend seq and the kept 'M' answers */
+static void forgetSequences( void )
+{
+  unsigned char i;
+
+  haveLastVend = 0;
+  for( i = 0; i < SLOTS; i++ )
+    slotSeq[i] = 0;
+}
+
+/* scanButtons: latches, or with PUSH_BUTTONS pushes, the lowest button
+ *  that has newly stayed down for DEBOUNCE milliseconds. A held button is
+ *  only reported once.
+ */
+static void scanButtons( void )
+{
+  unsigned char down = ~BUTTON_PORT;
+  unsigned char pressed;
+  unsigned char button;
+
+  if( down != buttonsDown )
+  {
+    buttonsDown = down;
+    buttonsChanged = now();
+    return;
+  }
+  if( (unsigned int)( now() - buttonsChanged ) < DEBOUNCE )
+    return;
+
+  pressed = down & ~buttonsStable;
+  buttonsStable = down;
+  if( !pressed || ( latched != NO_BUTTON && !( pushed & PUSH_BUTTONS ) ) )
+    return;
+
+  for( button = 0; !( pressed & 1 ); button++ )
+    pressed >>= 1;
+
+  if( pushed & PUSH_BUTTONS )
+    pushEvent( EVENT_BUTTON, button, buttonsChanged );
+  else
+    latched = button;
+}
+
+/* scanSensors: with PUSH_INVENTORY, pushes the inventory once the can
+ *  sensors have settled on something new. The motor holds up the main
+ *  loop, so a vend's change goes out after its answer.
+ */
+static void scanSensors( void )
+{
+  unsigned char cans = inventory();
+
+  if( cans != sensorsSeen )
+  {
+    sensorsSeen = cans;
+    sensorsChanged = now();
+    return;
+  }
+  if( cans == sensorsStable ||
+      (unsigned int)( now() - sensorsChanged ) < SENSE_DEBOUNCE )
+    return;
+
+  sensorsStable = cans;
+  if( pushed & PUSH_INVENTORY )
+    pushEvent( EVENT_INVENTORY, cans, sensorsChanged );
+}
+
+static unsigned char hexDigit( const unsigned char value )
+{
+  return value < 10 ? '0' + value : 'A' + value - 10;
+}
+
+/* reply: one answer frame */
+static void reply( const unsigned char seq, const unsigned char command,
+                   const unsigned char *payload, const unsigned char length )
+{
+  unsigned char sum = length + 2 + seq + command;
+  unsigned char i;
+
+  putByte( FRAME_START );
+  putByte( length + 2 );
+  putByte( seq );
+  putByte( command );
+  for( i = 0; i < length; i++ )
+  {
+    putByte( payload[i] );
+    sum += payload[i];
+  }
+  putByte( (unsigned char)( 0 - sum ) );
+}
+
+/* pushEvent: an event frame, numbered by eventSeq */
+static void pushEvent( const unsigned char kind, const unsigned char value,
+                       const unsigned int when )
+{
+  unsigned char payload[3];
+
+  payload[0] = value;
+  payload[1] = when >> 8;
+  payload[2] = when & 0xFF;
+  reply( eventSeq++, kind, payload, 3 );
+}
+
+/* setPushed: the 'E' mask. Turning on inventory events pushes the
+ *  inventory as it is now, so the host starts from something.
+ */
+static void setPushed( const unsigned char mask )
+{
+  pushed = mask;
+  if( pushed & PUSH_INVENTORY )
+  {
+    sensorsStable = sensorsSeen = inventory();
+    pushEvent( EVENT_INVENTORY, sensorsStable, now() );
+  }
+}
+
+/* runFrame: acts on a frame whose checksum was good */
+static void runFrame( void )
+{
+  unsigned char seq = frame[0];
+  unsigned char command = frame[1];
+  unsigned char answer[2];
+
+  switch( command )
+  {
+    case 'S':
+      answer[0] = inventory();
+      reply( seq, command, answer, 1 );
+      break;
+    case 'V':
+      if( frameLength != 3 )
+        goto unknown;
+      answer[0] = vendOnce( seq, frame[2] );
+      reply( seq, command, answer, 1 );
+      break;
+    case 'B':
+      answer[0] = latched;
+      latched = NO_BUTTON;
+      reply( seq, command, answer, 1 );
+      break;
+    case 'R':
+      forgetSequences();
+      reply( seq, command, answer, 0 );
+      break;
+    case 'P':
+      answer[0] = overruns;
+      answer[1] = badFrames;
+      reply( seq, command, answer, 2 );
+      break;
+    case 'C':
+      answer[0] = rxFree();
+      reply( seq, command, answer, 1 );
+      break;
+    case 'E':
+      if( frameLength != 3 )
+        goto unknown;
+      reply( seq, command, &frame[2], 1 );
+      setPushed( frame[2] );
+      break;
+    default:
+    unknown:
+      answer[0] = command;
+      reply( seq, '!', answer, 1 );
+      break;
+  }
+}
+
+/* legacyCommand: the first byte of a command that is not a frame. Any
+ *  byte ends a legacy button wait.
+ */
+static void legacyCommand( const unsigned char byte )
+{
+  unsigned char bits;
+
+  buttonWait = 0;
+
+  switch( byte )
+  {
+    case 'S':
+      bits = inventory();
+      putByte( '?' );
+      putByte( hexDigit( bits >> 4 ) );
+      putByte( hexDigit( bits & 0x0F ) );
+      break;
+    case 'B':
+      buttonWait = 1;
+      latched = NO_BUTTON;      // only presses from now on
+      break;
+    case 'V':
+      parse = PARSE_SLOT;
+      break;
+    case 'W':
+      parse = PARSE_SEQUENCE;
+      break;
+    case 'E':
+      parse = PARSE_EVENTS;
+      break;
+    case 'L':
+      parse = PARSE_LIMIT;
+      break;
+    case 'M':
+      parse = PARSE_MOTOR_SEQUENCE;
+      break;
+    case 'R':
+      forgetSequences();
+      putByte( 'K' );
+      break;
+    case 'C':
+      putByte( 'K' );
+      putByte( rxFree() );
+      break;
+    case FRAME_START:
+      parse = PARSE_LENGTH;
+      break;
+    default:
+      break;
+  }
+}
+
+/* abandon: drops a command left unfinished once every byte received has
+ *  been parsed and the line has been quiet for PARSE_GAP. Bytes that
+ *  queued while the main loop was held up are parsed first, so only a
+ *  pause after the last of them counts.
+ */
+static void abandon( void )
 {
-  IE = 0x90;
-  SCON = 0x50;
-  
\ No newline at end of file
+  if( parse == PARSE_COMMAND || rxTail != rxHead || rxQuiet <= PARSE_GAP )
+    return;
+
+  if( parse >= PARSE_LENGTH )
+    badFrames++;
+  parse = PARSE_COMMAND;
+}
+
+/* receive: one byte through the parser */
+static void receive( const unsigned char byte )
+{
+  switch( parse )
+  {
+    case PARSE_COMMAND:
+      legacyCommand( byte );
+      break;
+    case PARSE_SLOT:
+      parse = PARSE_COMMAND;
+      putByte( vend( byte ) );
+      break;
+    case PARSE_SEQUENCE:
+      legacySequence = byte;
+      parse = PARSE_SEQUENCED_SLOT;
+      break;
+    case PARSE_SEQUENCED_SLOT:
+      parse = PARSE_COMMAND;
+      /* As startMotor(): a lost seq or slot. Answered, it would become
+       *  the last seq, and the retry of the real one would vend again */
+      if( legacySequence < 0x80 || byte >= SLOTS )
+        break;
+      putByte( vendOnce( legacySequence, byte ) );
+      putByte( legacySequence );
+      break;
+    case PARSE_EVENTS:
+      parse = PARSE_COMMAND;
+      putByte( 'K' );
+      setPushed( byte );
+      break;
+    case PARSE_LIMIT:
+      parse = PARSE_COMMAND;
+      motorLimit = byte < 1 ? 1 : byte > MOTOR_MAX ? MOTOR_MAX : byte;
+      putByte( 'K' );
+      putByte( motorLimit );
+      break;
+    case PARSE_MOTOR_SEQUENCE:
+      legacySequence = byte;
+      parse = PARSE_MOTOR_SLOT;
+      break;
+    case PARSE_MOTOR_SLOT:
+      parse = PARSE_COMMAND;
+      startMotor( legacySequence, byte );
+      break;
+    case PARSE_LENGTH:
+      if( byte < 2 || byte > FRAME_MAX )
+      {
+        badFrames++;
+        parse = PARSE_COMMAND;
+        break;
+      }
+      frameLength = byte;
+      frameSum = byte;
+      frameGot = 0;
+      parse = PARSE_BODY;
+      break;
+    case PARSE_BODY:
+      frame[frameGot++] = byte;
+      frameSum += byte;
+      if( frameGot == frameLength )
+        parse = PARSE_CHECK;
+      break;
+    case PARSE_CHECK:
+      parse = PARSE_COMMAND;
+      if( (unsigned char)( frameSum + byte ) == 0 )
+        runFrame();
+      else
+        badFrames++;
+      break;
+  }
+}
+
+void main( void )
+{
+  unsigned char byte;
+
+  SENSE_PORT = 0xFF;             // inputs
+  BUTTON_PORT = 0xFF;
+  MOTOR_PORT = 0xFF;             // motors off
+
+  rxHead = rxTail = txHead = txTail = 0;
+  txBusy = 0;
+  ticks = 0;
+  rxQuiet = 0xFF;
+  overruns = badFrames = 0;
+  parse = PARSE_COMMAND;
+  haveLastVend = 0;
+  buttonWait = 0;
+  latched = NO_BUTTON;
+  buttonsDown = buttonsStable = 0;
+  buttonsChanged = 0;
+  pushed = eventSeq = 0;
+  sensorsSeen = sensorsStable = 0;
+  sensorsChanged = 0;
+  motorLimit = 1;
+  motorCount = 0;
+  slotVended = 0;
+  forgetSequences();
+
+  TMOD = 0x21;                   // timer 1: 8-bit auto-reload (baud rate)
+                                 // timer 0: 16-bit (tick)
+  TH1 = TL1 = BAUD_RELOAD;
+  TH0 = TICK_RELOAD >> 8;
+  TL0 = TICK_RELOAD & 0xFF;
+  TR1 = 1;
+  TR0 = 1;
+
+  SCON = 0x50;                   // mode 1 (8N1), receiver on
+  IE = 0x92;                     // EA, ES, ET0
+
+  while( 1 )
+  {
+    scanButtons();
+    scanSensors();
+    runMotors();
+
+    if( buttonWait && latched != NO_BUTTON )
+    {
+      putByte( latched );
+      latched = NO_BUTTON;
+      buttonWait = 0;
+    }
+
+    if( getByte( &byte ) )
+      receive( byte );
+    else
+      abandon();
+  }
+}
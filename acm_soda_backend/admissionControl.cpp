@@ -0,0 +1,335 @@
+#include "admissionControl.h"
+
+/* Clients idle this long with a full bucket are forgotten */
+#define CLIENT_IDLE_TIME ( 10 * 60 * 1000000LL )
+
+/* Starting guess for one vend: a few bytes at 4800 baud plus the motor */
+#define INITIAL_SERVICE_TIME 2000000.0
+
+/* Clients the table holds before it needs another slab of nodes */
+#define CLIENT_NODES 64
+
+using namespace std;
+
+tokenBucket::tokenBucket()
+{
+  tokens = 0;
+  rate = 0;
+  capacity = 0;
+  last = 0;
+}
+
+/* void tokenBucket::configure( const double perSecond, const double burst )
+ *
+ * Starts the bucket full.
+ */
+void tokenBucket::configure( const double perSecond, const double burst )
+{
+  rate = perSecond / 1000000.0;
+  capacity = burst;
+  tokens = burst;
+}
+
+void tokenBucket::refill( const int64_t now )
+{
+  if( last != 0 && now > last )
+  {
+    tokens += ( now - last ) * rate;
+    if( tokens > capacity )
+      tokens = capacity;
+  }
+  last = now;
+}
+
+/* bool tokenBucket::take( const int64_t now )
+ *
+ * Takes a token if there is one.
+ */
+bool tokenBucket::take( const int64_t now )
+{
+  refill( now );
+  if( tokens < 1.0 )
+    return false;
+  tokens -= 1.0;
+  return true;
+}
+
+/* void tokenBucket::refund()
+ *
+ * Gives back a token taken for a request that was then refused anyway.
+ */
+void tokenBucket::refund()
+{
+  tokens += 1.0;
+  if( tokens > capacity )
+    tokens = capacity;
+}
+
+/* int64_t tokenBucket::wait( const int64_t now )
+ *
+ * Microseconds until the next token.
+ */
+int64_t tokenBucket::wait( const int64_t now )
+{
+  refill( now );
+  if( tokens >= 1.0 || rate <= 0 )
+    return 0;
+  return (int64_t)( ( 1.0 - tokens ) / rate ) + 1;
+}
+
+bool tokenBucket::full( const int64_t now )
+{
+  refill( now );
+  return tokens >= capacity;
+}
+
+/* Constructor:
+ *  - perSecond, burst: every client's token bucket
+ *  - maxQueue: requests waiting across all clients
+ */
+admissionControl::admissionControl( const double perSecond,
+                                    const double burst,
+                                    const size_t maxQueue )
+  : requestNodes( maxQueue ), clientNodes( CLIENT_NODES ),
+    clients( less<clientName>(), poolAllocator<clientEntry>( &clientNodes ) )
+{
+  this->perSecond = perSecond;
+  this->burst = burst;
+  this->maxQueue = maxQueue;
+  total = 0;
+  changeCount = 0;
+  serviceEstimate = INITIAL_SERVICE_TIME;
+  active.reserve( CLIENT_NODES );
+}
+
+/* clientState *admissionControl::longestQueue()
+ *
+ * The active client with the most waiting requests.
+ */
+admissionControl::clientState *admissionControl::longestQueue()
+{
+  clientState *longest = NULL;
+
+  for( size_t i = 0; i < active.size(); i++ )
+    if( longest == NULL || active[i]->pending.size() > longest->pending.size() )
+      longest = active[i];
+
+  return longest;
+}
+
+/* admissionDecision admissionControl::admit( request, now, evicted )
+ *
+ * - Refuses the request if the client is over its rate
+ * - If the queue is full, pushes out the newest request of the longest
+ *    queue when this client's queue is shorter, otherwise refuses with
+ *    the time the queue takes to drain
+ * - Queues the request, adding the client to the round-robin if needed
+ */
+admissionDecision admissionControl::admit( const vendRequest &request,
+                                   const int64_t now,
+                                   vendRequest &evicted )
+{
+  admissionDecision result;
+  clientState &client = findClient( request.client, now );
+
+  result.admitted = false;
+  result.evicted = false;
+  result.retryAfter = 0;
+
+  if( !client.bucket.take( now ) )
+  {
+    result.retryAfter = ( client.bucket.wait( now ) + 999 ) / 1000;
+    return result;
+  }
+
+  if( total >= maxQueue )
+  {
+    clientState *longest = longestQueue();
+
+    if( longest == NULL || longest == &client ||
+        longest->pending.size() <= client.pending.size() + 1 )
+    {
+      client.bucket.refund();
+      result.retryAfter = drainTime();
+      return result;
+    }
+
+    evicted = longest->pending.back();
+    result.evicted = true;
+    longest->pending.pop_back();
+    total--;
+    changeCount++;
+  }
+
+  enqueue( client, request );
+
+  result.admitted = true;
+  return result;
+}
+
+/* void admissionControl::restore( const vendRequest &request,
+ *                                 const int64_t now )
+ *
+ * Queues a request admitted by another admissionControl, e.g. that of
+ *  the sodaDaemon this one took over from. It has already been charged
+ *  and counted, so neither the bucket nor the bound applies. Restoring a
+ *  queue in the order next() gave it out keeps its round-robin order.
+ */
+void admissionControl::restore( const vendRequest &request, const int64_t now )
+{
+  enqueue( findClient( request.client, now ), request );
+}
+
+/* admissionControl::clientState &admissionControl::findClient( name, now )
+ *
+ * A new "<uid>/<name>" whose uid has SUBCLIENTS_MAX names already is
+ *  "<uid>/~" instead: '~' is never in a name a client gives, so that one
+ *  is shared by every name beyond the cap, until expire() makes room.
+ */
+admissionControl::clientState &admissionControl::findClient( const char *name,
+                                                             const int64_t now )
+{
+  clientName key;
+
+  strncpy( key.text, name, sizeof(key.text) - 1 );
+  key.text[ sizeof(key.text) - 1 ] = '\0';
+
+  clientTable::iterator found = clients.find( key );
+  const char *slash = strchr( key.text, '/' );
+
+  if( found == clients.end() && slash != NULL &&
+      slash - key.text + 2 < (ptrdiff_t)sizeof(key.text) )
+  {
+    size_t length = slash - key.text + 1;
+
+    key.text[length] = '\0';
+    if( subClients( key, length ) >= SUBCLIENTS_MAX )
+    {
+      key.text[length] = '~';
+      key.text[length + 1] = '\0';
+      found = clients.find( key );
+    }
+    else
+      strncpy( key.text, name, sizeof(key.text) - 1 );
+  }
+
+  if( found == clients.end() )
+  {
+    found = clients.insert( make_pair( key,
+                                       clientState( &requestNodes ) ) ).first;
+    found->second.bucket.configure( perSecond, burst );
+    found->second.active = false;
+  }
+
+  found->second.lastSeen = now;
+  return found->second;
+}
+
+/* size_t admissionControl::subClients( prefix, length )
+ *
+ * Names starting with the length characters of prefix, "<uid>/". The
+ *  table is sorted by name, so they follow one another from prefix on.
+ */
+size_t admissionControl::subClients( const clientName &prefix,
+                                     const size_t length ) const
+{
+  size_t count = 0;
+
+  for( clientTable::const_iterator i = clients.lower_bound( prefix );
+       i != clients.end() && strncmp( i->first.text, prefix.text, length ) == 0;
+       ++i )
+    count++;
+
+  return count;
+}
+
+/* void admissionControl::enqueue( clientState &client, request )
+ *
+ * Adds the client to the round-robin if it was not waiting already.
+ */
+void admissionControl::enqueue( clientState &client,
+                                const vendRequest &request )
+{
+  client.pending.push_back( request );
+  total++;
+  changeCount++;
+
+  if( !client.active )
+  {
+    client.active = true;
+    active.push_back( &client );
+  }
+}
+
+/* bool admissionControl::next( vendRequest &request )
+ *
+ * Takes the oldest request of the client at the front of the round-robin
+ *  and moves that client to the back if it has more waiting.
+ */
+bool admissionControl::next( vendRequest &request )
+{
+  if( active.empty() )
+    return false;
+
+  clientState *client = active.front();
+  active.erase( active.begin() );
+
+  request = client->pending.front();
+  client->pending.pop_front();
+  total--;
+  changeCount++;
+
+  if( client->pending.empty() )
+    client->active = false;
+  else
+    active.push_back( client );
+
+  return true;
+}
+
+/* void admissionControl::waiting( vector<vendRequest> &requests )
+ *
+ * Round k of the round-robin serves the k-th request of every client
+ *  that has one, in the order the clients are active. Each client's
+ *  cursor walks its list one request per round.
+ */
+void admissionControl::waiting( vector<vendRequest> &requests ) const
+{
+  requests.clear();
+  for( size_t i = 0; i < active.size(); i++ )
+    active[i]->cursor = active[i]->pending.begin();
+
+  while( requests.size() < total )
+    for( size_t i = 0; i < active.size(); i++ )
+      if( active[i]->cursor != active[i]->pending.end() )
+        requests.push_back( *active[i]->cursor++ );
+}
+
+/* void admissionControl::serviced( const int64_t serviceTime )
+ *
+ * Exponential moving average, 1/8 weight to the newest sample.
+ */
+void admissionControl::serviced( const int64_t serviceTime )
+{
+  serviceEstimate += ( serviceTime - serviceEstimate ) / 8.0;
+}
+
+/* void admissionControl::expire( const int64_t now )
+ *
+ * Drops clients with nothing queued, a full bucket, and no requests
+ *  in CLIENT_IDLE_TIME, so made-up client names cannot grow the table
+ *  forever.
+ */
+void admissionControl::expire( const int64_t now )
+{
+  clientTable::iterator i = clients.begin();
+
+  while( i != clients.end() )
+  {
+    if( !i->second.active && now - i->second.lastSeen > CLIENT_IDLE_TIME &&
+        i->second.bucket.full( now ) )
+      clients.erase( i++ );
+    else
+      ++i;
+  }
+}
@@ -0,0 +1,181 @@
+#ifndef ADMISSIONCONTROL
+#define ADMISSIONCONTROL
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <list>
+#include <map>
+#include <vector>
+
+#include "nodePool.h"
+
+using namespace std;
+
+/******************************************************************************\
+ * admissionControl class: Decides which vend requests sodaDaemon accepts
+ *                         and in what order it serves them.
+ *
+ * - Every client has a token bucket. A request that finds it empty is
+ *   refused with the time until the next token.
+ * - A client is a connection's uid ("uid1000"), or a name the client
+ *   gave under it ("uid1000/web"). One uid has at most SUBCLIENTS_MAX
+ *   such names at a time; a new name beyond them shares "uid1000/~".
+ * - At most maxQueue requests wait in total. When the queue is full, a
+ *   request from a client with a shorter queue than the longest one
+ *   pushes out the newest request of the longest queue; otherwise it is
+ *   refused with an estimate of the time to drain the queue.
+ * - Waiting requests are served round-robin between clients, so one
+ *   client looping on vend_soda() cannot queue everyone else behind it.
+ *
+ * All times are monotonic microseconds passed in by the caller, so the
+ * same code runs in the daemon and in a simulated load test.
+ *
+ * Queued requests are list nodes from one nodePool of maxQueue, and
+ * clients map nodes from another, so admitting and serving requests
+ * allocates nothing once the queue has been full and the clients seen.
+ *
+ * Functions:
+ *
+ * - admissionDecision admit( const vendRequest &request, const int64_t now,
+ *                    vendRequest &evicted )
+ *       Queues the request or refuses it. At most one request is pushed
+ *       out to make room: then the decision's evicted is true and the
+ *       request is copied to evicted; the caller tells its client to retry.
+ *
+ * - bool next( vendRequest &request )
+ *       Takes the next request to serve. Returns false if none are waiting.
+ *
+ * - void restore( const vendRequest &request, const int64_t now )
+ *       Queues a request handed over from another sodaDaemon, which has
+ *       already admitted it.
+ *
+ * - void waiting( vector<vendRequest> &requests )
+ *       The waiting requests, in the order next() would give them out.
+ *
+ * - unsigned long changes()
+ *       Counts requests queued, pushed out and taken, so a caller can tell
+ *       when the queue is no longer what it last saw.
+ *
+ * - void serviced( const int64_t serviceTime )
+ *       Feeds the time a request took into the drain time estimate.
+ *
+ * - int64_t drainTime()
+ *       Milliseconds the waiting requests are expected to take.
+ *
+ * - void expire( const int64_t now )
+ *       Forgets clients that have been idle for a while.
+ \*****************************************************************************/
+
+#define CLIENT_NAME_LENGTH 32
+#define SUBCLIENTS_MAX 16            // names one uid may give at a time
+#define KEY_LENGTH 48                // an idempotency key and its NUL
+#define PRODUCT_LENGTH 16            // a product name and its NUL
+
+/* A vend request waiting for the serial link */
+struct vendRequest
+{
+  unsigned long connection;        // which client connection to answer
+  char command;                    // 'V', or 'M' for a slot of a batch
+  unsigned short slot;
+  char client[CLIENT_NAME_LENGTH];
+  char key[KEY_LENGTH];            // idempotency key, "" for none
+  char product[PRODUCT_LENGTH];    // the slot was chosen for it, "" for V
+  int64_t arrival;                 // monotonic microseconds
+  int64_t deadline;                // monotonic microseconds, 0 for none
+};
+
+struct admissionDecision
+{
+  bool admitted;
+  bool evicted;                    // another request was pushed out
+  int64_t retryAfter;              // milliseconds, when not admitted
+};
+
+class tokenBucket
+{
+  public:
+    tokenBucket();
+
+    void configure( const double perSecond, const double burst );
+    bool take( const int64_t now );
+    void refund();
+    int64_t wait( const int64_t now );
+    bool full( const int64_t now );
+
+  private:
+    void refill( const int64_t now );
+
+    double tokens;
+    double rate;                   // tokens per microsecond
+    double capacity;
+    int64_t last;
+};
+
+class admissionControl
+{
+  public:
+    admissionControl( const double perSecond, const double burst,
+                      const size_t maxQueue );
+
+    admissionDecision admit( const vendRequest &request, const int64_t now,
+                     vendRequest &evicted );
+    bool next( vendRequest &request );
+    void restore( const vendRequest &request, const int64_t now );
+    void waiting( vector<vendRequest> &requests ) const;
+    void serviced( const int64_t serviceTime );
+    void expire( const int64_t now );
+    size_t queued() const { return total; };
+    unsigned long changes() const { return changeCount; };
+    int64_t drainTime() const
+      { return (int64_t)( serviceEstimate * total / 1000 ); };
+
+  private:
+    admissionControl( const admissionControl & );
+    admissionControl &operator=( const admissionControl & );
+
+    typedef list< vendRequest, poolAllocator<vendRequest> > requestList;
+
+    struct clientState
+    {
+      clientState( nodePool *requests )
+        : pending( poolAllocator<vendRequest>( requests ) ) {};
+
+      tokenBucket bucket;
+      requestList pending;
+      mutable requestList::const_iterator cursor;  // for waiting()
+      int64_t lastSeen;
+      bool active;
+    };
+
+    /* A client's name as the map's key, compared without a string */
+    struct clientName
+    {
+      char text[CLIENT_NAME_LENGTH];
+
+      bool operator<( const clientName &other ) const
+        { return strcmp( text, other.text ) < 0; };
+    };
+
+    typedef pair<const clientName, clientState> clientEntry;
+    typedef map< clientName, clientState, less<clientName>,
+                 poolAllocator<clientEntry> > clientTable;
+
+    clientState *longestQueue();
+    clientState &findClient( const char *name, const int64_t now );
+    size_t subClients( const clientName &prefix, const size_t length ) const;
+    void enqueue( clientState &client, const vendRequest &request );
+
+    nodePool requestNodes;         // before the clients, whose lists use it
+    nodePool clientNodes;
+    clientTable clients;
+    vector<clientState *> active;  // round-robin of clients with requests
+    size_t total;
+    unsigned long changeCount;
+    size_t maxQueue;
+    double perSecond;
+    double burst;
+    double serviceEstimate;        // microseconds, moving average
+};
+
+#endif
@@ -0,0 +1,351 @@
+/* admissionLoadTest.cpp
+ *
+ * Load test for sodaDaemon's admission control against an emulated MCU.
+ *
+ * The requests go through the daemon's own vend path (vendPath, see
+ * vendPath.h) to an emulatedSodaMachine, in the order its main loop
+ * takes them: the requests sent by now are admitted, the next admitted
+ * one is started, the queue committed, and service() runs the link until
+ * the vend finishes. Every client has a socket of its own, as it would
+ * on pipes/vendsoda.sock, and reads its answers from it. The MCU is on a
+ * virtual clock, so an hour of overload runs in seconds and every run
+ * gives the same numbers; requests sent while a vend runs are read when
+ * it is done, as the daemon reads them.
+ *
+ * Each scenario is run three times with the daemon's default limits:
+ * with every client under one name, as clients of one uid that give no
+ * client= are; with a client= name for each under one uid, as the web
+ * site's users are, of which only SUBCLIENTS_MAX get a bucket of their
+ * own; and with a uid for each. Well-behaved clients should see flat
+ * latency with names of their own however hard the looping client
+ * pushes.
+ *
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <deque>
+#include <queue>
+#include <vector>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include "sodaMachine.h"
+#include "admissionControl.h"
+#include "idempotencyCache.h"
+#include "eventBus.h"
+#include "slotSelector.h"
+#include "stateCheckpoint.h"
+#include "nodePool.h"
+#include "frontEnd.h"
+#include "vendPath.h"
+
+#define SECOND 1000000LL
+
+/* The daemon's defaults */
+#define CLIENT_RATE 0.2
+#define CLIENT_BURST 3
+#define MAX_QUEUE 16
+#define VEND_DEADLINE 0
+
+#define KEY_CAPACITY 64
+#define DURATION ( 3600 * SECOND )
+
+using namespace std;
+
+struct scenario
+{
+  const char *name;
+  unsigned politeClients;    // Poisson clients
+  double politeInterval;     // mean seconds between their requests
+  double loopInterval;       // seconds between the looping client's requests
+};
+
+enum naming
+{
+  ONE_NAME,
+  OWN_NAMES,
+  OWN_UIDS
+};
+
+struct arrival
+{
+  int64_t time;
+  unsigned client;
+  bool operator<( const arrival &other ) const { return time > other.time; }
+};
+
+/* A client's end of its socket, and when it sent each request it has no
+ *  answer to yet: answers come in that order, and BUSY always answers
+ *  the newest (refused, or pushed out of the queue) */
+struct simClient
+{
+  int socket;
+  deque<int64_t> sent;
+};
+
+struct results
+{
+  vector<int64_t> politeLatency;
+  unsigned long politeBusy;
+  unsigned long loopServed;
+  unsigned long loopBusy;
+  int64_t maxQueue;
+};
+
+results run( const scenario &test, const naming names, const int number );
+void readAnswers( vector<simClient> &clients, const int64_t now, results &r );
+double exponential( double mean );
+void report( const char *label, results &r );
+
+int main()
+{
+  char scratch[] = "/tmp/admissionLoadTestXXXXXX";
+  const char *labels[] = { "one name", "own names", "own uids" };
+  const scenario scenarios[] =
+  {
+    { "quiet, no looping client", 6, 30.0, 0 },
+    { "looping client, 6 users", 6, 30.0, 0.05 },
+    { "looping client, lunch rush", 30, 60.0, 0.05 }
+  };
+
+  if( mkdtemp( scratch ) == NULL || chdir( scratch ) != 0 )
+  {
+    perror( "admissionLoadTest: could not make a scratch directory" );
+    return 1;
+  }
+
+  cout << "Emulated MCU on a virtual clock, " << DURATION / SECOND
+       << " s simulated" << endl;
+
+  for( size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++ )
+  {
+    cout << endl << scenarios[i].name << ":" << endl;
+
+    for( int names = ONE_NAME; names <= OWN_UIDS; names++ )
+    {
+      srand( 1 );
+      results r = run( scenarios[i], (naming)names, 3 * i + names );
+      report( labels[names], r );
+    }
+  }
+
+  if( chdir( "/" ) == 0 )
+  {
+    string command = string( "rm -rf " ) + scratch;
+    if( system( command.c_str() ) != 0 )
+      cerr << "admissionLoadTest: could not remove " << scratch << endl;
+  }
+  return 0;
+}
+
+/* run: one scenario through the daemon's vend path, client 0 being the
+ *  looping client; in a directory of its own, for the daemon's log,
+ *  journal and checkpoint */
+results run( const scenario &test, const naming names, const int number )
+{
+  char directory[16];
+
+  snprintf( directory, sizeof(directory), "run%d", number );
+  if( mkdir( directory, 0755 ) != 0 || chdir( directory ) != 0 ||
+      mkdir( "log", 0755 ) != 0 )
+  {
+    perror( "admissionLoadTest: could not make a run directory" );
+    exit( 1 );
+  }
+
+  unsigned clientCount = test.politeClients + 1;
+  emulatedSodaMachine acmSoda;
+  mcuModel &mcu = acmSoda.getTransport().mcu();
+  virtualClock &clock = acmSoda.getClock();
+  admissionControl admission( CLIENT_RATE, CLIENT_BURST, MAX_QUEUE );
+  idempotencyCache keys( KEY_CAPACITY, 600 * SECOND );
+  eventBus bus;
+  slotSelector selector;
+  stateCheckpoint checkpoint( emulatedSodaMachine::geometry::slotCount );
+  nodePool connectionNodes( clientCount );
+  connectionTable connections( ( less<unsigned long>() ),
+                     poolAllocator<connectionEntry>( &connectionNodes ) );
+  frontEnd fronts( 0, -1, clientCount + 1,
+                   emulatedSodaMachine::geometry::slotCount );
+  vendPath path( admission, keys, selector, bus, checkpoint, connections,
+                 fronts, VEND_DEADLINE );
+  priority_queue<arrival> arrivals;
+  vector<simClient> clients( clientCount );
+  bool vending = false;
+  int64_t serviceStart = 0;
+  linkResult done;
+  results r;
+
+  r.politeBusy = r.loopServed = r.loopBusy = 0;
+  r.maxQueue = 0;
+
+  mcu.setSlots( emulatedSodaMachine::geometry::slotCount );
+  for( unsigned slot = 0; slot < emulatedSodaMachine::geometry::slotCount;
+       slot++ )
+    mcu.setStock( slot, DURATION / SECOND );
+  if( !checkpoint.open( "log/state" ) )
+  {
+    cerr << "admissionLoadTest: could not open the state file" << endl;
+    exit( 1 );
+  }
+
+  /* Connection c + 1 is client c's */
+  for( unsigned c = 0; c < clientCount; c++ )
+  {
+    int pair[2];
+    clientConnection connection;
+
+    if( socketpair( AF_UNIX, SOCK_STREAM, 0, pair ) != 0 )
+    {
+      perror( "admissionLoadTest: socketpair" );
+      exit( 1 );
+    }
+    clients[c].socket = pair[0];
+    connection.fd = pair[1];
+    connection.buffered = 0;
+    snprintf( connection.client, sizeof(connection.client), "uid1000" );
+    connections[c + 1] = connection;
+  }
+
+  for( unsigned c = 1; c < clientCount; c++ )
+  {
+    arrival a = { (int64_t)( exponential( test.politeInterval ) * SECOND ), c };
+    arrivals.push( a );
+  }
+  if( test.loopInterval > 0 )
+  {
+    arrival a = { 0, 0 };
+    arrivals.push( a );
+  }
+
+  while( clock.now() < DURATION )
+  {
+    /* The requests sent by now, as the loop reads them */
+    while( !arrivals.empty() && arrivals.top().time <= clock.now() )
+    {
+      arrival a = arrivals.top();
+      vendRequest request;
+
+      arrivals.pop();
+      memset( &request, 0x00, sizeof(request) );
+      request.connection = a.client + 1;
+      request.command = 'V';
+      request.slot = a.client % emulatedSodaMachine::geometry::slotCount;
+      request.arrival = clock.now();
+      if( names == OWN_UIDS )
+        snprintf( request.client, sizeof(request.client), "uid%u",
+                  1000 + a.client );
+      else
+        snprintf( request.client, sizeof(request.client),
+                  names == OWN_NAMES ? "uid1000/client%u" : "uid1000",
+                  a.client );
+      clients[a.client].sent.push_back( a.time );
+      path.admitRequest( request );
+      readAnswers( clients, clock.now(), r );
+
+      /* This client's next request */
+      a.time += (int64_t)( ( a.client == 0 ? test.loopInterval :
+                  exponential( test.politeInterval ) ) * SECOND );
+      arrivals.push( a );
+    }
+    r.maxQueue = max( r.maxQueue, (int64_t)admission.queued() );
+
+    if( !vending && path.startVend( acmSoda ) )
+    {
+      vending = true;
+      serviceStart = clock.now();
+    }
+    path.commit();
+
+    /* The link, until the vend is done; or nothing to do until the next
+     *  request */
+    if( vending )
+    {
+      if( acmSoda.service( done ) )
+      {
+        path.finishVend( done, clock.now() - serviceStart );
+        vending = false;
+        readAnswers( clients, clock.now(), r );
+      }
+    }
+    else if( !arrivals.empty() )
+      clock.sleepUntil( arrivals.top().time );
+  }
+
+  for( unsigned c = 0; c < clientCount; c++ )
+  {
+    close( clients[c].socket );
+    close( connections[c + 1].fd );
+  }
+  if( chdir( ".." ) != 0 )
+    exit( 1 );
+  return r;
+}
+
+/* readAnswers: what the clients have been sent, at now */
+void readAnswers( vector<simClient> &clients, const int64_t now, results &r )
+{
+  char text[256];
+
+  for( size_t c = 0; c < clients.size(); c++ )
+  {
+    ssize_t got;
+
+    while( ( got = recv( clients[c].socket, text, sizeof(text) - 1,
+                         MSG_DONTWAIT ) ) > 0 )
+    {
+      text[got] = '\0';
+      for( char *line = text; *line != '\0'; line = strchr( line, '\n' ) + 1 )
+      {
+        if( clients[c].sent.empty() )
+          break;
+        if( strncmp( line, "BUSY", 4 ) == 0 )
+        {
+          clients[c].sent.pop_back();
+          ( c == 0 ? r.loopBusy : r.politeBusy )++;
+        }
+        else
+        {
+          if( c == 0 )
+            r.loopServed++;
+          else
+            r.politeLatency.push_back( now - clients[c].sent.front() );
+          clients[c].sent.pop_front();
+        }
+        if( strchr( line, '\n' ) == NULL )
+          break;
+      }
+    }
+  }
+}
+
+/* exponential: Poisson inter-arrival time with the given mean */
+double exponential( double mean )
+{
+  return -mean * log( ( rand() + 1.0 ) / ( RAND_MAX + 2.0 ) );
+}
+
+/* report: latency percentiles of the well-behaved clients */
+void report( const char *label, results &r )
+{
+  vector<int64_t> &l = r.politeLatency;
+  sort( l.begin(), l.end() );
+
+  cout << "  " << setw(14) << left << label << right;
+  if( l.empty() )
+    cout << " no vends for well-behaved clients";
+  else
+    cout << " polite p50 " << setw(8) << l[l.size() / 2] / 1000 << " ms"
+         << "  p99 " << setw(8) << l[l.size() * 99 / 100] / 1000 << " ms"
+         << "  served " << setw(5) << l.size()
+         << "  busy " << setw(4) << r.politeBusy;
+  cout << "  | looping served " << setw(5) << r.loopServed
+       << " busy " << setw(6) << r.loopBusy
+       << "  | max queue " << r.maxQueue << endl;
+}
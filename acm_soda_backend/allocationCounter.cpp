@@ -0,0 +1,104 @@
+#include "allocationCounter.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+using namespace std;
+
+/* Zero-initialized before any constructor runs, so allocations made by
+ *  other static constructors are counted too */
+static atomic<unsigned long> allocations;
+static atomic<unsigned long> allocated;
+static atomic<unsigned long> deallocations;
+
+void *countedAllocate( size_t size );
+void countedFree( void *memory );
+
+unsigned long allocationCount()
+{
+  return allocations.load( memory_order_relaxed );
+}
+
+unsigned long allocationBytes()
+{
+  return allocated.load( memory_order_relaxed );
+}
+
+unsigned long deallocationCount()
+{
+  return deallocations.load( memory_order_relaxed );
+}
+
+/* countedAllocate: malloc() that counts, and never returns NULL for a
+ *  size of 0, as operator new must not
+ */
+void *countedAllocate( size_t size )
+{
+  allocations.fetch_add( 1, memory_order_relaxed );
+  allocated.fetch_add( size, memory_order_relaxed );
+  return malloc( size == 0 ? 1 : size );
+}
+
+void countedFree( void *memory )
+{
+  if( memory == NULL )
+    return;
+  deallocations.fetch_add( 1, memory_order_relaxed );
+  free( memory );
+}
+
+void *operator new( size_t size )
+{
+  void *memory = countedAllocate( size );
+
+  if( memory == NULL )
+    throw bad_alloc();
+  return memory;
+}
+
+void *operator new[]( size_t size )
+{
+  return operator new( size );
+}
+
+void *operator new( size_t size, const nothrow_t & ) noexcept
+{
+  return countedAllocate( size );
+}
+
+void *operator new[]( size_t size, const nothrow_t & ) noexcept
+{
+  return countedAllocate( size );
+}
+
+void operator delete( void *memory ) noexcept
+{
+  countedFree( memory );
+}
+
+void operator delete[]( void *memory ) noexcept
+{
+  countedFree( memory );
+}
+
+void operator delete( void *memory, const nothrow_t & ) noexcept
+{
+  countedFree( memory );
+}
+
+void operator delete[]( void *memory, const nothrow_t & ) noexcept
+{
+  countedFree( memory );
+}
+
+/* C++14 libraries call these even from C++11 code */
+void operator delete( void *memory, size_t ) noexcept
+{
+  countedFree( memory );
+}
+
+void operator delete[]( void *memory, size_t ) noexcept
+{
+  countedFree( memory );
+}
@@ -0,0 +1,41 @@
+#ifndef ALLOCATIONCOUNTER
+#define ALLOCATIONCOUNTER
+
+#include <stddef.h>
+
+/******************************************************************************\
+ * allocationCounter: Counts the program's heap allocations, so that code
+ *                    meant not to allocate can be checked for it.
+ *
+ * allocationCounter.cpp replaces the global operator new and delete (all
+ * of their forms) with ones that count and then call malloc() and free().
+ * Linking it into a program is all it takes; without it these functions
+ * are not there, so nothing that does not link it pays for the counting.
+ * Everything the standard library allocates for containers and strings
+ * goes through operator new and is counted. malloc() called directly (by
+ * C library functions such as fopen() or strdup()) is not.
+ *
+ * The counts are atomic, so allocations on any thread are counted, and
+ * cost one uncontended atomic add each.
+ *
+ * A caller that must not allocate takes allocationCount() before and
+ * after, e.g. sodaDaemon around each vend once it is warmed up, and
+ * vendPathBench over many vends.
+ *
+ * Functions:
+ *
+ * - unsigned long allocationCount()
+ *       operator new calls since the program started.
+ *
+ * - unsigned long allocationBytes()
+ *       Bytes asked for by those calls.
+ *
+ * - unsigned long deallocationCount()
+ *       operator delete calls on memory other than NULL.
+ \*****************************************************************************/
+
+unsigned long allocationCount();
+unsigned long allocationBytes();
+unsigned long deallocationCount();
+
+#endif
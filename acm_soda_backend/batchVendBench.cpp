@@ -0,0 +1,172 @@
+/* batchVendBench.cpp
+ *
+ * Throughput and latency of batch vends (group orders of several cans
+ *  from different slots) against the emulated MCU (emulatedSodaMachine,
+ *  on a virtual clock), whose motors take their full motorTime and which
+ *  runs no more of them at once than its 'L' limit allows.
+ *
+ * Each run vends BATCH_COUNT batches of BATCH_SIZE slots, submitting a
+ *  whole batch to the link scheduler and calling service() until every
+ *  slot in it is reported, as sodaDaemon does for an M line:
+ *
+ *  - V:          each slot a plain vend (retryable 'W'), one after
+ *                 another, as a batch ran before
+ *  - M, limit n: 'M' vends, up to n motors at once (setMotorLimit())
+ *
+ * The MCU grants at most motorMax (4) motors, so asking for 8 shows what
+ *  the firmware allows, not what was asked. Runs are repeated with each
+ *  byte lost with probability LOSS, where lost answers are retried under
+ *  the same seq.
+ *
+ * Cans/s is per virtual second. First and last are the mean times from
+ *  submitting a batch to its first and to its last per-slot result: a
+ *  client's first can comes as soon as it would alone, and the rest as
+ *  motors free up. Failed are slots not vended (the MCU never answered);
+ *  double vends are cans the MCU dropped beyond those reported; peak is
+ *  the most motors that ran at once.
+ *
+ * Runs in a scratch directory so that nothing is logged or journaled.
+ *
+ * Usage: batchVendBench [batches] [batch size]
+ *
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include "sodaMachine.h"
+
+#define BATCH_COUNT 50
+#define BATCH_SIZE 6
+#define LOSS 0.01
+
+using namespace std;
+
+struct runResult
+{
+  double rate;
+  double first;                    // milliseconds
+  double last;
+  unsigned long failed;
+  long doubleVends;
+  unsigned long peak;
+  unsigned granted;
+};
+
+void run( const unsigned limit, const double loss, const size_t batches,
+          const size_t size, runResult &result );
+
+int main( int argc, char *argv[] )
+{
+  char scratch[] = "/tmp/batchVendBenchXXXXXX";
+  const unsigned limits[] = { 0, 1, 2, 3, 4, 8 };
+  size_t batches = argc > 1 ? atol( argv[1] ) : BATCH_COUNT;
+  size_t size = argc > 2 ? atol( argv[2] ) : BATCH_SIZE;
+
+  if( size < 1 || size > emulatedSodaMachine::geometry::slotCount )
+  {
+    cerr << "batchVendBench: a batch is 1 to "
+         << emulatedSodaMachine::geometry::slotCount << " slots" << endl;
+    return 1;
+  }
+  if( mkdtemp( scratch ) == NULL || chdir( scratch ) != 0 )
+  {
+    perror( "batchVendBench: could not make a scratch directory" );
+    return 1;
+  }
+
+  for( int lossy = 0; lossy < 2; lossy++ )
+  {
+    cout << batches << " batches of " << size << " slots";
+    if( lossy )
+      cout << ", " << LOSS * 100 << "% of bytes lost";
+    cout << endl << "  mode       granted  cans/s  first ms   last ms"
+         << "  failed  double vends  peak" << endl;
+
+    for( size_t i = 0; i < sizeof(limits) / sizeof(limits[0]); i++ )
+    {
+      runResult result;
+      char mode[24];
+
+      run( limits[i], lossy ? LOSS : 0, batches, size, result );
+      if( limits[i] == 0 )
+        snprintf( mode, sizeof(mode), "V" );
+      else
+        snprintf( mode, sizeof(mode), "M, limit %u", limits[i] );
+      cout << "  " << setw(10) << left << mode << right << setw(8)
+           << result.granted << setw(8) << fixed << setprecision(2)
+           << result.rate << setw(10) << setprecision(0) << result.first
+           << setw(10) << result.last << setw(8) << result.failed
+           << setw(14) << result.doubleVends << setw(6) << result.peak
+           << endl;
+    }
+    cout << endl;
+  }
+
+  if( chdir( "/" ) == 0 )
+    rmdir( scratch );
+  return 0;
+}
+
+/* run: one motor limit (0: plain vends), one loss rate */
+void run( const unsigned limit, const double loss, const size_t batches,
+          const size_t size, runResult &result )
+{
+  emulatedSodaMachine acmSoda;
+  mcuModel &mcu = acmSoda.getTransport().mcu();
+  virtualClock &clock = acmSoda.getClock();
+  const unsigned slots = emulatedSodaMachine::geometry::slotCount;
+  unsigned long vended = 0;
+  double firstTotal = 0;
+  double lastTotal = 0;
+
+  mcu.setSlots( slots );
+  for( unsigned slot = 0; slot < slots; slot++ )
+    mcu.setStock( slot, batches * size );
+  mcu.sequencedVends = true;
+  mcu.concurrentVends = true;
+  mcu.seedLoss( 42 );
+
+  acmSoda.setSequencedVends( true );
+  if( limit > 0 )
+    acmSoda.setMotorLimit( limit );
+  mcu.lossRate = loss;
+
+  result.failed = 0;
+  int64_t start = clock.now();
+  for( size_t batch = 0; batch < batches; batch++ )
+  {
+    int64_t submitted = clock.now();
+    int64_t first = 0;
+    size_t reported = 0;
+    linkResult done;
+
+    for( size_t i = 0; i < size; i++ )
+      acmSoda.submit( limit > 0 ? 'M' : 'V', ( batch * size + i ) % slots,
+                      LINK_INTERACTIVE, 0 );
+
+    while( reported < size )
+    {
+      if( !acmSoda.service( done ) )
+        continue;
+      if( reported++ == 0 )
+        first = clock.now();
+      if( done.result == 0 )
+        vended++;
+      else
+        result.failed++;
+    }
+
+    firstTotal += first - submitted;
+    lastTotal += clock.now() - submitted;
+  }
+
+  result.rate = batches * size / ( ( clock.now() - start ) / 1e6 );
+  result.first = firstTotal / batches / 1000;
+  result.last = lastTotal / batches / 1000;
+  result.doubleVends = (long)mcu.vends - (long)vended;
+  result.peak = mcu.motorPeak;
+  result.granted = limit > 0 ? acmSoda.motorsAllowed() : 1;
+}
@@ -0,0 +1,255 @@
+/* checkpointBench.cpp
+ *
+ * What sodaDaemon's state checkpoint (stateCheckpoint.h) costs, and
+ *  whether it survives being cut short.
+ *
+ *  - update:  one finished vend as the daemon saves it (counters, link
+ *              estimates, the queue without that request) and its commit
+ *  - restore: opening the file and reading everything back, as a
+ *              restarting daemon does before it serves
+ *  - crash:   a child process commits transactions as fast as it can and
+ *              is SIGKILLed at random points; every reopen must give one
+ *              whole transaction, never older than the last one reopened
+ *  - torn:    random bytes of the file are overwritten, as a power cut
+ *              can leave it; every reopen must still give one whole
+ *              transaction
+ *
+ * A transaction n queues 1 + n % CHECKPOINT_BACKLOG requests, each
+ *  arriving at n, and counts n vends of slot 0, so a mix of two is seen.
+ *
+ * Usage: checkpointBench [-n crashes] [file]
+ *
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <bitset>
+#include <vector>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "stateCheckpoint.h"
+
+#define SLOTS 48
+#define UPDATES 100000
+#define CRASHES 200
+
+using namespace std;
+
+int64_t monotonicNow();
+void transaction( stateCheckpoint &checkpoint, const int64_t n );
+bool check( const char *path, int64_t &n );
+bool crash( const char *path, const int rounds );
+bool tear( const char *path, const int rounds );
+
+int main( int argc, char *argv[] )
+{
+  const char *path = "/tmp/checkpointBench.state";
+  int rounds = CRASHES;
+  int option;
+
+  while( ( option = getopt( argc, argv, "n:" ) ) != -1 )
+    switch( option )
+    {
+      case 'n':
+        rounds = atoi( optarg );
+        break;
+      default:
+        cerr << "Usage: checkpointBench [-n crashes] [file]" << endl;
+        return 1;
+    }
+  if( optind < argc )
+    path = argv[optind];
+  unlink( path );
+
+  /* update: the queue shrinks by one each vend, as the link takes it */
+  {
+    stateCheckpoint checkpoint( SLOTS );
+    vector<vendRequest> queued( 16 );
+    checkpointLink link = { 9000, 2000, 320000, 40000 };
+    bitset<SLOTS> bits;
+
+    if( !checkpoint.open( path ) )
+    {
+      perror( "checkpointBench: open" );
+      return 1;
+    }
+    memset( &queued[0], 0, queued.size() * sizeof(vendRequest) );
+    for( size_t i = 0; i < queued.size(); i++ )
+    {
+      queued[i].command = 'V';
+      queued[i].slot = i % SLOTS;
+      queued[i].arrival = i;
+    }
+
+    int64_t start = monotonicNow();
+    for( int i = 0; i < UPDATES; i++ )
+    {
+      int64_t now = stateCheckpoint::now();
+
+      checkpoint.count( i % SLOTS, 0, now );
+      link.vendSmoothed += i % 3 - 1;
+      checkpoint.saveLink( link );
+      bits.flip( i % SLOTS );
+      checkpoint.saveInventory( bits, now );
+      queued.erase( queued.begin() );
+      vendRequest next = queued.back();
+      next.arrival++;
+      queued.push_back( next );
+      checkpoint.saveBacklog( queued, 0, 0 );
+      checkpoint.commit( now );
+    }
+    double each = ( monotonicNow() - start ) * 1000.0 / UPDATES;
+    cout << "update: " << fixed << setprecision( 0 ) << each
+         << " ns per vend saved and committed" << endl;
+  }
+
+  /* restore */
+  {
+    int64_t start = monotonicNow();
+    stateCheckpoint checkpoint( SLOTS );
+    vector<vendRequest> queued;
+    bitset<SLOTS> bits;
+    checkpointLink link;
+
+    checkpoint.open( path );
+    checkpoint.loadLink( link );
+    checkpoint.loadInventory( bits );
+    checkpoint.loadBacklog( queued, 0, 0 );
+    cout << "restore: " << monotonicNow() - start << " us to open and read "
+         << queued.size() << " queued requests" << endl;
+  }
+
+  unlink( path );
+  bool good = crash( path, rounds ) && tear( path, rounds );
+  unlink( path );
+  return good ? 0 : 1;
+}
+
+/* transaction: the n-th state, saved and committed */
+void transaction( stateCheckpoint &checkpoint, const int64_t n )
+{
+  vector<vendRequest> queued( 1 + n % CHECKPOINT_BACKLOG );
+  slotCounters counted = checkpoint.counters( 0 );
+
+  memset( &queued[0], 0, queued.size() * sizeof(vendRequest) );
+  for( size_t i = 0; i < queued.size(); i++ )
+  {
+    queued[i].command = 'V';
+    queued[i].slot = i % SLOTS;
+    queued[i].arrival = n;
+  }
+  checkpoint.saveBacklog( queued, 0, 0 );
+  while( (int64_t)counted.vends < n )
+  {
+    checkpoint.count( 0, 0, n );
+    counted.vends++;
+  }
+  checkpoint.commit( stateCheckpoint::now() );
+}
+
+/* check: reopens the file; n is the transaction found (0 for none).
+ *  Returns false if what was found is not one whole transaction.
+ */
+bool check( const char *path, int64_t &n )
+{
+  stateCheckpoint checkpoint( SLOTS );
+  vector<vendRequest> queued;
+
+  if( !checkpoint.open( path ) )
+    return false;
+  checkpoint.loadBacklog( queued, 0, 0 );
+  n = checkpoint.counters( 0 ).vends;
+  if( !checkpoint.restored() )
+    return n == 0 && queued.empty();
+  if( n == 0 || queued.size() != (size_t)( 1 + n % CHECKPOINT_BACKLOG ) )
+    return false;
+  for( size_t i = 0; i < queued.size(); i++ )
+    if( queued[i].arrival != n )
+      return false;
+  return true;
+}
+
+/* crash: SIGKILL a child committing transactions, rounds times */
+bool crash( const char *path, const int rounds )
+{
+  int64_t last = 0, n = 0;
+  int bad = 0;
+
+  for( int round = 0; round < rounds; round++ )
+  {
+    pid_t child = fork();
+
+    if( child == 0 )
+    {
+      stateCheckpoint checkpoint( SLOTS );
+      if( !checkpoint.open( path ) )
+        _exit( 1 );
+      for( int64_t next = checkpoint.counters( 0 ).vends + 1; ; next++ )
+        transaction( checkpoint, next );
+    }
+
+    usleep( 1000 + rand() % 5000 );
+    kill( child, SIGKILL );
+    waitpid( child, NULL, 0 );
+
+    if( !check( path, n ) || n < last )
+      bad++;
+    last = n;
+  }
+
+  cout << "crash: " << rounds << " kills, " << last
+       << " transactions committed, " << bad << " inconsistent" << endl;
+  return bad == 0;
+}
+
+/* tear: overwrite a few random bytes, then check and carry on from what
+ *  was found, so that later tears hit a file with history in it
+ */
+bool tear( const char *path, const int rounds )
+{
+  int64_t n = 0;
+  int bad = 0, lost = 0;
+
+  for( int round = 0; round < rounds; round++ )
+  {
+    {
+      stateCheckpoint checkpoint( SLOTS );
+      checkpoint.open( path );
+      for( int i = 0; i < 1 + rand() % 20; i++ )
+        transaction( checkpoint, checkpoint.counters( 0 ).vends + 1 );
+    }
+
+    int fd = open( path, O_RDWR );
+    off_t size = lseek( fd, 0, SEEK_END );
+    for( int i = 0; i < 1 + rand() % 4; i++ )
+    {
+      unsigned char junk = rand();
+      if( pwrite( fd, &junk, 1, rand() % size ) != 1 )
+        perror( "checkpointBench: pwrite" );
+    }
+    close( fd );
+
+    int64_t before = n;
+    if( !check( path, n ) )
+      bad++;
+    if( n < before )
+      lost++;
+  }
+
+  cout << "torn: " << rounds << " rounds of random overwrites, " << bad
+       << " inconsistent, " << lost << " fell back to an older state" << endl;
+  return bad == 0;
+}
+
+int64_t monotonicNow()
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
@@ -0,0 +1,56 @@
+#include "creditWindow.h"
+
+creditWindow::creditWindow()
+{
+  configure( 0, 0 );
+}
+
+void creditWindow::configure( const size_t credits, const size_t queued )
+{
+  granted = credits;
+  queueBytes = queued;
+  creditStalls = queueStalls = 0;
+  reset();
+}
+
+/* bool creditWindow::admits( const size_t length )
+ *
+ * A command longer than the credits still goes once the window is empty:
+ *  it is no worse off than with stop-and-wait.
+ */
+bool creditWindow::admits( const size_t length ) const
+{
+  if( commands == 0 )
+    return true;
+  if( commands == CREDIT_COMMANDS || granted == 0 )
+    return false;
+
+  return granted == CREDITS_UNLIMITED || spent + length <= granted;
+}
+
+void creditWindow::sent( const size_t length )
+{
+  if( commands == CREDIT_COMMANDS )
+    return;
+
+  lengths[ ( first + commands ) % CREDIT_COMMANDS ] = length;
+  commands++;
+  spent += length;
+}
+
+void creditWindow::answered()
+{
+  if( commands == 0 )
+    return;
+
+  spent -= lengths[first];
+  first = ( first + 1 ) % CREDIT_COMMANDS;
+  commands--;
+}
+
+void creditWindow::reset()
+{
+  spent = 0;
+  first = 0;
+  commands = 0;
+}
@@ -0,0 +1,87 @@
+#ifndef CREDITWINDOW
+#define CREDITWINDOW
+
+#include <stddef.h>
+#include <stdint.h>
+
+/******************************************************************************\
+ * creditWindow class: How many bytes the host may have on their way to the
+ *                     MCU, so that commands sent back to back never
+ *                     overrun its receive ring.
+ *
+ * The MCU advertises the room in its ring ('C', see 89C51/README): that
+ * many credits. Every byte sent spends one. The MCU takes a command out of
+ * its ring before it answers it, so a command's credits come back when its
+ * answer arrives; answers come in order, so the window keeps the lengths
+ * of the commands in flight in order too. This is conservative: bytes
+ * leave the ring a little before their answer shows.
+ *
+ * Bytes in the kernel's output queue (TIOCOUTQ) spend credits as well, but
+ * they have not reached the MCU, and whatever is written behind them waits
+ * there instead of in the MCU. So a command is also held back while more
+ * than the queue limit is waiting in the kernel.
+ *
+ * With no credits the window holds one command at a time: stop-and-wait,
+ * the way the link ran before the MCU could say how much it holds.
+ *
+ * Functions:
+ *
+ * - void configure( const size_t credits, const size_t queued )
+ *       Starts over with credits bytes of room in the MCU (0: one command
+ *       at a time, CREDITS_UNLIMITED: no limit) and at most queued bytes
+ *       left in the kernel before another command is written.
+ *
+ * - bool admits( const size_t length ), bool queueFull( const size_t queued )
+ *       Whether a command of length bytes fits the credits, and whether
+ *       the kernel's queue is too long to add to. A command is always
+ *       admitted when nothing is in flight.
+ *
+ * - void sent( const size_t length ), void answered()
+ *       A command was written; the oldest one in flight was answered.
+ *
+ * - void reset()
+ *       Forgets the commands in flight, once their answers are given up
+ *       on and the input flushed.
+ *
+ * - size_t inFlight(), size_t credits(), size_t queueLimit()
+ *       Bytes spent, the credits granted and the kernel queue allowed.
+ *
+ * Variables:
+ *
+ * - unsigned long creditStalls, queueStalls
+ *       Commands held back for an answer, and for the kernel's queue.
+ \*****************************************************************************/
+
+#define CREDITS_UNLIMITED ( (size_t)-1 )
+#define CREDIT_COMMANDS 256          // commands in flight at most
+
+class creditWindow
+{
+  public:
+    creditWindow();
+
+    void configure( const size_t credits, const size_t queued );
+    bool admits( const size_t length ) const;
+    bool queueFull( const size_t queued ) const
+      { return queued > queueBytes; };
+    void sent( const size_t length );
+    void answered();
+    void reset();
+
+    size_t inFlight() const { return spent; };
+    size_t credits() const { return granted; };
+    size_t queueLimit() const { return queueBytes; };
+
+    unsigned long creditStalls;
+    unsigned long queueStalls;
+
+  private:
+    size_t granted;
+    size_t queueBytes;
+    size_t spent;
+    size_t lengths[CREDIT_COMMANDS]; // of the commands in flight, a ring
+    size_t first;
+    size_t commands;
+};
+
+#endif
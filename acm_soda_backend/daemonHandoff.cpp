@@ -0,0 +1,314 @@
+#include "daemonHandoff.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+using namespace std;
+
+/* First message of a handoff, carrying the descriptors */
+struct handoffHeader
+{
+  char magic[8];
+  uint32_t descriptors;
+  uint32_t reserved;
+  uint64_t payload;              // bytes of state that follow
+};
+
+/* Appends fixed-size values and strings to the payload */
+static void put( string &out, const void *data, const size_t length )
+{
+  out.append( (const char *)data, length );
+}
+
+static void putString( string &out, const string &value )
+{
+  uint32_t length = value.size();
+  put( out, &length, sizeof(length) );
+  out.append( value );
+}
+
+/* Reads them back, failing (ok = false) rather than running off the end */
+struct payloadReader
+{
+  const char *next;
+  const char *end;
+  bool ok;
+
+  void get( void *data, const size_t length )
+  {
+    if( !ok || (size_t)( end - next ) < length )
+    {
+      ok = false;
+      memset( data, 0x00, length );
+      return;
+    }
+    memcpy( data, next, length );
+    next += length;
+  }
+
+  void getString( string &value )
+  {
+    uint32_t length;
+    get( &length, sizeof(length) );
+    if( !ok || (size_t)( end - next ) < length )
+    {
+      ok = false;
+      return;
+    }
+    value.assign( next, length );
+    next += length;
+  }
+};
+
+/* int32_t descriptorIndex( fds, fd )
+ *
+ * Adds fd to the descriptors to send, returning its position, or -1 for
+ *  no descriptor (or no room).
+ */
+static int32_t descriptorIndex( vector<int> &fds, const int fd )
+{
+  if( fd < 0 || fds.size() >= MAX_HANDOFF_DESCRIPTORS )
+    return -1;
+  fds.push_back( fd );
+  return fds.size() - 1;
+}
+
+/* int claim( fds, used, index, ok )
+ *
+ * The received descriptor at index, -1 for none. Fails (ok = false) on an
+ *  index out of range or used twice.
+ */
+static int claim( const vector<int> &fds, vector<bool> &used,
+                  const int32_t index, bool &ok )
+{
+  if( index == -1 )
+    return -1;
+  if( index < 0 || (size_t)index >= fds.size() || used[index] )
+  {
+    ok = false;
+    return -1;
+  }
+  used[index] = true;
+  return fds[index];
+}
+
+/* void putConnections( out, fds, connections )
+ *
+ * As many connections as there are descriptors left for.
+ */
+static void putConnections( string &out, vector<int> &fds,
+                            const vector<handoffConnection> &connections )
+{
+  uint32_t count = 0;
+  int32_t index;
+
+  for( size_t i = 0; i < connections.size(); i++ )
+    count += fds.size() + i < MAX_HANDOFF_DESCRIPTORS;
+  put( out, &count, sizeof(count) );
+  for( size_t i = 0; i < connections.size(); i++ )
+  {
+    const handoffConnection &connection = connections[i];
+
+    if( ( index = descriptorIndex( fds, connection.fd ) ) < 0 )
+      break;
+
+    uint64_t id = connection.id;
+    uint32_t topics = connection.topics;
+    put( out, &id, sizeof(id) );
+    put( out, &index, sizeof(index) );
+    put( out, connection.client, sizeof(connection.client) );
+    put( out, &topics, sizeof(topics) );
+    putString( out, connection.buffer );
+  }
+}
+
+/* void getConnections( in, fds, used, connections )
+ */
+static void getConnections( payloadReader &in, const vector<int> &fds,
+                            vector<bool> &used,
+                            vector<handoffConnection> &connections )
+{
+  uint32_t count;
+
+  in.get( &count, sizeof(count) );
+  connections.clear();
+  for( uint32_t i = 0; in.ok && i < count; i++ )
+  {
+    handoffConnection connection;
+    uint64_t id;
+    int32_t index;
+    uint32_t topics;
+
+    in.get( &id, sizeof(id) );
+    connection.id = id;
+    in.get( &index, sizeof(index) );
+    connection.fd = claim( fds, used, index, in.ok );
+    in.get( connection.client, sizeof(connection.client) );
+    connection.client[ sizeof(connection.client) - 1 ] = '\0';
+    in.get( &topics, sizeof(topics) );
+    connection.topics = topics;
+    in.getString( connection.buffer );
+    if( connection.fd < 0 )
+      in.ok = false;
+    connections.push_back( connection );
+  }
+}
+
+/* bool sendHandoff( const int channel, const handoffState &state )
+ */
+bool sendHandoff( const int channel, const handoffState &state )
+{
+  vector<int> fds;
+  string payload;
+  int32_t index;
+  uint32_t count;
+
+  put( payload, &state.stopped, sizeof(state.stopped) );
+  uint64_t nextConnection = state.nextConnection;
+  put( payload, &nextConnection, sizeof(nextConnection) );
+
+  const int own[5] = { state.serial, state.listener, state.control,
+                       state.events, state.pipeIn };
+  for( int i = 0; i < 5; i++ )
+  {
+    index = descriptorIndex( fds, own[i] );
+    put( payload, &index, sizeof(index) );
+  }
+  putString( payload, state.pipeBuffer );
+
+  count = state.queued.size();
+  put( payload, &count, sizeof(count) );
+  for( size_t i = 0; i < state.queued.size(); i++ )
+    put( payload, &state.queued[i], sizeof(vendRequest) );
+
+  putConnections( payload, fds, state.connections );
+  putConnections( payload, fds, state.subscribers );
+
+  /* The header and descriptors in one message, then the state */
+  handoffHeader header;
+  memset( &header, 0x00, sizeof(header) );
+  memcpy( header.magic, HANDOFF_MAGIC, sizeof(header.magic) );
+  header.descriptors = fds.size();
+  header.payload = payload.size();
+
+  struct iovec part = { &header, sizeof(header) };
+  struct msghdr message;
+  char control[ CMSG_SPACE( sizeof(int) * MAX_HANDOFF_DESCRIPTORS ) ];
+
+  memset( &message, 0x00, sizeof(message) );
+  memset( control, 0x00, sizeof(control) );
+  message.msg_iov = &part;
+  message.msg_iovlen = 1;
+
+  if( !fds.empty() )
+  {
+    message.msg_control = control;
+    message.msg_controllen = CMSG_SPACE( sizeof(int) * fds.size() );
+
+    struct cmsghdr *rights = CMSG_FIRSTHDR( &message );
+    rights->cmsg_level = SOL_SOCKET;
+    rights->cmsg_type = SCM_RIGHTS;
+    rights->cmsg_len = CMSG_LEN( sizeof(int) * fds.size() );
+    memcpy( CMSG_DATA( rights ), &fds[0], sizeof(int) * fds.size() );
+  }
+
+  if( sendmsg( channel, &message, MSG_NOSIGNAL ) != sizeof(header) )
+    return false;
+
+  for( size_t sent = 0; sent < payload.size(); )
+  {
+    ssize_t result = send( channel, payload.data() + sent,
+                           payload.size() - sent, MSG_NOSIGNAL );
+    if( result <= 0 )
+      return false;
+    sent += result;
+  }
+
+  return true;
+}
+
+/* bool receiveHandoff( const int channel, handoffState &state )
+ */
+bool receiveHandoff( const int channel, handoffState &state )
+{
+  handoffHeader header;
+  struct iovec part = { &header, sizeof(header) };
+  struct msghdr message;
+  char control[ CMSG_SPACE( sizeof(int) * MAX_HANDOFF_DESCRIPTORS ) ];
+  vector<int> fds;
+  vector<bool> used;
+
+  memset( &message, 0x00, sizeof(message) );
+  message.msg_iov = &part;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+
+  if( recvmsg( channel, &message, MSG_WAITALL ) != sizeof(header) )
+    return false;
+
+  for( struct cmsghdr *rights = CMSG_FIRSTHDR( &message ); rights != NULL;
+       rights = CMSG_NXTHDR( &message, rights ) )
+    if( rights->cmsg_level == SOL_SOCKET && rights->cmsg_type == SCM_RIGHTS )
+    {
+      size_t count = ( rights->cmsg_len - CMSG_LEN( 0 ) ) / sizeof(int);
+      fds.resize( count );
+      memcpy( &fds[0], CMSG_DATA( rights ), sizeof(int) * count );
+    }
+  used.assign( fds.size(), false );
+
+  string payload;
+  bool ok = !memcmp( header.magic, HANDOFF_MAGIC, sizeof(header.magic) ) &&
+            !( message.msg_flags & MSG_CTRUNC ) &&
+            header.descriptors == fds.size() && header.payload < ( 1 << 24 );
+
+  if( ok )
+  {
+    payload.resize( header.payload );
+    for( size_t got = 0; ok && got < payload.size(); )
+    {
+      ssize_t result = recv( channel, &payload[got], payload.size() - got, 0 );
+      ok = result > 0;
+      got += ok ? result : 0;
+    }
+  }
+
+  payloadReader in = { payload.data(), payload.data() + payload.size(), ok };
+  int32_t index;
+  uint32_t count;
+
+  in.get( &state.stopped, sizeof(state.stopped) );
+  uint64_t nextConnection;
+  in.get( &nextConnection, sizeof(nextConnection) );
+  state.nextConnection = nextConnection;
+
+  int *own[5] = { &state.serial, &state.listener, &state.control,
+                  &state.events, &state.pipeIn };
+  for( int i = 0; i < 5; i++ )
+  {
+    in.get( &index, sizeof(index) );
+    *own[i] = claim( fds, used, index, in.ok );
+  }
+  in.getString( state.pipeBuffer );
+
+  in.get( &count, sizeof(count) );
+  state.queued.clear();
+  for( uint32_t i = 0; in.ok && i < count; i++ )
+  {
+    vendRequest request;
+    in.get( &request, sizeof(request) );
+    request.client[ sizeof(request.client) - 1 ] = '\0';
+    state.queued.push_back( request );
+  }
+
+  getConnections( in, fds, used, state.connections );
+  getConnections( in, fds, used, state.subscribers );
+
+  /* Descriptors nobody claimed, or all of them if the state is bad */
+  for( size_t i = 0; i < fds.size(); i++ )
+    if( !in.ok || !used[i] )
+      close( fds[i] );
+
+  return in.ok;
+}
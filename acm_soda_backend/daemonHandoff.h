@@ -0,0 +1,75 @@
+#ifndef DAEMONHANDOFF
+#define DAEMONHANDOFF
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "admissionControl.h"
+
+using namespace std;
+
+/******************************************************************************\
+ * daemonHandoff: What a running sodaDaemon hands to the one replacing it
+ *                (sodaDaemon -u), so that an upgrade fails no vends.
+ *
+ * The old daemon stops between two link commands, so no vend is ever cut
+ * short, and sends over the control socket:
+ *
+ * - its open descriptors with SCM_RIGHTS: the serial port, the client,
+ *   event and control socket listeners, the legacy request pipe, every
+ *   client connection and every event subscriber, and
+ * - the state around them: requests admitted but not yet vended (in the
+ *   order they would have been served), the unfinished request line of
+ *   each client, the topics and unwritten events of each subscriber, and
+ *   when it stopped serving.
+ *
+ * Times are CLOCK_MONOTONIC, which both processes share, so arrivals and
+ * deadlines carry over unchanged.
+ *
+ * Functions:
+ *
+ * - bool sendHandoff( const int channel, const handoffState &state )
+ *       Returns false if the state could not be sent; the sender still
+ *       has everything and can carry on.
+ *
+ * - bool receiveHandoff( const int channel, handoffState &state )
+ *       Returns false on a short or malformed handoff, closing any
+ *       descriptors received.
+ *
+ * At most MAX_HANDOFF_DESCRIPTORS descriptors go in one handoff. Clients
+ * beyond that are not sent; they see the old daemon close and reconnect.
+ \*****************************************************************************/
+
+#define HANDOFF_MAGIC "SODAHND4"
+#define MAX_HANDOFF_DESCRIPTORS 250
+
+struct handoffConnection
+{
+  unsigned long id;
+  int fd;
+  char client[CLIENT_NAME_LENGTH];
+  string buffer;                 // bytes of a request line not yet complete,
+                                 //  or of events not yet written
+  unsigned topics;               // eventBus topics of a subscriber
+};
+
+struct handoffState
+{
+  int serial;                    // -1 for none in each of these
+  int listener;
+  int control;
+  int events;
+  int pipeIn;
+  string pipeBuffer;
+  unsigned long nextConnection;
+  int64_t stopped;               // when the old daemon stopped serving
+  vector<vendRequest> queued;
+  vector<handoffConnection> connections;
+  vector<handoffConnection> subscribers;
+};
+
+bool sendHandoff( const int channel, const handoffState &state );
+bool receiveHandoff( const int channel, handoffState &state );
+
+#endif
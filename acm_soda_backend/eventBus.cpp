@@ -0,0 +1,351 @@
+#include "eventBus.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sstream>
+
+#define WRITE_BATCH 64         // events per writev()
+
+using namespace std;
+
+static const char *topicNames[EVENT_TOPICS] =
+  { "inventory", "vend", "button", "link" };
+
+eventBus::eventBus( const size_t backlog )
+{
+  ring.resize( backlog > 0 ? backlog : 1 );
+  head = 0;
+  droppedTotal = 0;
+  memset( total, 0x00, sizeof(total) );
+  memset( listeners, 0x00, sizeof(listeners) );
+}
+
+/* void eventBus::publish( const unsigned topic, const char *text )
+ *
+ * Overwrites the oldest event in the ring. Subscribers still behind it
+ *  notice in catchUp().
+ */
+void eventBus::publish( const unsigned topic, const char *text )
+{
+  busEvent &event = ring[ head % ring.size() ];
+  size_t length = strnlen( text, EVENT_LENGTH - 1 );
+
+  event.topic = topic;
+  memcpy( event.line, text, length );
+  event.line[length] = '\n';
+  event.length = length + 1;
+  memcpy( event.before, total, sizeof(total) );
+
+  for( int i = 0; i < EVENT_TOPICS; i++ )
+    if( topic & ( 1 << i ) )
+      total[i]++;
+  head++;
+}
+
+/* void eventBus::retain( const unsigned topic, const char *text )
+ *
+ * Assigned in place, so a line no longer than the last one takes no
+ *  allocation.
+ */
+void eventBus::retain( const unsigned topic, const char *text )
+{
+  for( int i = 0; i < EVENT_TOPICS; i++ )
+    if( topic & ( 1 << i ) )
+    {
+      retained[i].assign( text );
+      retained[i] += '\n';
+    }
+}
+
+void eventBus::add( const int fd, const unsigned topics, const string &unsent )
+{
+  busSubscriber &sub = subscriber[fd];
+
+  sub.topics = 0;
+  sub.cursor = head;
+  sub.matched = 0;
+  sub.dropped = 0;
+  sub.pending = unsent;
+  setTopics( sub, topics );
+}
+
+void eventBus::remove( const int fd )
+{
+  map<int, busSubscriber>::iterator found = subscriber.find( fd );
+
+  if( found == subscriber.end() )
+    return;
+  setTopics( found->second, 0 );
+  subscriber.erase( found );
+  close( fd );
+}
+
+/* bool eventBus::readable( const int fd )
+ *
+ * Reads SUBSCRIBE lines. Answers "OK" followed by the retained line of
+ *  each topic newly subscribed to, or "ERR unknown topic".
+ */
+bool eventBus::readable( const int fd )
+{
+  busSubscriber &sub = subscriber[fd];
+  char buf[MAX_SUBSCRIBE_LINE];
+  ssize_t length = read( fd, buf, sizeof(buf) );
+  size_t newline;
+
+  if( length == 0 || ( length < 0 && errno != EAGAIN && errno != EINTR ) )
+    return false;
+  if( length < 0 )
+    return true;
+
+  sub.input.append( buf, length );
+
+  while( ( newline = sub.input.find( '\n' ) ) != string::npos )
+  {
+    string line = sub.input.substr( 0, newline );
+    unsigned topics = 0;
+
+    sub.input.erase( 0, newline + 1 );
+    if( line.compare( 0, 10, "SUBSCRIBE " ) == 0 )
+      topics = parseTopics( line.substr( 10 ) );
+
+    if( topics == 0 )
+    {
+      sub.pending += "ERR unknown topic\n";
+      continue;
+    }
+
+    unsigned added = topics & ~sub.topics;
+    setTopics( sub, topics );
+    sub.pending += "OK\n";
+    for( int i = 0; i < EVENT_TOPICS; i++ )
+      if( added & ( 1 << i ) )
+        sub.pending += retained[i];
+  }
+
+  return sub.input.size() < MAX_SUBSCRIBE_LINE;
+}
+
+/* bool eventBus::writable( const int fd )
+ *
+ * Writes as much as the socket takes: first pending, then the
+ *  subscriber's events from the ring, a batch per writev(). An event
+ *  written in part is finished from pending, so the ring may overwrite it.
+ */
+bool eventBus::writable( const int fd )
+{
+  busSubscriber &sub = subscriber[fd];
+  struct iovec part[WRITE_BATCH];
+  uint64_t sequence[WRITE_BATCH];
+  ssize_t written;
+
+  catchUp( sub );
+
+  while( true )
+  {
+    if( !sub.pending.empty() )
+    {
+      written = write( fd, sub.pending.data(), sub.pending.size() );
+      if( written < 0 )
+        return errno == EAGAIN || errno == EINTR;
+      sub.pending.erase( 0, written );
+      if( !sub.pending.empty() )
+        return true;
+    }
+
+    int batch = 0;
+    uint64_t scan = sub.cursor;
+    for( ; scan < head && batch < WRITE_BATCH; scan++ )
+    {
+      busEvent &event = ring[ scan % ring.size() ];
+      if( !( event.topic & sub.topics ) )
+        continue;
+      part[batch].iov_base = event.line;
+      part[batch].iov_len = event.length;
+      sequence[batch++] = scan;
+    }
+
+    if( batch == 0 )
+    {
+      sub.cursor = head;
+      return true;
+    }
+
+    if( ( written = writev( fd, part, batch ) ) < 0 )
+      return errno == EAGAIN || errno == EINTR;
+
+    for( int i = 0; i < batch; i++ )
+    {
+      size_t length = part[i].iov_len;
+
+      if( written == 0 )
+        return true;
+      if( (size_t)written < length )
+        sub.pending.append( (const char *)part[i].iov_base + written,
+                            length - written );
+      written -= min<size_t>( written, length );
+      sub.cursor = sequence[i] + 1;
+      sub.matched++;
+    }
+    sub.cursor = scan;
+  }
+}
+
+bool eventBus::backlogged( const int fd ) const
+{
+  map<int, busSubscriber>::const_iterator found = subscriber.find( fd );
+
+  if( found == subscriber.end() )
+    return false;
+
+  const busSubscriber &sub = found->second;
+  if( !sub.pending.empty() )
+    return true;
+  if( sub.topics == 0 || sub.cursor >= head )
+    return false;
+  return head - sub.cursor > ring.size() ||
+         matchedBefore( head, sub.topics ) > sub.matched;
+}
+
+/* string eventBus::unsent( const int fd )
+ *
+ * Moves the subscriber's events still in the ring to pending and returns
+ *  it.
+ */
+string eventBus::unsent( const int fd )
+{
+  busSubscriber &sub = subscriber[fd];
+
+  catchUp( sub );
+  for( ; sub.cursor < head; sub.cursor++ )
+  {
+    busEvent &event = ring[ sub.cursor % ring.size() ];
+    if( event.topic & sub.topics )
+    {
+      sub.pending.append( event.line, event.length );
+      sub.matched++;
+    }
+  }
+
+  return sub.pending;
+}
+
+unsigned eventBus::topics( const int fd ) const
+{
+  map<int, busSubscriber>::const_iterator found = subscriber.find( fd );
+
+  return found == subscriber.end() ? 0 : found->second.topics;
+}
+
+unsigned eventBus::listening() const
+{
+  unsigned topics = 0;
+
+  for( int i = 0; i < EVENT_TOPICS; i++ )
+    if( listeners[i] > 0 )
+      topics |= 1 << i;
+  return topics;
+}
+
+void eventBus::descriptors( vector<int> &fds ) const
+{
+  for( map<int, busSubscriber>::const_iterator i = subscriber.begin();
+       i != subscriber.end(); ++i )
+    fds.push_back( i->first );
+}
+
+/* unsigned eventBus::parseTopics( const string &names )
+ */
+unsigned eventBus::parseTopics( const string &names )
+{
+  istringstream in( names );
+  string name;
+  unsigned topics = 0;
+
+  while( in >> name )
+  {
+    unsigned topic = name == "all" ? EVENT_ALL : 0;
+
+    for( int i = 0; i < EVENT_TOPICS; i++ )
+      if( name == topicNames[i] )
+        topic = 1 << i;
+    if( topic == 0 )
+      return 0;
+    topics |= topic;
+  }
+
+  return topics;
+}
+
+/* uint64_t eventBus::matchedBefore( sequence, topics )
+ *
+ * Events of the topics published before the given one, which must still
+ *  be in the ring (or be head).
+ */
+uint64_t eventBus::matchedBefore( const uint64_t sequence,
+                                  const unsigned topics ) const
+{
+  const uint64_t *counts = sequence == head ? total :
+                           ring[ sequence % ring.size() ].before;
+  uint64_t matched = 0;
+
+  for( int i = 0; i < EVENT_TOPICS; i++ )
+    if( topics & ( 1 << i ) )
+      matched += counts[i];
+  return matched;
+}
+
+/* void eventBus::catchUp( busSubscriber &sub )
+ *
+ * Moves a subscriber the ring has lapped up to its oldest event, and
+ *  tells it how many of its events it lost.
+ */
+void eventBus::catchUp( busSubscriber &sub )
+{
+  uint64_t oldest = head > ring.size() ? head - ring.size() : 0;
+
+  if( sub.cursor >= oldest )
+    return;
+
+  uint64_t lost = matchedBefore( oldest, sub.topics ) - sub.matched;
+  sub.cursor = oldest;
+  sub.matched += lost;
+  if( lost == 0 )
+    return;
+
+  ostringstream notice;
+  notice << "dropped " << lost << "\n";
+  sub.pending += notice.str();
+  sub.dropped += lost;
+  droppedTotal += lost;
+}
+
+/* void eventBus::setTopics( busSubscriber &sub, const unsigned topics )
+ *
+ * Events of the old topics already published stay queued; the new ones
+ *  start from now.
+ */
+void eventBus::setTopics( busSubscriber &sub, const unsigned topics )
+{
+  if( sub.topics != 0 )
+  {
+    catchUp( sub );
+    for( ; sub.cursor < head; sub.cursor++ )
+    {
+      busEvent &event = ring[ sub.cursor % ring.size() ];
+      if( event.topic & sub.topics )
+        sub.pending.append( event.line, event.length );
+    }
+  }
+
+  for( int i = 0; i < EVENT_TOPICS; i++ )
+  {
+    listeners[i] -= ( sub.topics >> i ) & 1;
+    listeners[i] += ( topics >> i ) & 1;
+  }
+
+  sub.topics = topics;
+  sub.cursor = head;
+  sub.matched = matchedBefore( head, topics );
+}
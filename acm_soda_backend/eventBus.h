@@ -0,0 +1,134 @@
+#ifndef EVENTBUS
+#define EVENTBUS
+
+#include <stdint.h>
+#include <stddef.h>
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/******************************************************************************\
+ * eventBus class: Pushes what happens at the machine to local subscribers,
+ *                 so nobody has to poll the database or the serial link.
+ *
+ * Subscribers connect to sodaDaemon's event socket and send one line,
+ *
+ *    SUBSCRIBE <topic> [<topic>...]      (inventory, vend, button, link, all)
+ *
+ * then read one line per event. Sending another SUBSCRIBE line replaces
+ * the topics.
+ *
+ * Every event is written once, into a ring of the last backlog events.
+ * Each subscriber only keeps a cursor into the ring, so publishing costs
+ * the same with one subscriber or a thousand, and a subscriber is sent
+ * its events when its socket has room. One that falls more than backlog
+ * events behind loses the oldest and is told how many it lost with a
+ * "dropped <n>" line, counting only events of its own topics.
+ *
+ * A topic may also keep a retained line, the current state (e.g. the whole
+ * inventory), which a new subscriber of that topic is sent first.
+ *
+ * Functions:
+ *
+ * - void publish( const unsigned topic, const char *text )
+ *       Queues an event line (without the newline) for every subscriber
+ *       of the topic. Copied into the ring: nothing is allocated.
+ *
+ * - void retain( const unsigned topic, const char *text )
+ *       Sets the line new subscribers of the topic start with.
+ *
+ * - void add( const int fd, const unsigned topics, const string &unsent )
+ *       Takes a subscriber connection; unsent is written before anything
+ *       else (the output an upgraded sodaDaemon had not written yet).
+ *
+ * - bool readable( const int fd ), bool writable( const int fd )
+ *       Handle poll() results for a subscriber. Return false when the
+ *       connection should be closed with remove().
+ *
+ * - bool backlogged( const int fd )
+ *       True if the subscriber has output waiting: poll it for POLLOUT.
+ *
+ * - string unsent( const int fd )
+ *       Everything not yet written to the subscriber, for a handoff.
+ *
+ * - unsigned listening()
+ *       The topics somebody subscribes to.
+ *
+ * - static unsigned parseTopics( const string &names )
+ *       The topic bits for a list of names, 0 if any is unknown.
+ \*****************************************************************************/
+
+enum eventTopic
+{
+  EVENT_INVENTORY = 1,
+  EVENT_VEND = 2,
+  EVENT_BUTTON = 4,
+  EVENT_LINK = 8
+};
+
+#define EVENT_TOPICS 4
+#define EVENT_ALL 0x0F
+#define EVENT_LENGTH 288       // longest event line: a 256-slot inventory
+#define EVENT_BACKLOG 1024     // events a subscriber may fall behind
+#define MAX_SUBSCRIBE_LINE 256
+
+struct busEvent
+{
+  unsigned topic;
+  unsigned length;
+  char line[EVENT_LENGTH];
+  uint64_t before[EVENT_TOPICS];   // events of each topic published earlier
+};
+
+struct busSubscriber
+{
+  unsigned topics;                 // 0 until it subscribes
+  uint64_t cursor;                 // sequence number of the next event
+  uint64_t matched;                // events of its topics before the cursor
+  uint64_t dropped;
+  string pending;                  // written before the ring's events
+  string input;                    // a SUBSCRIBE line not yet complete
+};
+
+class eventBus
+{
+  public:
+    eventBus( const size_t backlog = EVENT_BACKLOG );
+
+    void publish( const unsigned topic, const char *text );
+    void retain( const unsigned topic, const char *text );
+
+    void add( const int fd, const unsigned topics = 0,
+              const string &unsent = "" );
+    void remove( const int fd );
+    bool readable( const int fd );
+    bool writable( const int fd );
+    bool backlogged( const int fd ) const;
+    string unsent( const int fd );
+
+    unsigned topics( const int fd ) const;
+    unsigned listening() const;
+    size_t subscribers() const { return subscriber.size(); };
+    uint64_t published() const { return head; };
+    uint64_t dropped() const { return droppedTotal; };
+    void descriptors( vector<int> &fds ) const;
+
+    static unsigned parseTopics( const string &names );
+
+  private:
+    uint64_t matchedBefore( const uint64_t sequence, const unsigned topics ) const;
+    void catchUp( busSubscriber &sub );
+    void setTopics( busSubscriber &sub, const unsigned topics );
+
+    vector<busEvent> ring;
+    uint64_t head;                   // sequence number of the next event
+    uint64_t total[EVENT_TOPICS];    // events of each topic ever published
+    string retained[EVENT_TOPICS];
+    size_t listeners[EVENT_TOPICS];  // subscribers of each topic
+    uint64_t droppedTotal;
+    map<int, busSubscriber> subscriber;
+};
+
+#endif
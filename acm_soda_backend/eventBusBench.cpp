@@ -0,0 +1,201 @@
+/* eventBusBench.cpp
+ *
+ * Fan-out benchmark for sodaDaemon's eventBus, over real Unix sockets.
+ *
+ * For 1 to 1000 subscribers, publishes a burst of events and times the
+ *  publishing alone (which should not depend on the subscriber count)
+ *  and then delivering them all (which is one writev() per subscriber
+ *  per batch of events).
+ *
+ * Then one subscriber stops reading: the others should still get every
+ *  event, and it should be told exactly how many it lost.
+ *
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <vector>
+#include <unistd.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include "eventBus.h"
+
+#define EVENT_COUNT 1000
+#define SLOW_EVENTS 20000
+
+using namespace std;
+
+double wallSeconds();
+bool subscribe( eventBus &bus, vector<int> &readers, const unsigned topics );
+size_t drain( const int fd, size_t &drops );
+void closeAll( eventBus &bus, vector<int> &readers );
+
+int main()
+{
+  struct rlimit files;
+  const size_t counts[] = { 1, 10, 100, 1000 };
+
+  /* Two descriptors per subscriber */
+  if( getrlimit( RLIMIT_NOFILE, &files ) == 0 )
+  {
+    files.rlim_cur = files.rlim_max;
+    setrlimit( RLIMIT_NOFILE, &files );
+  }
+
+  cout << setw(12) << "subscribers" << setw(16) << "publish ns/ev"
+       << setw(18) << "deliver us/ev" << setw(14) << "lines read" << endl;
+
+  for( size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++ )
+  {
+    eventBus bus( EVENT_COUNT );
+    vector<int> readers;
+    vector<int> fds;
+
+    for( size_t i = 0; i < counts[c]; i++ )
+      if( !subscribe( bus, readers, EVENT_VEND ) )
+      {
+        perror( "eventBusBench: socketpair" );
+        return 1;
+      }
+    bus.descriptors( fds );
+
+    double start = wallSeconds();
+    for( int i = 0; i < EVENT_COUNT; i++ )
+      bus.publish( EVENT_VEND, "vend completed 3 uid1000 0" );
+    double published = wallSeconds() - start;
+
+    /* Deliver and read until every subscriber has had everything */
+    size_t lines = 0, drops = 0;
+    start = wallSeconds();
+    for( bool busy = true; busy; )
+    {
+      busy = false;
+      for( size_t i = 0; i < fds.size(); i++ )
+        if( bus.backlogged( fds[i] ) )
+        {
+          busy = true;
+          bus.writable( fds[i] );
+          lines += drain( readers[i], drops );
+        }
+    }
+    double delivered = wallSeconds() - start;
+
+    cout << setw(12) << counts[c]
+         << setw(16) << fixed << setprecision(1)
+         << published * 1e9 / EVENT_COUNT
+         << setw(18) << setprecision(2) << delivered * 1e6 / EVENT_COUNT
+         << setw(14) << lines;
+    if( lines != counts[c] * EVENT_COUNT || drops != 0 )
+      cout << "  (expected " << counts[c] * EVENT_COUNT << ", "
+           << drops << " dropped)";
+    cout << endl;
+
+    closeAll( bus, readers );
+  }
+
+  /* A subscriber that stops reading */
+  eventBus bus;
+  vector<int> readers;
+  vector<int> fds;
+  size_t lines = 0, drops = 0;
+  size_t slowLines = 0, slowDrops = 0;
+
+  subscribe( bus, readers, EVENT_ALL );
+  subscribe( bus, readers, EVENT_ALL );
+  bus.descriptors( fds );
+
+  for( int i = 0; i < SLOW_EVENTS; i++ )
+  {
+    bus.publish( EVENT_BUTTON, "button 1" );
+    bus.writable( fds[0] );
+    bus.writable( fds[1] );
+    lines += drain( readers[0], drops );
+  }
+  lines += drain( readers[0], drops );
+
+  /* It wakes up and reads everything it still can */
+  while( bus.backlogged( fds[1] ) )
+  {
+    bus.writable( fds[1] );
+    slowLines += drain( readers[1], slowDrops );
+  }
+  slowLines += drain( readers[1], slowDrops );
+
+  cout << endl << "Slow subscriber, " << SLOW_EVENTS << " events, backlog "
+       << EVENT_BACKLOG << ":" << endl
+       << "  reader:   " << lines << " events, " << drops << " dropped" << endl
+       << "  sleeper:  " << slowLines << " events, " << slowDrops
+       << " reported dropped, " << bus.dropped() << " counted" << endl;
+  if( lines != SLOW_EVENTS || slowLines + slowDrops != SLOW_EVENTS )
+    cout << "  events went missing!" << endl;
+
+  closeAll( bus, readers );
+  return 0;
+}
+
+/* subscribe: a socket pair, one end on the bus and one to read */
+bool subscribe( eventBus &bus, vector<int> &readers, const unsigned topics )
+{
+  int pair[2];
+
+  if( socketpair( AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, pair ) != 0 )
+    return false;
+  bus.add( pair[0], topics );
+  readers.push_back( pair[1] );
+  return true;
+}
+
+/* drain: reads what has arrived, counting event lines and adding up
+ *  "dropped <n>" notices
+ */
+size_t drain( const int fd, size_t &drops )
+{
+  static map<int, string> partials;
+  string &partial = partials[fd];
+  char buf[65536];
+  ssize_t length;
+  size_t lines = 0;
+
+  while( ( length = read( fd, buf, sizeof(buf) ) ) > 0 )
+  {
+    partial.append( buf, length );
+
+    size_t start = 0, newline;
+    while( ( newline = partial.find( '\n', start ) ) != string::npos )
+    {
+      if( partial.compare( start, 8, "dropped " ) == 0 )
+        drops += atol( partial.c_str() + start + 8 );
+      else
+        lines++;
+      start = newline + 1;
+    }
+    partial.erase( 0, start );
+  }
+
+  return lines;
+}
+
+void closeAll( eventBus &bus, vector<int> &readers )
+{
+  vector<int> fds;
+
+  bus.descriptors( fds );
+  for( size_t i = 0; i < fds.size(); i++ )
+    bus.remove( fds[i] );
+  for( size_t i = 0; i < readers.size(); i++ )
+    close( readers[i] );
+  readers.clear();
+}
+
+/* wallSeconds: real time, for the rates */
+double wallSeconds()
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
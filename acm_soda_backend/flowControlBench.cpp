@@ -0,0 +1,192 @@
+/* flowControlBench.cpp
+ *
+ * Throughput and loss of commands sent back to back to an MCU with a
+ *  small receive ring, against the emulated MCU (emulatedSodaMachine, on
+ *  a virtual clock).
+ *
+ * The MCU model gets a receive ring of each size in turn (the firmware's
+ *  holds 31 bytes) and, like the firmware, stops reading it while a vend
+ *  motor runs or its 7-byte transmit ring is full. Each run sends the
+ *  same COMMAND_COUNT commands through sodaMachine::pipeline():
+ *
+ *  - stop-and-wait:  one command at a time, as the link always ran
+ *  - blind:          everything at once, no credits and no TIOCOUTQ limit
+ *  - credits:        as many bytes as the MCU's 'C' advertises, paced by
+ *                     its answers and the output queue (see creditWindow.h)
+ *
+ * and two workloads: inventory queries only ('S', one byte out, three
+ *  back, so the MCU's transmit ring backs up), and the same with a
+ *  retryable vend ('W') every VEND_EVERY commands.
+ *
+ * A command whose answer is lost or garbled is sent again with all those
+ *  after it, after waiting out the timeout, as a caller of pipeline()
+ *  would. The rates are commands per virtual second, timeouts included.
+ *  Overruns are bytes the ring dropped: that is what blind pipelining
+ *  costs besides the waiting. Double vends are retried vends whose first
+ *  copy had run after all. There should be none, even blind:
+ *  pipeline() holds a 'W' back while another is unanswered, and takes
+ *  only an answer carrying its seq, so sending the rest again never
+ *  repeats an older vend's seq.
+ *
+ * Nothing but this benchmark pipelines: sodaDaemon never asks for
+ *  credits, and its link runs through service().
+ *
+ * Runs in a scratch directory so that nothing is logged or journaled.
+ *
+ * Usage: flowControlBench [commands]
+ *
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <unistd.h>
+#include "sodaMachine.h"
+
+#define COMMAND_COUNT 2000
+#define VEND_EVERY 50
+#define INVENTORY_WAIT 50000         // microseconds for an answer
+#define VEND_WAIT 2000000
+
+using namespace std;
+
+enum flowMode
+{
+  STOP_AND_WAIT,
+  BLIND,
+  CREDITS
+};
+
+struct runResult
+{
+  double rate;
+  unsigned long overruns;
+  unsigned long timeouts;
+  long doubleVends;
+  size_t credits;
+};
+
+void run( const size_t ring, const bool vends, const flowMode mode,
+          const size_t count, runResult &result );
+bool answered( const pipelinedCommand &command );
+
+int main( int argc, char *argv[] )
+{
+  char scratch[] = "/tmp/flowControlBenchXXXXXX";
+  const size_t rings[] = { 8, 16, 31, 64 };
+  const char *modes[] = { "stop-and-wait", "blind", "credits" };
+  size_t count = argc > 1 ? atol( argv[1] ) : COMMAND_COUNT;
+
+  if( mkdtemp( scratch ) == NULL || chdir( scratch ) != 0 )
+  {
+    perror( "flowControlBench: could not make a scratch directory" );
+    return 1;
+  }
+
+  for( int vends = 0; vends < 2; vends++ )
+  {
+    cout << ( vends ? "inventory, a vend every " : "inventory only" );
+    if( vends )
+      cout << VEND_EVERY;
+    cout << endl << "  ring  mode           commands/s  overruns  timeouts"
+         << "  double vends" << endl;
+
+    for( size_t i = 0; i < sizeof(rings) / sizeof(rings[0]); i++ )
+      for( int mode = STOP_AND_WAIT; mode <= CREDITS; mode++ )
+      {
+        runResult result;
+
+        run( rings[i], vends, (flowMode)mode, count, result );
+        cout << setw(6) << rings[i] << "  " << setw(13) << left
+             << modes[mode] << right << setw(12) << fixed << setprecision(1)
+             << result.rate << setw(10) << result.overruns << setw(10)
+             << result.timeouts << setw(14) << result.doubleVends;
+        if( mode == CREDITS )
+          cout << "  (" << result.credits << " credits)";
+        cout << endl;
+      }
+    cout << endl;
+  }
+
+  if( chdir( "/" ) == 0 )
+    rmdir( scratch );
+  return 0;
+}
+
+/* run: one ring size, one workload, one way of sending */
+void run( const size_t ring, const bool vends, const flowMode mode,
+          const size_t count, runResult &result )
+{
+  emulatedSodaMachine acmSoda;
+  mcuModel &mcu = acmSoda.getTransport().mcu();
+  virtualClock &clock = acmSoda.getClock();
+  vector<pipelinedCommand> commands( count );
+  unsigned long vendCount = 0;
+  size_t next = 0;
+
+  mcu.setSlots( emulatedSodaMachine::geometry::slotCount );
+  for( unsigned slot = 0; slot < emulatedSodaMachine::geometry::slotCount;
+       slot++ )
+    mcu.setStock( slot, count );
+  mcu.sequencedVends = true;
+  mcu.flowCredits = true;
+  mcu.receiveBuffer = ring;
+
+  acmSoda.setSequencedVends( true );
+  if( mode == CREDITS )
+    acmSoda.setFlowControl( true );
+  else if( mode == BLIND )
+    acmSoda.flowCredits().configure( CREDITS_UNLIMITED, CREDITS_UNLIMITED );
+  result.credits = acmSoda.flowCredits().credits();
+
+  for( size_t i = 0; i < count; i++ )
+  {
+    pipelinedCommand &command = commands[i];
+
+    if( vends && i % VEND_EVERY == VEND_EVERY - 1 )
+    {
+      command.bytes[0] = 'W';
+      command.bytes[1] = (char)( 0x80 + vendCount++ % 0x80 );
+      command.bytes[2] = i % emulatedSodaMachine::geometry::slotCount;
+      command.length = 3;
+      command.replyLength = 2;
+    }
+    else
+    {
+      command.bytes[0] = 'S';
+      command.length = 1;
+      command.replyLength = 1 + emulatedSodaMachine::geometry::inventoryLength;
+    }
+  }
+
+  result.timeouts = 0;
+  int64_t start = clock.now();
+  while( next < count )
+  {
+    size_t got = acmSoda.pipeline( &commands[next], count - next,
+                                   vends ? VEND_WAIT : INVENTORY_WAIT );
+    size_t good = 0;
+
+    while( good < got && answered( commands[next + good] ) )
+      good++;
+    next += good;
+    if( next < count )
+      result.timeouts++;
+  }
+
+  result.rate = count / ( ( clock.now() - start ) / 1e6 );
+  result.overruns = mcu.overruns;
+  result.doubleVends = (long)mcu.vends - (long)vendCount;
+}
+
+/* answered: whether the answer is the one the command asked for */
+bool answered( const pipelinedCommand &command )
+{
+  if( command.bytes[0] == 'S' )
+    return command.reply[0] == '?';
+
+  return ( command.reply[0] == 'Y' || command.reply[0] == 'N' ) &&
+         command.reply[1] == command.bytes[1];
+}
@@ -0,0 +1,464 @@
+#include "frontEnd.h"
+#include "linkScheduler.h"
+
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <system_error>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* Clients one thread holds before its pool needs another slab, and polls
+ *  without growing its descriptor list */
+#define FRONT_NODES 64
+
+using namespace std;
+
+frontEnd::frontWorker::frontWorker( const unsigned long first )
+  : replies( FRONT_REPLIES ), nodes( FRONT_NODES ),
+    connections( ( less<unsigned long>() ),
+                 poolAllocator<connectionEntry>( &nodes ) )
+{
+  next = first;
+  stopping.store( false );
+}
+
+/* Constructor:
+ *  - threads: front-end threads, 0 to leave clients to the main loop
+ *  - listener: the client socket, non-blocking
+ *  - first: the number of the first client, above those the main loop has
+ *  - slots: the machine's slot count, to reject the slots it does not have
+ */
+frontEnd::frontEnd( const unsigned threads, const int listener,
+                    const unsigned long first, const unsigned slots )
+  : requests( FRONT_QUEUE )
+{
+  this->listener = listener;
+  this->first = first;
+  this->slots = slots;
+  running = false;
+
+  for( unsigned k = 0; k < threads; k++ )
+    workers.push_back( new frontWorker( first + k ) );
+}
+
+/* Destructor:
+ *  - Stops the threads and closes their clients
+ */
+frontEnd::~frontEnd()
+{
+  stop();
+  for( size_t k = 0; k < workers.size(); k++ )
+  {
+    for( connectionTable::iterator i = workers[k]->connections.begin();
+         i != workers[k]->connections.end(); ++i )
+      close( i->second.fd );
+    delete workers[k];
+  }
+}
+
+/* bool frontEnd::start()
+ *
+ * Returns false if a thread could not be started; those that were run.
+ */
+bool frontEnd::start()
+{
+  if( running )
+    return true;
+
+  running = true;
+  for( size_t k = 0; k < workers.size(); k++ )
+  {
+    workers[k]->stopping.store( false );
+    try
+    {
+      workers[k]->runner = thread( &frontEnd::run, this, workers[k] );
+    }
+    catch( const system_error &error )
+    {
+      cerr << "frontEnd::start(): thread " << k << " did not start: "
+           << error.what() << endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+/* void frontEnd::stop()
+ *
+ * Each thread writes the answers it was sent before it returns.
+ */
+void frontEnd::stop()
+{
+  if( !running )
+    return;
+
+  for( size_t k = 0; k < workers.size(); k++ )
+  {
+    workers[k]->stopping.store( true );
+    workers[k]->replies.ring();
+  }
+  for( size_t k = 0; k < workers.size(); k++ )
+    if( workers[k]->runner.joinable() )
+      workers[k]->runner.join();
+  running = false;
+}
+
+/* bool frontEnd::reply( const unsigned long connection, const char *text )
+ *
+ * A client of a thread whose mailbox is full does not get its answer;
+ *  with FRONT_REPLIES per thread that takes a thread stuck for a while.
+ */
+bool frontEnd::reply( const unsigned long connection, const char *text )
+{
+  if( workers.empty() || connection < first )
+    return false;
+
+  frontWorker &worker = *workers[ ( connection - first ) % workers.size() ];
+  frontReply answer;
+
+  answer.connection = connection;
+  strncpy( answer.text, text, sizeof(answer.text) - 1 );
+  answer.text[ sizeof(answer.text) - 1 ] = '\0';
+  if( !worker.replies.post( answer ) )
+    cerr << "frontEnd::reply(): no room to answer connection " << connection
+         << endl;
+  return true;
+}
+
+void frontEnd::flush()
+{
+  for( size_t k = 0; k < workers.size(); k++ )
+    deliver( *workers[k] );
+}
+
+/* void frontEnd::handOver( vector<handoffConnection> &connections )
+ */
+void frontEnd::handOver( vector<handoffConnection> &connections ) const
+{
+  for( size_t k = 0; k < workers.size(); k++ )
+    for( connectionTable::const_iterator i = workers[k]->connections.begin();
+         i != workers[k]->connections.end(); ++i )
+    {
+      handoffConnection connection;
+
+      connection.id = i->first;
+      connection.fd = i->second.fd;
+      connection.buffer.assign( i->second.buffer, i->second.buffered );
+      connection.topics = 0;
+      memcpy( connection.client, i->second.client,
+              sizeof(connection.client) );
+      connections.push_back( connection );
+    }
+}
+
+/* unsigned long frontEnd::nextConnection()
+ */
+unsigned long frontEnd::nextConnection() const
+{
+  unsigned long next = first;
+
+  for( size_t k = 0; k < workers.size(); k++ )
+    if( workers[k]->next > next )
+      next = workers[k]->next;
+  return next;
+}
+
+/* void frontEnd::run( frontWorker *worker )
+ *
+ * One thread's loop: new clients, request lines, and answers from the
+ *  main loop, until stop().
+ */
+void frontEnd::run( frontWorker *worker )
+{
+  vector<struct pollfd> polled;
+  vector<unsigned long> polledIds;
+
+  polled.reserve( 2 + FRONT_NODES );
+  polledIds.reserve( FRONT_NODES );
+
+  while( !worker->stopping.load() )
+  {
+    struct pollfd entry;
+
+    polled.clear();
+    polledIds.clear();
+    entry.events = POLLIN;
+    entry.revents = 0;
+
+    entry.fd = listener;
+    polled.push_back( entry );
+    entry.fd = worker->replies.descriptor();
+    polled.push_back( entry );
+    for( connectionTable::iterator i = worker->connections.begin();
+         i != worker->connections.end(); ++i )
+    {
+      entry.fd = i->second.fd;
+      polled.push_back( entry );
+      polledIds.push_back( i->first );
+    }
+
+    if( poll( &polled[0], polled.size(), 1000 ) < 0 && errno != EINTR )
+      break;
+
+    if( polled[1].revents & POLLIN )
+      worker->replies.acknowledge();
+    deliver( *worker );
+
+    /* Every thread polls the listener; those that lose the race for a
+     *  client just get EAGAIN
+     */
+    clientConnection connection;
+    if( ( polled[0].revents & POLLIN ) && accept( listener, connection ) )
+    {
+      worker->connections[ worker->next ] = connection;
+      worker->next += workers.size();
+    }
+
+    for( size_t i = 2; i < polled.size(); i++ )
+    {
+      if( polled[i].revents == 0 )
+        continue;
+
+      connectionTable::iterator found =
+        worker->connections.find( polledIds[i - 2] );
+
+      if( !receive( found->first, found->second ) )
+      {
+        close( found->second.fd );
+        worker->connections.erase( found );
+      }
+    }
+  }
+
+  deliver( *worker );
+}
+
+/* bool frontEnd::receive( id, connection )
+ *
+ * Reads what a client sent and posts each complete, well-formed line to
+ *  the main loop. Returns false when the connection should be closed.
+ */
+bool frontEnd::receive( const unsigned long id, clientConnection &connection )
+{
+  ssize_t length = read( connection.fd, connection.buffer + connection.buffered,
+                         MAX_LINE - connection.buffered );
+  char *line = connection.buffer;
+  char *newline;
+
+  if( length == 0 || ( length < 0 && errno != EAGAIN && errno != EINTR ) )
+    return false;
+  if( length < 0 )
+    return true;
+
+  connection.buffered += length;
+
+  while( ( newline = (char *)memchr( line, '\n', connection.buffer +
+                                     connection.buffered - line ) ) != NULL )
+  {
+    vendRequest decoded[BATCH_MAX];
+    size_t count;
+    const char *error;
+
+    *newline = '\0';
+    error = decode( line, connection.client, true, slots, decoded, count );
+    if( error != NULL )
+    {
+      send( connection, error );
+      count = 0;
+    }
+    for( size_t i = 0; i < count; i++ )
+    {
+      decoded[i].connection = id;
+      if( !requests.post( decoded[i] ) )
+      {
+        char text[32];
+        if( decoded[i].command == 'M' )
+          snprintf( text, sizeof(text), "BUSY %d slot=%u\n", FRONT_RETRY,
+                    (unsigned)decoded[i].slot );
+        else
+          snprintf( text, sizeof(text), "BUSY %d\n", FRONT_RETRY );
+        send( connection, text );
+      }
+    }
+    line = newline + 1;
+  }
+
+  connection.buffered -= line - connection.buffer;
+  memmove( connection.buffer, line, connection.buffered );
+
+  /* No request is this long */
+  return connection.buffered < MAX_LINE;
+}
+
+/* void frontEnd::deliver( frontWorker &worker )
+ *
+ * Answers to clients that have gone are dropped.
+ */
+void frontEnd::deliver( frontWorker &worker )
+{
+  frontReply answer;
+
+  while( worker.replies.take( answer ) )
+  {
+    connectionTable::iterator found =
+      worker.connections.find( answer.connection );
+
+    if( found != worker.connections.end() )
+      send( found->second, answer.text );
+  }
+}
+
+void frontEnd::send( const clientConnection &connection, const char *text )
+{
+  if( write( connection.fd, text, strlen( text ) ) < 0 )
+    return;
+}
+
+/* bool frontEnd::accept( const int listener, clientConnection &connection )
+ */
+bool frontEnd::accept( const int listener, clientConnection &connection )
+{
+  int fd = accept4( listener, NULL, NULL, SOCK_NONBLOCK );
+  struct ucred credentials;
+  socklen_t length = sizeof(credentials);
+
+  if( fd < 0 )
+    return false;
+
+  connection.fd = fd;
+  connection.buffered = 0;
+  if( getsockopt( fd, SOL_SOCKET, SO_PEERCRED, &credentials, &length ) == 0 )
+    snprintf( connection.client, sizeof(connection.client), "uid%u",
+              (unsigned)credentials.uid );
+  else
+    snprintf( connection.client, sizeof(connection.client), "unknown" );
+  return true;
+}
+
+/* const char *frontEnd::decode( line, client, products, slots, requests,
+ *                               count )
+ *
+ *  "V <slot> [client=<name>] [deadline=<ms>] [key=<token>]"
+ *  "P <product> [client=<name>] [deadline=<ms>] [key=<token>]"
+ *  "M <slot> [<slot>...] [client=<name>] [deadline=<ms>] [key=<token>]"
+ *
+ *  client is the connection's own name, its uid ("uid1000"); client=
+ *  only names a part of it ("uid1000/web"), so a client can neither take
+ *  another uid's bucket nor escape its own (admissionControl caps the
+ *  parts one uid may have). Names are up to 31 of [A-Za-z0-9_.-], cut
+ *  short to fit after the uid.
+ *
+ *  M is a batch: one 'M' request per slot, sharing the options. Each
+ *  gets the key with "/<n>" added, n its place in the line, so that the
+ *  same line sent again retries every vend in it; '/' is not allowed in
+ *  a key, so no other request can name them.
+ *
+ *  A slot of slots or above is refused here, so that it never reaches
+ *  the link scheduler.
+ *
+ *  Arrivals and deadlines are linkScheduler::now() microseconds.
+ */
+const char *frontEnd::decode( const char *line, const char *client,
+                              const bool products, const unsigned slots,
+                              vendRequest *requests, size_t &count )
+{
+  vendRequest &request = requests[0];
+  unsigned short batch[BATCH_MAX];
+  char command[8];
+  int slot;
+  int consumed = 0;
+  int milliseconds;
+  int length = 0;
+  char name[CLIENT_NAME_LENGTH];
+  const char *options;
+
+  memset( &request, 0x00, sizeof(request) );
+  count = 1;
+
+  if( products &&
+      sscanf( line, "%7s %15[A-Za-z0-9_.-]%n", command,
+              request.product, &consumed ) == 2 &&
+      strcmp( command, "P" ) == 0 &&
+      ( line[consumed] == '\0' || isspace( line[consumed] ) ) )
+    slot = 0;
+  else if( products && sscanf( line, "%7s%n", command, &consumed ) == 1 &&
+           strcmp( command, "M" ) == 0 )
+  {
+    request.product[0] = '\0';
+    count = 0;
+    while( count < BATCH_MAX &&
+           sscanf( line + consumed, "%d%n", &slot, &length ) == 1 &&
+           slot >= 0 && slot < (int)slots &&
+           ( line[consumed + length] == '\0' ||
+             isspace( line[consumed + length] ) ) )
+    {
+      batch[count++] = slot;
+      consumed += length;
+    }
+    /* Anything numeric left over is a bad slot, or one too many */
+    if( count == 0 || sscanf( line + consumed, "%d", &slot ) == 1 )
+      return "ERR expected M and 1-16 slots\n";
+    slot = batch[0];
+  }
+  else if( sscanf( line, "%7s %d%n", command, &slot, &consumed ) != 2 ||
+           strcmp( command, "V" ) != 0 || slot < 0 || slot >= (int)slots )
+    return "ERR expected V <slot>, P <product> or M <slot>...\n";
+  else
+    request.product[0] = '\0';
+
+  request.command = command[0] == 'M' ? 'M' : 'V';
+  request.slot = slot;
+  request.arrival = linkScheduler::now();
+  strncpy( request.client, client, sizeof(request.client) - 1 );
+
+  options = strstr( line + consumed, "client=" );
+  if( options != NULL )
+  {
+    size_t used = strlen( request.client );
+
+    if( sscanf( options, "client=%31[A-Za-z0-9_.-]%n", name, &length ) != 1 ||
+        ( options[length] != '\0' && !isspace( options[length] ) ) )
+      return "ERR bad client\n";
+    if( used + 2 < sizeof(request.client) )
+    {
+      request.client[used] = '/';
+      memcpy( request.client + used + 1, name,
+              min( strlen( name ), sizeof(request.client) - used - 2 ) );
+    }
+  }
+
+  options = strstr( line + consumed, "deadline=" );
+  if( options != NULL && sscanf( options, "deadline=%d", &milliseconds ) == 1 &&
+      milliseconds > 0 )
+    request.deadline = request.arrival + milliseconds * 1000LL;
+
+  /* The whole token must fit, or two long keys could end up the same */
+  options = strstr( line + consumed, "key=" );
+  if( options != NULL &&
+      ( sscanf( options, "key=%47[A-Za-z0-9_.:-]%n", request.key,
+                &length ) != 1 ||
+        ( options[length] != '\0' && !isspace( options[length] ) ) ) )
+    return "ERR bad key\n";
+
+  if( request.command != 'M' )
+    return NULL;
+
+  size_t keyLength = strlen( request.key );
+  if( keyLength > 0 && keyLength + 3 >= sizeof(request.key) )
+    return "ERR bad key\n";
+
+  for( size_t i = 0; i < count; i++ )
+  {
+    if( i > 0 )
+      requests[i] = request;
+    requests[i].slot = batch[i];
+    if( keyLength > 0 )
+      snprintf( requests[i].key + keyLength, sizeof(request.key) - keyLength,
+                "/%u", (unsigned)i );
+  }
+  return NULL;
+}
@@ -0,0 +1,168 @@
+#ifndef FRONTEND
+#define FRONTEND
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <map>
+#include <thread>
+#include <vector>
+
+#include "admissionControl.h"
+#include "daemonHandoff.h"
+#include "mpscQueue.h"
+#include "nodePool.h"
+
+using namespace std;
+
+/******************************************************************************\
+ * frontEnd class: Threads that serve sodaDaemon's clients, so that the
+ *                 thread driving the serial link does nothing else.
+ *
+ * sodaDaemon -j <n> starts n front-end threads. Each one accepts clients
+ * on the shared listening socket, reads their request lines and decodes
+ * them (decode(), which sodaDaemon's own loop uses too), answering
+ * malformed ones itself. Decoded requests go to the daemon's main loop,
+ * the one thread that owns the sodaMachine and its serial port, through
+ * one mailbox (see mpscQueue.h) that every front end posts to. The main
+ * loop admits them and vends them as before, and sends every answer back
+ * with reply(), which posts it to the mailbox of the thread that owns the
+ * connection; only that thread ever writes to it.
+ *
+ * Connection numbers tell the threads apart: thread k of n numbers its
+ * connections first + k, first + k + n, ... Numbers below first belong to
+ * the main loop (handed over by an upgrade).
+ *
+ * A request that finds the mailbox full is answered BUSY FRONT_RETRY. A
+ * client's connection, its unfinished line and its answers stay with the
+ * one thread, so its answers come back in order.
+ *
+ * For an upgrade the main loop stop()s the threads, takes the requests
+ * they had posted, flush()es their answers and hands over their clients
+ * with handOver(); if the new daemon does not take over, start() carries
+ * on with the same clients.
+ *
+ * Functions:
+ *
+ * - frontEnd( threads, listener, first, slots )
+ *       Serves clients of listener on threads threads (none: the main loop
+ *       serves them), numbering them from first, for a machine of slots
+ *       slots.
+ *
+ * - bool start(), void stop()
+ *       Starts and joins the threads.
+ *
+ * - int descriptor(), void acknowledge(), bool next( vendRequest &request )
+ *       The main loop's end of the request mailbox: poll descriptor(),
+ *       acknowledge() when it is readable, and take requests with next().
+ *
+ * - bool reply( const unsigned long connection, const char *text )
+ *       Sends a line to a front-end client. Returns false if the
+ *       connection is not a front end's.
+ *
+ * - void flush()
+ *       While stopped: writes the answers the threads have not yet.
+ *
+ * - void handOver( vector<handoffConnection> &connections )
+ *       While stopped: adds every front-end client.
+ *
+ * - unsigned long nextConnection()
+ *       While stopped: above every number a front end has given out.
+ *
+ * - static bool accept( const int listener, clientConnection &connection )
+ *       Takes a new connection, named by its uid ("uid1000").
+ *
+ * - static const char *decode( line, client, products, slots, requests,
+ *                              count )
+ *       Parses a request line into count requests (room for BATCH_MAX):
+ *       one, or one per slot of a batch. Returns NULL if it is well
+ *       formed, else the error line to answer it with; a slot the
+ *       machine does not have (slots or above) is an error. products is
+ *       false for the legacy pipe, which only vends single slots. The
+ *       requests are client's, or client's "/<name>" with client=.
+ \*****************************************************************************/
+
+#define MAX_LINE 256                 // a request line
+#define BATCH_MAX 16                 // slots in one batch vend
+#define REPLY_LENGTH 48              // an answer line and its NUL
+#define FRONT_QUEUE 1024             // requests posted and not yet taken
+#define FRONT_REPLIES 1024           // answers posted to one thread
+#define FRONT_RETRY 100              // milliseconds, when the queue is full
+
+struct clientConnection
+{
+  int fd;
+  size_t buffered;                   // bytes of a request line not yet complete
+  char buffer[MAX_LINE];
+  char client[CLIENT_NAME_LENGTH];
+};
+
+/* Connections by number. Both a front end's and the main loop's gain and
+ *  lose entries with every client, so their nodes are pooled.
+ */
+typedef pair<const unsigned long, clientConnection> connectionEntry;
+typedef map< unsigned long, clientConnection, less<unsigned long>,
+             poolAllocator<connectionEntry> > connectionTable;
+
+struct frontReply
+{
+  unsigned long connection;
+  char text[REPLY_LENGTH];
+};
+
+class frontEnd
+{
+  public:
+    frontEnd( const unsigned threads, const int listener,
+              const unsigned long first, const unsigned slots );
+    ~frontEnd();
+
+    bool start();
+    void stop();
+    unsigned threads() const { return workers.size(); };
+
+    int descriptor() const
+      { return workers.empty() ? -1 : requests.descriptor(); };
+    void acknowledge() { requests.acknowledge(); };
+    bool next( vendRequest &request ) { return requests.take( request ); };
+
+    bool reply( const unsigned long connection, const char *text );
+    void flush();
+    void handOver( vector<handoffConnection> &connections ) const;
+    unsigned long nextConnection() const;
+
+    static bool accept( const int listener, clientConnection &connection );
+    static const char *decode( const char *line, const char *client,
+                               const bool products, const unsigned slots,
+                               vendRequest *requests, size_t &count );
+
+  private:
+    frontEnd( const frontEnd & );
+    frontEnd &operator=( const frontEnd & );
+
+    struct frontWorker
+    {
+      frontWorker( const unsigned long first );
+
+      thread runner;
+      mailbox<frontReply> replies;
+      nodePool nodes;                // before connections, which uses it
+      connectionTable connections;
+      unsigned long next;            // number for its next client
+      atomic<bool> stopping;
+    };
+
+    void run( frontWorker *worker );
+    bool receive( const unsigned long id, clientConnection &connection );
+    void deliver( frontWorker &worker );
+    static void send( const clientConnection &connection, const char *text );
+
+    vector<frontWorker *> workers;
+    mailbox<vendRequest> requests;
+    int listener;
+    unsigned long first;
+    unsigned slots;
+    bool running;
+};
+
+#endif
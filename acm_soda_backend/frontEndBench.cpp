@@ -0,0 +1,310 @@
+/* frontEndBench.cpp
+ *
+ * How sodaDaemon's request rate scales with front-end threads (-j, see
+ *  frontEnd.h).
+ *
+ * A main loop like the daemon's owns an emulatedSodaMachine, so a vend
+ *  costs only sodaMachine's own code (see protocolBench.cpp), and admits,
+ *  vends and answers requests one at a time. CLIENTS client threads
+ *  each send "V <slot>" over their own connection and wait for the
+ *  answer before sending the next, for SECONDS per row.
+ *
+ *  - 0 threads:  the main loop reads the clients itself, as without -j
+ *  - n threads:  n frontEnd threads read and decode the lines and post
+ *                 them to the main loop, which answers through them
+ *
+ * Admission control lets everything through, so the rows compare the
+ *  cost of getting requests to the serial-owning thread and back, not
+ *  the link. Each row reports requests per second and the latency a
+ *  client saw. More threads than CPUs cannot help: the machine's CPU
+ *  count is printed first.
+ *
+ * Usage: frontEndBench [clients] [seconds]
+ *
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <poll.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "sodaMachine.h"
+#include "admissionControl.h"
+#include "frontEnd.h"
+
+#define CLIENTS 16
+#define SECONDS 2
+#define QUEUE 4096
+
+using namespace std;
+
+struct clientResult
+{
+  vector<double> latency;          // microseconds
+};
+
+double wallSeconds();
+int listenAt( const char *path );
+void client( const char *path, const unsigned n, atomic<bool> *done,
+             clientResult *result );
+void serve( const unsigned threads, const int listener,
+            atomic<bool> *done );
+
+int main( int argc, char *argv[] )
+{
+  unsigned clients = argc > 1 ? atoi( argv[1] ) : CLIENTS;
+  double seconds = argc > 2 ? atof( argv[2] ) : SECONDS;
+  char scratch[] = "/tmp/frontEndBenchXXXXXX";
+  unsigned rows[] = { 0, 1, 2, 4, 8 };
+
+  if( mkdtemp( scratch ) == NULL || chdir( scratch ) != 0 )
+  {
+    perror( "frontEndBench: could not make a scratch directory" );
+    return 1;
+  }
+
+  cout << thread::hardware_concurrency() << " CPUs, " << clients
+       << " clients" << endl;
+
+  for( size_t row = 0; row < sizeof(rows) / sizeof(rows[0]); row++ )
+  {
+    int listener = listenAt( "bench.sock" );
+    vector<clientResult> results( clients );
+    vector<thread> threads;
+    vector<double> latency;
+    atomic<bool> done( false );
+    atomic<bool> served( false );
+
+    if( listener < 0 )
+    {
+      perror( "frontEndBench: listen" );
+      return 1;
+    }
+
+    thread server( serve, rows[row], listener, &served );
+    double start = wallSeconds();
+    for( unsigned n = 0; n < clients; n++ )
+      threads.push_back( thread( client, "bench.sock", n, &done,
+                                 &results[n] ) );
+    usleep( (useconds_t)( seconds * 1e6 ) );
+    done.store( true );
+    for( unsigned n = 0; n < clients; n++ )
+      threads[n].join();
+    double wall = wallSeconds() - start;
+    served.store( true );
+    server.join();
+    close( listener );
+    unlink( "bench.sock" );
+
+    for( unsigned n = 0; n < clients; n++ )
+      latency.insert( latency.end(), results[n].latency.begin(),
+                      results[n].latency.end() );
+    sort( latency.begin(), latency.end() );
+    if( latency.empty() )
+      latency.push_back( 0 );
+
+    cout << setw(2) << rows[row] << " threads  "
+         << setw(9) << fixed << setprecision(0) << latency.size() / wall
+         << " requests/s  p50 " << setw(7) << setprecision(1)
+         << latency[ latency.size() / 2 ] << " us  p99 " << setw(7)
+         << latency[ latency.size() * 99 / 100 ] << " us" << endl;
+  }
+
+  if( chdir( "/" ) == 0 )
+    rmdir( scratch );
+  return 0;
+}
+
+/* client: one connection, one request at a time, until done */
+void client( const char *path, const unsigned n, atomic<bool> *done,
+             clientResult *result )
+{
+  struct sockaddr_un address;
+  int fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+  char line[64];
+  char answer[64];
+
+  memset( &address, 0x00, sizeof(address) );
+  address.sun_family = AF_UNIX;
+  strncpy( address.sun_path, path, sizeof(address.sun_path) - 1 );
+  if( fd < 0 || connect( fd, (struct sockaddr *)&address,
+                         sizeof(address) ) != 0 )
+  {
+    perror( "frontEndBench: connect" );
+    exit( 1 );
+  }
+
+  for( unsigned long i = 0; !done->load(); i++ )
+  {
+    int length = snprintf( line, sizeof(line), "V %lu client=c%u\n",
+                           ( i + n ) % emulatedSodaMachine::geometry::slotCount,
+                           n );
+    double sent = wallSeconds();
+    ssize_t got = 0;
+
+    if( write( fd, line, length ) != length )
+      break;
+    while( got == 0 || answer[got - 1] != '\n' )
+    {
+      ssize_t more = read( fd, answer + got, sizeof(answer) - got );
+      if( more <= 0 )
+        break;
+      got += more;
+    }
+    if( got == 0 )
+      break;
+    result->latency.push_back( ( wallSeconds() - sent ) * 1e6 );
+  }
+  close( fd );
+}
+
+/* serve: the daemon's main loop, cut down to what a vend takes. With no
+ *  threads it reads the clients itself.
+ */
+void serve( const unsigned threads, const int listener, atomic<bool> *done )
+{
+  emulatedSodaMachine acmSoda;
+  mcuModel &mcu = acmSoda.getTransport().mcu();
+  admissionControl admission( 1e9, 1e9, QUEUE );
+  frontEnd fronts( threads, listener, 1,
+                   emulatedSodaMachine::geometry::slotCount );
+  nodePool nodes( CLIENTS );
+  connectionTable connections( ( less<unsigned long>() ),
+                               poolAllocator<connectionEntry>( &nodes ) );
+  unsigned long nextConnection = 1;
+  unsigned long waiting = 0;       // the connection of the vend on the link
+  vector<struct pollfd> polled;
+  vector<unsigned long> polledIds;
+  vendRequest request;
+  vendRequest decoded[BATCH_MAX];
+  size_t count;
+  vendRequest evicted;
+  linkResult result;
+  char text[32];
+
+  mcu.setSlots( emulatedSodaMachine::geometry::slotCount );
+  for( unsigned slot = 0; slot < emulatedSodaMachine::geometry::slotCount;
+       slot++ )
+    mcu.setStock( slot, 100000000 );
+  fronts.start();
+
+  while( !done->load() )
+  {
+    struct pollfd entry;
+
+    polled.clear();
+    polledIds.clear();
+    entry.events = POLLIN;
+    entry.revents = 0;
+    entry.fd = threads > 0 ? -1 : listener;
+    polled.push_back( entry );
+    entry.fd = fronts.descriptor();
+    polled.push_back( entry );
+    for( connectionTable::iterator i = connections.begin();
+         i != connections.end(); ++i )
+    {
+      entry.fd = i->second.fd;
+      polled.push_back( entry );
+      polledIds.push_back( i->first );
+    }
+
+    if( poll( &polled[0], polled.size(),
+              admission.queued() > 0 || acmSoda.pending() > 0 ? 0 : 100 ) < 0 )
+      break;
+
+    clientConnection connection;
+    if( ( polled[0].revents & POLLIN ) &&
+        frontEnd::accept( listener, connection ) )
+      connections[ nextConnection++ ] = connection;
+
+    if( polled[1].revents & POLLIN )
+      fronts.acknowledge();
+    while( fronts.next( request ) )
+      admission.admit( request, request.arrival, evicted );
+
+    /* The main loop's own clients, a line per read at most */
+    for( size_t i = 2; i < polled.size(); i++ )
+    {
+      if( polled[i].revents == 0 )
+        continue;
+
+      connectionTable::iterator found = connections.find( polledIds[i - 2] );
+      clientConnection &client = found->second;
+      ssize_t length = read( client.fd, client.buffer, MAX_LINE - 1 );
+
+      if( length <= 0 )
+      {
+        close( client.fd );
+        connections.erase( found );
+        continue;
+      }
+      client.buffer[length] = '\0';
+      if( frontEnd::decode( client.buffer, client.client, true,
+                            emulatedSodaMachine::geometry::slotCount,
+                            decoded, count ) == NULL )
+        for( size_t i = 0; i < count; i++ )
+        {
+          decoded[i].connection = found->first;
+          admission.admit( decoded[i], decoded[i].arrival, evicted );
+        }
+    }
+
+    if( waiting == 0 && admission.next( request ) )
+    {
+      acmSoda.submit( request.command, request.slot, LINK_INTERACTIVE,
+                      acmSoda.getClock().now() + 5000000 );
+      waiting = request.connection;
+    }
+    if( waiting == 0 || !acmSoda.service( result ) )
+      continue;
+
+    snprintf( text, sizeof(text), "%d\n", result.result );
+    connectionTable::iterator found = connections.find( waiting );
+    if( found != connections.end() )
+    {
+      if( write( found->second.fd, text, strlen( text ) ) < 0 )
+        perror( "frontEndBench: write" );
+    }
+    else
+      fronts.reply( waiting, text );
+    waiting = 0;
+  }
+
+  fronts.stop();
+  for( connectionTable::iterator i = connections.begin();
+       i != connections.end(); ++i )
+    close( i->second.fd );
+}
+
+/* listenAt: a non-blocking listening socket, as sodaDaemon's */
+int listenAt( const char *path )
+{
+  struct sockaddr_un address;
+  int fd = socket( AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0 );
+
+  memset( &address, 0x00, sizeof(address) );
+  address.sun_family = AF_UNIX;
+  strncpy( address.sun_path, path, sizeof(address.sun_path) - 1 );
+  if( fd < 0 ||
+      bind( fd, (struct sockaddr *)&address, sizeof(address) ) != 0 ||
+      listen( fd, 64 ) != 0 )
+    return -1;
+  return fd;
+}
+
+/* wallSeconds: real time, for the rate */
+double wallSeconds()
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
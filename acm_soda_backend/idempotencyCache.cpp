@@ -0,0 +1,391 @@
+#include "idempotencyCache.h"
+
+#include <stdio.h>
+#include <algorithm>
+#include <fstream>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+/* A key whose vend was cut short by a crash: the can may have dropped */
+#define UNKNOWN_RESULT -1
+
+/* Bytes of the rewritten file written at a time */
+#define REWRITE_BLOCK 4096
+
+using namespace std;
+
+static bool finishedBefore( const pair<int64_t, keyText> &a,
+                            const pair<int64_t, keyText> &b )
+{
+  return a.first < b.first;
+}
+
+/* Constructor:
+ *  - capacity: keys kept at most; the table's buckets, its nodes and the
+ *     ring of finished keys are all sized for it here
+ *  - ttl: microseconds a finished key is kept
+ */
+idempotencyCache::idempotencyCache( const size_t capacity, const int64_t ttl )
+  : nodes( capacity ),
+    entries( capacity, keyTextHash(), equal_to<keyText>(),
+             poolAllocator<keyEntry>( &nodes ) )
+{
+  this->capacity = capacity > 0 ? capacity : 1;
+  this->ttl = ttl;
+  done.resize( this->capacity );
+  doneFirst = 0;
+  doneCount = 0;
+  fd = -1;
+  lines = 0;
+}
+
+idempotencyCache::~idempotencyCache()
+{
+  if( fd >= 0 )
+    close( fd );
+}
+
+/* bool idempotencyCache::open( const char *path )
+ *
+ * An "S" without its "D" is a vend that was on the link when the last
+ *  daemon stopped; it is kept as finished with UNKNOWN_RESULT.
+ */
+bool idempotencyCache::open( const char *path )
+{
+  ifstream file( path );
+  string line;
+  int64_t current = now();
+  vector< pair<int64_t, keyText> > order;
+
+  this->path = path;
+  temporary = this->path + ".new";
+
+  while( getline( file, line ) )
+  {
+    char type;
+    long long time;
+    unsigned slot;
+    int result = UNKNOWN_RESULT;
+    int consumed = 0;
+    int more = 0;
+
+    if( sscanf( line.c_str(), "%c %lld %u%n", &type, &time, &slot,
+                &consumed ) != 3 ||
+        ( type == 'D' && sscanf( line.c_str() + consumed, " %d%n", &result,
+                                 &more ) != 1 ) ||
+        ( type != 'S' && type != 'D' ) || slot > 0xFFFF ||
+        consumed + more + 1 >= (int)line.size() ||
+        line.size() - ( consumed + more + 1 ) >= KEY_TEXT_LENGTH )
+      continue;
+
+    consumed += more;
+    keyText key;
+    strcpy( key.text, line.c_str() + consumed + 1 );
+    idempotencyEntry &entry = entries[key];
+    entry.slot = slot;
+    entry.state = KEY_DONE;
+    entry.result = result;
+    entry.finished = time;
+  }
+
+  for( keyTable::iterator i = entries.begin(); i != entries.end(); )
+    if( i->second.finished + ttl <= current )
+      i = entries.erase( i );
+    else
+    {
+      order.push_back( make_pair( i->second.finished, i->first ) );
+      ++i;
+    }
+
+  /* Past capacity, remember() drops the ones that finished first */
+  sort( order.begin(), order.end(), finishedBefore );
+  for( size_t i = 0; i < order.size(); i++ )
+    remember( order[i].second, order[i].first );
+
+  return rewrite();
+}
+
+/* idempotencyEntry *idempotencyCache::find( const keyText &key, now )
+ */
+idempotencyEntry *idempotencyCache::find( const keyText &key, const int64_t now )
+{
+  keyTable::iterator found = entries.find( key );
+
+  if( found == entries.end() )
+    return NULL;
+  if( found->second.state == KEY_DONE && found->second.finished + ttl <= now )
+  {
+    entries.erase( found );
+    return NULL;
+  }
+  return &found->second;
+}
+
+/* void idempotencyCache::queued( key, slot, connection, now )
+ */
+void idempotencyCache::queued( const keyText &key, const unsigned short slot,
+                               const unsigned long connection,
+                               const int64_t now )
+{
+  expire( now );
+  while( entries.size() >= capacity && doneCount > 0 )
+    evict();
+
+  idempotencyEntry &entry = entries[key];
+  entry.slot = slot;
+  entry.state = KEY_QUEUED;
+  entry.result = 0;
+  entry.finished = 0;
+  entry.waiters.count = 1;
+  entry.waiters.connection[0] = connection;
+}
+
+/* bool idempotencyCache::attach( idempotencyEntry &entry, connection )
+ *
+ * A connection is answered once however often it retries.
+ */
+bool idempotencyCache::attach( idempotencyEntry &entry,
+                               const unsigned long connection )
+{
+  keyWaiters &waiters = entry.waiters;
+
+  if( std::find( waiters.connection, waiters.connection + waiters.count,
+                 connection ) != waiters.connection + waiters.count )
+    return true;
+  if( waiters.count == KEY_WAITERS )
+    return false;
+  waiters.connection[ waiters.count++ ] = connection;
+  return true;
+}
+
+/* void idempotencyCache::started( const keyText &key, const int64_t now )
+ */
+void idempotencyCache::started( const keyText &key, const int64_t now )
+{
+  keyTable::iterator found = entries.find( key );
+  char text[48 + KEY_TEXT_LENGTH];
+  int length;
+
+  if( found == entries.end() )
+    return;
+
+  found->second.state = KEY_VENDING;
+  length = snprintf( text, sizeof(text), "S %lld %u %s\n", (long long)now,
+                     (unsigned)found->second.slot, key.text );
+  append( text, length, true );
+}
+
+/* void idempotencyCache::finished( key, result, now, waiters )
+ */
+void idempotencyCache::finished( const keyText &key, const int result,
+                                 const int64_t now, keyWaiters &waiters )
+{
+  keyTable::iterator found = entries.find( key );
+  char text[64 + KEY_TEXT_LENGTH];
+  int length;
+
+  waiters.count = 0;
+  if( found == entries.end() )
+    return;
+
+  idempotencyEntry &entry = found->second;
+  waiters = entry.waiters;
+  entry.waiters.count = 0;
+  entry.state = KEY_DONE;
+  entry.result = result;
+  entry.finished = now;
+  remember( key, now );
+
+  length = snprintf( text, sizeof(text), "D %lld %u %d %s\n", (long long)now,
+                     (unsigned)entry.slot, result, key.text );
+  append( text, length, false );
+}
+
+/* void idempotencyCache::forget( const keyText &key, waiters )
+ *
+ * Only for keys that never reached the link: a started vend has to stay.
+ *  waiters is left as it is for an unknown key.
+ */
+void idempotencyCache::forget( const keyText &key, keyWaiters &waiters )
+{
+  keyTable::iterator found = entries.find( key );
+
+  if( found == entries.end() || found->second.state != KEY_QUEUED )
+    return;
+  waiters = found->second.waiters;
+  entries.erase( found );
+}
+
+/* void idempotencyCache::expire( const int64_t now )
+ *
+ * done is in finishing order, so expired keys are at its front. A key
+ *  erased or finished again since has a different (or no) entry, and is
+ *  skipped.
+ */
+void idempotencyCache::expire( const int64_t now )
+{
+  while( doneCount > 0 && done[doneFirst].finished + ttl <= now )
+  {
+    finishedKey &oldest = done[doneFirst];
+    keyTable::iterator found = entries.find( oldest.key );
+
+    if( found != entries.end() && found->second.state == KEY_DONE &&
+        found->second.finished == oldest.finished )
+      entries.erase( found );
+    doneFirst = ( doneFirst + 1 ) % done.size();
+    doneCount--;
+  }
+}
+
+/* void idempotencyCache::remember( const keyText &key, finished )
+ *
+ * Adds a finished key to the ring. A full ring first drops the key that
+ *  finished first, as evict() would.
+ */
+void idempotencyCache::remember( const keyText &key, const int64_t finished )
+{
+  if( doneCount == done.size() )
+    evict();
+
+  finishedKey &newest = done[ ( doneFirst + doneCount ) % done.size() ];
+  newest.key = key;
+  newest.finished = finished;
+  doneCount++;
+}
+
+/* void idempotencyCache::evict()
+ *
+ * Makes room by dropping the key that finished first, expired or not.
+ */
+void idempotencyCache::evict()
+{
+  while( doneCount > 0 )
+  {
+    finishedKey &oldest = done[doneFirst];
+    keyTable::iterator found = entries.find( oldest.key );
+    bool live = found != entries.end() && found->second.state == KEY_DONE &&
+                found->second.finished == oldest.finished;
+
+    doneFirst = ( doneFirst + 1 ) % done.size();
+    doneCount--;
+    if( live )
+    {
+      entries.erase( found );
+      return;
+    }
+  }
+}
+
+/* void idempotencyCache::append( line, length, sync )
+ */
+void idempotencyCache::append( const char *line, const size_t length,
+                               const bool sync )
+{
+  if( fd < 0 )
+    return;
+
+  if( write( fd, line, length ) != (ssize_t)length )
+    return;
+  if( sync )
+    fdatasync( fd );
+
+  if( ++lines > 2 * capacity )
+    rewrite();
+}
+
+/* bool idempotencyCache::rewrite()
+ *
+ * Writes the live keys to a new file and renames it over the old one, so
+ *  that a crash leaves one or the other. Queued keys are left out. Lines
+ *  are gathered in a block on the stack, since this also runs between
+ *  vends.
+ */
+bool idempotencyCache::rewrite()
+{
+  int newFd = ::open( temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600 );
+  char block[REWRITE_BLOCK];
+  size_t used = 0;
+  bool written = true;
+
+  if( newFd < 0 )
+    return false;
+
+  lines = 0;
+  for( keyTable::iterator i = entries.begin(); i != entries.end(); ++i )
+  {
+    char line[64 + KEY_TEXT_LENGTH];
+    int length;
+
+    if( i->second.state == KEY_DONE )
+      length = snprintf( line, sizeof(line), "D %lld %u %d %s\n",
+                         (long long)i->second.finished,
+                         (unsigned)i->second.slot, i->second.result,
+                         i->first.text );
+    else if( i->second.state == KEY_VENDING )
+      length = snprintf( line, sizeof(line), "S %lld %u %s\n",
+                         (long long)now(), (unsigned)i->second.slot,
+                         i->first.text );
+    else
+      continue;
+
+    if( used + length > sizeof(block) )
+    {
+      written = written && write( newFd, block, used ) == (ssize_t)used;
+      used = 0;
+    }
+    memcpy( block + used, line, length );
+    used += length;
+    lines++;
+  }
+  written = written && write( newFd, block, used ) == (ssize_t)used;
+
+  if( !written || fdatasync( newFd ) != 0 ||
+      rename( temporary.c_str(), path.c_str() ) != 0 )
+  {
+    close( newFd );
+    unlink( temporary.c_str() );
+    return false;
+  }
+
+  if( fd >= 0 )
+    close( fd );
+  fd = newFd;
+  lseek( fd, 0, SEEK_END );
+  return true;
+}
+
+/* keyText idempotencyCache::makeKey( const char *client, const char *token )
+ */
+keyText idempotencyCache::makeKey( const char *client, const char *token )
+{
+  keyText key;
+
+  snprintf( key.text, sizeof(key.text), "%s %s", client, token );
+  return key;
+}
+
+/* size_t keyTextHash::operator()( const keyText &key )
+ */
+size_t keyTextHash::operator()( const keyText &key ) const
+{
+  uint64_t hash = 14695981039346656037ULL;
+
+  for( const char *c = key.text; *c != '\0'; c++ )
+  {
+    hash ^= (unsigned char)*c;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+/* int64_t idempotencyCache::now()
+ *
+ * Microseconds since the epoch.
+ */
+int64_t idempotencyCache::now()
+{
+  struct timeval tv;
+  gettimeofday( &tv, NULL );
+  return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
@@ -0,0 +1,188 @@
+#ifndef IDEMPOTENCYCACHE
+#define IDEMPOTENCYCACHE
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "nodePool.h"
+
+using namespace std;
+
+/******************************************************************************\
+ * idempotencyCache class: Remembers the vends sodaDaemon was asked for by
+ *                         key, so that a retried request never vends twice.
+ *
+ * A client that sends "key=<token>" with a vend may send the same line
+ * again after a timeout. The daemon looks the key up first:
+ *
+ * - KEY_QUEUED or KEY_VENDING: the retry waits for the first request's
+ *   result instead of queueing a second vend (attach())
+ * - KEY_DONE: the retry is answered at once with the stored result
+ * - not found: the request goes through admission control as usual
+ *
+ * Keys are per client ("<client> <token>"), so one client can neither
+ * read nor block another's. Finished keys are kept for ttl microseconds
+ * after they finish; at most capacity keys are kept, the oldest finished
+ * ones giving way first. Up to KEY_WAITERS connections can wait for one
+ * key at a time.
+ *
+ * Nothing allocates once the cache has been full: keys are fixed-size
+ * keyTexts, entries are nodes of a nodePool sized for capacity, finished
+ * keys are remembered in a ring of capacity, and log lines are formatted
+ * on the stack.
+ *
+ * The cache survives restarts in an append-only file of lines
+ *
+ *     S <time> <slot> <key>            a vend was sent to the MCU
+ *     D <time> <slot> <result> <key>   and finished with result
+ *
+ * "S" is written with fdatasync() before the vend goes to the link, so a
+ * crash in the middle of a vend leaves its key behind: after the restart
+ * it is answered -1, like a vend the MCU never confirmed, rather than
+ * vended again. open() and every 2 * capacity lines rewrite the file with
+ * just the live keys. Keys still queued are only in memory: nothing has
+ * been vended for them, and an upgrading sodaDaemon hands the requests
+ * over.
+ *
+ * All times are wall-clock microseconds (now()) passed in by the caller,
+ * since they have to mean the same thing after a restart.
+ *
+ * Functions:
+ *
+ * - bool open( const char *path )
+ *       Loads the file, drops keys past their ttl, and rewrites it.
+ *       Returns false if it cannot be written; the cache then works in
+ *       memory only.
+ *
+ * - idempotencyEntry *find( const keyText &key, const int64_t now )
+ *       The key's entry, or NULL if it is unknown or has expired.
+ *
+ * - void queued( key, slot, connection, now )
+ *       A request with the key was admitted.
+ *
+ * - bool attach( idempotencyEntry &entry, unsigned long connection )
+ *       Another connection waits for the result too. Returns false if
+ *       KEY_WAITERS already do; that one has to retry later.
+ *
+ * - void started( const keyText &key, const int64_t now )
+ *       Its vend is going to the MCU. Written and synced first.
+ *
+ * - void finished( key, result, now, keyWaiters &waiters )
+ *       The vend finished (result LINK_EXPIRED if its deadline passed
+ *       first). Fills in waiters, the connections to answer.
+ *
+ * - void forget( const keyText &key, keyWaiters &waiters )
+ *       The request was pushed out of the queue before it was vended.
+ *       Fills in waiters, the connections to tell to retry (the key is
+ *       then new again).
+ *
+ * - void expire( const int64_t now )
+ *       Drops finished keys past their ttl.
+ *
+ * - static keyText makeKey( const char *client, const char *token )
+ *       "<client> <token>", cut short if it does not fit (sodaDaemon's
+ *       client names and tokens always do).
+ *
+ * - static int64_t now()
+ \*****************************************************************************/
+
+enum keyState
+{
+  KEY_QUEUED,                        // admitted, waiting for the link
+  KEY_VENDING,                       // sent to the MCU
+  KEY_DONE
+};
+
+#define KEY_TEXT_LENGTH 80           // "<client> <token>" and its NUL
+#define KEY_WAITERS 8                // connections waiting on one key
+
+struct keyText
+{
+  char text[KEY_TEXT_LENGTH];
+
+  bool operator==( const keyText &other ) const
+    { return strcmp( text, other.text ) == 0; };
+};
+
+/* FNV-1a of the text */
+struct keyTextHash
+{
+  size_t operator()( const keyText &key ) const;
+};
+
+struct keyWaiters
+{
+  size_t count;
+  unsigned long connection[KEY_WAITERS];
+};
+
+struct idempotencyEntry
+{
+  unsigned short slot;
+  keyState state;
+  int result;                        // when KEY_DONE
+  int64_t finished;                  // when KEY_DONE
+  keyWaiters waiters;                // connections to answer
+};
+
+class idempotencyCache
+{
+  public:
+    idempotencyCache( const size_t capacity, const int64_t ttl );
+    ~idempotencyCache();
+
+    bool open( const char *path );
+    idempotencyEntry *find( const keyText &key, const int64_t now );
+    void queued( const keyText &key, const unsigned short slot,
+                 const unsigned long connection, const int64_t now );
+    bool attach( idempotencyEntry &entry, const unsigned long connection );
+    void started( const keyText &key, const int64_t now );
+    void finished( const keyText &key, const int result, const int64_t now,
+                   keyWaiters &waiters );
+    void forget( const keyText &key, keyWaiters &waiters );
+    void expire( const int64_t now );
+    size_t size() const { return entries.size(); };
+
+    static keyText makeKey( const char *client, const char *token );
+    static int64_t now();
+
+  private:
+    idempotencyCache( const idempotencyCache & );
+    idempotencyCache &operator=( const idempotencyCache & );
+
+    typedef pair<const keyText, idempotencyEntry> keyEntry;
+    typedef unordered_map< keyText, idempotencyEntry, keyTextHash,
+                           equal_to<keyText>, poolAllocator<keyEntry> >
+      keyTable;
+
+    struct finishedKey
+    {
+      keyText key;
+      int64_t finished;
+    };
+
+    void remember( const keyText &key, const int64_t finished );
+    void evict();
+    void append( const char *line, const size_t length, const bool sync );
+    bool rewrite();
+
+    nodePool nodes;                  // before entries, which uses it
+    keyTable entries;
+    vector<finishedKey> done;        // ring of keys by when they finished
+    size_t doneFirst;
+    size_t doneCount;
+    size_t capacity;
+    int64_t ttl;
+    string path;
+    string temporary;                // path.new, for rewrite()
+    int fd;
+    size_t lines;                    // in the file
+};
+
+#endif
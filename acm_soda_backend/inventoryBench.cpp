@@ -0,0 +1,148 @@
+/* inventoryBench.cpp
+ *
+ * Measures how long it takes to decode an MCU inventory reply for
+ * machines of 8, 64 and 256 slots, in both inventory encodings.
+ *
+ * Every reply is built from random slot bits and checked after decoding,
+ * so the benchmark also verifies the encodings round-trip.
+ *
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+#include <sys/time.h>
+#include "machineGeometry.h"
+
+#define REPLIES 1024
+#define ROUNDS 2000
+
+using namespace std;
+
+double seconds();
+
+/* encodeHex: what an MCU using hexEncoding would send for bits */
+template< size_t SLOTS >
+void encodeHex( const bitset<SLOTS> &bits, char *out )
+{
+  const char DIGITS[] = "0123456789ABCDEF";
+  const unsigned digits = hexEncoding::length( SLOTS );
+
+  for( unsigned d = 0; d < digits; d++ )
+  {
+    unsigned bit = ( digits - 1 - d ) * 4;
+    unsigned value = 0;
+    for( unsigned b = 0; b < 4 && bit + b < SLOTS; b++ )
+      value |= bits[bit + b] << b;
+    out[d] = DIGITS[value];
+  }
+}
+
+/* encodeBinary: what an MCU using binaryEncoding would send for bits */
+template< size_t SLOTS >
+void encodeBinary( const bitset<SLOTS> &bits, char *out )
+{
+  for( unsigned i = 0; i < binaryEncoding::length( SLOTS ); i++ )
+  {
+    unsigned char value = 0;
+    for( unsigned b = 0; b < 8 && i * 8 + b < SLOTS; b++ )
+      value |= bits[i * 8 + b] << b;
+    out[i] = value;
+  }
+}
+
+/* run: times decoding REPLIES replies ROUNDS times for one geometry */
+template< class GEOMETRY >
+void run( const char *name, bool binary )
+{
+  const unsigned length = GEOMETRY::inventoryLength;
+  static char replies[REPLIES][ length ];
+  static typename GEOMETRY::inventory expected[REPLIES];
+  typename GEOMETRY::inventory bits;
+  unsigned long checksum = 0;
+
+  for( unsigned r = 0; r < REPLIES; r++ )
+  {
+    for( unsigned s = 0; s < GEOMETRY::slotCount; s++ )
+      expected[r][s] = rand() & 1;
+    if( binary )
+      encodeBinary( expected[r], replies[r] );
+    else
+      encodeHex( expected[r], replies[r] );
+
+    if( !GEOMETRY::decodeInventory( replies[r], bits ) || bits != expected[r] )
+    {
+      cout << name << ": round trip failed" << endl;
+      exit( 1 );
+    }
+  }
+
+  double start = seconds();
+  for( unsigned round = 0; round < ROUNDS; round++ )
+    for( unsigned r = 0; r < REPLIES; r++ )
+    {
+      GEOMETRY::decodeInventory( replies[r], bits );
+      checksum += bits[0] + bits[GEOMETRY::slotCount - 1];
+    }
+  double elapsed = seconds() - start;
+
+  cout << setw(24) << name << setw(8) << length << " bytes"
+       << setw(12) << elapsed * 1e9 / ( (double)ROUNDS * REPLIES )
+       << " ns/decode   (" << checksum << ")" << endl;
+}
+
+/* legacyDecode: the table search sodaMachine::charToInt() used to do */
+int legacyDecode( const char msb, const char lsb )
+{
+  const char HEXTABLE[16] =
+  {'0','1','2','3','4','5','6','7','8','9','A','B','C','D','E','F'};
+  int m = -1, l = -1;
+
+  for( short i = 0; i < 16; i++ )
+  {
+    if( HEXTABLE[i] == msb )
+      m = i;
+    if( HEXTABLE[i] == lsb )
+      l = i;
+  }
+  return ( m == -1 || l == -1 ) ? -1 : m * 16 + l;
+}
+
+int main()
+{
+  static char replies[REPLIES][2];
+  unsigned long checksum = 0;
+
+  for( unsigned r = 0; r < REPLIES; r++ )
+  {
+    bitset<8> bits( rand() & 0xFF );
+    encodeHex( bits, replies[r] );
+  }
+
+  double start = seconds();
+  for( unsigned round = 0; round < ROUNDS; round++ )
+    for( unsigned r = 0; r < REPLIES; r++ )
+      checksum += legacyDecode( replies[r][0], replies[r][1] );
+  double elapsed = seconds() - start;
+
+  cout << setw(24) << "8 slots, charToInt" << setw(8) << 2 << " bytes"
+       << setw(12) << elapsed * 1e9 / ( (double)ROUNDS * REPLIES )
+       << " ns/decode   (" << checksum << ")" << endl;
+
+  run< machineGeometry<8> >( "8 slots, hex", false );
+  run< machineGeometry<64> >( "64 slots, hex", false );
+  run< machineGeometry<256> >( "256 slots, hex", false );
+  run< machineGeometry<8, 8, binaryEncoding> >( "8 slots, binary", true );
+  run< machineGeometry<64, 8, binaryEncoding> >( "64 slots, binary", true );
+  run< machineGeometry<256, 8, binaryEncoding> >( "256 slots, binary", true );
+
+  return 0;
+}
+
+/* seconds: wall clock time for the measurements */
+double seconds()
+{
+  struct timeval tv;
+  gettimeofday( &tv, NULL );
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
@@ -0,0 +1,138 @@
+#ifndef INVENTORYFILTER
+#define INVENTORYFILTER
+
+#include <stddef.h>
+#include <bitset>
+
+using namespace std;
+
+/******************************************************************************\
+ * inventoryFilter class: Stable inventory answers from the last few
+ *                        samples of flickering can sensors.
+ *
+ * A slot sensor that drops out for a sample makes a full slot read empty,
+ * and a vend to it is refused without asking the MCU. The filter keeps
+ * the last depth samples bit-sliced: one bitset per sample, bit n slot n,
+ * so every slot is filtered at once with a handful of word operations
+ * instead of a loop over the slots.
+ *
+ * The answer has hysteresis towards full: a slot reads full if any of the
+ * last depth samples saw a can, so it only reads empty once depth samples
+ * in a row agree. A spurious full costs nothing but the vend the MCU then
+ * refuses ('N'), which empty() takes as final; a spurious empty used to
+ * cost the customer's vend. A real refill shows at once.
+ *
+ * A flicker is an empty run shorter than depth that ends with a can seen
+ * again, i.e. one the filter hid. They are counted per slot.
+ *
+ *     answer  = sample | older samples    (depth of them)
+ *     flicker = sample & ~previous & answer before the sample
+ *
+ * Functions:
+ *
+ * - inventoryFilter( const size_t depth = 1 )
+ *
+ * - bool configure( const size_t depth )
+ *       Starts over keeping depth samples, 1 (the last sample as it is) to
+ *       FILTER_DEPTH_MAX. Returns false, changing nothing, outside that.
+ *
+ * - const bitset<SLOTS> &sample( const bitset<SLOTS> &bits )
+ *       Adds an inventory as the MCU reported it. Returns the new answer.
+ *
+ * - void empty( const size_t slot )
+ *       The MCU said the slot is empty when asked to vend from it: that
+ *       is no sensor, so the slot's history is cleared.
+ *
+ * - const bitset<SLOTS> &answer()
+ *       The filtered inventory; nothing full before the first sample.
+ *
+ * - size_t depth()
+ *
+ * - unsigned long flickers( const size_t slot ), unsigned long samples()
+ *       Empties hidden in the slot, and samples taken since configure().
+ \*****************************************************************************/
+
+#define FILTER_DEPTH_MAX 8           // samples kept at most
+
+template< size_t SLOTS >
+class inventoryFilter
+{
+  public:
+    inventoryFilter( const size_t depth = 1 ) { configure( depth ); };
+
+    bool configure( const size_t depth );
+    const bitset<SLOTS> &sample( const bitset<SLOTS> &bits );
+    void empty( const size_t slot );
+
+    const bitset<SLOTS> &answer() const { return filtered; };
+    size_t depth() const { return kept; };
+    unsigned long flickers( const size_t slot ) const
+      { return slot < SLOTS ? flickerCounts[slot] : 0; };
+    unsigned long samples() const { return taken; };
+
+  private:
+    bitset<SLOTS> history[FILTER_DEPTH_MAX]; // a ring, newest at next - 1
+    bitset<SLOTS> filtered;
+    size_t kept;
+    size_t next;
+    unsigned long taken;
+    unsigned long flickerCounts[SLOTS];
+};
+
+template< size_t SLOTS >
+bool inventoryFilter<SLOTS>::configure( const size_t depth )
+{
+  if( depth < 1 || depth > FILTER_DEPTH_MAX )
+    return false;
+
+  for( size_t i = 0; i < FILTER_DEPTH_MAX; i++ )
+    history[i].reset();
+  filtered.reset();
+  kept = depth;
+  next = 0;
+  taken = 0;
+  for( size_t slot = 0; slot < SLOTS; slot++ )
+    flickerCounts[slot] = 0;
+  return true;
+}
+
+/* const bitset<SLOTS> &inventoryFilter::sample( const bitset<SLOTS> &bits )
+ *
+ * Until depth samples are in, the planes not yet written are empty and OR
+ *  in nothing.
+ */
+template< size_t SLOTS >
+const bitset<SLOTS> &inventoryFilter<SLOTS>::sample( const bitset<SLOTS> &bits )
+{
+  const bitset<SLOTS> &previous =
+    history[ ( next + FILTER_DEPTH_MAX - 1 ) % FILTER_DEPTH_MAX ];
+  bitset<SLOTS> flicker = bits & ~previous & filtered;
+
+  if( flicker.any() )
+    for( size_t slot = 0; slot < SLOTS; slot++ )
+      if( flicker.test( slot ) )
+        flickerCounts[slot]++;
+
+  history[next] = bits;
+  next = ( next + 1 ) % FILTER_DEPTH_MAX;
+  taken++;
+
+  filtered = bits;
+  for( size_t age = 1; age < kept; age++ )
+    filtered |= history[ ( next + FILTER_DEPTH_MAX - 1 - age ) %
+                         FILTER_DEPTH_MAX ];
+  return filtered;
+}
+
+template< size_t SLOTS >
+void inventoryFilter<SLOTS>::empty( const size_t slot )
+{
+  if( slot >= SLOTS )
+    return;
+
+  for( size_t i = 0; i < FILTER_DEPTH_MAX; i++ )
+    history[i].reset( slot );
+  filtered.reset( slot );
+}
+
+#endif
@@ -0,0 +1,312 @@
+/* jitterBench.cpp
+ *
+ * How late the serial-owning thread runs, with and without sodaDaemon's
+ *  real-time mode (realTime.h), on an idle host and on one where every
+ *  CPU is busy with ordinary processes.
+ *
+ *  - wake-up:  a 1 ms periodic clock_nanosleep(); how long after each
+ *               period the thread is running again
+ *  - response: a stand-in MCU thread writes a byte into a pty every 1 to
+ *               3 ms; how long until the thread that poll()s the other end
+ *               has read it
+ *
+ * The stand-in MCU runs SCHED_FIFO above the measured thread whenever
+ *  that is permitted, and on another CPU when the measured thread is
+ *  pinned, since a real MCU does not slow down with the host.
+ *  Each run is a child process, so that real-time settings do not carry
+ *  over to the next one.
+ *
+ * Usage: jitterBench [-n samples] [-t priority] [-c cpu]
+ *
+ * Real-time runs need root or CAP_SYS_NICE; without them they are listed
+ *  with what failed, and measure the same as the normal ones.
+ *
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <pty.h>
+#include <sched.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "realTime.h"
+
+#define SAMPLES 5000
+#define PERIOD 1000          // microseconds between wake-ups
+#define PRIORITY 50
+#define HOG_MEMORY ( 4 << 20 ) // bytes each hog keeps rewriting
+
+using namespace std;
+
+struct responder
+{
+  int fd;
+  size_t samples;
+  volatile bool stop;
+};
+
+int64_t monotonicNow();
+void run( const bool realTime, const bool loaded, const size_t samples,
+          const int priority, const int cpu );
+void measureWakeUp( const size_t samples, vector<int64_t> &late );
+bool measureResponse( const size_t samples, const int priority,
+                      vector<int64_t> &late );
+void *respond( void *argument );
+void startHogs( vector<pid_t> &hogs );
+void stopHogs( vector<pid_t> &hogs );
+void report( const char *name, vector<int64_t> &latency );
+
+int main( int argc, char *argv[] )
+{
+  size_t samples = SAMPLES;
+  int priority = PRIORITY;
+  int cpu = 0;
+  int option;
+
+  while( ( option = getopt( argc, argv, "n:t:c:" ) ) != -1 )
+    switch( option )
+    {
+      case 'n':
+        samples = atoi( optarg );
+        break;
+      case 't':
+        priority = atoi( optarg );
+        break;
+      case 'c':
+        cpu = atoi( optarg );
+        break;
+      default:
+        cerr << "Usage: jitterBench [-n samples] [-t priority] [-c cpu]"
+             << endl;
+        return 1;
+    }
+
+  cout << "us late" << setw(45) << "p50" << setw(9) << "p99" << setw(9)
+       << "p99.9" << setw(9) << "max" << endl;
+
+  for( int loaded = 0; loaded < 2; loaded++ )
+    for( int realTime = 0; realTime < 2; realTime++ )
+    {
+      vector<pid_t> hogs;
+      pid_t child;
+
+      if( loaded )
+        startHogs( hogs );
+
+      /* The report goes out in one piece, after the run */
+      cout.flush();
+      if( ( child = fork() ) == 0 )
+      {
+        run( realTime, loaded, samples, priority, cpu );
+        exit( 0 );
+      }
+      if( child > 0 )
+        waitpid( child, NULL, 0 );
+
+      stopHogs( hogs );
+    }
+
+  return 0;
+}
+
+/* run: one configuration, in a child process */
+void run( const bool realTime, const bool loaded, const size_t samples,
+          const int priority, const int cpu )
+{
+  vector<int64_t> wakeUp;
+  vector<int64_t> response;
+  string problems;
+  bool stoodIn;
+
+  wakeUp.reserve( samples );
+  response.reserve( samples );
+
+  cout << ( realTime ? "real-time" : "normal" )
+       << ( loaded ? ", every CPU busy" : ", idle host" ) << endl;
+
+  if( realTime && !enterRealTime( priority, cpu, RT_HEAP_RESERVE,
+                                  RT_STACK_RESERVE, problems ) )
+    cout << "  (incomplete) " << problems;
+
+  measureWakeUp( samples, wakeUp );
+  stoodIn = measureResponse( samples, priority, response );
+
+  report( "wake-up", wakeUp );
+  report( stoodIn ? "response" : "response (MCU not real-time)", response );
+}
+
+/* measureWakeUp: lateness of each 1 ms periodic wake-up */
+void measureWakeUp( const size_t samples, vector<int64_t> &late )
+{
+  struct timespec next;
+
+  clock_gettime( CLOCK_MONOTONIC, &next );
+  for( size_t i = 0; i < samples; i++ )
+  {
+    next.tv_nsec += PERIOD * 1000;
+    if( next.tv_nsec >= 1000000000 )
+    {
+      next.tv_nsec -= 1000000000;
+      next.tv_sec++;
+    }
+    clock_nanosleep( CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL );
+
+    int64_t target = (int64_t)next.tv_sec * 1000000 + next.tv_nsec / 1000;
+    late.push_back( monotonicNow() - target );
+  }
+}
+
+/* measureResponse: time from the stand-in MCU writing a byte to this
+ *  thread having read it. Each byte carries nothing; the time it was
+ *  written is passed through memory, since both ends share the clock.
+ *  Returns false if the stand-in could not run real-time.
+ */
+volatile int64_t sentAt;
+
+bool measureResponse( const size_t samples, const int priority,
+                      vector<int64_t> &late )
+{
+  int master, slave;
+  struct termios raw;
+  pthread_t thread;
+  pthread_attr_t attributes;
+  struct sched_param parameters;
+  responder mcu;
+  cpu_set_t mine, others;
+  bool stoodIn = true;
+
+  if( openpty( &master, &slave, NULL, NULL, NULL ) != 0 )
+  {
+    perror( "jitterBench: openpty" );
+    return false;
+  }
+  cfmakeraw( &raw );
+  tcsetattr( slave, TCSANOW, &raw );
+
+  mcu.fd = master;
+  mcu.samples = samples;
+  mcu.stop = false;
+
+  /* Off the measured thread's CPU, if it has one to itself */
+  sched_getaffinity( 0, sizeof(mine), &mine );
+  CPU_ZERO( &others );
+  if( CPU_COUNT( &mine ) == 1 )
+    for( long cpu = 0; cpu < sysconf( _SC_NPROCESSORS_ONLN ); cpu++ )
+      if( !CPU_ISSET( cpu, &mine ) )
+        CPU_SET( cpu, &others );
+
+  pthread_attr_init( &attributes );
+  pthread_attr_setinheritsched( &attributes, PTHREAD_EXPLICIT_SCHED );
+  pthread_attr_setschedpolicy( &attributes, SCHED_FIFO );
+  parameters.sched_priority = min( priority + 1, sched_get_priority_max( SCHED_FIFO ) );
+  pthread_attr_setschedparam( &attributes, &parameters );
+  if( CPU_COUNT( &others ) > 0 )
+    pthread_attr_setaffinity_np( &attributes, sizeof(others), &others );
+  if( pthread_create( &thread, &attributes, respond, &mcu ) != 0 )
+  {
+    stoodIn = false;
+    pthread_create( &thread, NULL, respond, &mcu );
+  }
+  pthread_attr_destroy( &attributes );
+
+  for( size_t i = 0; i < samples; i++ )
+  {
+    struct pollfd wait = { slave, POLLIN, 0 };
+    char byte;
+
+    if( poll( &wait, 1, 1000 ) != 1 || read( slave, &byte, 1 ) != 1 )
+      break;
+    late.push_back( monotonicNow() - sentAt );
+  }
+
+  mcu.stop = true;
+  pthread_join( thread, NULL );
+  close( slave );
+  close( master );
+  return stoodIn;
+}
+
+/* respond: the stand-in MCU */
+void *respond( void *argument )
+{
+  responder *mcu = (responder *)argument;
+  unsigned seed = 1;
+
+  for( size_t i = 0; i < mcu->samples && !mcu->stop; i++ )
+  {
+    usleep( 1000 + rand_r( &seed ) % 2000 );
+    sentAt = monotonicNow();
+    if( write( mcu->fd, "Y", 1 ) != 1 )
+      break;
+  }
+  return NULL;
+}
+
+/* startHogs: one ordinary process per CPU, each spinning over its own
+ *  memory so that it also competes for the caches
+ */
+void startHogs( vector<pid_t> &hogs )
+{
+  long cpus = sysconf( _SC_NPROCESSORS_ONLN );
+
+  for( long i = 0; i < cpus; i++ )
+  {
+    pid_t hog = fork();
+
+    if( hog == 0 )
+    {
+      volatile char *memory = (volatile char *)malloc( HOG_MEMORY );
+      for( size_t j = 0; ; j = ( j + 64 ) % HOG_MEMORY )
+        memory[j]++;
+    }
+    if( hog > 0 )
+      hogs.push_back( hog );
+  }
+}
+
+void stopHogs( vector<pid_t> &hogs )
+{
+  for( size_t i = 0; i < hogs.size(); i++ )
+  {
+    kill( hogs[i], SIGKILL );
+    waitpid( hogs[i], NULL, 0 );
+  }
+  hogs.clear();
+}
+
+int64_t monotonicNow()
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void report( const char *name, vector<int64_t> &latency )
+{
+  size_t n = latency.size();
+
+  if( n == 0 )
+  {
+    cout << "  " << name << ": no samples" << endl;
+    return;
+  }
+
+  sort( latency.begin(), latency.end() );
+  cout << "  " << setw(40) << left << name << right
+       << setw(9) << latency[n / 2]
+       << setw(9) << latency[n * 99 / 100]
+       << setw(9) << latency[n * 999 / 1000]
+       << setw(9) << latency[n - 1] << endl;
+}
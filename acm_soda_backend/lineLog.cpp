@@ -0,0 +1,59 @@
+#include "lineLog.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+lineLog::lineLog()
+{
+  fd = -1;
+}
+
+lineLog::~lineLog()
+{
+  close();
+}
+
+/* bool lineLog::open( const char *path )
+ */
+bool lineLog::open( const char *path )
+{
+  close();
+  fd = ::open( path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644 );
+  return fd >= 0;
+}
+
+/* void lineLog::write( const char *format, ... )
+ *
+ * A line cut short still ends in its newline.
+ */
+void lineLog::write( const char *format, ... )
+{
+  char line[LOG_LINE];
+  va_list arguments;
+  int length;
+
+  if( fd < 0 )
+    return;
+
+  va_start( arguments, format );
+  length = vsnprintf( line, sizeof(line) - 1, format, arguments );
+  va_end( arguments );
+
+  if( length < 0 )
+    return;
+  if( length > (int)sizeof(line) - 2 )
+    length = sizeof(line) - 2;
+  line[length++] = '\n';
+
+  if( ::write( fd, line, length ) != length )
+    return;
+}
+
+void lineLog::close()
+{
+  if( fd >= 0 )
+    ::close( fd );
+  fd = -1;
+}
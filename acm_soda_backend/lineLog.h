@@ -0,0 +1,50 @@
+#ifndef LINELOG
+#define LINELOG
+
+#include <stddef.h>
+
+/******************************************************************************\
+ * lineLog class: sodaMachine's text log, written a line at a time without
+ *                iostreams or the heap.
+ *
+ * The log was an ofstream, and a vend wrote a dozen lines to it: each one
+ * formatted through the stream's locale and flushed by endl with a write()
+ * of its own, some of them in pieces. Now each line is formatted with
+ * vsnprintf() into a LOG_LINE byte buffer on the stack (a longer line is
+ * cut short) and written with one write() to a descriptor opened with
+ * O_APPEND, so two daemons logging during an upgrade never split each
+ * other's lines.
+ *
+ * Functions:
+ *
+ * - bool open( const char *path )
+ *       Appends to path, creating it. Returns false if that fails; lines
+ *       are then dropped, as the ofstream did.
+ *
+ * - void write( const char *format, ... )
+ *       printf() formatting; the newline is added.
+ *
+ * - void close()
+ \*****************************************************************************/
+
+#define LOG_LINE 256
+
+class lineLog
+{
+  public:
+    lineLog();
+    ~lineLog();
+
+    bool open( const char *path );
+    void write( const char *format, ... )
+      __attribute__(( format( printf, 2, 3 ) ));
+    void close();
+
+  private:
+    lineLog( const lineLog & );
+    lineLog &operator=( const lineLog & );
+
+    int fd;                          // -1 when not open
+};
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef LINKCLOCK
+#define LINKCLOCK
+
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+
+/******************************************************************************\
+ * Clocks for basicSodaMachine's CLOCK template argument. sodaMachine only
+ * ever asks a clock for the time and to wait, so a test or benchmark can
+ * swap the real clock for one that jumps instead of sleeping.
+ *
+ * Functions:
+ *
+ * - int64_t now()
+ *       Monotonic microseconds.
+ *
+ * - void sleepUntil( const int64_t when )
+ *       Returns once now() >= when.
+ *
+ * systemClock: CLOCK_MONOTONIC, the same time base as linkScheduler::now().
+ *
+ * virtualClock: Starts at 0 and only moves when someone sleeps on it (or
+ *  calls advance()), so a 10 second timeout takes no time at all.
+ \*****************************************************************************/
+
+struct systemClock
+{
+  int64_t now() const
+  {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  }
+
+  void sleepUntil( const int64_t when ) const
+  {
+    struct timespec ts;
+    ts.tv_sec = when / 1000000;
+    ts.tv_nsec = ( when % 1000000 ) * 1000;
+    while( clock_nanosleep( CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+                            NULL ) == EINTR )
+      ;
+  }
+};
+
+class virtualClock
+{
+  public:
+    virtualClock() : current( 0 ) {};
+
+    int64_t now() const { return current; };
+    void sleepUntil( const int64_t when )
+      { if( when > current ) current = when; };
+    void advance( const int64_t microseconds ) { current += microseconds; };
+
+  private:
+    int64_t current;
+};
+
+#endif
@@ -0,0 +1,141 @@
+/* linkLossBench.cpp
+ *
+ * Tail latency of inventory queries and vends over a lossy link, against
+ *  the emulated MCU (emulatedSodaMachine, on a virtual clock).
+ *
+ * At each loss rate, every byte in either direction is lost with that
+ *  probability, and the same run is made twice:
+ *
+ *  - fixed:    timeouts pinned at INVENTORY_TIMEOUT and VEND_TIMEOUT
+ *  - adaptive: timeouts from the round-trip estimates
+ *
+ * Both repeat 'S' and the sequenced vend on a timeout (before the
+ *  estimates, a single lost byte made sodaMachine exit). Latencies are
+ *  virtual milliseconds per call, including the inventory check a vend
+ *  makes. The MCU's can count is checked against the vends reported, so
+ *  a retry that dropped a second can would show as a double vend.
+ *
+ * Runs in a scratch directory so that nothing is logged or journaled.
+ *
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <unistd.h>
+#include "sodaMachine.h"
+
+#define INVENTORY_COUNT 20000
+#define VEND_COUNT 2000
+#define SEED 0x5eedULL
+
+using namespace std;
+
+struct runResult
+{
+  vector<int64_t> inventory;
+  vector<int64_t> vend;
+  unsigned long retransmissions;
+  long doubleVends;
+  unsigned long failedVends;
+};
+
+void run( const double loss, const bool adaptive, runResult &result );
+void report( const char *name, vector<int64_t> &latency );
+
+int main()
+{
+  char scratch[] = "/tmp/linkLossBenchXXXXXX";
+  const double losses[] = { 0, 0.001, 0.01, 0.03 };
+
+  if( mkdtemp( scratch ) == NULL || chdir( scratch ) != 0 )
+  {
+    perror( "linkLossBench: could not make a scratch directory" );
+    return 1;
+  }
+
+  cout << "virtual ms per call" << setw(32) << "p50" << setw(9) << "p99"
+       << setw(9) << "p99.9" << setw(9) << "max" << endl;
+
+  for( size_t i = 0; i < sizeof(losses) / sizeof(losses[0]); i++ )
+    for( int adaptive = 0; adaptive < 2; adaptive++ )
+    {
+      runResult result;
+
+      run( losses[i], adaptive, result );
+
+      cout << endl << "loss " << setw(5) << fixed << setprecision(1)
+           << losses[i] * 100 << "%, " << ( adaptive ? "adaptive" : "fixed" )
+           << ": " << result.retransmissions << " retransmissions, "
+           << result.failedVends << " vends failed, " << result.doubleVends
+           << " double vends" << endl;
+      report( "getSodaInventory", result.inventory );
+      report( "vendSoda", result.vend );
+    }
+
+  if( chdir( "/" ) == 0 )
+    rmdir( scratch );
+  return 0;
+}
+
+/* run: one machine, one loss rate, the same lost bytes for both modes */
+void run( const double loss, const bool adaptive, runResult &result )
+{
+  emulatedSodaMachine acmSoda;
+  mcuModel &mcu = acmSoda.getTransport().mcu();
+  virtualClock &clock = acmSoda.getClock();
+  unsigned long vended = 0;
+
+  mcu.setSlots( emulatedSodaMachine::geometry::slotCount );
+  for( unsigned slot = 0; slot < emulatedSodaMachine::geometry::slotCount;
+       slot++ )
+    mcu.setStock( slot, VEND_COUNT );
+  mcu.sequencedVends = true;
+  mcu.lossRate = loss;
+  mcu.seedLoss( SEED );
+
+  acmSoda.setSequencedVends( true );
+  if( !adaptive )
+  {
+    acmSoda.roundTrip( 'S' ).configure( 500000, 500000, 500000 );
+    acmSoda.roundTrip( 'V' ).configure( 5000000, 5000000, 5000000 );
+  }
+
+  for( int i = 0; i < INVENTORY_COUNT; i++ )
+  {
+    int64_t start = clock.now();
+    acmSoda.getSodaInventory();
+    result.inventory.push_back( clock.now() - start );
+  }
+
+  result.failedVends = 0;
+  for( int i = 0; i < VEND_COUNT; i++ )
+  {
+    int64_t start = clock.now();
+    int vendResult = acmSoda.vendSoda( i % emulatedSodaMachine::geometry::slotCount );
+    result.vend.push_back( clock.now() - start );
+    if( vendResult == 0 )
+      vended++;
+    else
+      result.failedVends++;
+  }
+
+  result.retransmissions = acmSoda.roundTrip( 'S' ).timeouts +
+                           acmSoda.roundTrip( 'V' ).timeouts;
+  result.doubleVends = (long)mcu.vends - (long)vended;
+}
+
+void report( const char *name, vector<int64_t> &latency )
+{
+  sort( latency.begin(), latency.end() );
+
+  size_t n = latency.size();
+  cout << "  " << setw(20) << left << name << right << setprecision(1)
+       << setw(25) << latency[n / 2] / 1000.0
+       << setw(9) << latency[n * 99 / 100] / 1000.0
+       << setw(9) << latency[n * 999 / 1000] / 1000.0
+       << setw(9) << latency[n - 1] / 1000.0 << endl;
+}
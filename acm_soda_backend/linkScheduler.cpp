@@ -0,0 +1,110 @@
+#include "linkScheduler.h"
+
+#include <time.h>
+
+using namespace std;
+
+linkScheduler::linkScheduler()
+{
+  nextId = 1;
+}
+
+/* int64_t linkScheduler::now()
+ *
+ * Deadlines are on the monotonic clock so that setting the wall clock
+ *  cannot expire or revive them.
+ */
+int64_t linkScheduler::now()
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void linkScheduler::push( const linkCommand &command )
+{
+  if( command.priority == LINK_BACKGROUND )
+    background.push( command );
+  else
+    urgent.push( command );
+}
+
+/* unsigned long linkScheduler::submit( command, argument, priority, deadline )
+ */
+unsigned long linkScheduler::submit( const char command,
+                                     const unsigned short argument,
+                                     const linkPriority priority,
+                                     const int64_t deadline )
+{
+  linkCommand entry;
+
+  entry.id = nextId++;
+  entry.command = command;
+  entry.argument = argument;
+  entry.priority = priority;
+  entry.deadline = deadline;
+
+  push( entry );
+  return entry.id;
+}
+
+/* void linkScheduler::defer( const linkCommand &command )
+ */
+void linkScheduler::defer( const linkCommand &command )
+{
+  push( command );
+}
+
+/* void linkScheduler::expire( const int64_t now, vector<linkCommand> &expired )
+ *
+ * Both queues are ordered by deadline, so expired commands are all at
+ *  the front.
+ */
+void linkScheduler::expire( const int64_t now, vector<linkCommand> &expired )
+{
+  drop( now );
+  expired.insert( expired.end(), dropped.begin(), dropped.end() );
+  dropped.clear();
+}
+
+/* void linkScheduler::drop( const int64_t now )
+ *
+ * Moves expired commands to dropped until expire() reports them.
+ */
+void linkScheduler::drop( const int64_t now )
+{
+  queue *queues[2] = { &urgent, &background };
+
+  for( int q = 0; q < 2; q++ )
+    while( !queues[q]->empty() && queues[q]->top().deadline != 0 &&
+           queues[q]->top().deadline < now )
+    {
+      dropped.push_back( queues[q]->top() );
+      queues[q]->pop();
+    }
+}
+
+/* bool linkScheduler::next( linkCommand &command, const int64_t now )
+ *
+ * Urgent commands first, background ones only when no urgent one waits.
+ */
+bool linkScheduler::next( linkCommand &command, const int64_t now )
+{
+  drop( now );
+
+  if( !urgent.empty() )
+  {
+    command = urgent.top();
+    urgent.pop();
+    return true;
+  }
+
+  if( !background.empty() )
+  {
+    command = background.top();
+    background.pop();
+    return true;
+  }
+
+  return false;
+}
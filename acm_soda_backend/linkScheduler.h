@@ -0,0 +1,116 @@
+#ifndef LINKSCHEDULER
+#define LINKSCHEDULER
+
+#include <stdint.h>
+#include <stddef.h>
+#include <queue>
+#include <vector>
+
+using namespace std;
+
+/******************************************************************************\
+ * linkScheduler class: Orders the commands that share the serial link to
+ *                      the MCU.
+ *
+ * Every command has a priority class and a deadline (monotonic
+ * microseconds, 0 for none). Interactive and normal commands are sent
+ * earliest-deadline-first; background commands (periodic inventory
+ * refreshes, idle polling) are only sent when nothing else is waiting.
+ * Commands whose deadline has passed are dropped instead of sent: there
+ * is no point vending to a user who has walked away.
+ *
+ * Functions:
+ *
+ * - unsigned long submit( char command, unsigned short argument,
+ *                         linkPriority priority, int64_t deadline )
+ *       Queues a command and returns its id.
+ *
+ * - void defer( const linkCommand &command )
+ *       Puts a started command back, keeping its id and deadline. Used
+ *       when a long button poll is preempted.
+ *
+ * - void expire( const int64_t now, vector<linkCommand> &expired )
+ *       Removes every command whose deadline is before now.
+ *
+ * - bool next( linkCommand &command, const int64_t now )
+ *       Takes the command to send next, dropping expired ones on the way
+ *       (they are returned by the next expire()). False if none waits.
+ *
+ * - bool urgentWaiting()
+ *       True if a non-background command is waiting: a running
+ *       preemptible command should yield the link.
+ *
+ * - static int64_t now()
+ *       Monotonic microseconds.
+ \*****************************************************************************/
+
+enum linkPriority
+{
+  LINK_INTERACTIVE = 0,    // someone is standing at the machine
+  LINK_NORMAL      = 1,
+  LINK_BACKGROUND  = 2     // nobody is waiting on the answer
+};
+
+/* linkResult.result for a command dropped at its deadline */
+#define LINK_EXPIRED -2
+
+struct linkCommand
+{
+  unsigned long id;
+  char command;            // 'S', 'B', 'V' or 'M'
+  unsigned short argument; // slot for 'V' and 'M'
+  linkPriority priority;
+  int64_t deadline;        // monotonic microseconds, 0 for none
+};
+
+struct linkResult
+{
+  unsigned long id;
+  char command;
+  int result;              // vendSoda()'s result, the button, or LINK_EXPIRED
+  int64_t elapsed;         // microseconds from sending it to its answer
+};
+
+class linkScheduler
+{
+  public:
+    linkScheduler();
+
+    unsigned long submit( const char command, const unsigned short argument,
+                          const linkPriority priority, const int64_t deadline );
+    void defer( const linkCommand &command );
+    void expire( const int64_t now, vector<linkCommand> &expired );
+    bool next( linkCommand &command, const int64_t now );
+    bool urgentWaiting() const { return !urgent.empty(); };
+    size_t waiting() const { return urgent.size() + background.size(); };
+
+    static int64_t now();
+
+  private:
+    /* Earliest deadline first, then higher priority, then oldest */
+    struct later
+    {
+      bool operator()( const linkCommand &a, const linkCommand &b ) const
+      {
+        int64_t da = a.deadline ? a.deadline : INT64_MAX;
+        int64_t db = b.deadline ? b.deadline : INT64_MAX;
+        if( da != db )
+          return da > db;
+        if( a.priority != b.priority )
+          return a.priority > b.priority;
+        return a.id > b.id;
+      }
+    };
+
+    typedef priority_queue< linkCommand, vector<linkCommand>, later > queue;
+
+    void push( const linkCommand &command );
+    void drop( const int64_t now );
+
+    queue urgent;
+    queue background;
+    vector<linkCommand> dropped;
+    unsigned long nextId;
+};
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef LOOPBACKTRANSPORT
+#define LOOPBACKTRANSPORT
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <ostream>
+
+#include "mcuModel.h"
+
+using namespace std;
+
+/******************************************************************************\
+ * loopbackTransport class: A TRANSPORT (see serialTransport.h) whose MCU
+ *                          is an mcuModel in the same process.
+ *
+ * Waiting for a reply sleeps the CLOCK until the model's next byte is due,
+ * so on a virtualClock a vend that keeps the motor running for a second
+ * returns at once, with the clock a second later.
+ *
+ * - mcuModel &mcu()
+ *       The model, to script stock and button presses and read counters.
+ \*****************************************************************************/
+
+class loopbackTransport
+{
+  public:
+    bool open( ostream &log )
+    {
+      log << "loopbackTransport::open(): Talking to an emulated MCU" << endl;
+      return true;
+    };
+    bool adopt( const int, ostream &log )
+    {
+      log << "loopbackTransport::adopt(): Nothing to adopt" << endl;
+      return false;
+    };
+    void close() {};
+
+    ssize_t send( const void *buf, const size_t length, const int64_t now )
+    {
+      model.receive( buf, length, now );
+      return length;
+    };
+    ssize_t receive( void *buf, const size_t length, const int64_t now )
+      { return model.transmit( buf, length, now ); };
+    void flushInput( const int64_t now ) { model.discard( now ); };
+    size_t outputQueued( const int64_t now ) const
+      { return model.queuedInput( now ); };
+
+    template< class CLOCK >
+    bool waitReadable( CLOCK &clock, const int64_t deadline )
+    {
+      int64_t next = model.nextByte();
+
+      if( next > deadline )
+      {
+        clock.sleepUntil( deadline );
+        return false;
+      }
+      clock.sleepUntil( next );
+      return true;
+    };
+
+    template< class CLOCK >
+    bool waitDrained( CLOCK &clock, const size_t queued, const int64_t deadline )
+    {
+      int64_t drained = model.drainedAt( queued );
+
+      if( drained > deadline )
+      {
+        clock.sleepUntil( deadline );
+        return false;
+      }
+      clock.sleepUntil( drained );
+      return true;
+    };
+
+    mcuModel &mcu() { return model; };
+
+  private:
+    mcuModel model;
+};
+
+#endif
@@ -0,0 +1,173 @@
+#ifndef MACHINEGEOMETRY
+#define MACHINEGEOMETRY
+
+#include <stddef.h>
+#include <stdint.h>
+#include <bitset>
+
+using namespace std;
+
+/******************************************************************************\
+ * machineGeometry: Compile-time description of a soda machine, used as the
+ *                  template argument of basicSodaMachine.
+ *
+ * Template arguments:
+ *
+ * - SLOTS
+ *       Number of vending columns. The 'V' command carries the slot in one
+ *       byte, so at most 256.
+ *
+ * - BUTTONS
+ *       Number of selection buttons on the front of the machine.
+ *
+ * - ENCODING
+ *       How the MCU reports inventory in its reply to 'S'. hexEncoding
+ *       (the current MCU, two ASCII hex digits for 8 slots) or
+ *       binaryEncoding.
+ *
+ * Members:
+ *
+ * - inventory
+ *       bitset<SLOTS>, bit n set if slot n has soda.
+ *
+ * - static const unsigned inventoryLength
+ *       Bytes of inventory following the reply byte to 'S'.
+ *
+ * - static constexpr bool validSlot( const long slot )
+ * - static constexpr bool validButton( const long button )
+ *       Range checks, folded to constant comparisons.
+ *
+ * - static bool decodeInventory( const char *data, inventory &bits )
+ *       Decodes inventoryLength bytes of MCU reply. Returns false if the
+ *       reply is malformed.
+ \*****************************************************************************/
+
+/* hexEncoding: Slot bits as ASCII hex digits, most significant digit first.
+ *  The 8-slot MCU sends "xHL": H is slots 7-4, L is slots 3-0.
+ */
+struct hexEncoding
+{
+  static constexpr unsigned length( const unsigned slots )
+    { return ( slots + 3 ) / 4; }
+
+  /* Decodes up to 16 digits into value, returning false on a bad digit.
+   *  Branch-free, so random replies do not cost mispredictions.
+   */
+  static inline bool word( const char *data, const unsigned digits,
+                           uint64_t &value )
+  {
+    unsigned valid = 1;
+
+    value = 0;
+    for( unsigned i = 0; i < digits; i++ )
+    {
+      unsigned c = (unsigned char)data[i];
+      unsigned decimal = c - '0';
+      unsigned letter = ( c | 0x20 ) - 'a';
+      unsigned isDecimal = decimal < 10;
+      unsigned isLetter = letter < 6;
+
+      valid &= isDecimal | isLetter;
+      value = ( value << 4 ) | ( ( decimal & -isDecimal ) |
+                                 ( ( letter + 10 ) & -isLetter ) );
+    }
+    return valid;
+  }
+
+  template< size_t SLOTS >
+  static inline bool decode( const char *data, bitset<SLOTS> &bits )
+  {
+    const unsigned digits = length( SLOTS );
+    uint64_t value;
+
+    if( SLOTS <= 64 )
+    {
+      if( !word( data, digits, value ) )
+        return false;
+      bits = bitset<SLOTS>( (unsigned long long)value );
+      return true;
+    }
+
+    /* Most significant digits first: shift each 64-bit group in */
+    bits.reset();
+    for( unsigned done = 0; done < digits; )
+    {
+      unsigned take = ( ( digits - done ) % 16 ) ? ( digits - done ) % 16 : 16;
+      if( !word( data + done, take, value ) )
+        return false;
+      bits <<= 4 * take;
+      bits |= bitset<SLOTS>( (unsigned long long)value );
+      done += take;
+    }
+    return true;
+  }
+};
+
+/* binaryEncoding: Slot bits packed 8 per byte, slot 0 in the low bit of
+ *  the first byte.
+ */
+struct binaryEncoding
+{
+  static constexpr unsigned length( const unsigned slots )
+    { return ( slots + 7 ) / 8; }
+
+  template< size_t SLOTS >
+  static inline bool decode( const char *data, bitset<SLOTS> &bits )
+  {
+    const unsigned bytes = length( SLOTS );
+    const unsigned char *in = (const unsigned char *)data;
+
+    if( SLOTS <= 64 )
+    {
+      uint64_t value = 0;
+      for( unsigned i = 0; i < bytes; i++ )
+        value |= (uint64_t)in[i] << ( 8 * i );
+      bits = bitset<SLOTS>( (unsigned long long)value );
+      return true;
+    }
+
+    /* Last 8 bytes hold the highest slots: shift each word in */
+    bits.reset();
+    for( unsigned end = bytes; end > 0; )
+    {
+      unsigned take = ( end % 8 ) ? end % 8 : 8;
+      uint64_t value = 0;
+      for( unsigned i = 0; i < take; i++ )
+        value |= (uint64_t)in[end - take + i] << ( 8 * i );
+      bits <<= 8 * take;
+      bits |= bitset<SLOTS>( (unsigned long long)value );
+      end -= take;
+    }
+    return true;
+  }
+};
+
+template< unsigned SLOTS, unsigned BUTTONS = SLOTS,
+          class ENCODING = hexEncoding >
+struct machineGeometry
+{
+  static_assert( SLOTS >= 1 && SLOTS <= 256,
+                 "the vend command carries the slot in one byte" );
+  static_assert( BUTTONS >= 1 && BUTTONS <= 256,
+                 "the MCU reports a button in one byte" );
+
+  typedef bitset<SLOTS> inventory;
+  typedef ENCODING encoding;
+
+  static const unsigned slotCount = SLOTS;
+  static const unsigned buttonCount = BUTTONS;
+  static const unsigned inventoryLength = ENCODING::length( SLOTS );
+
+  static constexpr bool validSlot( const long slot )
+    { return slot >= 0 && slot < (long)SLOTS; }
+  static constexpr bool validButton( const long button )
+    { return button >= 0 && button < (long)BUTTONS; }
+
+  static inline bool decodeInventory( const char *data, inventory &bits )
+    { return ENCODING::decode( data, bits ); }
+};
+
+/* The machine in the CS lounge */
+typedef machineGeometry<8> standardGeometry;
+
+#endif
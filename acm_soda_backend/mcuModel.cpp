@@ -0,0 +1,671 @@
+#include "mcuModel.h"
+
+using namespace std;
+
+mcuModel::mcuModel( const unsigned slots )
+  : cans( slots, 1 ), dark( slots ), motorAnswers( slots )
+{
+  byteTime = 2083;
+  thinkTime = 1000;
+  motorTime = 1200000;
+  binaryInventory = false;
+  sequencedVends = false;
+  pushedEvents = false;
+  flowCredits = false;
+  concurrentVends = false;
+  motorMax = 4;
+  debounceTime = 10000;
+  lossRate = 0;
+  flickerRate = 0;
+  receiveBuffer = 0;
+  transmitBuffer = 7;
+  commands = vends = lost = bytesSent = overruns = motorPeak = flickers = 0;
+  inputFree = outputFree = 0;
+  outputFirst = 0;
+  ringFirst = 0;
+  busyUntil = 0;
+  parse = PARSE_COMMAND;
+  parseFrom = 0;
+  sequence = 0;
+  lastSequence = -1;
+  lastAnswerAt = 0;
+  random = 1;
+  buttonWait = false;
+  buttonFrom = 0;
+  pushed = 0;
+  eventSequence = 0;
+  motorLimit = 1;
+}
+
+/* void mcuModel::receive( bytes, length, now )
+ *
+ * Each byte is acted on once it has crossed the wire, if it does, and with
+ *  a receiveBuffer once the main loop gets to it, if the ring had room.
+ */
+void mcuModel::receive( const void *bytes, const size_t length,
+                        const int64_t now )
+{
+  const unsigned char *in = (const unsigned char *)bytes;
+
+  for( size_t i = 0; i < length; i++ )
+  {
+    inputFree = ( inputFree > now ? inputFree : now ) + byteTime;
+    if( lose() )
+      continue;
+    if( receiveBuffer == 0 )
+    {
+      command( in[i], inputFree );
+      continue;
+    }
+
+    if( ringFree( inputFree ) == 0 )
+    {
+      overruns++;
+      continue;
+    }
+    int64_t at = busyUntil > inputFree ? busyUntil : inputFree;
+    ring.push_back( at );
+    command( in[i], at );
+  }
+}
+
+/* size_t mcuModel::ringFree( const int64_t at )
+ *
+ * Bytes are taken in the order they came, so those taken by at are at the
+ *  front. The ring is a vector emptied once all of it is taken, like the
+ *  output queue.
+ */
+size_t mcuModel::ringFree( const int64_t at )
+{
+  while( ringFirst < ring.size() && ring[ringFirst] <= at )
+    ringFirst++;
+  if( ringFirst == ring.size() )
+  {
+    ring.clear();
+    ringFirst = 0;
+  }
+
+  size_t held = ring.size() - ringFirst;
+  return held < receiveBuffer ? receiveBuffer - held : 0;
+}
+
+/* void mcuModel::occupy( const int64_t until )
+ *
+ * The main loop is busy until then, or until its answers fit the transmit
+ *  ring, whichever is later.
+ */
+void mcuModel::occupy( const int64_t until )
+{
+  int64_t sent = outputFree - (int64_t)transmitBuffer * byteTime;
+
+  if( receiveBuffer == 0 )
+    return;
+  if( until > busyUntil )
+    busyUntil = until;
+  if( sent > busyUntil )
+    busyUntil = sent;
+}
+
+/* void mcuModel::command( const unsigned char byte, const int64_t at )
+ */
+void mcuModel::command( const unsigned char byte, const int64_t at )
+{
+  if( parse != PARSE_COMMAND && at - parseFrom > PARSE_GAP * byteTime )
+    parse = PARSE_COMMAND;
+
+  switch( parse )
+  {
+    case PARSE_SLOT:
+      parse = PARSE_COMMAND;
+      vend( byte, at );
+      return;
+    case PARSE_SEQUENCE:
+      parse = PARSE_SEQUENCED_SLOT;
+      sequence = byte;
+      return;
+    case PARSE_SEQUENCED_SLOT:
+      parse = PARSE_COMMAND;
+      sequencedVend( byte, at );
+      return;
+    case PARSE_LIMIT:
+      parse = PARSE_COMMAND;
+      finishMotors( at );
+      motorLimit = byte < 1 ? 1 : byte > motorMax ? motorMax : byte;
+      reply( string( "K" ) + (char)motorLimit, at + thinkTime );
+      occupy( at + thinkTime );
+      return;
+    case PARSE_MOTOR_SEQUENCE:
+      parse = PARSE_MOTOR_SLOT;
+      sequence = byte;
+      return;
+    case PARSE_MOTOR_SLOT:
+      parse = PARSE_COMMAND;
+      startMotor( byte, at );
+      return;
+    case PARSE_EVENTS:
+      parse = PARSE_COMMAND;
+      settle( at );
+      pushed = byte;
+      buttonFrom = at;
+      reply( "K", at + thinkTime );
+      if( pushed & PUSH_INVENTORY )
+        pushEvent( 's', inventoryBytes(), at + thinkTime );
+      occupy( at + thinkTime );
+      return;
+    default:
+      break;
+  }
+
+  /* A press before this command still answers the button poll */
+  finishMotors( at );
+  settle( at );
+  buttonWait = false;
+  parseFrom = at;
+
+  switch( byte )
+  {
+    case 'S':
+      commands++;
+      flicker();
+      reply( "?" + inventory(), at + thinkTime );
+      dark.assign( dark.size(), false );
+      occupy( at + thinkTime );
+      break;
+    case 'B':
+      commands++;
+      buttonWait = true;
+      buttonFrom = at + thinkTime;
+      break;
+    case 'V':
+      commands++;
+      parse = PARSE_SLOT;
+      break;
+    case 'W':
+      if( !sequencedVends )
+        break;
+      commands++;
+      parse = PARSE_SEQUENCE;
+      break;
+    case 'R':
+      if( !sequencedVends )
+        break;
+      commands++;
+      lastSequence = -1;
+      for( size_t i = 0; i < motorAnswers.size(); i++ )
+        motorAnswers[i].clear();
+      reply( "K", at + thinkTime );
+      occupy( at + thinkTime );
+      break;
+    case 'C':
+      if( !flowCredits )
+        break;
+      commands++;
+      {
+        size_t room = receiveBuffer == 0 ? 255 : ringFree( at );
+        reply( string( "K" ) + (char)( room < 255 ? room : 255 ),
+               at + thinkTime );
+      }
+      occupy( at + thinkTime );
+      break;
+    case 'L':
+    case 'M':
+      if( !concurrentVends )
+        break;
+      commands++;
+      parse = byte == 'L' ? PARSE_LIMIT : PARSE_MOTOR_SEQUENCE;
+      break;
+    case 'E':
+      if( !pushedEvents )
+        break;
+      commands++;
+      parse = PARSE_EVENTS;
+      break;
+    default:
+      break;
+  }
+}
+
+/* void mcuModel::vend( const unsigned char slot, int64_t at )
+ */
+void mcuModel::vend( const unsigned char slot, int64_t at )
+{
+  at = motorsStopped( at );
+  if( slot < cans.size() && cans[slot] > 0 )
+  {
+    cans[slot]--;
+    vends++;
+    reply( "Y", at + thinkTime + motorTime );
+    pushInventory( slot, outputFree );
+    occupy( at + thinkTime + motorTime );
+  }
+  else
+  {
+    reply( "N", at + thinkTime );
+    occupy( at + thinkTime );
+  }
+}
+
+/* void mcuModel::sequencedVend( const unsigned char slot, int64_t at )
+ *
+ * A repeat of the last seq while its answer is still to come is ignored:
+ *  the answer is on its way.
+ */
+void mcuModel::sequencedVend( const unsigned char slot, int64_t at )
+{
+  at = motorsStopped( at );
+
+  /* As for 'M': a lost seq or slot. Answered, it would also become the
+   *  last seq, and the retry of the real one would vend again */
+  if( sequence < 0x80 || slot >= cans.size() )
+  {
+    occupy( at + thinkTime );
+    return;
+  }
+  if( lastSequence == sequence )
+  {
+    if( at >= lastAnswerAt )
+      reply( lastAnswer, at + thinkTime );
+    occupy( at + thinkTime );
+    return;
+  }
+
+  bool full = slot < cans.size() && cans[slot] > 0;
+  int64_t answerAt = at + thinkTime + ( full ? motorTime : 0 );
+
+  if( full )
+  {
+    cans[slot]--;
+    vends++;
+  }
+
+  lastSequence = sequence;
+  lastAnswer = string( full ? "Y" : "N" ) + (char)sequence;
+  reply( lastAnswer, answerAt );
+  lastAnswerAt = outputFree;
+  if( full )
+    pushInventory( slot, lastAnswerAt );
+  occupy( answerAt );
+}
+
+/* void mcuModel::startMotor( const unsigned char slot, const int64_t at )
+ *
+ * The answer is only queued when the motor stops (finishMotors()): an
+ *  answer queued now would hold up every reply behind it until then.
+ */
+void mcuModel::startMotor( const unsigned char slot, const int64_t at )
+{
+  runningMotor motor;
+
+  occupy( at + thinkTime );
+
+  /* The slot, after the seq was lost, or most likely the next command's
+   *  first byte, after the slot was lost */
+  if( sequence < 0x80 || slot >= cans.size() )
+    return;
+
+  for( size_t i = 0; i < motors.size(); i++ )
+    if( motors[i].sequence == sequence )
+      return;
+  if( motorAnswers[slot].size() == 2 &&
+      (unsigned char)motorAnswers[slot][1] == sequence )
+  {
+    reply( motorAnswers[slot], at + thinkTime );
+    return;
+  }
+
+  if( cans[slot] == 0 )
+  {
+    motorAnswers[slot] = string( "N" ) + (char)sequence;
+    reply( motorAnswers[slot], at + thinkTime );
+    return;
+  }
+
+  bool running = false;
+  for( size_t i = 0; i < motors.size(); i++ )
+    running = running || motors[i].slot == slot;
+  if( running || motors.size() >= motorLimit )
+  {
+    reply( string( "L" ) + (char)sequence, at + thinkTime );
+    return;
+  }
+
+  cans[slot]--;
+  vends++;
+  motor.done = at + thinkTime + motorTime;
+  motor.sequence = sequence;
+  motor.slot = slot;
+  motors.push_back( motor );
+  if( motors.size() > motorPeak )
+    motorPeak = motors.size();
+}
+
+/* void mcuModel::finishMotors( const int64_t at )
+ *
+ * Answers the motors that have stopped by at, in the order they stopped.
+ */
+void mcuModel::finishMotors( const int64_t at )
+{
+  while( !motors.empty() )
+  {
+    size_t first = 0;
+
+    for( size_t i = 1; i < motors.size(); i++ )
+      if( motors[i].done < motors[first].done )
+        first = i;
+    if( motors[first].done > at )
+      return;
+
+    string &answer = motorAnswers[motors[first].slot];
+
+    answer = string( "Y" ) + (char)motors[first].sequence;
+    reply( answer, motors[first].done );
+    pushInventory( motors[first].slot, outputFree );
+    motors.erase( motors.begin() + first );
+  }
+}
+
+/* int64_t mcuModel::motorsStopped( const int64_t at )
+ *
+ * When a blocking vend received at can start: once every 'M' motor has
+ *  stopped and been answered.
+ */
+int64_t mcuModel::motorsStopped( const int64_t at )
+{
+  int64_t start = at;
+
+  for( size_t i = 0; i < motors.size(); i++ )
+    if( motors[i].done > start )
+      start = motors[i].done;
+  finishMotors( start );
+  return start;
+}
+
+/* void mcuModel::reply( const string &bytes, const int64_t at )
+ *
+ * Queues bytes to go out from at, one byteTime each. A lost byte still
+ *  takes its time on the wire.
+ */
+void mcuModel::reply( const string &bytes, const int64_t at )
+{
+  for( size_t i = 0; i < bytes.size(); i++ )
+  {
+    pendingByte next;
+    outputFree = ( outputFree > at ? outputFree : at ) + byteTime;
+    next.ready = outputFree;
+    next.byte = bytes[i];
+    bytesSent++;
+    if( !lose() )
+      output.push_back( next );
+  }
+}
+
+/* void mcuModel::pushEvent( const char kind, const string &data, int64_t at )
+ *
+ * An event frame: FRAME_START, length, event seq, kind, data, the time in
+ *  MCU milliseconds (high byte first), and a check byte that makes length
+ *  to check sum to 0.
+ */
+void mcuModel::pushEvent( const char kind, const string &data,
+                          const int64_t at )
+{
+  unsigned ticks = (unsigned)( at / 1000 );
+  string frame( 1, (char)FRAME_START );
+  unsigned char sum;
+
+  frame += (char)( data.size() + 4 );
+  frame += (char)eventSequence++;
+  frame += kind;
+  frame += data;
+  frame += (char)( ticks >> 8 );
+  frame += (char)ticks;
+
+  sum = 0;
+  for( size_t i = 1; i < frame.size(); i++ )
+    sum += (unsigned char)frame[i];
+  frame += (char)( 0 - sum );
+
+  reply( frame, at );
+}
+
+/* void mcuModel::pushInventory( const unsigned short slot, int64_t at )
+ *
+ * The sensors only see a slot change when its last can goes.
+ */
+void mcuModel::pushInventory( const unsigned short slot, const int64_t at )
+{
+  if( ( pushed & PUSH_INVENTORY ) && cans[slot] == 0 )
+    pushEvent( 's', inventoryBytes(), at + debounceTime );
+}
+
+/* bool mcuModel::lose()
+ *
+ * True with probability lossRate, from a xorshift generator so that runs
+ *  repeat.
+ */
+bool mcuModel::lose()
+{
+  if( !chance( lossRate ) )
+    return false;
+
+  lost++;
+  return true;
+}
+
+/* bool mcuModel::chance( const double rate )
+ *
+ * True with probability rate. Draws nothing when rate is 0, so one kind
+ *  of fault left off does not change where the others fall.
+ */
+bool mcuModel::chance( const double rate )
+{
+  if( rate <= 0 )
+    return false;
+
+  random ^= random << 13;
+  random ^= random >> 7;
+  random ^= random << 17;
+  return ( random >> 11 ) * ( 1.0 / 9007199254740992.0 ) < rate;
+}
+
+/* void mcuModel::flicker()
+ *
+ * Darkens the sensors of the full slots that drop out of this 'S'.
+ */
+void mcuModel::flicker()
+{
+  for( size_t slot = 0; slot < cans.size(); slot++ )
+    if( cans[slot] > 0 && chance( flickerRate ) )
+    {
+      dark[slot] = true;
+      flickers++;
+    }
+}
+
+/* void mcuModel::settle( const int64_t now )
+ *
+ * Answers a waiting button poll with the first press made since it
+ *  started, if that press has happened by now, or with PUSH_BUTTONS
+ *  pushes every press debounced by now. Earlier presses are forgotten:
+ *  nobody was asking.
+ */
+void mcuModel::settle( const int64_t now )
+{
+  while( !presses.empty() && presses.front().when < buttonFrom )
+    presses.erase( presses.begin() );
+
+  if( pushed & PUSH_BUTTONS )
+  {
+    while( !presses.empty() && presses.front().when + debounceTime <= now )
+    {
+      pushEvent( 'b', string( 1, (char)presses.front().button ),
+                 presses.front().when + debounceTime );
+      presses.erase( presses.begin() );
+    }
+    return;
+  }
+
+  if( !buttonWait || presses.empty() || presses.front().when > now )
+    return;
+
+  reply( string( 1, (char)presses.front().button ), presses.front().when );
+  presses.erase( presses.begin() );
+  buttonWait = false;
+}
+
+/* size_t mcuModel::transmit( bytes, length, now )
+ */
+size_t mcuModel::transmit( void *bytes, const size_t length, const int64_t now )
+{
+  unsigned char *out = (unsigned char *)bytes;
+  size_t sent = 0;
+
+  finishMotors( now );
+  settle( now );
+  while( sent < length && outputReady( now ) )
+    out[sent++] = output[outputFirst++].byte;
+
+  return sent;
+}
+
+/* bool mcuModel::outputReady( const int64_t now )
+ *
+ * The queue is a vector read from outputFirst and emptied once all of it
+ *  has been read, so replying to the host allocates nothing once it has
+ *  grown to the longest reply. With pushed events it may never be quite
+ *  empty (a frame still debouncing behind each reply), so once half of
+ *  it has been read, the rest moves to the front instead.
+ */
+bool mcuModel::outputReady( const int64_t now )
+{
+  if( outputFirst == output.size() )
+  {
+    output.clear();
+    outputFirst = 0;
+    return false;
+  }
+  if( outputFirst * 2 >= output.size() )
+  {
+    output.erase( output.begin(), output.begin() + outputFirst );
+    outputFirst = 0;
+  }
+  return output[outputFirst].ready <= now;
+}
+
+/* int64_t mcuModel::nextByte()
+ *
+ * A motor still running answers once it stops, a press once it is seen.
+ */
+int64_t mcuModel::nextByte() const
+{
+  int64_t next = INT64_MAX;
+  int64_t press = INT64_MAX;
+
+  if( outputFirst < output.size() )
+    return output[outputFirst].ready;
+
+  for( size_t i = 0; i < motors.size(); i++ )
+    if( motors[i].done < next )
+      next = motors[i].done;
+  if( !motors.empty() )
+    next = ( next > outputFree ? next : outputFree ) + byteTime;
+
+  if( ( pushed & PUSH_BUTTONS ) && !presses.empty() )
+    press = ( presses.front().when + debounceTime > outputFree ?
+              presses.front().when + debounceTime : outputFree ) + byteTime;
+  else if( buttonWait )
+    for( size_t i = 0; i < presses.size(); i++ )
+      if( presses[i].when >= buttonFrom )
+      {
+        press = ( presses[i].when > outputFree ? presses[i].when : outputFree )
+                + byteTime;
+        break;
+      }
+
+  return press < next ? press : next;
+}
+
+/* size_t mcuModel::queuedInput( const int64_t now )
+ */
+size_t mcuModel::queuedInput( const int64_t now ) const
+{
+  if( inputFree <= now )
+    return 0;
+  return (size_t)( ( inputFree - now + byteTime - 1 ) / byteTime );
+}
+
+/* void mcuModel::discard( const int64_t now )
+ */
+void mcuModel::discard( const int64_t now )
+{
+  finishMotors( now );
+  settle( now );
+  while( outputReady( now ) )
+    outputFirst++;
+}
+
+void mcuModel::setStock( const unsigned short slot, const unsigned cans )
+{
+  if( slot < this->cans.size() )
+    this->cans[slot] = cans;
+}
+
+unsigned mcuModel::stock( const unsigned short slot ) const
+{
+  return slot < cans.size() ? cans[slot] : 0;
+}
+
+/* void mcuModel::pressButton( const int64_t when, const unsigned char button )
+ *
+ * Presses are kept in time order.
+ */
+void mcuModel::pressButton( const int64_t when, const unsigned char button )
+{
+  buttonPress press = { when, button };
+  vector<buttonPress>::iterator i = presses.end();
+
+  while( i != presses.begin() && ( i - 1 )->when > when )
+    --i;
+  presses.insert( i, press );
+}
+
+/* string mcuModel::inventory()
+ *
+ * The slot bits in the encodings machineGeometry decodes.
+ */
+string mcuModel::inventory() const
+{
+  string bits;
+
+  if( binaryInventory )
+    return inventoryBytes();
+
+  size_t digits = ( cans.size() + 3 ) / 4;
+  bits.assign( digits, '0' );
+  for( size_t digit = 0; digit < digits; digit++ )
+  {
+    unsigned value = 0;
+    for( unsigned bit = 0; bit < 4; bit++ )
+    {
+      size_t slot = ( digits - 1 - digit ) * 4 + bit;
+      if( slot < cans.size() && cans[slot] > 0 && !dark[slot] )
+        value |= 1 << bit;
+    }
+    bits[digit] = "0123456789ABCDEF"[value];
+  }
+  return bits;
+}
+
+/* string mcuModel::inventoryBytes()
+ *
+ * Slot 0 in the low bit of the first byte, as in binary replies and
+ *  inventory events.
+ */
+string mcuModel::inventoryBytes() const
+{
+  string bits( ( cans.size() + 7 ) / 8, (char)0 );
+
+  for( size_t slot = 0; slot < cans.size(); slot++ )
+    if( cans[slot] > 0 && !dark[slot] )
+      bits[slot / 8] |= 1 << ( slot % 8 );
+  return bits;
+}
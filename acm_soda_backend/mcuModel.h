@@ -0,0 +1,236 @@
+#ifndef MCUMODEL
+#define MCUMODEL
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+#define PARSE_GAP 10
+
+#define FRAME_START 0xA5           // the firmware's frames, see 89C51/sodaMCU.c
+#define PUSH_BUTTONS 0x01
+#define PUSH_INVENTORY 0x02
+
+using namespace std;
+
+/******************************************************************************\
+ * mcuModel class: Byte-level model of the MCU's side of the serial link,
+ *                 for loopbackTransport, tests and benchmarks.
+ *
+ * It speaks the legacy protocol:
+ *
+ * - 'S'         '?' then the inventory, hex digits (most significant
+ *               first) or, with binaryInventory, bytes (slot 0 in the
+ *               low bit of the first)
+ * - 'B'         the first button pressed from then on; any other command
+ *               ends the wait
+ * - 'V' <slot>  'Y' once the motor has run, or 'N' if the slot is empty
+ *
+ * and, with sequencedVends, the retryable vend:
+ *
+ * - 'W' <seq> <slot>  'Y' or 'N' followed by seq. The last seq is
+ *               remembered: the same 'W' again is answered again (once
+ *               the first answer is out) without running the motor. A
+ *               seq below 0x80 or a slot the machine does not have is
+ *               not answered, as for 'M'.
+ * - 'R'         'K'; forgets the last seq, so a host that starts over
+ *               cannot be taken for a retry.
+ *
+ * and, with flowCredits, the firmware's credit advert:
+ *
+ * - 'C'         'K' and the free bytes in its receive ring (255 at most,
+ *               and 255 when the ring is unlimited)
+ *
+ * and, with concurrentVends, the firmware's vends that do not wait:
+ *
+ * - 'L' <n>     'K' and the motor limit: n, at least 1 and at most
+ *               motorMax. It is 1 until set.
+ * - 'M' <seq> <slot>  starts the motor and answers 'Y' or 'N' followed by
+ *               seq once it has run motorTime, or 'L' and seq at once if
+ *               the limit is reached or the slot is already running. A
+ *               slot the machine does not have is not answered at all. Up
+ *               to the limit run side by side and answer as they stop;
+ *               the main loop is not held up while they run. Each slot
+ *               keeps its last answer for a retry of its seq, and a seq
+ *               still running is not answered twice. 'V' and 'W'
+ *               wait for every 'M' motor to stop first.
+ *
+ * and, with pushedEvents, the firmware's unsolicited event frames:
+ *
+ * - 'E' <mask>  'K'; from then on button presses (PUSH_BUTTONS) and
+ *               slots emptied by a vend (PUSH_INVENTORY) are pushed as
+ *               FRAME_START frames, debounceTime after they happen.
+ *               PUSH_INVENTORY also pushes the inventory at once.
+ *
+ * A multi-byte command not finished within PARSE_GAP byte times is
+ * abandoned, as the firmware's receive timer would, so a lost byte
+ * cannot make the next command's first byte a slot number.
+ *
+ * With lossRate, each byte in either direction is lost with that
+ * probability (reproducibly, see seedLoss()). With flickerRate, each
+ * full slot's sensor reads empty in an 'S' answer with that probability
+ * (flickers), as a dirty or loose one does; pushed inventories are
+ * debounced by the firmware and never flicker.
+ *
+ * With a receiveBuffer, bytes from the host wait in a ring of that many
+ * until the MCU's main loop takes them, and one that finds the ring full
+ * is lost (overruns). The loop takes nothing while it is busy: while a
+ * vend motor runs, and, as with the firmware's putByte(), while more than
+ * transmitBuffer reply bytes wait for the wire. Without one (the default)
+ * every byte is acted on as soon as it arrives.
+ *
+ * Time is whatever the caller passes in (microseconds). Each byte takes
+ * byteTime on the wire in either direction, each command thinkTime before
+ * the answer starts, and each vend motorTime on top, so replies come out
+ * when they would from the real MCU.
+ *
+ * Functions:
+ *
+ * - void receive( const void *bytes, size_t length, int64_t now )
+ *       Bytes the host wrote at now.
+ *
+ * - size_t transmit( void *bytes, size_t length, int64_t now )
+ *       Takes reply bytes that have arrived by now.
+ *
+ * - int64_t nextByte()
+ *       When the next reply byte arrives, INT64_MAX if none is coming.
+ *
+ * - size_t queuedInput( int64_t now ), int64_t drainedAt( size_t queued )
+ *       Bytes from the host still waiting for the wire at now, and when
+ *       no more than queued will be: the model's TIOCOUTQ.
+ *
+ * - void discard( int64_t now )
+ *       Drops reply bytes that have arrived by now, like tcflush().
+ *
+ * - void setSlots( unsigned slots )
+ *       Slots the machine has, 8 unless constructed otherwise. Match it to
+ *       the geometry of the sodaMachine it talks to.
+ *
+ * - void setStock( unsigned short slot, unsigned cans ), stock( slot )
+ * - void pressButton( int64_t when, unsigned char button )
+ *       The script: cans in each slot and button presses to come.
+ \*****************************************************************************/
+
+class mcuModel
+{
+  public:
+    mcuModel( const unsigned slots = 8 );
+
+    void receive( const void *bytes, const size_t length, const int64_t now );
+    size_t transmit( void *bytes, const size_t length, const int64_t now );
+    int64_t nextByte() const;
+    size_t queuedInput( const int64_t now ) const;
+    int64_t drainedAt( const size_t queued ) const
+      { return inputFree - (int64_t)queued * byteTime; };
+    void discard( const int64_t now );
+
+    void setSlots( const unsigned slots )
+      { cans.resize( slots, 1 ); dark.resize( slots );
+        motorAnswers.resize( slots ); };
+    void setStock( const unsigned short slot, const unsigned cans );
+    unsigned stock( const unsigned short slot ) const;
+    void pressButton( const int64_t when, const unsigned char button );
+    void seedLoss( const uint64_t seed ) { random = seed | 1; };
+
+    int64_t byteTime;              // 10 bits at 4800 baud by default
+    int64_t thinkTime;
+    int64_t motorTime;
+    bool binaryInventory;
+    bool sequencedVends;
+    bool pushedEvents;
+    bool flowCredits;
+    bool concurrentVends;
+    size_t motorMax;               // motors 'L' may allow, 4 by default
+    int64_t debounceTime;
+    double lossRate;
+    double flickerRate;
+    size_t receiveBuffer;          // bytes, 0 for no limit
+    size_t transmitBuffer;
+
+    unsigned long commands;        // commands received
+    unsigned long vends;           // cans dropped
+    unsigned long lost;            // bytes lost on the wire
+    unsigned long bytesSent;       // bytes put on the wire to the host
+    unsigned long overruns;        // bytes lost to a full receive ring
+    unsigned long motorPeak;       // most motors that ran at once
+    unsigned long flickers;        // full slots 'S' answered empty
+
+  private:
+    struct pendingByte
+    {
+      int64_t ready;
+      unsigned char byte;
+    };
+
+    struct buttonPress
+    {
+      int64_t when;
+      unsigned char button;
+    };
+
+    struct runningMotor
+    {
+      int64_t done;                // when it stops and is answered
+      unsigned char sequence;
+      unsigned short slot;
+    };
+
+    enum parseState
+    {
+      PARSE_COMMAND,
+      PARSE_SLOT,                  // 'V' received
+      PARSE_SEQUENCE,              // 'W' received
+      PARSE_SEQUENCED_SLOT,        // 'W' <seq> received
+      PARSE_EVENTS,                // 'E' received
+      PARSE_LIMIT,                 // 'L' received
+      PARSE_MOTOR_SEQUENCE,        // 'M' received
+      PARSE_MOTOR_SLOT             // 'M' <seq> received
+    };
+
+    void command( const unsigned char byte, const int64_t at );
+    void vend( const unsigned char slot, int64_t at );
+    void sequencedVend( const unsigned char slot, int64_t at );
+    void startMotor( const unsigned char slot, const int64_t at );
+    void finishMotors( const int64_t at );
+    int64_t motorsStopped( const int64_t at );
+    void reply( const string &bytes, const int64_t at );
+    void pushEvent( const char kind, const string &data, const int64_t at );
+    void pushInventory( const unsigned short slot, const int64_t at );
+    void occupy( const int64_t until );
+    size_t ringFree( const int64_t at );
+    bool lose();
+    bool chance( const double rate );
+    void flicker();
+    void settle( const int64_t now );
+    bool outputReady( const int64_t now );
+    string inventory() const;
+    string inventoryBytes() const;
+
+    vector<pendingByte> output;    // from outputFirst on, reused once empty
+    size_t outputFirst;
+    vector<int64_t> ring;          // when each byte in the receive ring is
+    size_t ringFirst;              //  taken, from ringFirst on
+    int64_t busyUntil;             // when the main loop takes the next byte
+    vector<buttonPress> presses;    // in time order, reused once empty
+    vector<unsigned> cans;
+    vector<bool> dark;             // sensors reading empty for this 'S'
+    int64_t inputFree;             // when the wire from the host is idle
+    int64_t outputFree;            // when the wire to the host is idle
+    parseState parse;
+    int64_t parseFrom;             // when the command's first byte arrived
+    unsigned char sequence;        // of the 'W' being received
+    int lastSequence;              // of the last 'W' acted on, -1 for none
+    string lastAnswer;
+    int64_t lastAnswerAt;          // when its last byte is out
+    uint64_t random;
+    bool buttonWait;
+    int64_t buttonFrom;
+    unsigned char pushed;          // the 'E' mask
+    unsigned char eventSequence;
+    vector<runningMotor> motors;   // 'M's not yet answered
+    size_t motorLimit;
+    vector<string> motorAnswers;   // each slot's last, seq second; "" none
+};
+
+#endif
@@ -0,0 +1,230 @@
+#ifndef MPSCQUEUE
+#define MPSCQUEUE
+
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <atomic>
+
+using namespace std;
+
+/******************************************************************************\
+ * mpscQueue class: A bounded queue that any number of threads push into
+ *                  and one thread pops from, without a lock.
+ *
+ * The queue is a ring of capacity cells (rounded up to a power of two),
+ * each with a sequence number saying whose turn it is (D. Vyukov's bounded
+ * queue). A producer claims the next cell with one compare-and-swap on
+ * the tail, copies its item in and publishes it by bumping the cell's
+ * sequence; the consumer, alone on the head, needs no atomic read-modify-
+ * write at all. Nothing is allocated after construction, and a full queue
+ * is reported rather than waited on.
+ *
+ * T is copied in and out, so it should be a plain struct.
+ *
+ * mailbox<T> adds an eventfd, so that the consumer can sleep in poll()
+ * along with its other descriptors. Producers only write to it when the
+ * consumer may be asleep: the first post() after the consumer has
+ * acknowledge()d rings it, the ones after that do not.
+ *
+ *     consumer:  poll() says descriptor() is readable -> acknowledge()
+ *                while( take( item ) ) ...
+ *     producer:  if( !post( item ) ) ...the consumer is falling behind
+ *
+ * Functions:
+ *
+ * - mpscQueue( const size_t capacity )
+ *
+ * - bool push( const T &item )
+ *       Any thread. Returns false if the queue is full.
+ *
+ * - bool pop( T &item )
+ *       The consumer thread only. Returns false if the queue is empty.
+ *
+ * - bool post( const T &item ), bool take( T &item )
+ *       mailbox's push and pop.
+ *
+ * - int descriptor()
+ *       mailbox's eventfd, readable once something was posted.
+ *
+ * - void acknowledge()
+ *       Before taking what poll() said was posted.
+ *
+ * - void ring()
+ *       Wakes the consumer without posting anything, e.g. to stop it.
+ \*****************************************************************************/
+
+#define QUEUE_LINE 64                // bytes in a cache line, to pad with
+
+template< class T >
+class mpscQueue
+{
+  public:
+    mpscQueue( const size_t capacity );
+    ~mpscQueue();
+
+    bool push( const T &item );
+    bool pop( T &item );
+
+  private:
+    mpscQueue( const mpscQueue & );
+    mpscQueue &operator=( const mpscQueue & );
+
+    struct queueCell
+    {
+      atomic<size_t> sequence;
+      T item;
+    };
+
+    queueCell *cells;
+    size_t mask;
+    char padTail[QUEUE_LINE];        // producers and consumer apart
+    atomic<size_t> tail;             // next cell to push
+    char padHead[QUEUE_LINE];
+    size_t head;                     // next cell to pop
+};
+
+template< class T >
+class mailbox : public mpscQueue<T>
+{
+  public:
+    mailbox( const size_t capacity );
+    ~mailbox();
+
+    bool post( const T &item );
+    bool take( T &item ) { return this->pop( item ); };
+    int descriptor() const { return fd; };
+    void acknowledge();
+    void ring();
+
+  private:
+    int fd;
+    atomic<bool> rung;               // since the last acknowledge()
+};
+
+template< class T >
+mpscQueue<T>::mpscQueue( const size_t capacity )
+{
+  size_t size = 2;
+
+  while( size < capacity )
+    size *= 2;
+  cells = new queueCell[size];
+  for( size_t i = 0; i < size; i++ )
+    cells[i].sequence.store( i, memory_order_relaxed );
+  mask = size - 1;
+  tail.store( 0, memory_order_relaxed );
+  head = 0;
+}
+
+template< class T >
+mpscQueue<T>::~mpscQueue()
+{
+  delete[] cells;
+}
+
+/* bool mpscQueue::push( const T &item )
+ *
+ * A cell whose sequence equals the tail is free for that position; one
+ *  a lap behind still holds an item the consumer has not taken.
+ */
+template< class T >
+bool mpscQueue<T>::push( const T &item )
+{
+  size_t position = tail.load( memory_order_relaxed );
+  queueCell *cell;
+
+  while( true )
+  {
+    cell = &cells[ position & mask ];
+    intptr_t lag = (intptr_t)cell->sequence.load( memory_order_acquire ) -
+                   (intptr_t)position;
+
+    if( lag == 0 )
+    {
+      if( tail.compare_exchange_weak( position, position + 1,
+                                      memory_order_relaxed ) )
+        break;
+    }
+    else if( lag < 0 )
+      return false;
+    else
+      position = tail.load( memory_order_relaxed );
+  }
+
+  cell->item = item;
+  cell->sequence.store( position + 1, memory_order_release );
+  return true;
+}
+
+/* bool mpscQueue::pop( T &item )
+ *
+ * The cell is handed back for the position one lap on.
+ */
+template< class T >
+bool mpscQueue<T>::pop( T &item )
+{
+  queueCell *cell = &cells[ head & mask ];
+
+  if( cell->sequence.load( memory_order_acquire ) != head + 1 )
+    return false;
+
+  item = cell->item;
+  cell->sequence.store( head + mask + 1, memory_order_release );
+  head++;
+  return true;
+}
+
+template< class T >
+mailbox<T>::mailbox( const size_t capacity )
+  : mpscQueue<T>( capacity )
+{
+  fd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+  rung.store( false );
+}
+
+template< class T >
+mailbox<T>::~mailbox()
+{
+  if( fd >= 0 )
+    close( fd );
+}
+
+/* bool mailbox::post( const T &item )
+ *
+ * The fences pair with acknowledge()'s: either the consumer sees the item
+ *  after clearing rung, or this sees rung clear and rings.
+ */
+template< class T >
+bool mailbox<T>::post( const T &item )
+{
+  if( !this->push( item ) )
+    return false;
+  atomic_thread_fence( memory_order_seq_cst );
+  if( !rung.exchange( true ) )
+    ring();
+  return true;
+}
+
+template< class T >
+void mailbox<T>::acknowledge()
+{
+  uint64_t count;
+
+  if( read( fd, &count, sizeof(count) ) < 0 )
+    count = 0;
+  rung.store( false );
+  atomic_thread_fence( memory_order_seq_cst );
+}
+
+template< class T >
+void mailbox<T>::ring()
+{
+  uint64_t one = 1;
+
+  if( write( fd, &one, sizeof(one) ) < 0 )
+    return;
+}
+
+#endif
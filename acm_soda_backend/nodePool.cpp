@@ -0,0 +1,86 @@
+#include "nodePool.h"
+
+/* Blocks are rounded up to this, so that any node type is aligned */
+#define BLOCK_ALIGNMENT 16
+
+using namespace std;
+
+/* Constructor:
+ *  - count: blocks per slab, at least one
+ */
+nodePool::nodePool( const size_t count )
+{
+  this->count = count > 0 ? count : 1;
+  size = 0;
+  freeList = NULL;
+  freeCount = 0;
+}
+
+nodePool::~nodePool()
+{
+  for( size_t i = 0; i < slabs.size(); i++ )
+    ::operator delete( slabs[i] );
+}
+
+/* void *nodePool::take( const size_t size )
+ *
+ * The first block taken sets the size; blocks of any other size are not
+ *  the pool's to give.
+ */
+void *nodePool::take( const size_t size )
+{
+  size_t rounded = ( size + BLOCK_ALIGNMENT - 1 ) / BLOCK_ALIGNMENT *
+                   BLOCK_ALIGNMENT;
+
+  if( this->size == 0 )
+    this->size = rounded;
+  if( rounded != this->size )
+    return ::operator new( size );
+
+  if( freeList == NULL )
+    grow();
+
+  freeBlock *block = freeList;
+  freeList = block->next;
+  freeCount--;
+  return block;
+}
+
+/* void nodePool::give( void *block, const size_t size )
+ */
+void nodePool::give( void *block, const size_t size )
+{
+  size_t rounded = ( size + BLOCK_ALIGNMENT - 1 ) / BLOCK_ALIGNMENT *
+                   BLOCK_ALIGNMENT;
+
+  if( block == NULL )
+    return;
+  if( rounded != this->size )
+  {
+    ::operator delete( block );
+    return;
+  }
+
+  freeBlock *freed = (freeBlock *)block;
+  freed->next = freeList;
+  freeList = freed;
+  freeCount++;
+}
+
+/* void nodePool::grow()
+ *
+ * A slab of count blocks onto the free list, in address order.
+ */
+void nodePool::grow()
+{
+  char *slab = (char *)::operator new( count * size );
+
+  slabs.push_back( slab );
+  for( size_t i = count; i > 0; i-- )
+  {
+    freeBlock *block = (freeBlock *)( slab + ( i - 1 ) * size );
+    block->next = freeList;
+    freeList = block;
+  }
+  freeCount += count;
+}
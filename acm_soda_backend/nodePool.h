@@ -0,0 +1,124 @@
+#ifndef NODEPOOL
+#define NODEPOOL
+
+#include <stddef.h>
+#include <new>
+#include <vector>
+
+using namespace std;
+
+/******************************************************************************\
+ * nodePool class: Recycles the nodes of a map, unordered_map or list, so
+ *                 that once it has held as many entries as it ever will,
+ *                 inserting and erasing no longer touch the heap.
+ *
+ * Node-based containers allocate every entry separately. sodaDaemon's
+ * tables (connections, vends on the link, idempotency keys, queued
+ * requests) gain and lose an entry with every vend, so with the default
+ * allocator every vend was a handful of operator new and delete calls.
+ *
+ * A nodePool hands out blocks of one size. Freed blocks go on a free list,
+ * and the next allocation takes the most recently freed one (still warm
+ * in the cache). Blocks come from slabs of count blocks: the first slab
+ * is allocated when the first node is, and another only when every block
+ * is in use, so a pool of the right count allocates once. The block size
+ * is that of the first single-object allocation; anything else (an
+ * unordered_map's bucket array, say) is passed on to operator new.
+ *
+ * poolAllocator<T> is the standard allocator interface onto a nodePool:
+ *
+ *     nodePool pool( 64 );
+ *     map< int, vendRequest, less<int>,
+ *          poolAllocator< pair<const int, vendRequest> > >
+ *       table( less<int>(), poolAllocator< pair<const int, vendRequest> >( &pool ) );
+ *
+ * The pool must outlive the container. One without a pool (default
+ * constructed) is plain operator new. A pool is not thread-safe: it
+ * belongs to the thread that owns its container.
+ *
+ * Functions:
+ *
+ * - nodePool( const size_t count )
+ *       Blocks per slab.
+ *
+ * - void *take( const size_t size ), void give( void *block, size )
+ *       A block of size bytes, and back.
+ *
+ * - size_t blockSize(), size_t slabCount(), size_t free()
+ *       For benchmarks: the block size (0 before the first node), slabs
+ *       allocated, and blocks on the free list.
+ \*****************************************************************************/
+
+class nodePool
+{
+  public:
+    nodePool( const size_t count );
+    ~nodePool();
+
+    void *take( const size_t size );
+    void give( void *block, const size_t size );
+
+    size_t blockSize() const { return size; };
+    size_t slabCount() const { return slabs.size(); };
+    size_t free() const { return freeCount; };
+
+  private:
+    nodePool( const nodePool & );
+    nodePool &operator=( const nodePool & );
+
+    struct freeBlock
+    {
+      freeBlock *next;
+    };
+
+    void grow();
+
+    size_t count;
+    size_t size;                    // of a block, 0 until the first node
+    freeBlock *freeList;
+    size_t freeCount;
+    vector<void *> slabs;
+};
+
+template< class T >
+class poolAllocator
+{
+  public:
+    typedef T value_type;
+
+    poolAllocator() : pool( NULL ) {};
+    explicit poolAllocator( nodePool *pool ) : pool( pool ) {};
+    template< class U >
+    poolAllocator( const poolAllocator<U> &other ) : pool( other.pool ) {};
+
+    T *allocate( const size_t n )
+    {
+      if( pool == NULL || n != 1 )
+        return (T *)::operator new( n * sizeof(T) );
+      return (T *)pool->take( sizeof(T) );
+    };
+
+    void deallocate( T *block, const size_t n )
+    {
+      if( pool == NULL || n != 1 )
+        ::operator delete( block );
+      else
+        pool->give( block, sizeof(T) );
+    };
+
+    nodePool *pool;
+};
+
+template< class T, class U >
+bool operator==( const poolAllocator<T> &a, const poolAllocator<U> &b )
+{
+  return a.pool == b.pool;
+}
+
+template< class T, class U >
+bool operator!=( const poolAllocator<T> &a, const poolAllocator<U> &b )
+{
+  return a.pool != b.pool;
+}
+
+#endif
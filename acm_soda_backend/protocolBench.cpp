@@ -0,0 +1,136 @@
+/* protocolBench.cpp
+ *
+ * Protocol-level benchmark of sodaMachine against the in-process MCU
+ *  model (emulatedSodaMachine: loopbackTransport on a virtualClock).
+ *
+ * Every reply is exactly as slow as on the real link in virtual time (a
+ *  byte takes 2083 us at 4800 baud, a vend 1.2 s of motor), but no real
+ *  time passes, so the wall-clock rate is the cost of sodaMachine's own
+ *  code and a 10 second button timeout returns at once.
+ *
+ * Runs in a scratch directory so that nothing is logged or journaled:
+ *  the log and journal directories do not exist there.
+ *
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include <time.h>
+#include "sodaMachine.h"
+
+#define INVENTORY_COUNT 1000000
+#define VEND_COUNT 200000
+
+using namespace std;
+
+double wallSeconds();
+void report( const char *name, const unsigned long count, const double wall,
+             const int64_t virtualTime );
+
+int main()
+{
+  char scratch[] = "/tmp/protocolBenchXXXXXX";
+
+  if( mkdtemp( scratch ) == NULL || chdir( scratch ) != 0 )
+  {
+    perror( "protocolBench: could not make a scratch directory" );
+    return 1;
+  }
+
+  emulatedSodaMachine acmSoda;
+  mcuModel &mcu = acmSoda.getTransport().mcu();
+  virtualClock &clock = acmSoda.getClock();
+  unsigned long full = 0;
+  double start;
+  int64_t virtualStart;
+
+  mcu.setSlots( emulatedSodaMachine::geometry::slotCount );
+
+  /* Inventory queries */
+  start = wallSeconds();
+  virtualStart = clock.now();
+  for( unsigned long i = 0; i < INVENTORY_COUNT; i++ )
+    full += acmSoda.getSodaInventory().count();
+  report( "getSodaInventory", INVENTORY_COUNT, wallSeconds() - start,
+          clock.now() - virtualStart );
+  if( full != INVENTORY_COUNT * emulatedSodaMachine::geometry::slotCount )
+    cout << "  unexpected inventory!" << endl;
+
+  /* Vends, with the inventory check each one makes */
+  for( unsigned slot = 0; slot < emulatedSodaMachine::geometry::slotCount;
+       slot++ )
+    mcu.setStock( slot, VEND_COUNT );
+  unsigned long vended = 0;
+  start = wallSeconds();
+  virtualStart = clock.now();
+  for( unsigned long i = 0; i < VEND_COUNT; i++ )
+    vended += acmSoda.vendSoda( i % emulatedSodaMachine::geometry::slotCount )
+              == 0;
+  report( "vendSoda", VEND_COUNT, wallSeconds() - start,
+          clock.now() - virtualStart );
+  if( vended != VEND_COUNT || mcu.vends != VEND_COUNT )
+    cout << "  only " << vended << " vends succeeded!" << endl;
+
+  /* A button poll nobody answers */
+  start = wallSeconds();
+  virtualStart = clock.now();
+  int button = acmSoda.getButtonInput( 10 );
+  report( "getButtonInput(10), timeout", 1, wallSeconds() - start,
+          clock.now() - virtualStart );
+  if( button != -1 )
+    cout << "  expected a timeout, got button " << button << endl;
+
+  /* ...and one answered after three seconds */
+  mcu.pressButton( clock.now() + 3000000, 5 );
+  start = wallSeconds();
+  virtualStart = clock.now();
+  button = acmSoda.getButtonInput( 10 );
+  report( "getButtonInput(10), press", 1, wallSeconds() - start,
+          clock.now() - virtualStart );
+  if( button != 5 )
+    cout << "  expected button 5, got " << button << endl;
+
+  /* The link scheduler: a background refresh and a long button poll
+   *  should both give way to a vend
+   */
+  linkResult result;
+  int64_t submitted = clock.now();
+  acmSoda.submit( 'B', 0, LINK_INTERACTIVE, submitted + 30000000 );
+  acmSoda.submit( 'S', 0, LINK_BACKGROUND, 0 );
+  for( int slice = 0; slice < 5; slice++ )
+    acmSoda.service( result );
+  acmSoda.submit( 'V', 2, LINK_INTERACTIVE, clock.now() + 5000000 );
+  mcu.pressButton( clock.now() + 8000000, 1 );
+
+  cout << endl << "Scheduler (virtual ms after submission):" << endl;
+  while( acmSoda.pending() > 0 )
+    if( acmSoda.service( result ) )
+      cout << "  '" << result.command << "' -> " << setw(2) << result.result
+           << " at " << ( clock.now() - submitted ) / 1000 << endl;
+
+  if( chdir( "/" ) == 0 )
+    rmdir( scratch );
+  return 0;
+}
+
+/* wallSeconds: real time, for the rate */
+double wallSeconds()
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void report( const char *name, const unsigned long count, const double wall,
+             const int64_t virtualTime )
+{
+  cout << setw(30) << left << name << right
+       << setw(9) << count << " ops  "
+       << setw(12) << fixed << setprecision(0) << count / wall << " ops/s  "
+       << setw(10) << setprecision(3) << wall * 1e6 / count << " us/op wall  "
+       << setw(12) << setprecision(1) << (double)virtualTime / count / 1000
+       << " ms/op virtual" << endl;
+}
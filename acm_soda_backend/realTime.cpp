@@ -0,0 +1,85 @@
+#include "realTime.h"
+
+#include <alloca.h>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <malloc.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+using namespace std;
+
+static void addProblem( string &problems, const char *what );
+
+/* bool enterRealTime( priority, cpu, heapReserve, stackReserve, problems )
+ *
+ * Memory is set up before the scheduler is changed, so that faulting it
+ *  all in does not happen at real-time priority.
+ */
+bool enterRealTime( const int priority, const int cpu, const size_t heapReserve,
+                    const size_t stackReserve, string &problems )
+{
+  struct sched_param parameters;
+
+  problems.clear();
+
+  if( cpu >= 0 )
+  {
+    cpu_set_t cpus;
+    CPU_ZERO( &cpus );
+    CPU_SET( cpu, &cpus );
+    if( sched_setaffinity( 0, sizeof(cpus), &cpus ) != 0 )
+      addProblem( problems, "sched_setaffinity" );
+  }
+
+  /* Freed memory stays in the heap, and big blocks come from it too */
+  if( mallopt( M_TRIM_THRESHOLD, -1 ) == 0 || mallopt( M_MMAP_MAX, 0 ) == 0 )
+    addProblem( problems, "mallopt" );
+
+  if( mlockall( MCL_CURRENT | MCL_FUTURE ) != 0 )
+    addProblem( problems, "mlockall" );
+
+  /* With MCL_FUTURE the pages are faulted in as soon as they are mapped;
+   *  writing them makes sure of it without the lock
+   */
+  char *heap = (char *)malloc( heapReserve );
+  if( heap != NULL )
+  {
+    long page = sysconf( _SC_PAGESIZE );
+    for( size_t i = 0; i < heapReserve; i += page )
+      ((volatile char *)heap)[i] = 0;
+    free( heap );
+  }
+  prefaultStack( stackReserve );
+
+  memset( &parameters, 0x00, sizeof(parameters) );
+  parameters.sched_priority = priority;
+  if( sched_setscheduler( 0, SCHED_FIFO, &parameters ) != 0 )
+    addProblem( problems, "sched_setscheduler" );
+
+  return problems.empty();
+}
+
+/* void prefaultStack( const size_t bytes )
+ *
+ * Not inlined, so that the bytes are below whoever calls it.
+ */
+__attribute__(( noinline )) void prefaultStack( const size_t bytes )
+{
+  volatile char *stack = (volatile char *)alloca( bytes );
+  long page = sysconf( _SC_PAGESIZE );
+
+  for( size_t i = 0; i < bytes; i += page )
+    stack[i] = 0;
+}
+
+/* addProblem: appends "<what>: <errno text>" as a line */
+static void addProblem( string &problems, const char *what )
+{
+  problems += what;
+  problems += ": ";
+  problems += strerror( errno );
+  problems += "\n";
+}
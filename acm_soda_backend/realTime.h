@@ -0,0 +1,53 @@
+#ifndef REALTIME
+#define REALTIME
+
+#include <stddef.h>
+#include <string>
+
+using namespace std;
+
+/******************************************************************************\
+ * realTime: Keeps the thread that owns the serial link on time while the
+ *           rest of the host is busy (sodaDaemon -t).
+ *
+ * A vend or button reply is a few bytes at 4800 baud; what makes it late
+ * is the daemon not running when they arrive, or running into page
+ * faults when it does. enterRealTime():
+ *
+ * - pins the process to one CPU (cpu >= 0), so its cache and wake-ups
+ *   stay there,
+ * - stops malloc() from handing memory back to the kernel or mmap()ing
+ *   big blocks, and touches heapReserve bytes of heap once, so that later
+ *   allocations (the log's buffers, request strings) come out of pages
+ *   already there,
+ * - touches stackReserve bytes of stack,
+ * - locks all of it, and anything mapped later, in RAM (mlockall()), and
+ * - runs the calling thread SCHED_FIFO at priority, ahead of every normal
+ *   process (web workers, cron jobs).
+ *
+ * All of these need privileges (CAP_SYS_NICE, CAP_IPC_LOCK or a big
+ * enough RLIMIT_MEMLOCK). Each step is tried even if an earlier one
+ * failed.
+ *
+ * Linux keeps 5% of every second for normal processes by default
+ * (sched_rt_runtime_us), so a SCHED_FIFO loop that spins cannot lock up
+ * the machine.
+ *
+ * Functions:
+ *
+ * - bool enterRealTime( priority, cpu, heapReserve, stackReserve, problems )
+ *       Returns false if any step failed, with problems saying which and
+ *       why, one line each.
+ *
+ * - void prefaultStack( const size_t bytes )
+ *       Touches bytes of stack below the caller.
+ \*****************************************************************************/
+
+#define RT_HEAP_RESERVE ( 8 << 20 )
+#define RT_STACK_RESERVE ( 256 << 10 )
+
+bool enterRealTime( const int priority, const int cpu, const size_t heapReserve,
+                    const size_t stackReserve, string &problems );
+void prefaultStack( const size_t bytes );
+
+#endif
@@ -0,0 +1,67 @@
+#include "rttEstimator.h"
+
+rttEstimator::rttEstimator( const int64_t initial, const int64_t minimum,
+                            const int64_t maximum )
+{
+  configure( initial, minimum, maximum );
+}
+
+void rttEstimator::configure( const int64_t initial, const int64_t minimum,
+                              const int64_t maximum )
+{
+  this->minimum = minimum;
+  this->maximum = maximum;
+  srtt = rttvar = 0;
+  samples = timeouts = 0;
+  current = clamp( initial );
+}
+
+/* void rttEstimator::resume( const int64_t smoothed, deviation )
+ *
+ * Counts as one sample, so the next one is smoothed into it instead of
+ *  replacing it.
+ */
+void rttEstimator::resume( const int64_t smoothed, const int64_t deviation )
+{
+  if( smoothed <= 0 )
+    return;
+
+  srtt = smoothed;
+  rttvar = deviation;
+  samples = 1;
+  current = clamp( srtt + ( 4 * rttvar > RTT_SLACK ? 4 * rttvar : RTT_SLACK ) );
+}
+
+/* void rttEstimator::sample( const int64_t rtt )
+ *
+ * The first sample sets the deviation to half of it; later ones move the
+ *  average by 1/8 and the deviation by 1/4 of the difference.
+ */
+void rttEstimator::sample( const int64_t rtt )
+{
+  if( samples++ == 0 )
+  {
+    srtt = rtt;
+    rttvar = rtt / 2;
+  }
+  else
+  {
+    int64_t error = rtt - srtt;
+
+    rttvar += ( ( error < 0 ? -error : error ) - rttvar ) / 4;
+    srtt += error / 8;
+  }
+
+  current = clamp( srtt + ( 4 * rttvar > RTT_SLACK ? 4 * rttvar : RTT_SLACK ) );
+}
+
+void rttEstimator::backoff()
+{
+  timeouts++;
+  current = clamp( current + current / 2 );
+}
+
+int64_t rttEstimator::clamp( const int64_t value ) const
+{
+  return value < minimum ? minimum : value > maximum ? maximum : value;
+}
@@ -0,0 +1,76 @@
+#ifndef RTTESTIMATOR
+#define RTTESTIMATOR
+
+#include <stdint.h>
+
+/******************************************************************************\
+ * rttEstimator class: How long to wait for the MCU's reply to one kind of
+ *                     command, learnt from the replies so far.
+ *
+ * The link works like a tiny TCP connection and gets its timeouts the same
+ * way (Jacobson/Karels, as in RFC 6298): a smoothed round-trip time and
+ * its mean deviation, with
+ *
+ *     timeout = smoothed + max( RTT_SLACK, 4 * deviation )
+ *
+ * kept within [minimum, maximum]. Every timeout stretches it by half until
+ * the next sample (backoff), and only replies to commands sent once are
+ * sampled: the reply to a retransmission could be to either copy (Karn).
+ * TCP doubles instead, because its losses mean congestion; on the serial
+ * link they are line noise, and waiting longer does not make them rarer.
+ *
+ * All times are microseconds.
+ *
+ * Functions:
+ *
+ * - void configure( int64_t initial, int64_t minimum, int64_t maximum )
+ *       Forgets the samples and starts over from initial. Equal values
+ *       give a fixed timeout.
+ *
+ * - void resume( const int64_t smoothed, const int64_t deviation )
+ *       Carries on from an estimate saved earlier (e.g. by a sodaDaemon
+ *       before a restart), as if it had been sampled. Ignored if there
+ *       was none.
+ *
+ * - void sample( const int64_t rtt )
+ *       A reply took rtt after its command was sent.
+ *
+ * - void backoff()
+ *       No reply within timeout().
+ *
+ * - int64_t timeout()
+ *       How long to wait for the next reply.
+ \*****************************************************************************/
+
+#define RTT_SLACK 4000         // two bytes at 4800 baud
+
+class rttEstimator
+{
+  public:
+    rttEstimator( const int64_t initial = 1000000, const int64_t minimum = 0,
+                  const int64_t maximum = 60000000 );
+
+    void configure( const int64_t initial, const int64_t minimum,
+                    const int64_t maximum );
+    void resume( const int64_t smoothed, const int64_t deviation );
+    void sample( const int64_t rtt );
+    void backoff();
+
+    int64_t timeout() const { return current; };
+    int64_t smoothed() const { return srtt; };
+    int64_t deviation() const { return rttvar; };
+
+    unsigned long samples;
+    unsigned long timeouts;
+
+  private:
+    int64_t clamp( const int64_t value ) const;
+
+    int64_t srtt;
+    int64_t rttvar;
+    int64_t current;
+    int64_t minimum;
+    int64_t maximum;
+};
+
+#endif
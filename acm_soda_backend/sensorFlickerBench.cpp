@@ -0,0 +1,126 @@
+/* sensorFlickerBench.cpp
+ *
+ * What flickering can sensors cost vends, against the emulated MCU
+ *  (emulatedSodaMachine, on a virtual clock), with the sensor history
+ *  (sodaMachine::sensorHistory()) keeping 1 (off) to 4 inventories.
+ *
+ * Every slot starts with STOCK cans and is asked for STOCK + 2 vends, in
+ *  rotation, with vendSoda() as sodaDaemon calls it: an 'S', then the
+ *  vend if the slot reads full. Each full slot's sensor reads empty in an
+ *  'S' answer with the flicker probability.
+ *
+ * Spurious empties are vends answered 1 while the slot still had cans:
+ *  a customer refused, who asks again over the link. Late empties are
+ *  vends sent to a slot that had none, answered 'N' by the MCU: the cost
+ *  of believing a slot full for a few samples after its last can. Hidden
+ *  is the dropouts the history counted (flickers()), of those the MCU
+ *  injected; commands are link commands per vend asked for.
+ *
+ * Runs in a scratch directory so that nothing is logged or journaled.
+ *
+ * Usage: sensorFlickerBench [stock]
+ *
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include "sodaMachine.h"
+
+#define STOCK 50
+
+using namespace std;
+
+struct runResult
+{
+  unsigned long spurious;
+  unsigned long late;
+  unsigned long hidden;
+  unsigned long flickers;
+  double commands;
+};
+
+void run( const double flicker, const size_t depth, const unsigned stock,
+          runResult &result );
+
+int main( int argc, char *argv[] )
+{
+  char scratch[] = "/tmp/sensorFlickerBenchXXXXXX";
+  const double flickers[] = { 0, 0.01, 0.05, 0.2 };
+  const size_t depths[] = { 1, 2, 3, 4 };
+  unsigned stock = argc > 1 ? atoi( argv[1] ) : STOCK;
+
+  if( stock < 1 )
+  {
+    cerr << "sensorFlickerBench: stock must be at least 1" << endl;
+    return 1;
+  }
+  if( mkdtemp( scratch ) == NULL || chdir( scratch ) != 0 )
+  {
+    perror( "sensorFlickerBench: could not make a scratch directory" );
+    return 1;
+  }
+
+  cout << emulatedSodaMachine::geometry::slotCount << " slots of " << stock
+       << " cans, " << stock + 2 << " vends asked of each" << endl
+       << "  flicker  history  spurious empties  late empties"
+       << "     hidden  commands/vend" << endl;
+
+  for( size_t i = 0; i < sizeof(flickers) / sizeof(flickers[0]); i++ )
+    for( size_t j = 0; j < sizeof(depths) / sizeof(depths[0]); j++ )
+    {
+      runResult result;
+
+      run( flickers[i], depths[j], stock, result );
+      cout << setw(8) << fixed << setprecision(0) << flickers[i] * 100 << "%"
+           << setw(9) << depths[j] << setw(18) << result.spurious
+           << setw(14) << result.late << setw(7) << result.hidden << " of"
+           << setw(5) << result.flickers << setw(15) << setprecision(2)
+           << result.commands << endl;
+    }
+
+  if( chdir( "/" ) == 0 )
+    rmdir( scratch );
+  return 0;
+}
+
+/* run: one flicker rate, one history depth */
+void run( const double flicker, const size_t depth, const unsigned stock,
+          runResult &result )
+{
+  emulatedSodaMachine acmSoda;
+  mcuModel &mcu = acmSoda.getTransport().mcu();
+  const unsigned slots = emulatedSodaMachine::geometry::slotCount;
+  unsigned long asked = (unsigned long)slots * ( stock + 2 );
+
+  mcu.setSlots( slots );
+  for( unsigned slot = 0; slot < slots; slot++ )
+    mcu.setStock( slot, stock );
+  mcu.seedLoss( 42 );
+  mcu.flickerRate = flicker;
+  acmSoda.sensorHistory().configure( depth );
+
+  result.spurious = result.late = 0;
+  unsigned long before = mcu.commands;
+  for( unsigned long i = 0; i < asked; i++ )
+  {
+    unsigned slot = i % slots;
+    unsigned had = mcu.stock( slot );
+    unsigned long sent = mcu.commands;
+
+    if( acmSoda.vendSoda( slot ) != 1 )
+      continue;
+    if( had > 0 )
+      result.spurious++;
+    else if( mcu.commands - sent > 1 )
+      result.late++;
+  }
+
+  result.hidden = 0;
+  for( unsigned slot = 0; slot < slots; slot++ )
+    result.hidden += acmSoda.sensorHistory().flickers( slot );
+  result.flickers = mcu.flickers;
+  result.commands = (double)( mcu.commands - before ) / asked;
+}
@@ -0,0 +1,221 @@
+#include "serialTransport.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+
+#define BAUDRATE B4800
+#define DEVICE "/dev/ttyS0"
+#define DEVICE_VARIABLE "SODA_DEVICE"
+
+using namespace std;
+
+/* The anatomy of a program performing serial I/O with the help of
+ *  termios is as follows:
+ *
+ * - Open serial device with standard Unix system call open(2)
+ * - Configure communication parameters and other interface
+ *    properties (line discipline, etc.) with the help of specific
+ *    termios functions and data structures.
+ * - Use standard Unix system calls read(2) and write(2) for reading from,
+ *    and writing to the serial interface. Related system calls like readv(2)
+ *    and writev(2) can be used, too. Multiple I/O techniques, like blocking,
+ *    non-blocking, asynchronous I/O (select(2) or poll(2)) or 
+ *    signal-drive I/O (SIGIO signal) are also possible.
+ * - Close device with the standard Unix system call close(2) when done.
+ *
+ * The majority of these operations use <termios.h>
+ * 
+ * (source: http://en.wikibooks.org/wiki/Serial_Programming:Unix/termios )
+ */
+
+serialTransport::serialTransport()
+{
+  fileDes = -1;
+}
+
+/* bool serialTransport::open( ostream &log ): Opens a serial connection to
+ *  the MCU
+ *   Establishes a connection to the serial port. That location is DEVICE
+ *    unless the environment variable DEVICE_VARIABLE names another one,
+ *    e.g. a pty with an emulated MCU on the other end.
+ *   Returns false if any step fails.
+ */
+bool serialTransport::open( ostream &log )
+{
+  const char *device = getenv( DEVICE_VARIABLE );
+
+  if( device == NULL || *device == '\0' )
+    device = DEVICE;
+
+  log << "serialTransport::open() called" << endl;
+  
+  /* Opening a file at device
+   *  The following options will be set:
+   *  - O_RDWR: Opens the port for reading and writing
+   *  - O_NOCTTY: The port never becomes the controlling
+   *      terminal of the process.
+   *
+   * Then check for errors:
+   *  - If successful, open() returns a file descriptor.
+   *  - If unsuccessful, open() returns -1 and errno is set
+   */
+  
+  log << "opening a file at " << device << endl;
+  
+  fileDes = ::open(device, O_RDWR | O_NOCTTY );
+  
+  if (fileDes < 0)
+  {
+    log << "serialTransport::open():"
+	        << "Error opening connection to " << device << ", exiting. " << endl;
+    return false;
+  }
+
+  /* Saving the previos port settings in "oldtio"
+   *
+   * Then check for errors:
+   *  - If successful, tcgetattr() returns 0.
+   *  - If unsuccessful, tcgetattr() returns -1 and errno is set.
+   */
+  
+  log << "serialTransport::open(): Saving old port settings." << endl;
+  if( tcgetattr( fileDes, &oldtio ) != 0 )
+  {
+    log << "serialTransport::open():"
+	        << "Error saving old port settings, exiting. " << endl;
+    return false;
+  }
+  
+  /* Setting up a new termios struct "newtio"
+   *
+   * Setting "newtio"'s flags to the following settings:
+   *  Control flags (c_cflag):
+   *   - CS8: Sets character size to 8 bits
+   *   - CLOCAL: Ignore modem status lines
+   *   - CREAD: Enable receiver
+   *  Input flags (c_iflag):
+   *   - IGNPAR: Ignore characters with parity errors
+   *   - IGNBRK: Ignore break condition
+   *  Output flags (c_oflag):
+   *   x none currently enabled
+   *  Local flags (c_lflag):
+   *   x none currently enabled
+   *  Special input characters (c_cc):
+   *   - VTIME = 0: Don't want to use any character timer
+   *   - VMIN = 1: Must read 1 character before a read is satisfied
+   */
+  
+  log << "serialTransport::open(): setting up new termios struct."
+          << endl;
+  
+  /* Clearing "newtio", just in case */
+  memset( &newtio, 0x00, sizeof(newtio) );
+  
+  /* Setting option flags */
+  newtio.c_cflag = CS8 | CLOCAL | CREAD;  // control flags
+  newtio.c_iflag = IGNPAR | IGNBRK;       // input flags
+  newtio.c_oflag = 0;                     // output flags
+  newtio.c_lflag = 0;                     // local flags
+
+  newtio.c_cc[VTIME]    = 0;  // Special input characters
+  newtio.c_cc[VMIN]     = 1;
+  
+  /* Setting input & output baud rate */
+  if( cfsetospeed(&newtio, BAUDRATE) != 0 ||
+      cfsetispeed(&newtio, BAUDRATE) != 0 )
+  {
+    log << "serialTransport::open():"
+	        << "Error setting baud rate, exiting. " << endl;
+    return false;
+  }
+  
+  /* Flush unsent data:
+   *  - TCIFLUSH: Flush input data that has been recieved by the system but
+   *     has not yet been processed.
+   *
+   * Then check for errors:
+   *  - If successful, tcflush() returns 0.
+   *  - If unsuccessful, tcflush() returns -1 and errno is set
+   */
+   
+  log << "serialTransport::open(): Flushing unsent data" << endl;
+  
+  if ( tcflush(fileDes, TCIFLUSH) != 0 )
+  {
+    log << "serialTransport::open():"
+	        << "Error flushing terminal, exiting. " << endl;
+    return false;
+  }
+  
+  /* Apply changes:
+   *  - TCSANOW: Apply changes immediately
+   *
+   * Then, check for errors:
+   *  - If successsful, tcsetattr() returns 0.
+   *  - If unsuccessful, tcsetattr() returns -1 and errno is set.
+   */
+   
+  log << "serialTransport::open(): Applying new termios settings"
+          << endl;
+		  
+  if ( tcsetattr(fileDes,TCSANOW,&newtio) != 0 )
+  {
+    log << "serialTransport::open():"
+	        << "Error saving new port settings, exiting. " << endl;
+    return false;
+  }
+  
+  /* Modify the file descriptor to make the reads non-blocking */
+  fcntl(fileDes, F_SETFL, O_NONBLOCK);
+  
+  
+  /* Finished setting up new serial port connection. */
+  
+  /* TODO: Query the MCU and make sure it is connected */
+
+  log << "serialTransport::open(): "
+      << "Successfully connected. Returning to calling object" << endl;
+  
+  return true;
+}
+
+/* bool serialTransport::adopt( const int descriptor, ostream &log )
+ *
+ * The port is already configured and may be mid-conversation, so nothing
+ *  is flushed or set beyond making reads non-blocking. The settings from
+ *  before the first daemon opened the port are long gone; the ones in
+ *  force now are what close() will restore.
+ */
+bool serialTransport::adopt( const int descriptor, ostream &log )
+{
+  log << "serialTransport::adopt(): Taking over descriptor " << descriptor
+      << endl;
+
+  if( tcgetattr( descriptor, &oldtio ) != 0 )
+  {
+    log << "serialTransport::adopt(): Descriptor " << descriptor
+        << " is not a terminal, refusing it." << endl;
+    return false;
+  }
+
+  newtio = oldtio;
+  fileDes = descriptor;
+  fcntl( fileDes, F_SETFL, fcntl( fileDes, F_GETFL ) | O_NONBLOCK );
+
+  return true;
+}
+
+/* void serialTransport::close()
+ *  - Loads the old termios settings
+ *  - Closes the terminal connection
+ */
+void serialTransport::close()
+{
+  if( fileDes < 0 )
+    return;
+
+  tcsetattr(fileDes,TCSANOW,&oldtio);
+  ::close(fileDes);
+  fileDes = -1;
+}
@@ -0,0 +1,123 @@
+#ifndef SERIALTRANSPORT
+#define SERIALTRANSPORT
+
+#include <stdint.h>
+#include <unistd.h>
+#include <poll.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <ostream>
+
+#define DRAIN_POLL 2000
+
+using namespace std;
+
+/******************************************************************************\
+ * Transports for basicSodaMachine's TRANSPORT template argument: how bytes
+ * get to and from the MCU. The argument is resolved at compile time, so the
+ * serial port pays nothing for the choice.
+ *
+ * A transport provides:
+ *
+ * - bool open( ostream &log )
+ *       Connects. Returns false on failure, having said why in the log.
+ *
+ * - bool adopt( const int descriptor, ostream &log )
+ *       Takes over a connection another process opened and handed over
+ *       (see daemonHandoff.h), leaving its settings alone. Returns false
+ *       if the transport has no descriptor to adopt.
+ *
+ * - void close()
+ *
+ * - ssize_t send( const void *buf, const size_t length, const int64_t now )
+ *       Writes bytes to the MCU, returning the count written.
+ *
+ * - ssize_t receive( void *buf, const size_t length, const int64_t now )
+ *       Reads what has arrived without waiting. Returns 0 if nothing has.
+ *
+ * - template< class CLOCK > bool waitReadable( CLOCK &clock, int64_t deadline )
+ *       Waits until there is something to receive() or the deadline (on
+ *       the clock's time base) passes. Returns false at the deadline.
+ *
+ * - void flushInput( const int64_t now )
+ *       Discards bytes that have arrived but not been received.
+ *
+ * - size_t outputQueued( const int64_t now )
+ *       Bytes sent but still waiting to go out on the wire (TIOCOUTQ).
+ *
+ * - template< class CLOCK > bool waitDrained( CLOCK &clock, size_t queued,
+ *                                            int64_t deadline )
+ *       Waits until no more than queued bytes are left to go out, or the
+ *       deadline passes. Returns false at the deadline.
+ *
+ * serialTransport: The MCU on the serial port DEVICE at BAUDRATE, set up
+ *  for raw 8N1 and non-blocking reads.
+ *
+ * loopbackTransport (loopbackTransport.h): An mcuModel in the same
+ *  process.
+ \*****************************************************************************/
+
+class serialTransport
+{
+  public:
+    serialTransport();
+
+    bool open( ostream &log );
+    bool adopt( const int descriptor, ostream &log );
+    void close();
+
+    ssize_t send( const void *buf, const size_t length, const int64_t )
+      { return write( fileDes, buf, length ); };
+    ssize_t receive( void *buf, const size_t length, const int64_t )
+    {
+      ssize_t result = read( fileDes, buf, length );
+      return result < 0 ? 0 : result;
+    };
+    void flushInput( const int64_t ) { tcflush( fileDes, TCIFLUSH ); };
+    size_t outputQueued( const int64_t ) const
+    {
+      int queued = 0;
+      return ioctl( fileDes, TIOCOUTQ, &queued ) == 0 && queued > 0 ?
+             (size_t)queued : 0;
+    };
+
+    template< class CLOCK >
+    bool waitReadable( CLOCK &clock, const int64_t deadline )
+    {
+      struct pollfd port;
+      int64_t left = deadline - clock.now();
+
+      if( left <= 0 )
+        return false;
+
+      port.fd = fileDes;
+      port.events = POLLIN;
+      port.revents = 0;
+      return poll( &port, 1, (int)( ( left + 999 ) / 1000 ) ) > 0;
+    };
+
+    /* The kernel says nothing when its queue shrinks, so look every
+     *  DRAIN_POLL microseconds, a byte at 4800 baud */
+    template< class CLOCK >
+    bool waitDrained( CLOCK &clock, const size_t queued, const int64_t deadline )
+    {
+      while( outputQueued( 0 ) > queued )
+      {
+        int64_t now = clock.now();
+        if( now >= deadline )
+          return false;
+        clock.sleepUntil( now + DRAIN_POLL < deadline ? now + DRAIN_POLL :
+                                                        deadline );
+      }
+      return true;
+    };
+
+    int descriptor() const { return fileDes; };
+
+  private:
+    int fileDes;
+    termios oldtio;
+    termios newtio;
+};
+
+#endif
@@ -0,0 +1,224 @@
+#include "slotSelector.h"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <sys/stat.h>
+
+using namespace std;
+
+slotSelector::slotSelector()
+{
+  slotScore unused = { -1, 0, 0, 0 };
+
+  scores.assign( sodaMachine::geometry::slotCount, unused );
+  stocked.set();
+  nextProbe = INT64_MAX;
+  loaded = -1;
+}
+
+/* bool slotSelector::load( const char *path )
+ *
+ * Products keep the slot they chose last, so a reload with the same
+ *  columns does not restart the rotation.
+ */
+bool slotSelector::load( const char *path )
+{
+  ifstream file( path );
+  struct stat status;
+  unordered_map<string, int> newNames;
+  vector<productSlots> newMapped;
+  string line;
+
+  if( !file || stat( path, &status ) != 0 )
+    return false;
+
+  for( size_t slot = 0; slot < scores.size(); slot++ )
+    scores[slot].product = -1;
+
+  while( getline( file, line ) )
+  {
+    istringstream fields( line.substr( 0, line.find( '#' ) ) );
+    string name;
+    long slot;
+
+    if( !( fields >> name ) )
+      continue;
+
+    unordered_map<string, int>::iterator found = newNames.find( name );
+    if( found == newNames.end() )
+    {
+      productSlots product;
+      unordered_map<string, int>::iterator old = names.find( name );
+
+      product.last = old != names.end() ? mapped[ old->second ].last :
+                     scores.size() - 1;
+      found = newNames.insert( make_pair( name, (int)newMapped.size() ) ).first;
+      newMapped.push_back( product );
+    }
+
+    while( fields >> slot )
+    {
+      if( slot < 0 || slot >= (long)scores.size() )
+        continue;
+      if( scores[slot].product >= 0 )
+        newMapped[ scores[slot].product ].slots.reset( slot );
+      scores[slot].product = found->second;
+      newMapped[ found->second ].slots.set( slot );
+    }
+  }
+
+  names.swap( newNames );
+  mapped.swap( newMapped );
+  loaded = (int64_t)status.st_mtim.tv_sec * 1000000000 + status.st_mtim.tv_nsec;
+
+  slow.reset();
+  for( size_t product = 0; product < mapped.size(); product++ )
+    rank( product );
+  return true;
+}
+
+/* bool slotSelector::reload( const char *path )
+ */
+bool slotSelector::reload( const char *path )
+{
+  struct stat status;
+
+  if( stat( path, &status ) != 0 ||
+      (int64_t)status.st_mtim.tv_sec * 1000000000 + status.st_mtim.tv_nsec ==
+      loaded )
+    return false;
+  return load( path );
+}
+
+/* int slotSelector::choose( const string &product, const int64_t now )
+ */
+int slotSelector::choose( const string &product, const int64_t now )
+{
+  unordered_map<string, int>::iterator found = names.find( product );
+
+  if( found == names.end() )
+    return SELECT_UNKNOWN;
+
+  productSlots &chosen = mapped[ found->second ];
+  inventory candidates = chosen.slots & stocked;
+  inventory healthy = candidates & ~jammed;
+
+  if( candidates.none() )
+    return SELECT_SOLD_OUT;
+  if( ( healthy & ~slow ).any() )
+    return rotate( chosen, healthy & ~slow );
+  if( healthy.any() )
+    return rotate( chosen, healthy );
+
+  cool( now );
+  if( ( candidates & ~cooling ).any() )
+    return rotate( chosen, candidates & ~cooling );
+  return SELECT_JAMMED;
+}
+
+/* bool slotSelector::offers( const string &product, const unsigned slot )
+ */
+bool slotSelector::offers( const string &product, const unsigned slot ) const
+{
+  unordered_map<string, int>::const_iterator found = names.find( product );
+
+  return found != names.end() && slot < scores.size() &&
+         mapped[ found->second ].slots.test( slot );
+}
+
+/* void slotSelector::finished( slot, result, latency, now )
+ *
+ * An empty slot (result 1) says nothing about the column: the inventory
+ *  takes care of it.
+ */
+void slotSelector::finished( const unsigned slot, const int result,
+                             const int64_t latency, const int64_t now )
+{
+  if( slot >= scores.size() )
+    return;
+
+  slotScore &score = scores[slot];
+
+  if( result == 0 )
+  {
+    score.failures = 0;
+    jammed.reset( slot );
+    cooling.reset( slot );
+    score.latency += score.latency == 0 ? latency :
+                     ( latency - score.latency ) / 8;
+    rank( score.product );
+  }
+  else if( result == -1 )
+  {
+    score.failed = now;
+    if( ++score.failures >= JAM_FAILURES )
+    {
+      jammed.set( slot );
+      cooling.set( slot );
+      nextProbe = min<int64_t>( nextProbe, now + JAM_PROBE );
+    }
+  }
+}
+
+/* int slotSelector::rotate( productSlots &product, candidates )
+ *
+ * The first candidate after the slot the product chose last, or else the
+ *  first one, found a word at a time.
+ */
+int slotSelector::rotate( productSlots &product, const inventory &candidates )
+{
+  size_t slot = candidates._Find_next( product.last );
+
+  if( slot >= candidates.size() )
+    slot = candidates._Find_first();
+  if( slot >= candidates.size() )
+    return SELECT_SOLD_OUT;
+  product.last = slot;
+  return slot;
+}
+
+/* void slotSelector::cool( const int64_t now )
+ *
+ * Takes the jammed slots due a probe out of cooling, once the first of
+ *  them is: only the cooling slots are looked at, and only then.
+ */
+void slotSelector::cool( const int64_t now )
+{
+  if( now < nextProbe )
+    return;
+
+  nextProbe = INT64_MAX;
+  for( size_t slot = cooling._Find_first(); slot < cooling.size();
+       slot = cooling._Find_next( slot ) )
+    if( scores[slot].failed + JAM_PROBE <= now )
+      cooling.reset( slot );
+    else
+      nextProbe = min<int64_t>( nextProbe, scores[slot].failed + JAM_PROBE );
+}
+
+/* void slotSelector::rank( const int product )
+ *
+ * Marks the product's slots that are over SLOW_FACTOR times as slow as its
+ *  fastest one. Slots not vended from yet are not slow.
+ */
+void slotSelector::rank( const int product )
+{
+  int64_t fastest = 0;
+
+  if( product < 0 )
+    return;
+
+  const inventory &slots = mapped[product].slots;
+
+  for( size_t slot = slots._Find_first(); slot < slots.size();
+       slot = slots._Find_next( slot ) )
+    if( scores[slot].latency > 0 &&
+        ( fastest == 0 || scores[slot].latency < fastest ) )
+      fastest = scores[slot].latency;
+
+  for( size_t slot = slots._Find_first(); slot < slots.size();
+       slot = slots._Find_next( slot ) )
+    slow[slot] = scores[slot].latency > SLOW_FACTOR * fastest &&
+                 fastest > 0;
+}
@@ -0,0 +1,131 @@
+#ifndef SLOTSELECTOR
+#define SLOTSELECTOR
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "sodaMachine.h"
+
+using namespace std;
+
+/******************************************************************************\
+ * slotSelector class: Picks the slot to vend a product from, so that
+ *                     clients can ask sodaDaemon for "a coke" instead of
+ *                     looking up a slot in the database first.
+ *
+ * The products come from a map file, one product per line:
+ *
+ *     <product> <slot> [<slot>...]
+ *
+ * ('#' starts a comment) which the web front end writes whenever its
+ * inventory table changes. A slot belongs to at most one product; a later
+ * line takes it over.
+ *
+ * Each product keeps a slot mask. choose() intersects it with the stocked
+ * slots (the daemon's inventory bitmask) and with the healthy ones, and
+ * takes the first candidate after the one it chose last, so a product's
+ * columns empty evenly instead of lowest slot first. The masks are all
+ * bitsets, and the rotation finds the next candidate a word at a time
+ * (_Find_next(), then _Find_first() to wrap), so choosing costs a few
+ * word operations whatever slotCount is, with no lookup beyond the
+ * product's name.
+ *
+ * Slots are ranked, and the first rank with a stocked slot is used:
+ *
+ * 1. healthy: not jammed and not slow
+ * 2. slow: the latency average is over SLOW_FACTOR times the fastest slot
+ *    of the same product
+ * 3. jammed: JAM_FAILURES vends in a row the MCU did not confirm. A
+ *    jammed slot is given one more try (probed) JAM_PROBE microseconds
+ *    after its last failure; a confirmed vend clears it. Jammed slots not
+ *    yet due a probe are a mask too (cooling), looked at again only once
+ *    the earliest of them comes due.
+ *
+ * Latencies are averaged like rttEstimator, moving 1/8 of the way to each
+ * sample.
+ *
+ * Functions:
+ *
+ * - bool load( const char *path )
+ *       Reads the map file, replacing the products (but not the slot
+ *       scores). Returns false, keeping the old map, if it cannot be read.
+ *
+ * - bool reload( const char *path )
+ *       load() if the file changed since it was last loaded.
+ *
+ * - void stock( const inventory &bits )
+ *       The slots that have cans, as last read from the MCU. All slots
+ *       count as stocked until this is called.
+ *
+ * - int choose( const string &product, const int64_t now )
+ *       The slot to vend, or SELECT_SOLD_OUT when none of the product's
+ *       slots are stocked, SELECT_JAMMED when the stocked ones are all
+ *       jammed and none is due a probe, or SELECT_UNKNOWN for a product
+ *       not in the map.
+ *
+ * - bool offers( const string &product, const unsigned slot )
+ *       True if the slot holds the product.
+ *
+ * - void finished( slot, result, latency, now )
+ *       A vend from the slot returned result (vendSoda()'s) after latency
+ *       microseconds on the link.
+ \*****************************************************************************/
+
+#define SELECT_SOLD_OUT -1
+#define SELECT_UNKNOWN -2
+#define SELECT_JAMMED -3
+
+#define JAM_FAILURES 2               // unconfirmed vends in a row
+#define JAM_PROBE 600000000LL        // microseconds before a jammed slot is tried
+#define SLOW_FACTOR 2
+
+class slotSelector
+{
+  public:
+    typedef sodaMachine::inventory inventory;
+
+    slotSelector();
+
+    bool load( const char *path );
+    bool reload( const char *path );
+    void stock( const inventory &bits ) { stocked = bits; };
+    int choose( const string &product, const int64_t now );
+    bool offers( const string &product, const unsigned slot ) const;
+    void finished( const unsigned slot, const int result,
+                   const int64_t latency, const int64_t now );
+    size_t products() const { return names.size(); };
+
+  private:
+    struct productSlots
+    {
+      inventory slots;
+      unsigned last;                 // slot chosen last
+    };
+
+    struct slotScore
+    {
+      int product;                   // index into mapped, -1 for none
+      unsigned failures;             // unconfirmed vends in a row
+      int64_t failed;                // when the last one was
+      int64_t latency;               // average, 0 before the first vend
+    };
+
+    int rotate( productSlots &product, const inventory &candidates );
+    void rank( const int product );
+    void cool( const int64_t now );
+
+    unordered_map<string, int> names;
+    vector<productSlots> mapped;
+    vector<slotScore> scores;
+    inventory stocked;
+    inventory jammed;
+    inventory cooling;               // jammed and not yet due a probe
+    int64_t nextProbe;               // when the first of cooling is due
+    inventory slow;
+    int64_t loaded;                  // the map file's mtime, nanoseconds
+};
+
+#endif
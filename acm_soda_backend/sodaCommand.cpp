@@ -121,20 +121,17 @@ void showButtonInput( sodaMachine &acmSoda )
 /* showSodaInventory: Terminal interface for sodaMachine::getSodaInventory */
 void showSodaInventory( sodaMachine &acmSoda )
 {
-  int sodaInventory;
+  sodaMachine::inventory sodaInventory;
   
   cout << "Checking the soda machine's inventory now ... " << endl;
 			 
   sodaInventory = acmSoda.getSodaInventory();
       
-  cout << "Integer output of getSodaInventory:" << sodaInventory << endl
+  cout << "Bit output of getSodaInventory:" << sodaInventory << endl
        << "Formatted for human convenience: ";
       
-  for( short i = 0; i < 8; ++i )
-  {
-    cout << ( ( sodaInventory & 0x01 ) ? 'X' : '0' );
-    sodaInventory >>= 1;
-  }
+  for( size_t i = 0; i < sodaInventory.size(); ++i )
+    cout << ( sodaInventory.test( i ) ? 'X' : '0' );
   cout << endl;
 		
   cout << "Finished checking the machine's inventory." << endl;
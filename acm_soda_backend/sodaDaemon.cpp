@@ -1,34 +1,326 @@
 /* sodaDaemon.cpp
  *
- * Spawns a daemon process that uses pipes to fetch vending information
- *  and send it to the microcontroller. Can only vend a soda. Cannot
- *  receive any data from the MCU
+ * Spawns a daemon process that takes vend requests from clients and
+ *  sends them to the microcontroller.
+ *
+ * Clients connect to the Unix socket SOCKET_NAME and send one request per
+ *  line:
+ *
+ *    V <slot> [client=<name>] [deadline=<ms>] [key=<token>]
+ *    P <product> [client=<name>] [deadline=<ms>] [key=<token>]
+ *    M <slot> [<slot>...] [client=<name>] [deadline=<ms>] [key=<token>]
+ *
+ *  and get back one line per request, or for M one per slot:
+ *
+ *    <result>          vendSoda()'s return value
+ *    <result> slot=<n> the same for P, and the slot it came from; for M,
+ *                      the slot it answers for
+ *    BUSY <ms>         not accepted, retry after <ms> milliseconds (for M,
+ *                      followed by slot=<n>)
+ *    EXPIRED           not vended before the deadline
+ *    ERR <reason>      malformed request
+ *
+ *  Clients are named by their uid, "uid1000"; client= names a part of
+ *  it, "uid1000/web", which admission treats as a client of its own, up
+ *  to 16 names per uid at a time (beyond them, new names share one).
+ *  Requests pass through admissionControl: each client is rate limited,
+ *  the waiting queue is bounded, and clients are served round-robin.
+ *  A request not vended within deadline= milliseconds of arriving (or -d,
+ *  if it does not say) is dropped rather than vended late.
+ *
+ *  A request with key= can be sent again, on the same connection or a
+ *  new one, as often as the client likes: while it waits, the retry waits
+ *  for the same vend, and once it is done the retry gets the same answer,
+ *  for -k seconds and across restarts (see idempotencyCache.h). So a
+ *  client may time out after a few seconds and retry instead of waiting
+ *  out the slowest vend. Tokens are up to 47 of [A-Za-z0-9_.:-].
+ *
+ *  M vends a batch, up to 16 slots: each goes through admission like a V
+ *  of its own, and its line comes back as soon as its can has dropped,
+ *  so the lines of a batch come in the order the vends finish. With -l
+ *  the MCU runs up to that many motors at once (see
+ *  sodaMachine::setMotorLimit()), so a batch from different slots takes
+ *  about as long as its slowest vend; without it, or with firmware that
+ *  cannot, its vends run one after another. key= names the whole line:
+ *  sent again, it retries every vend in it.
+ *
+ *  P vends a product from whichever of its slots slotSelector picks: one
+ *  with cans, avoiding jammed and slow columns, in rotation. Products are
+ *  read from PRODUCTS_NAME (or -m), which is reloaded when it changes. A
+ *  product with no cans left answers "1", like an empty slot; one whose
+ *  slots are all jammed answers "-1", like a vend the MCU did not confirm.
+ *
+ * Anyone may also subscribe to events on EVENTS_NAME instead of polling
+ *  (see eventBus.h):
+ *
+ *    inventory all <0|1 per slot>   the whole inventory, when first read
+ *    inventory <slot> <0|1>         a slot filled or emptied
+ *    vend started <slot> <client>
+ *    vend completed <slot> <client> <result|EXPIRED>
+ *    button <n>
+ *    link up, link down
+ *
+ *  Inventory changes come from the background refresh and from vends
+ *  finding a slot empty, so subscribers cost no extra link commands.
+ *  Buttons are only polled, in the background, while someone subscribes
+ *  to them. With -p the MCU pushes presses and inventory changes itself
+ *  and nothing is polled: the serial port is watched along with the
+ *  sockets, so a press reaches subscribers as soon as its frame is in.
+ *
+ * sodaDaemon -u upgrades a running daemon without failing a vend: the new
+ *  process connects to the old one's control socket CONTROL_NAME and
+ *  takes over its serial port, sockets, pipe, clients, subscribers and
+ *  queued requests (see daemonHandoff.h), then reports how long nothing was served.
+ *
+ * The daemon keeps its state in CHECKPOINT_NAME (see stateCheckpoint.h):
+ *  the last inventory, per-slot counters, the queued requests and the
+ *  link's round-trip estimates. A daemon started after a crash or reboot
+ *  answers from that inventory at once, and checks it with the MCU in the
+ *  background. Queued requests with a key are vended, and their clients
+ *  get the result by retrying with the key; those without one are
+ *  dropped, since nobody is left to answer.
+ *
+ * With -t the daemon runs SCHED_FIFO at that priority, with its memory
+ *  faulted in and locked first (see realTime.h), so that a busy host does
+ *  not delay serial replies; -c also pins it to one CPU.
+ *
+ * With -j the clients are served by that many front-end threads (see
+ *  frontEnd.h): they read and decode request lines and write answers,
+ *  and the main loop, which alone touches the sodaMachine, admits and
+ *  vends what they post to it. Without -j the main loop serves clients
+ *  itself. Either way a vend takes the same steps, from its request line
+ *  to its answer: vendPath's (see vendPath.h), which vendPathBench runs
+ *  too.
+ *
+ * A slot reads empty only once the last -f inventories from the MCU (3
+ *  by default, see sodaMachine::sensorHistory()) all say so, so a can
+ *  sensor that drops out for one reading neither refuses a vend nor
+ *  tells subscribers the slot emptied. -f 1 trusts every reading. With
+ *  -p there is nothing to filter: the firmware debounces its sensors and
+ *  pushes only changes, and those are used as they come.
+ *
+ * With -w the MCU's retryable vend is used, so a vend whose answer is lost
+ *  on the wire is sent again instead of failing (see sodaMachine.h).
+ *  Batch vends with -l are always retryable.
+ *
+ * Admitted vends go to the sodaMachine's link scheduler one at a time as
+ *  interactive commands; a batch vend is started as soon as it gets
+ *  there if a motor is free, so the next can follow it at once. Every -i seconds the daemon also queues a
+ *  background inventory refresh, which only runs while no vend waits.
+ *
+ * The old pipes are still served as the client "fifo": write a slot number
+ *  to PIPE_IN_NAME and close it, then read "1" (vended) or "0" from
+ *  PIPE_OUT_NAME. An answer the reader is not there for yet is kept and
+ *  the pipe tried again every PIPE_RETRY milliseconds from the main loop,
+ *  for up to PIPE_WAIT, so a slow reader never holds up the link.
  *
  */
 
 #include <fstream>    // stream functions
 #include <cstdlib>    // atoi(), exit()
+#include <cstring>
+#include <cerrno>
+#include <cctype>   // isspace()
+#include <map>
+#include <string>
+#include <vector>
+#include <poll.h>     // poll()
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
 #include <sys/stat.h> // chmod()
+#include <sys/un.h>
 #include <unistd.h>   // fork()
 
 #include "sodaMachine.h"
+#include "admissionControl.h"
+#include "daemonHandoff.h"
+#include "eventBus.h"
+#include "idempotencyCache.h"
+#include "slotSelector.h"
+#include "realTime.h"
+#include "stateCheckpoint.h"
+#include "nodePool.h"
+#include "allocationCounter.h"
+#include "frontEnd.h"
+#include "vendPath.h"
 
 #define PIPE_IN_NAME "pipes/vendsodain"
-#define PIPE_OUT_NAME "pipes/vendsodaout"
+#define SOCKET_NAME "pipes/vendsoda.sock"
+#define CONTROL_NAME "pipes/vendsoda.ctl"
+#define EVENTS_NAME "pipes/vendsoda.events"
 #define LOG_NAME "log/vendsoda.log"
+#define KEYS_NAME "log/vendkeys"
+#define PRODUCTS_NAME "pipes/vendsoda.products"
+#define CHECKPOINT_NAME "log/vendsoda.state"
+
+/* Admission control defaults, see -r, -b and -q */
+#define CLIENT_RATE 0.2      // vends per second per client
+#define CLIENT_BURST 3       // vends a client may make back to back
+#define MAX_QUEUE 16         // vends waiting across all clients
+
+/* Link scheduler defaults, see -d and -i */
+#define VEND_DEADLINE 0      // milliseconds, 0 for none
+#define INVENTORY_REFRESH 60 // seconds between background refreshes
+#define BUTTON_WATCH 5000    // milliseconds per background button poll
+
+/* Idempotency keys, see -k */
+#define KEY_TTL 600          // seconds a finished key is remembered
+#define KEY_CAPACITY 4096    // keys remembered at most
+
+#define PRODUCTS_CHECK 1000000 // microseconds between looks at the product map
+
+/* Queued requests older than this are not restored from the checkpoint */
+#define RESTORE_AGE 60000000   // microseconds
+
+#define POLL_RESERVE 64      // descriptors polled without growing, with -t
+
+/* Table entries before the connections' pool needs another slab */
+#define CONNECTION_NODES 64
+
+/* Vends after which one that allocates is logged (see allocationCounter.h) */
+#define ALLOCATION_WARMUP 16
+
+#define RESTORED_CONNECTION ( (unsigned long)-1 ) // nobody, after a restart
+#define HANDOFF_TIMEOUT 10000 // milliseconds for the new daemon to take over
+#define FIXED_POLLED 6       // listener, pipeIn, control, events, serial,
+                             //  front-end requests
 
 using namespace std;
 
-int main()
+int64_t monotonicNow();
+void restoreState( stateCheckpoint &checkpoint, sodaMachine &acmSoda,
+                   admissionControl &admission, idempotencyCache &keys,
+                   vendPath &path, const bool backlog );
+void saveLink( stateCheckpoint &checkpoint, sodaMachine &acmSoda );
+void acceptClient( const int listener, connectionTable &connections,
+                   unsigned long &nextConnection );
+bool readClient( const unsigned long id, clientConnection &connection,
+                 vendPath &path );
+int openPipeIn();
+int listenOn( const char *name, const mode_t mode );
+bool upgradeRequested( const int channel );
+bool handOver( const int channel, const handoffState &state );
+int takeOver( handoffState &state );
+
+int main(int argc, char *argv[])
 {
-  char slotChoice[256];
-  fstream vendPipeIn;
-  fstream vendPipeOut;
-
-  //pid_t processID, sessionID;
-  
-  bool vendSuccess;
-  
+  char option;
+  double clientRate = CLIENT_RATE;
+  double clientBurst = CLIENT_BURST;
+  size_t maxQueue = MAX_QUEUE;
+  long defaultDeadline = VEND_DEADLINE;
+  int64_t refreshInterval = INVENTORY_REFRESH * 1000000LL;
+  int64_t keyTtl = KEY_TTL * 1000000LL;
+  const char *productsName = PRODUCTS_NAME;
+  int realTimePriority = 0;
+  int cpu = -1;
+  unsigned frontThreads = 0;
+  unsigned motorLimit = 0;
+  size_t sensorSamples = 0;
+  int64_t nextRefresh;
+  int64_t nextProductsCheck = 0;
+  linkResult done;
+  int listener;
+  int control;
+  int events;
+  int pipeIn;
+  string pipeBuffer;
+  bool upgrading = false;
+  bool sequencedVends = false;
+  bool pushedEvents = false;
+  int handoffChannel = -1;
+  handoffState handoff;
+  nodePool connectionNodes( CONNECTION_NODES );
+  connectionTable connections( ( less<unsigned long>() ),
+                     poolAllocator<connectionEntry>( &connectionNodes ) );
+  unsigned long nextConnection = FIFO_CONNECTION + 1;
+  vector<struct pollfd> polled;
+  vector<unsigned long> polledIds;
+  vector<int> polledSubscribers;
+  vendRequest posted;
+  size_t eventBacklog = EVENT_BACKLOG;
+  unsigned long buttonWatch = 0;
+  sodaMachine::pushedEvent pushed;
+  unsigned long vendsDone = 0;
+  unsigned long allocationsBefore = 0;
+
+  while( ( option = getopt(argc, argv, "r:b:q:d:i:e:k:m:t:c:j:l:f:wpu") ) != -1 )
+  {
+    switch( option )
+    {
+      case 'r':
+        clientRate = atof( optarg );
+        break;
+      case 'b':
+        clientBurst = atof( optarg );
+        break;
+      case 'q':
+        maxQueue = atoi( optarg );
+        break;
+      case 'd':
+        defaultDeadline = atoi( optarg );
+        break;
+      case 'i':
+        refreshInterval = atoi( optarg ) * 1000000LL;
+        break;
+      case 'e':
+        eventBacklog = atoi( optarg );
+        break;
+      case 'k':
+        keyTtl = atoi( optarg ) * 1000000LL;
+        break;
+      case 'm':
+        productsName = optarg;
+        break;
+      case 't':
+        realTimePriority = atoi( optarg );
+        break;
+      case 'c':
+        cpu = atoi( optarg );
+        break;
+      case 'j':
+        frontThreads = atoi( optarg );
+        break;
+      case 'l':
+        motorLimit = atoi( optarg );
+        break;
+      case 'f':
+        sensorSamples = atoi( optarg );
+        break;
+      case 'w':
+        sequencedVends = true;
+        break;
+      case 'p':
+        pushedEvents = true;
+        break;
+      case 'u':
+        upgrading = true;
+        break;
+      default:
+        cerr << "Usage: sodaDaemon [-r vends/second per client] "
+             << "[-b burst per client] [-q max queued vends] "
+             << "[-d default deadline ms] [-i inventory refresh seconds] "
+             << "[-e events a subscriber may fall behind] "
+             << "[-k seconds a finished key is remembered] "
+             << "[-m product map file] "
+             << "[-t real-time priority [-c CPU to run on]] "
+             << "[-j front-end threads] "
+             << "[-l motors batch vends may run at once] "
+             << "[-f inventories a slot must read empty in] "
+             << "[-w MCU firmware has retryable vends] "
+             << "[-p MCU firmware pushes events] "
+             << "[-u take over from the running daemon]" << endl;
+        exit( EXIT_FAILURE );
+    }
+  }
+
+  admissionControl admission( clientRate, clientBurst, maxQueue );
+  idempotencyCache keys( KEY_CAPACITY, keyTtl );
+  slotSelector selector;
+  eventBus bus( eventBacklog );
+  stateCheckpoint checkpoint( sodaMachine::geometry::slotCount );
+
   /* Spawn the daemon process and kill the parent
    *
    * If successful, fork():
@@ -38,7 +330,7 @@ int main()
    * If unsuccessful, fork():
    *  - fails to create a child process
    *  - returns a value of -1 (to the parent)
-   *  - sets errno 
+   *  - sets errno
    *
    * TODO: There is no error checking implemented at the moment. This is the bare
    *  minimum to spawn a child process then kill the parent.
@@ -47,7 +339,7 @@ int main()
    */
   if (fork() != 0)
     exit(0);
-  
+
   /* Set up file IO options
    *
    * Error checking:
@@ -63,79 +355,671 @@ int main()
    *  process is now a daemon and needs no IO.
    */
   umask(0);
-  
-  setsid(); 
-  
+
+  setsid();
+
   chdir("/");
-  
+
   // TODO: close stdin/stdout/stderr or redirect them; for security reasons
 
-  /* Delete old pipes if they exist:
-   *
-   * If successful: remove() returns 0
-   * If unsuccessful: remove() returns -1 and sets errno
-   *  - returns -1 if the file does not exist!
-   */
-  remove(PIPE_IN_NAME);
-  remove(PIPE_OUT_NAME);
+  /* A client hanging up mid-reply must not kill the daemon */
+  signal( SIGPIPE, SIG_IGN );
 
+  if( upgrading )
+  {
+    /* Everything below is already set up in the running daemon */
+    handoffChannel = takeOver( handoff );
+    listener = handoff.listener;
+    control = handoff.control;
+    events = handoff.events >= 0 ? handoff.events :
+             listenOn( EVENTS_NAME, S_IRWXU|S_IRWXG|S_IRWXO );
+    pipeIn = handoff.pipeIn >= 0 ? handoff.pipeIn : openPipeIn();
+    pipeBuffer = handoff.pipeBuffer;
+    nextConnection = handoff.nextConnection;
+  }
+  else
+  {
+    /* Delete old pipes if they exist:
+     *
+     * If successful: remove() returns 0
+     * If unsuccessful: remove() returns -1 and sets errno
+     *  - returns -1 if the file does not exist!
+     */
+    remove(PIPE_IN_NAME);
+    remove(PIPE_OUT_NAME);
+    remove(SOCKET_NAME);
+    remove(CONTROL_NAME);
+    remove(EVENTS_NAME);
 
-  /* Making pipes with the following permissions:
-   *  - S_IRWXU - Gives read, write, search, and execute permissions
-   *     to the file owner -- the user who started this daemon.
-   *
-   * using chmod() to change the mode of the pipe:
-   *  - S_IRWXU - Same as above (FIXME: pointlessly redundant?)
-   *  - S_IROTH - Read permission for users other than the file owner.
-   *
-   * If successful: mkfifo() and chmod() return 0
-   * If unsuccessful: mkfifo() and chmod() return -1 & set errno
+
+    /* Making pipes with the following permissions:
+     *  - S_IRWXU - Gives read, write, search, and execute permissions
+     *     to the file owner -- the user who started this daemon.
+     *
+     * using chmod() to change the mode of the pipe:
+     *  - S_IRWXU - Same as above (FIXME: pointlessly redundant?)
+     *  - S_IROTH - Read permission for users other than the file owner.
+     *
+     * If successful: mkfifo() and chmod() return 0
+     * If unsuccessful: mkfifo() and chmod() return -1 & set errno
+     */
+    mkfifo(PIPE_IN_NAME, S_IRWXU);
+    chmod(PIPE_IN_NAME, S_IRWXU|S_IWOTH);
+
+    mkfifo(PIPE_OUT_NAME, S_IRWXU);
+    chmod(PIPE_OUT_NAME, S_IRWXU|S_IROTH);
+
+    /* Listening socket for clients: anyone who can write to it may connect,
+     *  like PIPE_IN_NAME
+     */
+    listener = listenOn( SOCKET_NAME, S_IRWXU|S_IRWXG|S_IRWXO );
+
+    /* The control socket hands over the serial port: owner only */
+    control = listenOn( CONTROL_NAME, S_IRWXU );
+
+    /* Events are public, like the inventory on the web page */
+    events = listenOn( EVENTS_NAME, S_IRWXU|S_IRWXG|S_IRWXO );
+
+    pipeIn = openPipeIn();
+  }
+
+  // create a connection with the microcontroller, or adopt the old one's
+  sodaMachine acmSoda( upgrading ? handoff.serial : -1 );
+  if( sequencedVends )
+    acmSoda.setSequencedVends( true );
+  if( pushedEvents )
+    pushedEvents = acmSoda.setPushedEvents( true );
+  if( motorLimit > 0 && !acmSoda.setMotorLimit( motorLimit ) )
+    cerr << "sodaDaemon: the MCU cannot run motors at once, batch vends "
+         << "will run one at a time" << endl;
+  if( sensorSamples > 0 &&
+      !acmSoda.sensorHistory().configure( sensorSamples ) )
+    cerr << "sodaDaemon: -f takes 1 to " << FILTER_DEPTH_MAX
+         << " inventories, keeping the default" << endl;
+  nextRefresh = monotonicNow() + refreshInterval;
+
+  /* Read the inventory once now, so that subscribers can be told it */
+  acmSoda.submit( 'S', 0, LINK_BACKGROUND,
+                  refreshInterval > 0 ? nextRefresh : 0 );
+  bus.retain( EVENT_LINK, "link up" );
+  if( !upgrading )
+    bus.publish( EVENT_LINK, "link up" );
+
+  /* The old daemon, if any, has written its last key by now */
+  if( !keys.open( KEYS_NAME ) )
+    cerr << "sodaDaemon: cannot write " << KEYS_NAME
+         << ", idempotency keys will not survive a restart" << endl;
+
+  /* Without it only V works, until the file appears */
+  if( !selector.load( productsName ) )
+    cerr << "sodaDaemon: cannot read " << productsName
+         << ", products cannot be vended" << endl;
+
+  /* With -j, clients are read by threads of their own (started below,
+   *  before real-time mode); answers go to them or to this loop's clients
+   */
+  frontEnd fronts( frontThreads, listener, nextConnection,
+                   sodaMachine::geometry::slotCount );
+  vendPath path( admission, keys, selector, bus, checkpoint, connections,
+                 fronts, defaultDeadline );
+
+  /* Serve from the last known state at once; the refresh queued above
+   *  checks it with the MCU. An upgrade is handed the queue instead.
    */
-  mkfifo(PIPE_IN_NAME, S_IRWXU);
-  chmod(PIPE_IN_NAME, S_IRWXU|S_IWOTH);
+  if( !checkpoint.open( CHECKPOINT_NAME ) )
+    cerr << "sodaDaemon: cannot write " << CHECKPOINT_NAME
+         << ", state will not survive a restart" << endl;
+  else if( checkpoint.restored() )
+    restoreState( checkpoint, acmSoda, admission, keys, path, !upgrading );
+
+  if( upgrading )
+  {
+    for( size_t i = 0; i < handoff.queued.size(); i++ )
+    {
+      admission.restore( handoff.queued[i], monotonicNow() );
+      if( handoff.queued[i].key[0] != '\0' )
+        keys.queued( idempotencyCache::makeKey( handoff.queued[i].client,
+                                                handoff.queued[i].key ),
+                     handoff.queued[i].slot, handoff.queued[i].connection,
+                     idempotencyCache::now() );
+    }
+    for( size_t i = 0; i < handoff.connections.size(); i++ )
+    {
+      clientConnection connection;
+      connection.fd = handoff.connections[i].fd;
+      connection.buffered = min<size_t>( handoff.connections[i].buffer.size(),
+                                         MAX_LINE );
+      memcpy( connection.buffer, handoff.connections[i].buffer.data(),
+              connection.buffered );
+      memcpy( connection.client, handoff.connections[i].client,
+              sizeof(connection.client) );
+      connections[ handoff.connections[i].id ] = connection;
+    }
+    for( size_t i = 0; i < handoff.subscribers.size(); i++ )
+      bus.add( handoff.subscribers[i].fd, handoff.subscribers[i].topics,
+               handoff.subscribers[i].buffer );
+
+    /* The old daemon exits once it hears this */
+    if( write( handoffChannel, "OK\n", 3 ) != 3 )
+      exit( EXIT_FAILURE );
+    close( handoffChannel );
 
-  mkfifo(PIPE_OUT_NAME, S_IRWXU);
-  chmod(PIPE_OUT_NAME, S_IRWXU|S_IROTH);
-  
-  
-  // create a connection with the microcontroller
-  sodaMachine acmSoda;
+    cerr << "sodaDaemon: took over " << handoff.queued.size()
+         << " queued vends, " << handoff.connections.size()
+         << " clients and " << handoff.subscribers.size()
+         << " subscribers, " << monotonicNow() - handoff.stopped
+         << " us without service" << endl;
+  }
+
+  /* Before real-time mode, so that they do not inherit its priority */
+  if( !fronts.start() )
+    exit( EXIT_FAILURE );
+
+  /* Everything the loop needs is set up: from here on it should neither
+   *  page fault nor wait behind normal processes
+   */
+  if( realTimePriority > 0 )
+  {
+    string problems;
 
+    polled.reserve( FIXED_POLLED + POLL_RESERVE );
+    polledIds.reserve( POLL_RESERVE );
+    polledSubscribers.reserve( POLL_RESERVE );
+    if( !enterRealTime( realTimePriority, cpu, RT_HEAP_RESERVE,
+                        RT_STACK_RESERVE, problems ) )
+      cerr << "sodaDaemon: real-time mode is incomplete:\n" << problems;
+  }
 
   /* Main loop:
    *
-   * - Opens a stream to PIPE_IN_NAME
-   *   - fstream::in: only inputs allowed from this stream
-   * - Fetches slotChoice from this stream
-   *
-   * - Sends slotChoice to acmSoda.vendSoda
-   *
-   * - Opens a stream to PIPE_OUT_NAME
-   *   - fstream::out: only outputs allowed to this stream
-   * - Writes the return value of vendSoda to this stream
-   *
-   * - Closes the streams
+   * - Waits for new clients, request lines, and the legacy pipe; waits
+   *    not at all if the link has work
+   * - Passes every complete request line through admission control
+   * - Hands the next admitted request to the link scheduler once it has
+   *    sent the last one, and queues the periodic inventory refresh
+   * - Does one step of link work and answers the client it finished
    */
   while(1)
   {
-    /* Fetch slot choice */
-    vendPipeIn.open(PIPE_IN_NAME, fstream::in);
-    vendPipeIn.getline(slotChoice, 256);
-
-    /* Vend the can */
-    vendSuccess = acmSoda.vendSoda(atoi(slotChoice));
-    
-    /* Write the result of the vend operation */
-    
-    vendPipeOut.open(PIPE_OUT_NAME, fstream::out);
-    vendPipeOut << vendSuccess;
-
-    /* Close streams */
-    vendPipeIn.close();
-    vendPipeOut.flush();
-    vendPipeOut.close();
-    
-    // TODO: figure out how long to sleep()
+    /* What the last vend changed, before waiting */
+    path.commit();
+
+    polled.clear();
+    polledIds.clear();
+    polledSubscribers.clear();
+
+    struct pollfd entry;
+    entry.events = POLLIN;
+    entry.revents = 0;
+
+    entry.fd = fronts.threads() > 0 ? -1 : listener;
+    polled.push_back( entry );
+    entry.fd = pipeIn;
+    polled.push_back( entry );
+    entry.fd = control;
+    polled.push_back( entry );
+    entry.fd = events;
+    polled.push_back( entry );
+    entry.fd = pushedEvents ? acmSoda.getTransport().descriptor() : -1;
+    polled.push_back( entry );
+    entry.fd = fronts.descriptor();
+    polled.push_back( entry );
+
+    for( connectionTable::iterator i = connections.begin();
+         i != connections.end(); ++i )
+    {
+      entry.fd = i->second.fd;
+      polled.push_back( entry );
+      polledIds.push_back( i->first );
+    }
+
+    bus.descriptors( polledSubscribers );
+    for( size_t i = 0; i < polledSubscribers.size(); i++ )
+    {
+      entry.fd = polledSubscribers[i];
+      entry.events = POLLIN | ( bus.backlogged( entry.fd ) ? POLLOUT : 0 );
+      polled.push_back( entry );
+    }
+
+    if( poll( &polled[0], polled.size(),
+              admission.queued() > 0 || acmSoda.pending() > 0 ? 0 :
+              path.pipeWaiting() ? PIPE_RETRY : 1000 ) < 0
+        && errno != EINTR )
+      exit( EXIT_FAILURE );
+
+    path.retryPipe();
+
+    if( polled[0].revents & POLLIN )
+      acceptClient( listener, connections, nextConnection );
+
+    /* Requests the front ends have decoded */
+    if( polled[5].revents & POLLIN )
+      fronts.acknowledge();
+    while( fronts.next( posted ) )
+      path.admitRequest( posted );
+
+    if( polled[3].revents & POLLIN )
+    {
+      int fd = accept4( events, NULL, NULL, SOCK_NONBLOCK );
+      if( fd >= 0 )
+        bus.add( fd );
+    }
+
+    /* Legacy pipe: a request is everything written before the writer
+     *  closes it
+     */
+    if( polled[1].revents & ( POLLIN | POLLHUP ) )
+    {
+      char buf[MAX_LINE];
+      ssize_t length = read( pipeIn, buf, sizeof(buf) );
+
+      if( length > 0 && pipeBuffer.size() < MAX_LINE )
+        pipeBuffer.append( buf, length );
+      else if( length <= 0 )
+      {
+        if( !pipeBuffer.empty() )
+        {
+          char line[MAX_LINE + 3];
+          snprintf( line, sizeof(line), "V %s", pipeBuffer.c_str() );
+          path.handleRequest( line, FIFO_CONNECTION, "fifo" );
+        }
+        pipeBuffer.clear();
+        close( pipeIn );
+        pipeIn = openPipeIn();
+      }
+    }
+
+    /* An upgrade: hand everything over between two link commands, and
+     *  carry on as before if the new daemon does not take it. Running
+     *  batch vends are waited for: their answers would reach the new
+     *  daemon, which would vend them again.
+     */
+    if( ( polled[2].revents & POLLIN ) && acmSoda.motorsRunning() == 0 )
+    {
+      int channel = accept( control, NULL, NULL );
+
+      if( channel >= 0 && upgradeRequested( channel ) )
+      {
+        handoffState state;
+        vendRequest queued;
+
+        /* The front ends' clients go over with the rest, and what they
+         *  had decoded goes through admission first
+         */
+        fronts.stop();
+        while( fronts.next( posted ) )
+          path.admitRequest( posted );
+        fronts.flush();
+
+        state.serial = acmSoda.getTransport().descriptor();
+        state.listener = listener;
+        state.control = control;
+        state.events = events;
+        state.pipeIn = pipeIn;
+        state.pipeBuffer = pipeBuffer;
+        state.nextConnection = max( nextConnection, fronts.nextConnection() );
+        state.stopped = monotonicNow();
+
+        /* Vends given to the link scheduler but not sent go first */
+        path.submitted( state.queued );
+        size_t submitted = state.queued.size();
+        while( admission.next( queued ) )
+          state.queued.push_back( queued );
+
+        for( connectionTable::iterator i =
+             connections.begin(); i != connections.end(); ++i )
+        {
+          handoffConnection connection;
+          connection.id = i->first;
+          connection.fd = i->second.fd;
+          connection.buffer.assign( i->second.buffer, i->second.buffered );
+          connection.topics = 0;
+          memcpy( connection.client, i->second.client,
+                  sizeof(connection.client) );
+          state.connections.push_back( connection );
+        }
+        fronts.handOver( state.connections );
+
+        vector<int> subscribers;
+        bus.descriptors( subscribers );
+        for( size_t i = 0; i < subscribers.size(); i++ )
+        {
+          handoffConnection subscriber;
+          subscriber.id = 0;
+          subscriber.fd = subscribers[i];
+          subscriber.client[0] = '\0';
+          subscriber.buffer = bus.unsent( subscribers[i] );
+          subscriber.topics = bus.topics( subscribers[i] );
+          state.subscribers.push_back( subscriber );
+        }
+
+        if( handOver( channel, state ) )
+          exit( 0 );
+
+        for( size_t i = submitted; i < state.queued.size(); i++ )
+          admission.restore( state.queued[i], monotonicNow() );
+        fronts.start();
+      }
+      if( channel >= 0 )
+        close( channel );
+    }
+
+    for( size_t i = FIXED_POLLED; i < FIXED_POLLED + polledIds.size(); i++ )
+    {
+      if( polled[i].revents == 0 )
+        continue;
+
+      unsigned long id = polledIds[i - FIXED_POLLED];
+      connectionTable::iterator found =
+        connections.find( id );
+
+      if( !readClient( id, found->second, path ) )
+      {
+        close( found->second.fd );
+        connections.erase( found );
+      }
+    }
+
+    for( size_t i = FIXED_POLLED + polledIds.size(); i < polled.size(); i++ )
+    {
+      short revents = polled[i].revents;
+
+      if( revents == 0 )
+        continue;
+      if( ( revents & ( POLLERR | POLLNVAL ) ) ||
+          ( ( revents & ( POLLIN | POLLHUP ) ) && !bus.readable( polled[i].fd ) ) ||
+          ( ( revents & POLLOUT ) && !bus.writable( polled[i].fd ) ) )
+        bus.remove( polled[i].fd );
+    }
+
+    admission.expire( monotonicNow() );
+    keys.expire( idempotencyCache::now() );
+
+    if( monotonicNow() >= nextProductsCheck )
+    {
+      nextProductsCheck = monotonicNow() + PRODUCTS_CHECK;
+      selector.reload( productsName );
+    }
+
+    /* Feed the scheduler one vend at a time */
+    path.startVend( acmSoda );
+
+    /* Nobody waits on a refresh: it is stale by the next one */
+    if( refreshInterval > 0 && monotonicNow() >= nextRefresh )
+    {
+      nextRefresh = monotonicNow() + refreshInterval;
+      acmSoda.submit( 'S', 0, LINK_BACKGROUND, nextRefresh );
+    }
+
+    /* Pushed events, read between link commands */
+    while( acmSoda.nextEvent( pushed ) )
+      if( pushed.kind == 's' )
+      {
+        path.inventory( pushed.bits );
+      }
+      else if( pushed.button >= 0 )
+      {
+        char text[16];
+        snprintf( text, sizeof(text), "button %d", pushed.button );
+        bus.publish( EVENT_BUTTON, text );
+      }
+
+    /* Short polls, resubmitted only when the link is otherwise idle, so
+     *  that a refresh never waits behind one
+     */
+    if( !pushedEvents && ( bus.listening() & EVENT_BUTTON ) &&
+        buttonWatch == 0 && acmSoda.pending() == 0 )
+      buttonWatch = acmSoda.submit( 'B', 0, LINK_BACKGROUND,
+                                    monotonicNow() + BUTTON_WATCH * 1000LL );
+
+    /* Requests admitted above, before the link may take a while */
+    path.commit();
+
+    int64_t start = monotonicNow();
+    if( !acmSoda.service( done ) )
+      continue;
+    saveLink( checkpoint, acmSoda );
+
+    if( done.command == 'S' && done.result == 0 )
+      path.inventory( acmSoda.lastInventory() );
+
+    if( done.id == buttonWatch )
+    {
+      buttonWatch = 0;
+      if( done.result >= 0 )
+      {
+        char text[16];
+        snprintf( text, sizeof(text), "button %d", done.result );
+        bus.publish( EVENT_BUTTON, text );
+      }
+    }
+
+    if( !path.finishVend( done, monotonicNow() - start ) )
+      continue;
+
+    /* From the request line to its answer, a vend should not touch the
+     *  heap once the pools and buffers have grown; say so if one did
+     */
+    if( ++vendsDone > ALLOCATION_WARMUP &&
+        allocationCount() != allocationsBefore )
+      cerr << "sodaDaemon: " << allocationCount() - allocationsBefore
+           << " heap allocations since the vend before vend " << vendsDone
+           << endl;
+    allocationsBefore = allocationCount();
   }
   return 0;
 }
+
+/* restoreState: what the checkpoint kept from the last daemon. The
+ *  inventory is published as if just read, and the queue (if backlog)
+ *  refilled with the requests a client can still collect: those with a
+ *  key that is not already known, not past their deadline nor RESTORE_AGE.
+ */
+void restoreState( stateCheckpoint &checkpoint, sodaMachine &acmSoda,
+                   admissionControl &admission, idempotencyCache &keys,
+                   vendPath &path, const bool backlog )
+{
+  int64_t start = monotonicNow();
+  checkpointLink link;
+  sodaMachine::inventory bits;
+  vector<vendRequest> queued;
+  size_t restored = 0;
+  unsigned long vends = 0;
+
+  if( checkpoint.loadLink( link ) )
+  {
+    acmSoda.roundTrip( 'S' ).resume( link.inventorySmoothed,
+                                     link.inventoryDeviation );
+    acmSoda.roundTrip( 'V' ).resume( link.vendSmoothed, link.vendDeviation );
+  }
+
+  if( checkpoint.loadInventory( bits ) )
+    path.inventory( bits );
+
+  if( backlog )
+    checkpoint.loadBacklog( queued, start, stateCheckpoint::now() );
+  for( size_t i = 0; i < queued.size(); i++ )
+  {
+    vendRequest &request = queued[i];
+    keyText key = idempotencyCache::makeKey( request.client, request.key );
+
+    if( request.key[0] == '\0' ||
+        keys.find( key, idempotencyCache::now() ) != NULL ||
+        ( request.deadline != 0 && request.deadline <= start ) ||
+        start - request.arrival > RESTORE_AGE )
+      continue;
+
+    request.connection = RESTORED_CONNECTION;
+    admission.restore( request, start );
+    keys.queued( key, request.slot, RESTORED_CONNECTION,
+                 idempotencyCache::now() );
+    restored++;
+  }
+
+  for( unsigned slot = 0; slot < sodaMachine::geometry::slotCount; slot++ )
+    vends += checkpoint.counters( slot ).vends;
+
+  cerr << "sodaDaemon: restored state saved "
+       << ( stateCheckpoint::now() - checkpoint.savedAt() ) / 1000000
+       << " s ago: " << ( path.inventoryKnown() ? "inventory, " : "" )
+       << vends << " vends counted, " << restored << " of " << queued.size()
+       << " queued vends, in " << monotonicNow() - start << " us" << endl;
+}
+
+/* saveLink: the round-trip estimates, which only change when a command
+ *  finishes
+ */
+void saveLink( stateCheckpoint &checkpoint, sodaMachine &acmSoda )
+{
+  checkpointLink link;
+
+  link.inventorySmoothed = acmSoda.roundTrip( 'S' ).smoothed();
+  link.inventoryDeviation = acmSoda.roundTrip( 'S' ).deviation();
+  link.vendSmoothed = acmSoda.roundTrip( 'V' ).smoothed();
+  link.vendDeviation = acmSoda.roundTrip( 'V' ).deviation();
+  checkpoint.saveLink( link );
+}
+
+/* monotonicNow: microseconds on a clock that never jumps */
+int64_t monotonicNow()
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* acceptClient: takes a new connection, named by its uid by default */
+void acceptClient( const int listener, connectionTable &connections,
+                   unsigned long &nextConnection )
+{
+  clientConnection connection;
+
+  if( frontEnd::accept( listener, connection ) )
+    connections[ nextConnection++ ] = connection;
+}
+
+/* readClient: reads what a client sent into its buffer and handles each
+ *  complete line there, in place. Returns false when the connection
+ *  should be closed.
+ */
+bool readClient( const unsigned long id, clientConnection &connection,
+                 vendPath &path )
+{
+  ssize_t length = read( connection.fd, connection.buffer + connection.buffered,
+                         MAX_LINE - connection.buffered );
+  char *line = connection.buffer;
+  char *newline;
+
+  if( length == 0 || ( length < 0 && errno != EAGAIN && errno != EINTR ) )
+    return false;
+  if( length < 0 )
+    return true;
+
+  connection.buffered += length;
+
+  while( ( newline = (char *)memchr( line, '\n', connection.buffer +
+                                     connection.buffered - line ) ) != NULL )
+  {
+    *newline = '\0';
+    path.handleRequest( line, id, connection.client );
+    line = newline + 1;
+  }
+
+  connection.buffered -= line - connection.buffer;
+  memmove( connection.buffer, line, connection.buffered );
+
+  /* No request is this long */
+  return connection.buffered < MAX_LINE;
+}
+
+/* openPipeIn: opens the legacy request pipe without waiting for a writer */
+int openPipeIn()
+{
+  return open( PIPE_IN_NAME, O_RDONLY | O_NONBLOCK );
+}
+
+/* listenOn: a listening Unix socket at name, exiting if there cannot be one */
+int listenOn( const char *name, const mode_t mode )
+{
+  struct sockaddr_un address;
+  int fd = socket( AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0 );
+
+  memset( &address, 0x00, sizeof(address) );
+  address.sun_family = AF_UNIX;
+  strncpy( address.sun_path, name, sizeof(address.sun_path) - 1 );
+
+  if( fd < 0 ||
+      bind( fd, (struct sockaddr *)&address, sizeof(address) ) != 0 ||
+      listen( fd, 16 ) != 0 )
+    exit( EXIT_FAILURE );
+  chmod( name, mode );
+
+  return fd;
+}
+
+/* upgradeRequested: true if a control connection from our own user (or
+ *  root) asks for an upgrade
+ */
+bool upgradeRequested( const int channel )
+{
+  struct ucred credentials;
+  socklen_t length = sizeof(credentials);
+  struct pollfd wait = { channel, POLLIN, 0 };
+  char request[16];
+  ssize_t got;
+
+  if( getsockopt( channel, SOL_SOCKET, SO_PEERCRED, &credentials,
+                  &length ) != 0 ||
+      ( credentials.uid != getuid() && credentials.uid != 0 ) )
+    return false;
+
+  if( poll( &wait, 1, HANDOFF_TIMEOUT ) != 1 ||
+      ( got = read( channel, request, sizeof(request) - 1 ) ) <= 0 )
+    return false;
+  request[got] = '\0';
+
+  return strcmp( request, "UPGRADE\n" ) == 0;
+}
+
+/* handOver: sends the state to the new daemon and waits for it to say it
+ *  has taken over. Returns false if it did not, in which case this daemon
+ *  still holds everything and carries on.
+ */
+bool handOver( const int channel, const handoffState &state )
+{
+  struct pollfd wait = { channel, POLLIN, 0 };
+  char answer[4];
+
+  fcntl( channel, F_SETFL, fcntl( channel, F_GETFL ) & ~O_NONBLOCK );
+
+  return sendHandoff( channel, state ) &&
+         poll( &wait, 1, HANDOFF_TIMEOUT ) == 1 &&
+         recv( channel, answer, 3, MSG_WAITALL ) == 3 &&
+         memcmp( answer, "OK\n", 3 ) == 0;
+}
+
+/* takeOver: asks the running daemon for its state. Returns the channel to
+ *  answer it on once this daemon is ready; exits if there is nobody to
+ *  take over from.
+ */
+int takeOver( handoffState &state )
+{
+  struct sockaddr_un address;
+  int channel = socket( AF_UNIX, SOCK_STREAM, 0 );
+
+  memset( &address, 0x00, sizeof(address) );
+  address.sun_family = AF_UNIX;
+  strncpy( address.sun_path, CONTROL_NAME, sizeof(address.sun_path) - 1 );
+
+  if( channel < 0 ||
+      connect( channel, (struct sockaddr *)&address, sizeof(address) ) != 0 ||
+      write( channel, "UPGRADE\n", 8 ) != 8 ||
+      !receiveHandoff( channel, state ) || state.serial < 0 ||
+      state.listener < 0 || state.control < 0 )
+  {
+    cerr << "sodaDaemon: could not take over from the running daemon" << endl;
+    exit( EXIT_FAILURE );
+  }
+
+  return channel;
+}
@@ -0,0 +1,229 @@
+/* sodaJournal.cpp
+ *
+ * Answers questions about the vend journal written by sodaMachine, like
+ * "vends per slot in the last hour", or with -i "which slots had cans",
+ * without grepping vendsoda.log.
+ *
+ * Only the segments covering the requested time range are read; the
+ * journal's time index is used to seek straight to them.
+ *
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <map>
+#include <vector>
+#include <cstdlib>
+#include <ctime>
+#include <unistd.h> // for getopt()
+#include "vendJournal.h"
+
+#define JOURNAL_DIR "log/journal"
+
+using namespace std;
+
+struct vendTotals
+{
+  unsigned long vends;
+  unsigned long succeeded;
+  unsigned long empty;
+  unsigned long failed;
+  unsigned long long duration;
+};
+
+struct queryState
+{
+  bool byHour;
+  vector<vendTotals> slots;
+  map<int64_t, vendTotals> hours;
+  bool inventory;
+  map<uint16_t, int32_t> words;    // last inventory, by its records' first slot
+  int64_t inventoryTime;
+};
+
+void countRecord( const journalRecord &record, void *context );
+void addVend( vendTotals &totals, const journalRecord &record );
+void showTotals( const vendTotals &totals );
+void showInventory( const queryState &state );
+
+int main(int argc, char *argv[])
+{
+  char option;
+  const char *directory = JOURNAL_DIR;
+  int64_t now = vendJournal::now();
+  int64_t start = now - 3600LL * 1000000;
+  int64_t end = now + 1;
+  queryState state;
+  journalReader reader;
+  unsigned long scanned;
+  int64_t queryStart;
+
+  state.byHour = false;
+  state.inventory = false;
+  state.inventoryTime = 0;
+
+  while( ( option = getopt(argc, argv, "d:s:e:l:g:ih") ) != -1 )
+  {
+    switch( option )
+    {
+      case 'd':
+        directory = optarg;
+        break;
+      case 's':
+        start = atoll( optarg ) * 1000000;
+        break;
+      case 'e':
+        end = atoll( optarg ) * 1000000;
+        break;
+      case 'l':
+        start = now - atoll( optarg ) * 1000000;
+        end = now + 1;
+        break;
+      case 'g':
+        state.byHour = ( string( optarg ) == "hour" );
+        break;
+      case 'i':
+        state.inventory = true;
+        break;
+      default:
+        cout << "Usage: sodaJournal [OPTIONS]" << endl
+             << "     -d <dir>                 Journal directory" << endl
+             << "     -s <unix time>           Start of the range" << endl
+             << "     -e <unix time>           End of the range" << endl
+             << "     -l <seconds>             The last <seconds> (default 3600)"
+             << endl
+             << "     -g slot|hour             Group vends by slot or hour"
+             << endl
+             << "     -i                       The last inventory in the range"
+             << endl
+             << "     -h                       See this message" << endl;
+        return 1;
+    }
+  }
+
+  if( !reader.open( directory ) )
+  {
+    cout << "No journal found at " << directory << endl;
+    return 1;
+  }
+
+  queryStart = vendJournal::now();
+  scanned = reader.scan( start, end, countRecord, &state );
+
+  if( state.inventory )
+  {
+    showInventory( state );
+    cout << "Scanned " << scanned << " records in "
+         << ( vendJournal::now() - queryStart ) / 1000.0 << " ms" << endl;
+    return 0;
+  }
+
+  cout << setw(12) << ( state.byHour ? "hour" : "slot" )
+       << setw(10) << "vends" << setw(10) << "ok" << setw(10) << "empty"
+       << setw(10) << "failed" << setw(14) << "avg usec" << endl;
+
+  if( state.byHour )
+  {
+    for( map<int64_t, vendTotals>::const_iterator i = state.hours.begin();
+         i != state.hours.end(); ++i )
+    {
+      time_t hour = i->first * 3600;
+      char label[16];
+      strftime( label, sizeof(label), "%m-%d %H:00", localtime( &hour ) );
+      cout << setw(12) << label;
+      showTotals( i->second );
+    }
+  }
+  else
+  {
+    for( size_t i = 0; i < state.slots.size(); i++ )
+    {
+      if( state.slots[i].vends == 0 )
+        continue;
+      cout << setw(12) << i;
+      showTotals( state.slots[i] );
+    }
+  }
+
+  cout << "Scanned " << scanned << " records in "
+       << ( vendJournal::now() - queryStart ) / 1000.0 << " ms" << endl;
+
+  return 0;
+}
+
+/* countRecord: journalReader visitor, adds each vend to its slot or hour */
+void countRecord( const journalRecord &record, void *context )
+{
+  queryState &state = *(queryState *)context;
+
+  if( record.type == JOURNAL_INVENTORY )
+  {
+    state.words[ record.slot ] = record.value;
+    state.inventoryTime = record.time;
+    return;
+  }
+  if( record.type != JOURNAL_VEND )
+    return;
+
+  if( state.byHour )
+  {
+    addVend( state.hours[ record.time / 1000000 / 3600 ], record );
+    return;
+  }
+
+  if( record.slot >= state.slots.size() )
+  {
+    vendTotals zero = { 0, 0, 0, 0, 0 };
+    state.slots.resize( record.slot + 1, zero );
+  }
+  addVend( state.slots[ record.slot ], record );
+}
+
+/* addVend: folds one vend record into a set of totals */
+void addVend( vendTotals &totals, const journalRecord &record )
+{
+  totals.vends++;
+  if( record.value == 0 )
+    totals.succeeded++;
+  else if( record.value == 1 )
+    totals.empty++;
+  else
+    totals.failed++;
+  totals.duration += record.duration;
+}
+
+/* showTotals: prints the columns of one row of the report */
+void showTotals( const vendTotals &totals )
+{
+  cout << setw(10) << totals.vends << setw(10) << totals.succeeded
+       << setw(10) << totals.empty << setw(10) << totals.failed
+       << setw(14) << ( totals.vends ? totals.duration / totals.vends : 0 )
+       << endl;
+}
+
+/* showInventory: the last inventory recorded, JOURNAL_SLOTS slots a line,
+ *  1 for a slot with cans
+ */
+void showInventory( const queryState &state )
+{
+  time_t when = state.inventoryTime / 1000000;
+  char label[32];
+
+  if( state.words.empty() )
+  {
+    cout << "No inventory in the range" << endl;
+    return;
+  }
+
+  strftime( label, sizeof(label), "%Y-%m-%d %H:%M:%S", localtime( &when ) );
+  cout << "Inventory at " << label << endl;
+  for( map<uint16_t, int32_t>::const_iterator i = state.words.begin();
+       i != state.words.end(); ++i )
+  {
+    cout << setw(5) << i->first << "-" << left << setw(6)
+         << i->first + JOURNAL_SLOTS - 1 << right;
+    for( unsigned bit = 0; bit < JOURNAL_SLOTS; bit++ )
+      cout << ( ( (uint32_t)i->second >> bit ) & 1 );
+    cout << endl;
+  }
+}
@@ -0,0 +1,452 @@
+/* sodaLogIngest.cpp
+ *
+ * Turns years of free-form vendsoda.log output into per-vend records,
+ * written as a compact columnar file.
+ *
+ * Each input log is memory-mapped and cut into one chunk per thread.
+ * Chunks are scanned for line boundaries and for the handful of
+ * sodaMachine::vendSoda() messages that matter, 16 bytes at a time with
+ * SSE2 where available.
+ *
+ * A vend belongs to the chunk holding its "Function called" line; a chunk
+ * reads past its end to finish a vend in progress, and skips the tail of
+ * a vend that started in the previous chunk.
+ *
+ * Lines may carry a leading epoch timestamp ("1287512345.123456 ...", as
+ * written by `ts %.s`); when they do, vends get a start time and duration.
+ *
+ */
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <thread>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h> // for getopt()
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define COLUMN_MAGIC "SODACOL1"
+
+/* Messages as written by sodaMachine, without their "sodaMachine::" part */
+#define VEND_PREFIX      "sodaMachine::vendSoda(): "
+#define VEND_CALLED      "Function called with input"
+#define VEND_EMPTY       "Slot "
+#define VEND_RETURNING   "Reached end of function. Returning "
+#define VEND_EXITING     "Exiting"
+#define CONSTRUCTING     "Constructing a sodaMachine object"
+
+/* Results beyond what vendSoda() itself returns */
+#define RESULT_ABANDONED -3  // the daemon restarted before the vend finished
+
+using namespace std;
+
+struct vendColumns
+{
+  vector<uint16_t> slot;
+  vector<int8_t>   result;
+  vector<int64_t>  time;       // microseconds since the epoch, 0 if unknown
+  vector<uint32_t> duration;   // microseconds, 0 if unknown
+
+  void append( const vendColumns &other );
+};
+
+struct logChunk
+{
+  const char *begin;
+  const char *end;      // vends may be finished past this point
+  const char *limit;    // end of the mapped file
+  vendColumns vends;
+};
+
+void generateLog( const char *name, const unsigned long long bytes );
+bool mapLog( const char *name, const char *&data, size_t &size );
+void scanChunk( logChunk *chunk );
+bool writeColumns( const char *name, const vendColumns &vends );
+double seconds();
+
+int main(int argc, char *argv[])
+{
+  char option;
+  const char *output = "vends.col";
+  unsigned threads = thread::hardware_concurrency();
+  unsigned long long generateBytes = 0;
+  unsigned long long totalBytes = 0;
+  vendColumns vends;
+
+  while( ( option = getopt(argc, argv, "o:j:g:h") ) != -1 )
+  {
+    switch( option )
+    {
+      case 'o':
+        output = optarg;
+        break;
+      case 'j':
+        threads = atoi( optarg );
+        break;
+      case 'g':
+        generateBytes = strtoull( optarg, NULL, 10 ) << 20;
+        break;
+      default:
+        cout << "Usage: sodaLogIngest [OPTIONS] <vendsoda.log> ..." << endl
+             << "     -o <file>                Columnar output (vends.col)"
+             << endl
+             << "     -j <threads>             Scanning threads" << endl
+             << "     -g <MiB>                 Write a synthetic log of <MiB>"
+             << endl
+             << "                              to each input instead" << endl
+             << "     -h                       See this message" << endl;
+        return 1;
+    }
+  }
+
+  if( threads < 1 )
+    threads = 1;
+
+  if( generateBytes > 0 )
+  {
+    for( int i = optind; i < argc; i++ )
+      generateLog( argv[i], generateBytes );
+    return 0;
+  }
+
+  double start = seconds();
+
+  for( int i = optind; i < argc; i++ )
+  {
+    const char *data;
+    size_t size;
+
+    if( !mapLog( argv[i], data, size ) )
+    {
+      cout << "Could not map " << argv[i] << ", skipping" << endl;
+      continue;
+    }
+
+    /* Cut into one chunk per thread, each starting on a line */
+    vector<logChunk> chunks( threads );
+    const char *position = data;
+
+    for( unsigned c = 0; c < threads; c++ )
+    {
+      const char *end = ( c + 1 == threads ) ? data + size :
+                        data + size / threads * ( c + 1 );
+      if( end < position )
+        end = position;
+      const char *newline = (const char *)memchr( end, '\n',
+                                                  data + size - end );
+      end = newline ? newline + 1 : data + size;
+
+      chunks[c].begin = position;
+      chunks[c].end = end;
+      chunks[c].limit = data + size;
+      position = end;
+    }
+
+    vector<thread> workers;
+    for( unsigned c = 1; c < threads; c++ )
+      workers.push_back( thread( scanChunk, &chunks[c] ) );
+    scanChunk( &chunks[0] );
+    for( size_t w = 0; w < workers.size(); w++ )
+      workers[w].join();
+
+    for( unsigned c = 0; c < threads; c++ )
+      vends.append( chunks[c].vends );
+
+    munmap( (void *)data, size );
+    totalBytes += size;
+  }
+
+  double elapsed = seconds() - start;
+
+  if( !writeColumns( output, vends ) )
+  {
+    cout << "Could not write " << output << endl;
+    return 1;
+  }
+
+  cout << "Ingested " << vends.slot.size() << " vends from "
+       << totalBytes / 1048576.0 << " MiB in " << elapsed << " s using "
+       << threads << " threads: "
+       << ( elapsed > 0 ? totalBytes / elapsed / 1e9 : 0 ) << " GB/s" << endl;
+
+  return 0;
+}
+
+/* vendColumns::append: adds another chunk's vends after these */
+void vendColumns::append( const vendColumns &other )
+{
+  slot.insert( slot.end(), other.slot.begin(), other.slot.end() );
+  result.insert( result.end(), other.result.begin(), other.result.end() );
+  time.insert( time.end(), other.time.begin(), other.time.end() );
+  duration.insert( duration.end(), other.duration.begin(),
+                   other.duration.end() );
+}
+
+/* findNewline: first '\n' in [p, end), or end */
+static inline const char *findNewline( const char *p, const char *end )
+{
+#ifdef __SSE2__
+  const __m128i newline = _mm_set1_epi8( '\n' );
+
+  while( p + 16 <= end )
+  {
+    int mask = _mm_movemask_epi8(
+      _mm_cmpeq_epi8( _mm_loadu_si128( (const __m128i *)p ), newline ) );
+    if( mask != 0 )
+      return p + __builtin_ctz( mask );
+    p += 16;
+  }
+#endif
+  const char *found = (const char *)memchr( p, '\n', end - p );
+  return found ? found : end;
+}
+
+/* hasPrefix: true if [p, end) starts with the length-byte string prefix */
+static inline bool hasPrefix( const char *p, const char *end,
+                              const char *prefix, const size_t length )
+{
+  if( (size_t)( end - p ) < length )
+    return false;
+#ifdef __SSE2__
+  if( length >= 16 )
+  {
+    int mask = _mm_movemask_epi8( _mm_cmpeq_epi8(
+      _mm_loadu_si128( (const __m128i *)p ),
+      _mm_loadu_si128( (const __m128i *)prefix ) ) );
+    if( mask != 0xFFFF )
+      return false;
+    return memcmp( p + 16, prefix + 16, length - 16 ) == 0;
+  }
+#endif
+  return memcmp( p, prefix, length ) == 0;
+}
+
+/* parseInt: reads an optionally negative decimal number at p */
+static inline long parseInt( const char *p, const char *end )
+{
+  bool negative = ( p < end && *p == '-' );
+  long value = 0;
+
+  if( negative )
+    p++;
+  while( p < end && *p >= '0' && *p <= '9' )
+    value = value * 10 + ( *p++ - '0' );
+  return negative ? -value : value;
+}
+
+/* parseTime: reads a leading "seconds[.fraction] " timestamp, advancing p */
+static inline int64_t parseTime( const char *&p, const char *end )
+{
+  int64_t seconds = 0, micros = 0, scale = 100000;
+
+  if( p >= end || *p < '0' || *p > '9' )
+    return 0;
+
+  while( p < end && *p >= '0' && *p <= '9' )
+    seconds = seconds * 10 + ( *p++ - '0' );
+  if( p < end && *p == '.' )
+    for( p++; p < end && *p >= '0' && *p <= '9'; p++, scale /= 10 )
+      micros += ( *p - '0' ) * scale;
+  while( p < end && *p == ' ' )
+    p++;
+
+  return seconds * 1000000 + micros;
+}
+
+/* scanChunk: thread body, extracts the vends that start in one chunk
+ *
+ * Summary of the state machine:
+ *  - "Function called with input<slot>" opens a vend (closing an open
+ *      one as abandoned)
+ *  - "Slot <n> is empty" / "Returning <result>" / "Exiting" close it
+ *  - "Constructing a sodaMachine object" abandons an open vend
+ *  - past the chunk's end, only the open vend is finished
+ */
+void scanChunk( logChunk *chunk )
+{
+  const size_t prefixLength = sizeof(VEND_PREFIX) - 1;
+  const char *p = chunk->begin;
+  bool open = false;
+  long slot = 0;
+  int64_t openTime = 0;
+  vendColumns &vends = chunk->vends;
+
+  vends.slot.reserve( ( chunk->end - chunk->begin ) / 1024 );
+  vends.result.reserve( vends.slot.capacity() );
+  vends.time.reserve( vends.slot.capacity() );
+  vends.duration.reserve( vends.slot.capacity() );
+
+  while( p < chunk->limit && ( p < chunk->end || open ) )
+  {
+    const char *lineEnd = findNewline( p, chunk->limit );
+    const char *lineStart = p;
+    const char *line = p;
+    int64_t lineTime = parseTime( line, lineEnd );
+    int result;
+    bool close = false;
+
+    p = lineEnd + 1;
+
+    if( hasPrefix( line, lineEnd, CONSTRUCTING, sizeof(CONSTRUCTING) - 1 ) )
+    {
+      result = RESULT_ABANDONED;
+      close = open;
+    }
+    else if( !hasPrefix( line, lineEnd, VEND_PREFIX, prefixLength ) )
+      continue;
+    else
+    {
+      line += prefixLength;
+
+      if( hasPrefix( line, lineEnd, VEND_CALLED, sizeof(VEND_CALLED) - 1 ) )
+      {
+        if( open )
+        {
+          vends.slot.push_back( slot );
+          vends.result.push_back( RESULT_ABANDONED );
+          vends.time.push_back( openTime );
+          vends.duration.push_back( 0 );
+          open = false;
+        }
+
+        /* Past our end, this vend belongs to the next chunk */
+        if( lineStart >= chunk->end )
+          break;
+
+        open = true;
+        slot = parseInt( line + sizeof(VEND_CALLED) - 1, lineEnd );
+        openTime = lineTime;
+        continue;
+      }
+      else if( !open )
+        continue;
+      else if( hasPrefix( line, lineEnd, VEND_RETURNING,
+                          sizeof(VEND_RETURNING) - 1 ) )
+      {
+        result = parseInt( line + sizeof(VEND_RETURNING) - 1, lineEnd );
+        close = true;
+      }
+      else if( hasPrefix( line, lineEnd, VEND_EMPTY, sizeof(VEND_EMPTY) - 1 ) )
+      {
+        /* "Slot <n> is empty", the "Returning 1" that follows closes it */
+        continue;
+      }
+      else if( hasPrefix( line, lineEnd, VEND_EXITING,
+                          sizeof(VEND_EXITING) - 1 ) )
+      {
+        result = -1;
+        close = true;
+      }
+      else
+        continue;
+    }
+
+    if( !close )
+      continue;
+
+    vends.slot.push_back( slot );
+    vends.result.push_back( result );
+    vends.time.push_back( openTime );
+    vends.duration.push_back( ( openTime && lineTime >= openTime ) ?
+                              lineTime - openTime : 0 );
+    open = false;
+  }
+}
+
+/* mapLog: maps a whole log file read-only */
+bool mapLog( const char *name, const char *&data, size_t &size )
+{
+  struct stat status;
+  int fd = open( name, O_RDONLY );
+
+  if( fd < 0 )
+    return false;
+  if( fstat( fd, &status ) != 0 || status.st_size == 0 )
+  {
+    close( fd );
+    return false;
+  }
+
+  size = status.st_size;
+  void *map = mmap( NULL, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0 );
+  close( fd );
+  if( map == MAP_FAILED )
+    return false;
+
+  madvise( map, size, MADV_SEQUENTIAL );
+  data = (const char *)map;
+  return true;
+}
+
+/* writeColumns: header, then each column stored contiguously
+ *
+ * Layout: "SODACOL1", uint64 rows, then rows x uint16 slot, rows x int8
+ *  result, rows x int64 time, rows x uint32 duration.
+ */
+bool writeColumns( const char *name, const vendColumns &vends )
+{
+  uint64_t rows = vends.slot.size();
+  ofstream out( name, ofstream::binary | ofstream::trunc );
+
+  out.write( COLUMN_MAGIC, 8 );
+  out.write( (const char *)&rows, sizeof(rows) );
+  out.write( (const char *)vends.slot.data(), rows * sizeof(uint16_t) );
+  out.write( (const char *)vends.result.data(), rows * sizeof(int8_t) );
+  out.write( (const char *)vends.time.data(), rows * sizeof(int64_t) );
+  out.write( (const char *)vends.duration.data(), rows * sizeof(uint32_t) );
+
+  return out.good();
+}
+
+/* generateLog: writes <bytes> of log in the shape sodaMachine produces */
+void generateLog( const char *name, const unsigned long long bytes )
+{
+  ofstream out( name, ofstream::trunc );
+  unsigned long long written = 0;
+  unsigned n = 0;
+
+  while( written < bytes )
+  {
+    unsigned slot = n % 8;
+    bool empty = ( n % 7 == 0 );
+    size_t before = out.tellp();
+
+    if( n % 1000 == 0 )
+      out << "Constructing a sodaMachine object\n";
+    out << "sodaMachine::vendSoda(): Function called with input" << slot
+        << " Asserting initComplete\n"
+        << "sodaMachine::vendSoda(): Validating slot number\n"
+        << "sodaMachine::hasSoda(): Function called.\n"
+        << "sodaMachine::getSodaInventory(): Writing command to serial\n"
+        << "sodaMachine::hasSoda(): Complete. Returning " << !empty << "\n";
+    if( empty )
+      out << "sodaMachine::vendSoda(): Slot " << slot << " is empty. "
+          << "Set return value to 1\n";
+    else
+      out << "sodaMachine::vendSoda(): Slot is valid & has soda, vending\n"
+          << "sodaMachine::vendSoda(): Writing commands to serial\n"
+          << "sodaMachine::vendSoda(): Verifying that a vend took place\n";
+    out << "sodaMachine::vendSoda(): Reached end of function. Returning "
+        << ( empty ? 1 : 0 ) << "\n";
+
+    written += (size_t)out.tellp() - before;
+    n++;
+  }
+}
+
+/* seconds: wall clock time for throughput figures */
+double seconds()
+{
+  struct timeval tv;
+  gettimeofday( &tv, NULL );
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
@@ -1,10 +1,67 @@
 #include "sodaMachine.h"
 
-#define BAUDRATE B4800
-#define DEVICE "/dev/ttyS0"
 #define LOG_NAME "log/vendsoda.log"
+#define JOURNAL_DIR "log/journal"
 #define RETURNINVENTORY_CHAR 'S'
 #define RETURNBUTTONPRESS_CHAR 'B'
+#define SEQUENCEDVEND_CHAR 'W'
+#define RESETSEQUENCE_CHAR 'R'
+#define PUSHEVENTS_CHAR 'E'
+#define FLOWCREDITS_CHAR 'C'
+#define MOTORLIMIT_CHAR 'L'
+#define CONCURRENTVEND_CHAR 'M'
+
+/* Frames the MCU pushes (see 89C51/sodaMCU.c): FRAME_START, length, seq,
+ *  kind, data, time, check. A frame not finished within FRAME_GAP
+ *  milliseconds lost a byte and is dropped.
+ */
+#define FRAME_START 0xA5
+#define FRAME_MAX 64
+#define FRAME_GAP 20
+#define PUSH_BUTTONS 0x01
+#define PUSH_INVENTORY 0x02
+
+/* How long the MCU gets to answer, in milliseconds: where each command's
+ *  round-trip estimate starts, and the bounds it adapts within. A vend's
+ *  round trip includes the motor.
+ */
+#define INVENTORY_TIMEOUT 500
+#define INVENTORY_MIN_TIMEOUT 10
+#define INVENTORY_MAX_TIMEOUT 2000
+#define VEND_TIMEOUT 5000
+#define VEND_MIN_TIMEOUT 500
+#define VEND_MAX_TIMEOUT 10000
+
+/* Times each command is sent before the link is given up on */
+#define INVENTORY_ATTEMPTS 6
+#define VEND_ATTEMPTS 6
+
+/* Inventories kept by default to answer from, so that a slot reads empty
+ *  only once this many 'S' replies in a row say so */
+#define INVENTORY_HISTORY 3
+
+/* A queued button poll waits in slices of BUTTON_SLICE milliseconds so
+ *  that other commands can preempt it; BUTTON_POLL_LIMIT seconds is the
+ *  deadline of a poll submitted without one */
+#define BUTTON_SLICE 100
+#define BUTTON_POLL_LIMIT 60
+
+/* Batch vends in flight at most, whatever the MCU grants, and how long
+ *  service() waits for one to be answered before it returns, in
+ *  milliseconds, so that another can join them */
+#define MOTOR_MAX 8
+#define MOTOR_SLICE 100
+
+/* Bytes pipeline() leaves in the kernel's output queue before writing
+ *  another command: about one command, so the next one is never late */
+#define FLOW_QUEUED 4
+
+/* Commands dropped at once before service() needs more room for them */
+#define EXPIRED_RESERVE 16
+
+/* Pushed events waiting for nextEvent(); when more arrive, the oldest
+ *  is dropped and the inventory read again */
+#define EVENT_QUEUE 32
 
 using namespace std;
 
@@ -15,24 +72,6 @@ using namespace std;
  *  to search for TODO and FIXME
  */
  
-/* The anatomy of a program performing serial I/O with the help of
- *  termios is as follows:
- *
- * - Open serial device with standard Unix system call open(2)
- * - Configure communication parameters and other interface
- *    properties (line discipline, etc.) with the help of specific
- *    termios functions and data structures.
- * - Use standard Unix system calls read(2) and write(2) for reading from,
- *    and writing to the serial interface. Related system calls like readv(2)
- *    and writev(2) can be used, too. Multiple I/O techniques, like blocking,
- *    non-blocking, asynchronous I/O (select(2) or poll(2)) or 
- *    signal-drive I/O (SIGIO signal) are also possible.
- * - Close device with the standard Unix system call close(2) when done.
- *
- * The majority of these operations use <termios.h>
- * 
- * (source: http://en.wikibooks.org/wiki/Serial_Programming:Unix/termios )
- */
 
 /* Uncomment the line below if you want to compile this class all by itself */
 //int main() { return 0; }
@@ -40,311 +79,243 @@ using namespace std;
 
 /* Default constructor:
  *  - Sets initComplete to false
- *  - Connects to the serial port (which sets initComplete to true on success)
- *  - Initializes the filestream for logging
+ *  - Connects to the MCU, or adopts descriptor if it is not -1 (which sets
+ *     initComplete to true on success)
+ *  - Opens the log, appending so that a restart does not wipe the
+ *     previous run's log
+ *  - Opens the vend journal
  */
-sodaMachine::sodaMachine()
+template< class GEOMETRY, class TRANSPORT, class CLOCK >
+basicSodaMachine<GEOMETRY, TRANSPORT, CLOCK>::basicSodaMachine(
+  const int descriptor )
 {
   initComplete = false;
-  vendLog.open(LOG_NAME);
-  vendLog << "Constructing a sodaMachine object" << endl;
-  serialConnect();
+  buttonActive = false;
+  sequencedVends = false;
+  vendSequence = 0xFF;
+  pushedEvents = false;
+  inventoryStale = true;
+  frameFrom = 0;
+  lastEventSequence = -1;
+  inventoryRtt.configure( INVENTORY_TIMEOUT * 1000LL,
+                          INVENTORY_MIN_TIMEOUT * 1000LL,
+                          INVENTORY_MAX_TIMEOUT * 1000LL );
+  vendRtt.configure( VEND_TIMEOUT * 1000LL, VEND_MIN_TIMEOUT * 1000LL,
+                     VEND_MAX_TIMEOUT * 1000LL );
+  credits.configure( 0, FLOW_QUEUED );
+  motors.reserve( MOTOR_MAX );
+  sensors.configure( INVENTORY_HISTORY );
+  motorLimit = 0;
+  motorsRefused = 0;
+  memset( slotSequence, 0, sizeof(slotSequence) );
+  expired.reserve( EXPIRED_RESERVE );
+  events.resize( EVENT_QUEUE );
+  eventFirst = 0;
+  eventCount = 0;
+  finished.reserve( EXPIRED_RESERVE );
+  vendLog.open( LOG_NAME );
+  vendLog.write( "Constructing a sodaMachine object" );
+
+  if( !journal.open( JOURNAL_DIR ) )
+    vendLog.write( "sodaMachine::sodaMachine(): Could not open the journal "
+                   "at %s, continuing without it", JOURNAL_DIR );
+  journal.record( JOURNAL_START, 0, 0, 0 );
+
+  connect( descriptor );
 }
 
 /* Destructor:
- *  - Loads the old termios settings
- *  - Closes the logging filestream
- *  - Closes the terminal connection
+ *  - Closes the log
+ *  - Closes the connection to the MCU (restoring the old termios settings)
  */
-sodaMachine::~sodaMachine()
+template< class GEOMETRY, class TRANSPORT, class CLOCK >
+basicSodaMachine<GEOMETRY, TRANSPORT, CLOCK>::~basicSodaMachine()
 {
-  vendLog << "Deconstructing a sodaMachine object" << endl;
+  vendLog.write( "Deconstructing a sodaMachine object" );
+  journal.record( JOURNAL_STOP, 0, 0, 0 );
   vendLog.close();
-  tcsetattr(fileDes,TCSANOW,&oldtio);
-  close(fileDes);
+  port.close();
 }
 
-/* int sodaMachine::charToInt( const char input )
- *
- * Returns the integer that the input char would be if it was an integer.
- * FIXME: This is the legacy of the previous version of this program, once
- *   the MCU interactions make more sense, this function should no longer
- *   be necessary.
- *
- * Note that the code with this functionality was originally called "HexToInt"
- *   buy I changed that, as it was misleading.
- *
- *  The old code assumed that the values returned by the MCU were ASCII letters
- *    representing hex. I get the impression that the previous programmer
- *    didn't know how hex worked or something.
- *
- *  If the MCU actually returned character values which we were supposed to
- *    interpret as hex, then the old code solved for that... but why send
- *    characters masquerading as hex in the first place?
- *
- *  To future programmers: If the MCU is returning hex values, you don't need
- *    to convert it. It's all binary to the computer anyway. The value was
- *    was always an integer! If the MCU is returning characters ... stop it.
- *    Or at least stop pretending like sending characters is the same as
- *    sending a hex integer.
+/* sodaMachine::connect( descriptor ): Opens the connection to the MCU
+ *   The TRANSPORT does the work; for the serial port, that location is
+ *    defined by DEVICE in serialTransport.cpp. A descriptor other than -1
+ *    is a connection handed over by another sodaDaemon, used as it is.
+ *    It logs to an ostream of its own, since it only does so here.
+ *   If this succeeds, initComplete is set to true.
  */
+template< class GEOMETRY, class TRANSPORT, class CLOCK >
+void basicSodaMachine<GEOMETRY, TRANSPORT, CLOCK>::connect(
+  const int descriptor )
+{
+  ofstream transportLog( LOG_NAME, ofstream::out | ofstream::app );
 
-const char HEXTABLE[16] =
-{'0','1','2','3','4','5','6','7','8','9','A','B','C','D','E','F'};
- 
- int sodaMachine::charToInt( const char input )
+  vendLog.write( "sodaMachine::connect() called" );
+
+  if( descriptor >= 0 ? !port.adopt( descriptor, transportLog ) :
+                        !port.open( transportLog ) )
+  {
+    vendLog.write( "sodaMachine::connect(): Could not connect to the MCU, "
+                   "exiting." );
+    exit(EXIT_FAILURE);
+  }
+
+  initComplete = true;
+}
+
+/* int32_t journalValue( const bitset<SLOTS> &bits, const size_t first )
+ *
+ * 32 slots of an inventory from first on, for the journal's value field.
+ */
+template< size_t SLOTS >
+static int32_t journalValue( const bitset<SLOTS> &bits, const size_t first )
 {
-  for( short i = 0; i < 16; i++)
-    if( HEXTABLE[i] == input )
-      return i;
-  return -1;
+  uint32_t value = 0;
+  for( size_t i = 0; first + i < SLOTS && i < JOURNAL_SLOTS; i++ )
+    value |= (uint32_t)bits[first + i] << i;
+  return (int32_t)value;
 }
 
-/* int sodaMachine::charToInt( const char msb, const char lsb )
+/* void sodaMachine::journalInventory( const inventory &bits,
+ *                                     const int64_t duration )
  *
- * Same as function above, just processes two characters.
+ * One JOURNAL_INVENTORY record per JOURNAL_SLOTS slots, its slot field the
+ *  first of them, so that a machine of any size is recorded whole; the
+ *  standard machine takes one record, as it always did.
  */
-int sodaMachine::charToInt( const char msb, const char lsb )
+template< class GEOMETRY, class TRANSPORT, class CLOCK >
+void basicSodaMachine<GEOMETRY, TRANSPORT, CLOCK>::journalInventory(
+  const inventory &bits, const int64_t duration )
 {
-  short msbInt = charToInt( msb );
-  short lsbInt = charToInt( lsb );
-  
-  return (msbInt == -1 || lsbInt == -1) ? (-1) : (msbInt * 16 + lsbInt);
+  for( size_t first = 0; first < GEOMETRY::slotCount; first += JOURNAL_SLOTS )
+    journal.record( JOURNAL_INVENTORY, first, journalValue( bits, first ),
+                    duration );
 }
 
-/* sodaMachine::serialConnect(): Opens a serial connection to the MCU
- *   Establishes a connection to the serial port. Currently that location
- *    is defined by DEVICE, and there is currently no option to change this
- *    without recompiling.
- *   If this succeeds, initComplete is set to true.
+
+/* inventory sodaMachine::getSodaInventory()
+ * 
+ * Queries the MCU for the current soda inventory. The reply is one byte
+ *  followed by GEOMETRY::inventoryLength bytes of slot bits in the
+ *  geometry's encoding.
+ *
+ * Returns the decoded bits through the sensor history, or no bits at all
+ *  if the reply is malformed (so that a garbled reply never looks like a
+ *  full machine; it is not added to the history either).
+ *
+ * With pushedEvents the history is not used at all, for the pushed
+ *  inventory nor for an 'S' sent after a lost push: the firmware already
+ *  debounces its sensors before it pushes, and pushes only come on a
+ *  change, so a slot emptied by a vend would read full until two more
+ *  changes came. Both paths answer what the MCU said.
  */
-void sodaMachine::serialConnect()
+template< class GEOMETRY, class TRANSPORT, class CLOCK >
+typename basicSodaMachine<GEOMETRY, TRANSPORT, CLOCK>::inventory
+basicSodaMachine<GEOMETRY, TRANSPORT, CLOCK>::getSodaInventory()
 {
-  vendLog << "sodaMachine::serialConnect() called" << endl;
-  
-  /* Opening a file at DEVICE
-   *  The following options will be set:
-   *  - O_RDWR: Opens the port for reading and writing
-   *  - O_NOCTTY: The port never becomes the controlling
-   *      terminal of the process.
-   *
-   * Then check for errors:
-   *  - If successful, open() returns a file descriptor.
-   *  - If unsuccessful, open() returns -1 and errno is set
-   */
-  
-  vendLog << "opening a file at DEVICE" << endl;
-  
-  fileDes = open(DEVICE, O_RDWR | O_NOCTTY );
+  int64_t startTime = linkClock.now();
+  inventory bits;
+
+  vendLog.write( "sodaMachine::getSodaInventory(): Function called. "
+                 "Asserting initComplete" );
   
-  if (fileDes < 0)
-  {
-    vendLog << "sodaMachine::serialConnect():"
-	        << "Error opening connection to DEVICE, exiting. " << endl;
-    exit(EXIT_FAILURE);
-  }
+  assert( initComplete );
 
-  /* Saving the previos port settings in "oldtio"
-   *
-   * Then check for errors:
-   *  - If successful, tcgetattr() returns 0.
-   *  - If unsuccessful, tcgetattr() returns -1 and errno is set.
+  /* The MCU tells us when the inventory changes, so there is nothing to
+   *  ask unless a push went missing
    */
-  
-  vendLog << "sodaMachine::serialConnect(): Saving old port settings." << endl;
-  if( tcgetattr( fileDes, &oldtio ) != 0 )
+  if( pushedEvents )
   {
-    vendLog << "sodaMachine::serialConnect():"
-	        << "Error saving old port settings, exiting. " << endl;
-    exit(EXIT_FAILURE);
+    receiveEvents( linkClock.now() );
+    if( !inventoryStale )
+    {
+      journalInventory( pushedInventory, linkClock.now() - startTime );
+      return pushedInventory;
+    }
   }
   
-  /* Setting up a new termios struct "newtio"
-   *
-   * Setting "newtio"'s flags to the following settings:
-   *  Control flags (c_cflag):
-   *   - CS8: Sets character size to 8 bits
-   *   - CLOCAL: Ignore modem status lines
-   *   - CREAD: Enable receiver
-   *  Input flags (c_iflag):
-   *   - IGNPAR: Ignore characters with parity errors
-   *   - IGNBRK: Ignore break condition
-   *  Output flags (c_oflag):
-   *   x none currently enabled
-   *  Local flags (c_lflag):
-   *   x none currently enabled
-   *  Special input characters (c_cc):
-   *   - VTIME = 0: Don't want to use any character timer
-   *   - VMIN = 1: Must read 1 character before a read is satisfied
+  const char COMMAND = RETURNINVENTORY_CHAR;
+  char buf[ 1 + GEOMETRY::inventoryLength ];
+
+  /* 'S' is safe to repeat, so a reply lost or cut short on the wire is
+   *  just asked for again, after the adaptive timeout rather than a fixed
+   *  one. Only when every attempt fails is the link given up on.
    */
-  
-  vendLog << "sodaMachine::serialConnect(): setting up new termios struct."
-          << endl;
-  
-  /* Clearing "newtio", just in case */
-  memset( &newtio, 0x00, sizeof(newtio) );
-  
-  /* Setting option flags */
-  newtio.c_cflag = CS8 | CLOCAL | CREAD;  // control flags
-  newtio.c_iflag = IGNPAR | IGNBRK;       // input flags
-  newtio.c_oflag = 0;                     // output flags
-  newtio.c_lflag = 0;                     // local flags
-
-  newtio.c_cc[VTIME]    = 0;  // Special input characters
-  newtio.c_cc[VMIN]     = 1;
-  
-  /* Setting input & output baud rate */
-  if( cfsetospeed(&newtio, BAUDRATE) != 0 ||
-      cfsetispeed(&newtio, BAUDRATE) != 0 )
+  int attempt;
+  for( attempt = 0; attempt < INVENTORY_ATTEMPTS; attempt++ )
   {
-    vendLog << "sodaMachine::serialConnect():"
-	        << "Error setting baud rate, exiting. " << endl;
-    exit(EXIT_FAILURE);
+    memset( buf, 0x00, sizeof(buf) );
+    if( exchange( &COMMAND, 1, buf, sizeof(buf), inventoryRtt, attempt > 0 ) &&
+        buf[0] == '?' )
+      break;
+
+    vendLog.write( "sodaMachine::getSodaInventory(): No complete reply, "
+                   "asking again" );
   }
-  
-  /* Flush unsent data:
-   *  - TCIFLUSH: Flush input data that has been recieved by the system but
-   *     has not yet been processed.
-   *
-   * Then check for errors:
-   *  - If successful, tcflush() returns 0.
-   *  - If unsuccessful, tcflush() returns -1 and errno is set
-   */
-   
-  vendLog << "sodaMachine::serialConnect(): Flushing unsent data" << endl;
-  
-  if ( tcflush(fileDes, TCIFLUSH) != 0 )
+
+  if( attempt == INVENTORY_ATTEMPTS )
   {
-    vendLog << "sodaMachine::serialConnect():"
-	        << "Error flushing terminal, exiting. " << endl;
-    exit(EXIT_FAILURE);
+    vendLog.write( "sodaMachine::getSodaInventory(): No reply after %d "
+                   "attempts", INVENTORY_ATTEMPTS );
+    vendLog.write( "sodaMachine::getSodaInventory(): Exiting" );
+    exit( EXIT_FAILURE );
   }
-  
-  /* Apply changes:
-   *  - TCSANOW: Apply changes immediately
-   *
-   * Then, check for errors:
-   *  - If successsful, tcsetattr() returns 0.
-   *  - If unsuccessful, tcsetattr() returns -1 and errno is set.
-   */
-   
-  vendLog << "sodaMachine::serialConnect(): Applying new termios settings"
-          << endl;
-		  
-  if ( tcsetattr(fileDes,TCSANOW,&newtio) != 0 )
+
+  if( !GEOMETRY::decodeInventory( &buf[1], bits ) )
   {
-    vendLog << "sodaMachine::serialConnect():"
-	        << "Error saving new port settings, exiting. " << endl;
-    exit(EXIT_FAILURE);
+    vendLog.write( "sodaMachine::getSodaInventory(): Could not decode the "
+                   "inventory reply, reporting every slot empty" );
+    bits.reset();
   }
-  
-  /* Modify the file descriptor to make the reads non-blocking */
-  fcntl(fileDes, F_SETFL, O_NONBLOCK);
-  
-  
-  /* Finished setting up new serial port connection. Setting initComplete. */
-  
-  initComplete = true;
-  
-  /* TODO: Query the MCU and make sure it is connected */
-
-  vendLog << "sodaMachine::serialConnect(): "
-          << "Successfully connected. Returning to calling object" << endl;
-  
-  return;
-}
-
-/* int sodaMachine::getSodaInventory()
- * 
- * Currently just returns 0 because I don't know what the MCU returns,
- *  but still contains the code that serialController used just to keep it
- *  around and make sure it compiles.
- *
- * Queries the MCU to return an integer representing the curent soda inventory
- *
- * I honstly have no idea what the return value means. The MCU needs to be
- *   reprogrammed first.
- *
- */
-int sodaMachine::getSodaInventory()
-{
-  vendLog << "sodaMachine::getSodaInventory(): Function called. "
-          << "Asserting initComplete" << endl;
-  
-  assert( initComplete );
-  
-  const char COMMAND = RETURNINVENTORY_CHAR;
-  int readWriteResult;
-  char buf[10];
-
-  /* write():
-   * If successful, returns the number of bytes written.
-   * If unsuccessful, returns -1 & sets errno
-   *
-   * The second argument MUST be a pointer! That is why I am defining
-   *  the command to use, then using a const variable and reference down here.
-   */
-  
-  vendLog << "sodaMachine::getSodaInventory(): Writing command to serial" << endl;
-  
-  readWriteResult = write( fileDes, &COMMAND, 1);
-  
-  if( readWriteResult != 3 )
+  else if( !pushedEvents )
   {
-    vendLog << "sodaMachine::getSodaInventory(): Write returned an unexpected "
-	          << "value. Expected 3, received " << readWriteResult << endl
-			      << "sodaMachine::getSodaInventory(): Exiting" << endl;
-	exit( EXIT_FAILURE );
+    inventory seen = bits;
+
+    bits = sensors.sample( seen );
+    if( bits != seen )
+      vendLog.write( "sodaMachine::getSodaInventory(): %u slot(s) read "
+                     "empty but had a can within %u samples, still "
+                     "reporting them full", (unsigned)( bits & ~seen ).count(),
+                     (unsigned)sensors.depth() );
   }
-  
-  /* read operation:
-   * - clear buf
-   * - read the serial into buf
-   */
-  
-  vendLog << "sodaMachine::getSodaInventory(): Reading from serial port" << endl;
-  
-  memset( buf, 0x00, sizeof(buf) );
-  
-  readWriteResult = read( fileDes, buf, sizeof(buf) );
-  
-  if( readWriteResult != 3 )
+
+  if( pushedEvents )
   {
-    vendLog << "sodaMachine::getSodaInventory(): read returned an unexpected "
-	          << "value. Expected 3, received " << readWriteResult << endl
-			      << "sodaMachine::getSodaInventory(): Exiting" << endl;
-	  exit( EXIT_FAILURE );
+    pushedInventory = bits;
+    inventoryStale = false;
   }
 
-  
-  return charToInt(buf[1], buf[2]);
+  journalInventory( bits, linkClock.now() - startTime );
+
+  return bits;
 }
 
 /* bool sodaMachine::hasSoda( short slot )
  *
  * - Uses getSodaInventory and checks if a single slot has a soda
- *    by shifting getSodaInventory's return value by <slot> digits
- *    and ANDing it with 0x01
+ *    by testing bit <slot> of its return value
  * 
  * Returns true if the can is present, false if it is not present
  *  or is the slot was out of range.
  */
-bool sodaMachine::hasSoda( const unsigned short slot )
+template< class GEOMETRY, class TRANSPORT, class CLOCK >
+bool basicSodaMachine<GEOMETRY, TRANSPORT, CLOCK>::hasSoda( const unsigned short slot )
 {
   bool returnValue = false;
   
-  vendLog << "sodaMachine::hasSoda(): Function called." << endl;
-  vendLog << "sodaMachine::hasSoda(): Checking for valid slot & soda." << endl;
+  vendLog.write( "sodaMachine::hasSoda(): Function called." );
+  vendLog.write( "sodaMachine::hasSoda(): Checking for valid slot & soda." );
   
   if( !validSlot( slot ) )
-    vendLog << "sodaMachine::hasSoda(): Soda availability requested for a "
-	        << "slot outside of the valid range. Expected [0:7], recieved "
-			<< slot << endl;
+    vendLog.write( "sodaMachine::hasSoda(): Soda availability requested for "
+                   "a slot outside of the valid range. Expected [0:%u], "
+                   "recieved %u", (unsigned)GEOMETRY::slotCount - 1,
+                   (unsigned)slot );
   else
-    returnValue = ( getSodaInventory() >> slot ) & 0x01;
+    returnValue = getSodaInventory().test( slot );
 
-  vendLog << "sodaMachine::hasSoda(): Complete. Returning " << returnValue
-          << endl;
+  vendLog.write( "sodaMachine::hasSoda(): Complete. Returning %d",
+                 (int)returnValue );
     
   return returnValue;
 }
@@ -352,65 +323,54 @@ bool sodaMachine::hasSoda( const unsigned short slot )
 /* int sodaMachine::getButtonInput( time_t timout )
  *
  * Summary of instructions:
- *  - write COMMAND to fileDes, check for errors
+ *  - write COMMAND to the MCU, check for errors
  *  - spend the rest of the time waiting for a read, check for
  *      errors and return the read value
  *  - Returns number of pressed button if a button is pressed within the
  *      timeout period. Otherwise, returns -1
  */
-int sodaMachine::getButtonInput( const time_t timeout = 10 )
+template< class GEOMETRY, class TRANSPORT, class CLOCK >
+int basicSodaMachine<GEOMETRY, TRANSPORT, CLOCK>::getButtonInput( const time_t timeout )
 {	  
-  time_t end_time = time(NULL) + timeout;
+  int64_t startTime = linkClock.now();
+  int pressedButton;
   
-  const char COMMAND = RETURNBUTTONPRESS_CHAR;
-  int pressedButton = -1;
-  int readWriteResult;
-  
-  vendLog << "sodaMachine::getButtonInput(): called with timeout of "
-          << timeout << " seconds" << endl;
+  vendLog.write( "sodaMachine::getButtonInput(): called with timeout of "
+                 "%ld seconds", (long)timeout );
   if( timeout > 60 || timeout < 1)
   {
-    vendLog << "sodaMachine::getButtonInput(): timeout too large. "
-	        << "Exiting." << endl;
+    vendLog.write( "sodaMachine::getButtonInput(): timeout too large. "
+                   "Exiting." );
 	exit( EXIT_FAILURE );
   }
 
-  vendLog << "sodaMachine::getButtonInput(): Asserting initComplete" << endl;
+  vendLog.write( "sodaMachine::getButtonInput(): Asserting initComplete" );
   assert( initComplete );
   
-  vendLog << "sodaMachine::getButtonInput(): Writing command to serial"
-          << endl;
-  if ( (readWriteResult = write( fileDes, &COMMAND, 1 ) ) != 1 )
-  {
-      vendLog << "sodaMachine::getButtonInput(): write() return an unexpected "
-	          << "value. Expected 1, recieved " << readWriteResult
-			  << ". Exiting" << endl;
+  if( !startButtonPoll() )
 	  exit( EXIT_FAILURE );
-  }
   
-  vendLog << "sodaMachine::getButtonInput(): Entering read loop" << endl;
-  while( time( NULL ) < end_time && read( fileDes, &pressedButton, 1) != 1 )
-  {
-    if( (readWriteResult = read( fileDes, &pressedButton, 1) ) != 1 )
-    {
-    vendLog << "sodaMachine::getButtonInput(): read returned an unexpected "
-	        << "value. Expected 1, received " << readWriteResult << endl
-			<< "sodaMachine::serialConnect(): Exiting" << endl;
-	exit( EXIT_FAILURE );
-    }
-  }
+  vendLog.write( "sodaMachine::getButtonInput(): Waiting for a button" );
+  pressedButton = pollButton( startTime + timeout * 1000000LL );
   
-  if( time( NULL ) >= end_time )
+  if( pressedButton == -1 )
   {
-    vendLog << "sodaMachine::getButtonInput(): Loop timed out. Returning "
-	        << pressedButton << endl;
+    vendLog.write( "sodaMachine::getButtonInput(): Timed out. Returning %d",
+                   pressedButton );
   }
   else
   {
-    vendLog << "sodaMachine::getButtonInput(): Answer recieved within the "
-	        << "timeout period. Returning " << pressedButton << endl;
+    /* Anything beyond the machine's buttons is line noise */
+    if( pressedButton < 0 )
+      pressedButton = -1;
+
+    vendLog.write( "sodaMachine::getButtonInput(): Answer recieved within "
+                   "the timeout period. Returning %d", pressedButton );
   }
   
+  journal.record( JOURNAL_BUTTON, 0, pressedButton,
+                  linkClock.now() - startTime );
+
   // FIXME: I need to know more about the 89C51's responses first
   return pressedButton;
 }
@@ -420,75 +380,1111 @@ int sodaMachine::getButtonInput( const time_t timeout = 10 )
  * Tells the MCU to vend the can in slot number <slot>
  *
  * Returns 0 if successful, 1 if the stack is empty, and -1 on some other error
- * FIXME: needs error checking for reads and writes
+ *  (including no answer: the can may or may not have dropped)
  * FIXME: the MCU probably needs to be sent one character at a time,
  *  this should be rewritten to wait for a confirmation character or something
  */
-int sodaMachine::vendSoda( const unsigned short slot )
+template< class GEOMETRY, class TRANSPORT, class CLOCK >
+int basicSodaMachine<GEOMETRY, TRANSPORT, CLOCK>::vendSoda( const unsigned short slot )
 {
-  char CommandBuffer[10];
   int vendResult = -1;
-  int readWriteResult;
+  int64_t startTime = linkClock.now();
 
-  vendLog << "sodaMachine::vendSoda(): Function called with input" << slot
-          << " Asserting initComplete" << endl;
+  vendLog.write( "sodaMachine::vendSoda(): Function called with input%u "
+                 "Asserting initComplete", (unsigned)slot );
 		  
   assert( initComplete );
 
   /* Validating slot number */
   
-  vendLog << "sodaMachine::vendSoda(): Validating slot number" << endl;
+  vendLog.write( "sodaMachine::vendSoda(): Validating slot number" );
   
   if( !validSlot( slot ) )
-    vendLog << "sodaMachine::vendSoda(): Slot value outside of range" << endl;
+    vendLog.write( "sodaMachine::vendSoda(): Slot value outside of range" );
   if( !hasSoda( slot ) )
   {
     vendResult = 1;
-    vendLog << "sodaMachine::vendSoda(): Slot " << slot << " is empty. "
-	        << "Set return value to " << vendResult << endl;
+    vendLog.write( "sodaMachine::vendSoda(): Slot %u is empty. Set return "
+                   "value to %d", (unsigned)slot, vendResult );
   }
   else
   {
-    vendLog << "sodaMachine::vendSoda(): Slot is valid & has soda, vending"
-	        << endl;
-
-    /* Sending vend signal to machine using a
-     *  two-byte string: "V#" where # is the integer "slot"
-     *
-     * - Inserts "V<slot>" into the command buffer
-     * - Writes the command buffer to the serial port
-     */
-
-	vendLog << "sodaMachine::vendSoda(): Writing commands to serial" << endl;
-    CommandBuffer[0] = 'V';
-    CommandBuffer[1] = slot;
-
-    if( (readWriteResult = write( fileDes, &CommandBuffer, 2 ) ) != 2)
-	{
-      vendLog << "sodaMachine::vendSoda(): Write returned an unexpected "
-	          << "value. Expected 2, received " << readWriteResult << endl
-			  << "sodaMachine::vendSoda(): Exiting" << endl;
-	  exit( EXIT_FAILURE );
-	}
-
-    /* Verify that a vend took place:
-     *  - Check that the microcontroller sent a 'Y'
-     */
-    vendLog << "sodaMachine::vendSoda(): Verifying that a vend took place"
-	        << endl;
-    if( (readWriteResult = read( fileDes, &CommandBuffer[2], 1 ) ) != 1)
-	{
-      vendLog << "sodaMachine::vendSoda(): Read returned an unexpected "
-	          << "value. Expected 1, received " << readWriteResult << endl
-			  << "sodaMachine::vendSoda(): Exiting" << endl;
-	  exit( EXIT_FAILURE );
-	}  
-    if ( CommandBuffer[2] == 'Y')
-	  vendResult = 0;
+    vendLog.write( "sodaMachine::vendSoda(): Slot is valid & has soda, "
+                   "vending" );
+
+    if( sequencedVends )
+      vendResult = vendSequenced( slot );
+    else
+      vendResult = vendOnce( slot );
+    if( vendResult == 1 )
+      sensors.empty( slot );
   }
   
-  vendLog << "sodaMachine::vendSoda(): Reached end of function. Returning "
-          << vendResult << endl;
+  vendLog.write( "sodaMachine::vendSoda(): Reached end of function. "
+                 "Returning %d", vendResult );
+
+  journal.record( JOURNAL_VEND, slot, vendResult,
+                  linkClock.now() - startTime );
   
   return vendResult;
 }
+
+/* int sodaMachine::vendOnce( const unsigned short slot )
+ *
+ * The legacy vend: "V<slot>", answered 'Y', or 'N' if the slot is empty. Nothing says whether a
+ *  repeated 'V' is the same vend, so it is never repeated, and it waits
+ *  for the longer of the adaptive timeout and VEND_TIMEOUT: waiting costs
+ *  nothing but link time, giving up too early loses the answer for good.
+ */
+template< class GEOMETRY, class TRANSPORT, class CLOCK >
+int basicSodaMachine<GEOMETRY, TRANSPORT, CLOCK>::vendOnce( const unsigned short slot )
+{
+  char CommandBuffer[2];
+  char answer;
+  int64_t sent;
+  int64_t wait = max<int64_t>( vendRtt.timeout(), VEND_TIMEOUT * 1000LL );
+
+  /* Sending vend signal to machine using a
+   *  two-byte string: "V#" where # is the integer "slot"
+   */
+  vendLog.write( "sodaMachine::vendOnce(): Writing commands to serial" );
+  CommandBuffer[0] = 'V';
+  CommandBuffer[1] = slot;
+  sendCommand( CommandBuffer, 2 );
+  sent = linkClock.now();
+
+  /* Verify that a vend took place:
+   *  - Check that the microcontroller sent a 'Y'
+   */
+  vendLog.write( "sodaMachine::vendOnce(): Verifying that a vend took "
+                 "place" );
+  if( readBytes( &answer, 1, sent + wait ) != 1 )
+  {
+    vendRtt.backoff();
+    vendLog.write( "sodaMachine::vendOnce(): No answer within %lld ms",
+                   (long long)( wait / 1000 ) );
+    return -1;
+  }
+  vendRtt.sample( linkClock.now() - sent );
+
+  /* 'N': the slot was empty after all, e.g. its pushed inventory change
+   *  was still on the wire */
+  return answer == 'Y' ? 0 : answer == 'N' ? 1 : -1;
+}
+
+/* int sodaMachine::vendSequenced( const unsigned short slot )
+ *
+ * The retryable vend: "W<seq><slot>", answered 'Y' or 'N' and seq. The
+ *  MCU answers a repeat of the seq it last acted on without vending, so
+ *  the same command is simply sent again until an answer for this seq
+ *  comes back. Sequence numbers stay in 0x80-0xFF, where a stray one
+ *  can never be taken for a command letter.
+ */
+template< class GEOMETRY, class TRANSPORT, class CLOCK >
+int basicSodaMachine<GEOMETRY, TRANSPORT, CLOCK>::vendSequenced( const unsigned short slot )
+{
+  char CommandBuffer[3];
+  char answer[2];
+
+  CommandBuffer[0] = SEQUENCEDVEND_CHAR;
+  CommandBuffer[1] = (char)nextSequence();
+  CommandBuffer[2] = slot;
+
+  for( int attempt = 0; attempt < VEND_ATTEMPTS; attempt++ )
+  {
+    if( exchange( CommandBuffer, 3, answer, 2, vendRtt, attempt > 0 ) &&
+        (unsigned char)answer[1] == vendSequence )
+    {
+      if( attempt > 0 )
+        vendLog.write( "sodaMachine::vendSequenced(): Answered on attempt "
+                       "%d", attempt + 1 );
+      return answer[0] == 'Y' ? 0 : answer[0] == 'N' ? 1 : -1;
+    }
+
+    vendLog.write( "sodaMachine::vendSequenced(): No answer to vend %u, "
+                   "sending it again", (unsigned)vendSequence );
+  }
+
+  vendLog.write( "sodaMachine::vendSequenced(): No answer after %d "
+                 "attempts", VEND_ATTEMPTS );
+  return -1;
+}
+
+/* unsigned char sodaMachine::nextSequence()
+ *
+ * FRAME_START is skipped: a stale answer flushed with pushed events on
+ *  would start an event frame.
+ */
+template< class GEOMETRY, class TRANSPORT, class CLOCK >
+unsigned char basicSodaMachine<GEOMETRY, TRANSPORT, CLOCK>::nextSequence()
+{
+  vendSequence = vendSequence == 0xFF ? 0x80 : vendSequence + 1;
+  if( vendSequence == FRAME_START )
+    vendSequence++;
+  return vendSequence;
+}
+
+/* bool sodaMachine::setSequencedVends( const bool enable )
+ *
+ * Switches to the retryable vend, which needs firmware that knows 'W'.
+ *  'R' first makes the MCU forget the last sequence number it saw, which
+ *  may be this one's from an earlier run.
+ *
+ * Returns false, leaving legacy vends on, if the MCU never answers 'R'.
+ */
+template< class GEOMETRY, class TRANSPORT, class CLOCK >
+bool basicSodaMachine<GEOMETRY, TRANSPORT, CLOCK>::setSequencedVends( const bool enable )
+{
+  const char COMMAND = RESETSEQUENCE_CHAR;
+  rttEstimator resetRtt( INVENTORY_TIMEOUT * 1000LL,
+                         INVENTORY_TIMEOUT * 1000LL, INVENTORY_TIMEOUT * 1000LL );
+  char answer;
+
+  assert( initComplete );
+
+  sequencedVends = false;
+  if( !enable )
+    return true;
+
+  for( int attempt = 0; attempt < INVENTORY_ATTEMPTS; attempt++ )
+    if( exchange( &COMMAND, 1, &answer, 1, resetRtt, true ) && answer == 'K' )
+    {
+      vendLog.write( "sodaMachine::setSequencedVends(): Using sequenced "
+                     "vends" );
+      sequencedVends = true;
+      return true;
+    }
+
+  vendLog.write( "sodaMachine::setSequencedVends(): The MCU does not "
+                 "answer '%c', keeping legacy vends", COMMAND );
+  return false;
+}
+
+/* bool sodaMachine::setPushedEvents( const bool enable )
+ *
+ * "E<mask>", answered 'K'. The MCU pushes the inventory as soon as it has
+ *  answered, so the first vend need not ask for it. That push is waited
+ *  for here: an 'S' sent while it is on the wire would time out behind
+ *  it, and its late answer be taken for the next command's.
+ *
+ * Returns false, leaving polling on, if the MCU never answers 'E'.
+ */
+template< class GEOMETRY, class TRANSPORT, class CLOCK >
+bool basicSodaMachine<GEOMETRY, TRANSPORT, CLOCK>::setPushedEvents( const bool enable )
+{
+  const char mask = enable ? PUSH_BUTTONS | PUSH_INVENTORY : 0;
+  const char COMMAND[2] = { PUSHEVENTS_CHAR, mask };
+  rttEstimator eventsRtt( INVENTORY_TIMEOUT * 1000LL,
+                          INVENTORY_TIMEOUT * 1000LL, INVENTORY_TIMEOUT * 1000LL );
+  char answer;
+
+  assert( initComplete );
+
+  for( int attempt = 0; attempt < INVENTORY_ATTEMPTS; attempt++ )
+    if( exchange( COMMAND, 2, &answer, 1, eventsRtt, true ) && answer == 'K' )
+    {
+      vendLog.write( "sodaMachine::setPushedEvents(): The MCU %s events",
+                     enable ? "pushes" : "no longer pushes" );
+      pushedEvents = enable;
+      eventCount = 0;
+      frame.clear();
+      inventoryStale = true;
+      lastEventSequence = -1;
+      if( enable )
+        receiveEvents( linkClock.now() + eventsRtt.timeout() );
+      return true;
+    }
+
+  vendLog.write( "sodaMachine::setPushedEvents(): The MCU does not answer "
+                 "'%c', keeping polling", COMMAND[0] );
+  return false;
+}
+
+/* bool sodaMachine::setFlowControl( const bool enable )
+ *
+ * 'C', answered 'K' and the free bytes in the MCU's receive ring. Asked
+ *  while nothing else is in flight, that is the whole ring.
+ *
+ * Returns false, leaving one command at a time, if the MCU never answers.
+ */
+template< class GEOMETRY, class TRANSPORT, class CLOCK >
+bool basicSodaMachine<GEOMETRY, TRANSPORT, CLOCK>::setFlowControl( const bool enable )
+{
+  const char COMMAND = FLOWCREDITS_CHAR;
+  rttEstimator creditsRtt( INVENTORY_TIMEOUT * 1000LL,
+                           INVENTORY_TIMEOUT * 1000LL, INVENTORY_TIMEOUT * 1000LL );
+  char answer[2];
+
+  assert( initComplete );
+
+  credits.configure( 0, FLOW_QUEUED );
+  if( !enable )
+    return true;
+
+  for( int attempt = 0; attempt < INVENTORY_ATTEMPTS; attempt++ )
+    if( exchange( &COMMAND, 1, answer, 2, creditsRtt, true ) &&
+        answer[0] == 'K' )
+    {
+      credits.configure( (unsigned char)answer[1], FLOW_QUEUED );
+      vendLog.write( "sodaMachine::setFlowControl(): The MCU has room for "
+                     "%u bytes", (unsigned)credits.credits() );
+      return true;
+    }
+
+  vendLog.write( "sodaMachine::setFlowControl(): The MCU does not answer "
+                 "'%c', sending one command at a time", COMMAND );
+  return false;
+}
+
+/* bool sodaMachine::setMotorLimit( const unsigned limit )
+ *
+ * "L<n>", answered 'K' and the motors the MCU will run at once, which may
+ *  be fewer than asked for: the firmware knows what its supply takes.
+ *  A limit of 0 makes 'M' a plain vend again without asking.
+ *
+ * Returns false, leaving 'M' a plain vend, if the MCU never answers 'L'.
+ */
+template< class GEOMETRY, class TRANSPORT, class CLOCK >
+bool basicSodaMachine<GEOMETRY, TRANSPORT, CLOCK>::setMotorLimit( const unsigned limit )
+{
+  const char COMMAND[2] = { MOTORLIMIT_CHAR,
+                            (char)min<unsigned>( limit, MOTOR_MAX ) };
+  rttEstimator limitRtt( INVENTORY_TIMEOUT * 1000LL,
+                         INVENTORY_TIMEOUT * 1000LL, INVENTORY_TIMEOUT * 1000LL );
+  char answer[2];
+
+  assert( initComplete );
+  assert( motors.empty() );
+
+  motorLimit = 0;
+  if( limit == 0 )
+    return true;
+
+  for( int attempt = 0; attempt < INVENTORY_ATTEMPTS; attempt++ )
+    if( exchange( COMMAND, 2, answer, 2, limitRtt, true ) && answer[0] == 'K' )
+    {
+      motorLimit = min<unsigned>( (unsigned char)answer[1], MOTOR_MAX );
+      vendLog.write( "sodaMachine::setMotorLimit(): The MCU runs %u motors "
+                     "at once", motorLimit );
+      return true;
+    }
+
+  vendLog.write( "sodaMachine::setMotorLimit(): The MCU does not answer "
+                 "'%c', vending batches one at a time", COMMAND[0] );
+  return false;
+}
+
+/* void sodaMachine::startMotor( const linkCommand &command )
+ *
+ * "M<seq><slot>": the MCU starts the motor and answers when it stops, so
+ *  nothing is waited for here.
+ */
+template< class GEOMETRY, class TRANSPORT, class CLOCK >
+void basicSodaMachine<GEOMETRY, TRANSPORT, CLOCK>::startMotor( const linkCommand &command )
+{
+  runningVend motor;
+
+  motor.command = command;
+  motor.sequence = nextSequence();
+  if( motor.sequence == slotSequence[command.argument] )
+    motor.sequence = nextSequence();
+  slotSequence[command.argument] = motor.sequence;
+  motor.attempts = 0;
+  motor.sent = linkClock.now();
+  motors.push_back( motor );
+  sendMotor( motors.back() );
+
+  vendLog.write( "sodaMachine::startMotor(): Vend %u from slot %u, %lu "
+                 "running", (unsigned)motor.sequence, (unsigned)command.argument,
+                 (unsigned long)motors.size() );
+}
+
+/* void sodaMachine::sendMotor( runningVend &motor )
+ *
+ * Input is not flushed as exchange() would: it may hold the answers of
+ *  the other motors.
+ */
+template< class GEOMETRY, class TRANSPORT, class CLOCK >
+void basicSodaMachine<GEOMETRY, TRANSPORT, CLOCK>::sendMotor( runningVend &motor )
+{
+  char CommandBuffer[3];
+
+  CommandBuffer[0] = CONCURRENTVEND_CHAR;
+  CommandBuffer[1] = (char)motor.sequence;
+  CommandBuffer[2] = motor.command.argument;
+  sendCommand( CommandBuffer, 3 );
+  motor.attempts++;
+  motor.due = linkClock.now() + vendRtt.timeout();
+}
+
+/* bool sodaMachine::motorAnswer( linkResult &result )
+ *
+ * Answers are 'Y', 'N' or 'L' and the seq, in the order the motors stop,
+ *  so they are matched by seq; one matching no running vend is a late
+ *  answer to a retry and is dropped. 'L' (no motor free) puts the
+ *  command back to be started again later, under a new seq, and holds
+ *  off new ones for VEND_MIN_TIMEOUT or until one of ours stops.
+ *
+ * A vend not answered by its due time is sent again under the same seq,
+ *  which the MCU answers without vending if it already has, up to
+ *  VEND_ATTEMPTS times; after that it is reported as failed.
+ */
+template< class GEOMETRY, class TRANSPORT, class CLOCK >
+bool basicSodaMachine<GEOMETRY, TRANSPORT, CLOCK>::motorAnswer( linkResult &result )
+{
+  int64_t until = linkClock.now() + MOTOR_SLICE * 1000LL;
+  unsigned char answer[2];
+  size_t i;
+
+  for( i = 0; i < motors.size(); i++ )
+    until = min<int64_t>( until, motors[i].due );
+
+  if( readBytes( answer, 1, until ) == 1 )
+  {
+    /* Letters are below 0x80 and seqs above, so a byte lost on the wire
+     *  only costs the answer it was part of, which is sent again */
+    if( ( answer[0] != 'Y' && answer[0] != 'N' && answer[0] != 'L' ) ||
+        readBytes( answer + 1, 1, linkClock.now() +
+                   INVENTORY_MIN_TIMEOUT * 1000LL ) != 1 ||
+        answer[1] < 0x80 )
+    {
+      vendLog.write( "sodaMachine::motorAnswer(): Part of an answer ('%c'), "
+                     "dropping it", answer[0] );
+      return false;
+    }
+
+    for( i = 0; i < motors.size(); i++ )
+      if( motors[i].sequence == answer[1] )
+        break;
+    if( i == motors.size() )
+    {
+      vendLog.write( "sodaMachine::motorAnswer(): Answer '%c' for vend %u, "
+                     "which is not running", answer[0], (unsigned)answer[1] );
+      return false;
+    }
+
+    runningVend motor = motors[i];
+    motors.erase( motors.begin() + i );
+
+    if( answer[0] == 'L' )
+    {
+      vendLog.write( "sodaMachine::motorAnswer(): No motor free for vend "
+                     "%u, trying slot %u again later", (unsigned)answer[1],
+                     (unsigned)motor.command.argument );
+      scheduler.defer( motor.command );
+      motorsRefused = linkClock.now() + VEND_MIN_TIMEOUT * 1000LL;
+      return false;
+    }
+
+    motorsRefused = 0;
+    if( motor.attempts == 1 )
+      vendRtt.sample( linkClock.now() - motor.sent );
+    result.id = motor.command.id;
+    result.command = motor.command.command;
+    result.result = answer[0] == 'Y' ? 0 : answer[0] == 'N' ? 1 : -1;
+    result.elapsed = linkClock.now() - motor.sent;
+    if( result.result == 1 )
+      sensors.empty( motor.command.argument );
+    journal.record( JOURNAL_VEND, motor.command.argument, result.result,
+                    result.elapsed );
+    return true;
+  }
+
+  /* Nothing in time: whatever is overdue goes again, or is given up on */
+  i = 0;
+  while( i < motors.size() )
+  {
+    runningVend &motor = motors[i];
+
+    if( motor.due > linkClock.now() )
+      i++;
+    else if( motor.attempts < VEND_ATTEMPTS )
+    {
+      vendLog.write( "sodaMachine::motorAnswer(): No answer to vend %u, "
+                     "sending it again", (unsigned)motor.sequence );
+      vendRtt.backoff();
+      sendMotor( motor );
+      i++;
+    }
+    else
+    {
+      vendLog.write( "sodaMachine::motorAnswer(): No answer to vend %u "
+                     "after %d attempts", (unsigned)motor.sequence,
+                     VEND_ATTEMPTS );
+      linkResult failed = { motor.command.id, motor.command.command, -1,
+                            linkClock.now() - motor.sent };
+      finished.push_back( failed );
+      journal.record( JOURNAL_VEND, motor.command.argument, -1, failed.elapsed );
+      motors.erase( motors.begin() + i );
+    }
+  }
+
+  return false;
+}
+
+/* bool sodaMachine::noSlot( const linkCommand &command, linkResult &result )
+ *
+ * The MCU leaves an 'M' for a slot it does not have unanswered (see
+ *  89C51/README), and slotSequence has no room for it.
+ */
+template< class GEOMETRY, class TRANSPORT, class CLOCK >
+bool basicSodaMachine<GEOMETRY, TRANSPORT, CLOCK>::noSlot( const linkCommand &command,
+                                                          linkResult &result )
+{
+  vendLog.write( "sodaMachine::service(): No slot %u to vend from",
+                 (unsigned)command.argument );
+  result.id = command.id;
+  result.command = command.command;
+  result.result = 1;
+  result.elapsed = 0;
+  return true;
+}
+
+/* bool sodaMachine::slotRunning( const unsigned short slot )
+ */
+template< class GEOMETRY, class TRANSPORT, class CLOCK >
+bool basicSodaMachine<GEOMETRY, TRANSPORT, CLOCK>::slotRunning( const unsigned short slot ) const
+{
+  for( size_t i = 0; i < motors.size(); i++ )
+    if( motors[i].command.argument == slot )
+      return true;
+  return false;
+}
+
+/* size_t sodaMachine::pipeline( commands, count, timeout )
+ *
+ * Writes commands while the window admits them, then waits for the oldest
+ *  answer, whose arrival gives its command's credits back. Between
+ *  commands the kernel's queue is let drain to FLOW_QUEUED, so a command
+ *  waits in the host, where it costs nothing, rather than in the kernel.
+ *
+ * An answer that does not come within timeout ends the pipeline: the
+ *  commands after it may or may not have been acted on, and which to send
+ *  again is the caller's to decide, as is what a well-formed answer is.
+ *  Sending them all again is safe: a 'W' is held back until the 'W'
+ *  before it is answered, so an unanswered 'W' is always the MCU's last
+ *  seq, which it answers again without vending. With two in flight, the
+ *  first one's repeat would be a new seq to the MCU, and a second can.
+ *  For the same reason a 'W' only counts as answered by its own seq.
+ */
+template< class GEOMETRY, class TRANSPORT, class CLOCK >
+size_t basicSodaMachine<GEOMETRY, TRANSPORT, CLOCK>::pipeline( pipelinedCommand *commands,
+                                                              const size_t count,
+                                                              const int64_t timeout )
+{
+  size_t sent = 0;
+  size_t answered = 0;
+  size_t lastVend = count;           // the last 'W' sent, if any
+
+  assert( initComplete );
+
+  flushInput();
+  credits.reset();
+
+  while( answered < count )
+  {
+    bool vendHeld = false;
+
+    while( sent < count && credits.admits( commands[sent].length ) )
+    {
+      if( commands[sent].bytes[0] == SEQUENCEDVEND_CHAR )
+      {
+        if( lastVend < count && lastVend >= answered )
+        {
+          vendHeld = true;
+          break;
+        }
+        lastVend = sent;
+      }
+      if( credits.queueFull( port.outputQueued( linkClock.now() ) ) )
+      {
+        credits.queueStalls++;
+        port.waitDrained( linkClock, credits.queueLimit(),
+                          linkClock.now() + timeout );
+      }
+      sendCommand( commands[sent].bytes, commands[sent].length );
+      credits.sent( commands[sent].length );
+      sent++;
+    }
+    if( sent < count && !vendHeld )
+      credits.creditStalls++;
+
+    pipelinedCommand &oldest = commands[answered];
+    if( readBytes( oldest.reply, oldest.replyLength,
+                   linkClock.now() + timeout ) != (int)oldest.replyLength )
+    {
+      vendLog.write( "sodaMachine::pipeline(): No answer to command %lu of "
+                     "%lu ('%c'), %lu more were sent", (unsigned long)answered,
+                     (unsigned long)count, oldest.bytes[0],
+                     (unsigned long)( sent - answered - 1 ) );
+      break;
+    }
+
+    /* Out of step answers would let the next 'W' go before this one. The
+     *  rest of them are waited out, as a lost answer's would have been, so
+     *  that the caller's retry does not read them */
+    if( oldest.bytes[0] == SEQUENCEDVEND_CHAR && oldest.replyLength >= 2 &&
+        oldest.reply[1] != oldest.bytes[1] )
+    {
+      char stale[PIPELINE_REPLY];
+
+      vendLog.write( "sodaMachine::pipeline(): The answer to command %lu "
+                     "of %lu ('%c') is not its seq's", (unsigned long)answered,
+                     (unsigned long)count, oldest.bytes[0] );
+      while( readBytes( stale, sizeof(stale), linkClock.now() + timeout ) ==
+             (int)sizeof(stale) )
+        ;
+      break;
+    }
+    credits.answered();
+    answered++;
+  }
+
+  credits.reset();
+  return answered;
+}
+
+/* bool sodaMachine::nextEvent( pushedEvent &event )
+ */
+template< class GEOMETRY, class TRANSPORT, class CLOCK >
+bool basicSodaMachine<GEOMETRY, TRANSPORT, CLOCK>::nextEvent( pushedEvent &event )
+{
+  if( !pushedEvents )
+    return false;
+
+  /* Between the answers of running motors nothing may be dropped;
+   *  motorAnswer() takes out the events on its way */
+  if( motors.empty() )
+    receiveEvents( linkClock.now() );
+  if( eventCount == 0 )
+    return false;
+
+  event = queuedEvent( 0 );
+  dropEvent( 0 );
+  return true;
+}
+
+/* bool sodaMachine::exchange( command, length, reply, replyLength, rtt,
+ *                             retransmission )
+ *
+ * One attempt at a command: sends it and waits the rtt's timeout for
+ *  replyLength bytes. Input is flushed first, so that a late answer to an
+ *  earlier attempt is not read as this one's.
+ *
+ * Returns true if the whole reply arrived. Feeds the round-trip time into
+ *  rtt unless this is a retransmission, or backs it off on a timeout.
+ */
+template< class GEOMETRY, class TRANSPORT, class CLOCK >
+bool basicSodaMachine<GEOMETRY, TRANSPORT, CLOCK>::exchange( const char *command,
+                                                            const size_t length,
+                                                            char *reply,
+                                                            const size_t replyLength,
+                                                            rttEstimator &rtt,
+                                                            const bool retransmission )
+{
+  flushInput();
+  sendCommand( command, length );
+
+  int64_t sent = linkClock.now();
+  if( readBytes( reply, replyLength, sent + rtt.timeout() ) != (int)replyLength )
+  {
+    rtt.backoff();
+    return false;
+  }
+
+  if( !retransmission )
+    rtt.sample( linkClock.now() - sent );
+  return true;
+}
+
+/* void sodaMachine::sendCommand( const char *command, const size_t length )
+ *
+ * write():
+ * If successful, returns the number of bytes written.
+ * If unsuccessful, returns -1 & sets errno. A port that cannot be written
+ *  to is not coming back, so that exits.
+ */
+template< class GEOMETRY, class TRANSPORT, class CLOCK >
+void basicSodaMachine<GEOMETRY, TRANSPORT, CLOCK>::sendCommand( const char *command,
+                                                               const size_t length )
+{
+  int readWriteResult = port.send( command, length, linkClock.now() );
+
+  if( readWriteResult != (int)length )
+  {
+    vendLog.write( "sodaMachine::sendCommand(): Write returned an "
+                   "unexpected value. Expected %lu, received %ld",
+                   (unsigned long)length, (long)readWriteResult );
+    vendLog.write( "sodaMachine::sendCommand(): Exiting" );
+    exit( EXIT_FAILURE );
+  }
+}
+
+/* int sodaMachine::readBytes( void *buf, size_t length, int64_t deadline )
+ *
+ * The port is non-blocking, so a plain read right after a write finds
+ *  nothing yet. Wait for the rest of the reply, but never past the
+ *  deadline (on the CLOCK's time base).
+ */
+template< class GEOMETRY, class TRANSPORT, class CLOCK >
+int basicSodaMachine<GEOMETRY, TRANSPORT, CLOCK>::readBytes( void *buf,
+                                                            const size_t length,
+                                                            const int64_t deadline )
+{
+  char *next = (char *)buf;
+  size_t got = 0;
+  unsigned char byte;
+
+  while( got < length )
+  {
+    /* Until the reply starts, byte by byte, to take out event frames */
+    if( pushedEvents && ( got == 0 || !frame.empty() ) )
+    {
+      if( port.receive( &byte, 1, linkClock.now() ) == 1 )
+      {
+        if( !demux( byte, got == 0 ) )
+          next[got++] = byte;
+        continue;
+      }
+    }
+    else
+      got += port.receive( next + got, length - got, linkClock.now() );
+
+    if( got < length && !port.waitReadable( linkClock, deadline ) )
+      break;
+  }
+
+  return (int)got;
+}
+
+/* bool sodaMachine::demux( const unsigned char byte, const bool boundary )
+ *
+ * Collects an event frame and, once its check byte is in, queues the
+ *  event. A frame with a bad length or check is dropped, and since it
+ *  may have been an inventory change, the inventory is asked for again.
+ *  So is it when the event seq skips: a whole frame was lost.
+ */
+template< class GEOMETRY, class TRANSPORT, class CLOCK >
+bool basicSodaMachine<GEOMETRY, TRANSPORT, CLOCK>::demux( const unsigned char byte,
+                                                         const bool boundary )
+{
+  int64_t now = linkClock.now();
+
+  if( !frame.empty() && now - frameFrom > FRAME_GAP * 1000LL )
+  {
+    vendLog.write( "sodaMachine::demux(): Event frame cut short, dropping "
+                   "it" );
+    frame.clear();
+    inventoryStale = true;
+  }
+
+  if( frame.empty() )
+  {
+    if( !boundary || byte != FRAME_START )
+      return false;
+    frameFrom = now;
+  }
+
+  frame += (char)byte;
+  if( frame.size() == 2 && ( byte < 5 || byte > FRAME_MAX ) )
+  {
+    vendLog.write( "sodaMachine::demux(): Event frame length %u is "
+                   "impossible, dropping it", (unsigned)byte );
+    frame.clear();
+    inventoryStale = true;
+    return true;
+  }
+  if( frame.size() < 2 || frame.size() < (unsigned char)frame[1] + 3U )
+    return true;
+
+  unsigned char sum = 0;
+  for( size_t i = 1; i < frame.size(); i++ )
+    sum += (unsigned char)frame[i];
+  if( sum != 0 )
+  {
+    vendLog.write( "sodaMachine::demux(): Event frame fails its check, "
+                   "dropping it" );
+    frame.clear();
+    inventoryStale = true;
+    return true;
+  }
+
+  /* [2] seq, [3] kind, [4] data, then two bytes of time and the check */
+  unsigned char sequence = frame[2];
+  size_t dataLength = frame.size() - 7;
+  const unsigned char *data = (const unsigned char *)frame.data() + 4;
+  pushedEvent event;
+
+  if( lastEventSequence >= 0 && sequence != ( ( lastEventSequence + 1 ) & 0xFF ) )
+  {
+    vendLog.write( "sodaMachine::demux(): Missed %d events",
+                   ( sequence - lastEventSequence - 1 ) & 0xFF );
+    inventoryStale = true;
+  }
+  lastEventSequence = sequence;
+
+  event.kind = frame[3];
+  event.button = -1;
+  event.mcuTime = data[dataLength] << 8 | data[dataLength + 1];
+  event.received = now;
+
+  if( event.kind == 'b' && dataLength == 1 && GEOMETRY::validButton( data[0] ) )
+    event.button = data[0];
+  else if( event.kind == 's' )
+  {
+    for( size_t slot = 0; slot < GEOMETRY::slotCount && slot / 8 < dataLength;
+         slot++ )
+      event.bits.set( slot, ( data[slot / 8] >> ( slot % 8 ) ) & 1 );
+    pushedInventory = event.bits;
+    inventoryStale = false;
+  }
+  else
+  {
+    vendLog.write( "sodaMachine::demux(): Unknown event '%c', ignoring it",
+                   event.kind );
+    frame.clear();
+    return true;
+  }
+
+  queueEvent( event );
+  frame.clear();
+  return true;
+}
+
+/* void sodaMachine::queueEvent( const pushedEvent &event )
+ *
+ * A full ring loses its oldest event. The inventory is read again in case
+ *  it was one; a lost button press is only logged, like a missed frame.
+ */
+template< class GEOMETRY, class TRANSPORT, class CLOCK >
+void basicSodaMachine<GEOMETRY, TRANSPORT, CLOCK>::queueEvent( const pushedEvent &event )
+{
+  if( eventCount == events.size() )
+  {
+    vendLog.write( "sodaMachine::queueEvent(): %d events waiting, dropping "
+                   "the oldest ('%c')", (int)eventCount, queuedEvent( 0 ).kind );
+    dropEvent( 0 );
+    inventoryStale = true;
+  }
+  queuedEvent( eventCount++ ) = event;
+}
+
+/* void sodaMachine::dropEvent( const size_t i )
+ *
+ * Those after it move up one; the ring is short and rarely holds more
+ *  than one or two.
+ */
+template< class GEOMETRY, class TRANSPORT, class CLOCK >
+void basicSodaMachine<GEOMETRY, TRANSPORT, CLOCK>::dropEvent( const size_t i )
+{
+  if( i == 0 )
+  {
+    eventFirst = ( eventFirst + 1 ) % events.size();
+    eventCount--;
+    return;
+  }
+  for( size_t later = i + 1; later < eventCount; later++ )
+    queuedEvent( later - 1 ) = queuedEvent( later );
+  eventCount--;
+}
+
+/* bool sodaMachine::receiveEvents( const int64_t until )
+ *
+ * Between replies anything but an event frame is a stale answer, and is
+ *  dropped like flushInput() would. Returns true if an event was queued.
+ */
+template< class GEOMETRY, class TRANSPORT, class CLOCK >
+bool basicSodaMachine<GEOMETRY, TRANSPORT, CLOCK>::receiveEvents( const int64_t until )
+{
+  size_t queued = eventCount;
+  unsigned char byte;
+
+  do
+  {
+    while( port.receive( &byte, 1, linkClock.now() ) == 1 )
+      demux( byte, true );
+    if( eventCount > queued )
+      return true;
+  } while( port.waitReadable( linkClock, until ) );
+
+  return false;
+}
+
+/* void sodaMachine::flushInput()
+ */
+template< class GEOMETRY, class TRANSPORT, class CLOCK >
+void basicSodaMachine<GEOMETRY, TRANSPORT, CLOCK>::flushInput()
+{
+  if( pushedEvents )
+    receiveEvents( linkClock.now() );
+  else
+    port.flushInput( linkClock.now() );
+}
+
+/* int sodaMachine::waitButtonEvent( const int64_t until )
+ *
+ * Inventory events met on the way stay queued for nextEvent().
+ */
+template< class GEOMETRY, class TRANSPORT, class CLOCK >
+int basicSodaMachine<GEOMETRY, TRANSPORT, CLOCK>::waitButtonEvent( const int64_t until )
+{
+  do
+  {
+    for( size_t i = 0; i < eventCount; i++ )
+      if( queuedEvent( i ).kind == 'b' )
+      {
+        int button = queuedEvent( i ).button;
+        dropEvent( i );
+        return button < 0 ? -2 : button;
+      }
+  } while( receiveEvents( until ) || linkClock.now() < until );
+
+  return -1;
+}
+
+/* bool sodaMachine::startButtonPoll()
+ *
+ * Sends the button command. A later command byte ends the MCU's wait, so
+ *  a poll can be abandoned at any time; input is flushed first so that a
+ *  stale button byte is not taken for this poll's answer.
+ */
+template< class GEOMETRY, class TRANSPORT, class CLOCK >
+bool basicSodaMachine<GEOMETRY, TRANSPORT, CLOCK>::startButtonPoll()
+{
+  const char COMMAND = RETURNBUTTONPRESS_CHAR;
+  int readWriteResult;
+
+  /* Pushed presses need no command; only those from now on count */
+  if( pushedEvents )
+  {
+    receiveEvents( linkClock.now() );
+    for( size_t i = eventCount; i-- > 0; )
+      if( queuedEvent( i ).kind == 'b' )
+        dropEvent( i );
+    return true;
+  }
+
+  port.flushInput( linkClock.now() );
+
+  vendLog.write( "sodaMachine::startButtonPoll(): Writing command to "
+                 "serial" );
+  if ( (readWriteResult = port.send( &COMMAND, 1, linkClock.now() ) ) != 1 )
+  {
+    vendLog.write( "sodaMachine::startButtonPoll(): write() return an "
+                   "unexpected value. Expected 1, recieved %ld",
+                   (long)readWriteResult );
+    return false;
+  }
+
+  return true;
+}
+
+/* int sodaMachine::pollButton( int64_t until )
+ *
+ * Waits for the answer to a button poll until the given time.
+ *  Returns the button, -1 if nothing arrived, -2 if the byte is not one
+ *  of the machine's buttons.
+ */
+template< class GEOMETRY, class TRANSPORT, class CLOCK >
+int basicSodaMachine<GEOMETRY, TRANSPORT, CLOCK>::pollButton( const int64_t until )
+{
+  unsigned char button;
+
+  if( pushedEvents )
+    return waitButtonEvent( until );
+
+  if( readBytes( &button, 1, until ) != 1 )
+    return -1;
+
+  return GEOMETRY::validButton( button ) ? button : -2;
+}
+
+/* unsigned long sodaMachine::submit( command, argument, priority, deadline )
+ *
+ * Queues a command for service(). Nothing is sent until then.
+ */
+template< class GEOMETRY, class TRANSPORT, class CLOCK >
+unsigned long basicSodaMachine<GEOMETRY, TRANSPORT, CLOCK>::submit( const char command,
+                                                  const unsigned short argument,
+                                                  const linkPriority priority,
+                                                  int64_t deadline )
+{
+  if( command == RETURNBUTTONPRESS_CHAR && deadline == 0 )
+    deadline = linkClock.now() + BUTTON_POLL_LIMIT * 1000000LL;
+
+  unsigned long id = scheduler.submit( command, argument, priority, deadline );
+
+  vendLog.write( "sodaMachine::submit(): Queued '%c' %u as command %lu, "
+                 "priority %d", command, (unsigned)argument, id, (int)priority );
+
+  return id;
+}
+
+/* bool sodaMachine::service( linkResult &result )
+ *
+ * One step of the link:
+ *  - Report commands dropped at their deadline
+ *  - If a button poll is on the link, yield it to any waiting
+ *     non-background command, or else wait one slice for the button
+ *  - If batch vends are running, start the next if it is one and a motor
+ *     is free, or else wait one slice for an answer. Nothing else is
+ *     sent until they have all stopped: it would be answered between
+ *     theirs, and a 'V' waits for their motors in the MCU anyway.
+ *  - Otherwise run the most urgent command. 'S' and 'V' are short and
+ *     run to completion; 'B' and 'M' are only started.
+ *
+ * Returns true and fills in result when a command has finished.
+ */
+template< class GEOMETRY, class TRANSPORT, class CLOCK >
+bool basicSodaMachine<GEOMETRY, TRANSPORT, CLOCK>::service( linkResult &result )
+{
+  int64_t now = linkClock.now();
+  linkCommand command;
+  bool preempted = false;
+
+  assert( initComplete );
+
+  expired.clear();
+  scheduler.expire( now, expired );
+  for( size_t i = 0; i < expired.size(); i++ )
+  {
+    vendLog.write( "sodaMachine::service(): Dropping command %lu ('%c' %u), "
+                   "its deadline passed %lld ms ago", expired[i].id,
+                   expired[i].command, (unsigned)expired[i].argument,
+                   (long long)( ( now - expired[i].deadline ) / 1000 ) );
+    linkResult dropped = { expired[i].id, expired[i].command, LINK_EXPIRED,
+                           0 };
+    finished.push_back( dropped );
+  }
+
+  if( !finished.empty() )
+  {
+    result = finished.front();
+    finished.erase( finished.begin() );
+    return true;
+  }
+
+  if( !motors.empty() )
+  {
+    if( motors.size() < motorLimit && now >= motorsRefused &&
+        scheduler.next( command, now ) )
+    {
+      if( command.command == CONCURRENTVEND_CHAR &&
+          !validSlot( command.argument ) )
+        return noSlot( command, result );
+      if( command.command == CONCURRENTVEND_CHAR &&
+          !slotRunning( command.argument ) )
+      {
+        startMotor( command );
+        return false;
+      }
+      scheduler.defer( command );
+    }
+    return motorAnswer( result );
+  }
+
+  if( buttonActive )
+  {
+    if( scheduler.urgentWaiting() )
+    {
+      vendLog.write( "sodaMachine::service(): Preempting button poll %lu",
+                     buttonPoll.id );
+      preempted = true;
+      buttonActive = false;
+    }
+    else
+    {
+      int64_t until = min<int64_t>( buttonPoll.deadline, now + BUTTON_SLICE * 1000LL );
+      int button = pollButton( until );
+
+      if( button == -1 && linkClock.now() < buttonPoll.deadline )
+        return false;
+      if( button == -2 )
+      {
+        /* Line noise, keep waiting for a real button */
+        startButtonPoll();
+        return false;
+      }
+
+      buttonActive = false;
+      journal.record( JOURNAL_BUTTON, 0, button,
+                      ( linkClock.now() - buttonStart ) );
+      result.id = buttonPoll.id;
+      result.command = buttonPoll.command;
+      result.result = button;
+      result.elapsed = linkClock.now() - buttonStart;
+      return true;
+    }
+  }
+
+  /* A preempted poll goes back only once the command that preempted it
+   *  is off the queue, whatever their deadlines
+   */
+  bool found = scheduler.next( command, now );
+  if( preempted )
+    scheduler.defer( buttonPoll );
+  if( !found )
+    return false;
+
+  result.id = command.id;
+  result.command = command.command;
+  result.elapsed = 0;
+
+  switch( command.command )
+  {
+    case 'V':
+      result.result = vendSoda( command.argument );
+      result.elapsed = linkClock.now() - now;
+      return true;
+
+    case CONCURRENTVEND_CHAR:
+      if( motorLimit == 0 )
+      {
+        result.result = vendSoda( command.argument );
+        result.elapsed = linkClock.now() - now;
+        return true;
+      }
+      if( !validSlot( command.argument ) )
+        return noSlot( command, result );
+      /* Refused a moment ago with nothing of ours running: the MCU's
+       *  motors are someone else's, e.g. a daemon that crashed */
+      if( now < motorsRefused )
+      {
+        scheduler.defer( command );
+        linkClock.sleepUntil( min<int64_t>( motorsRefused,
+                                            now + MOTOR_SLICE * 1000LL ) );
+        return false;
+      }
+      startMotor( command );
+      return false;
+
+    case RETURNINVENTORY_CHAR:
+      cachedInventory = getSodaInventory();
+      result.result = 0;
+      result.elapsed = linkClock.now() - now;
+      return true;
+
+    case RETURNBUTTONPRESS_CHAR:
+      if( !startButtonPoll() )
+      {
+        result.result = -1;
+        return true;
+      }
+      buttonStart = linkClock.now();
+      buttonPoll = command;
+      buttonActive = true;
+      return false;
+
+    default:
+      vendLog.write( "sodaMachine::service(): Unknown command '%c', "
+                     "dropping it", command.command );
+      result.result = -1;
+      return true;
+  }
+}
+
+/* The geometry this build was configured for, on the serial port and on
+ *  the in-process emulator */
+template class basicSodaMachine< machineGeometry<SODA_SLOTS> >;
+template class basicSodaMachine< machineGeometry<SODA_SLOTS>,
+                                 loopbackTransport, virtualClock >;
@@ -2,11 +2,46 @@
 #define SODAMACHINE
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
 #include <termios.h>
 #include <fcntl.h>
 #include <fstream>
 #include <fcntl.h>
+#include <poll.h>
 #include <iostream>
+#include <vector>
+#include <string>
+
+#include "machineGeometry.h"
+#include "lineLog.h"
+#include "vendJournal.h"
+#include "linkScheduler.h"
+#include "linkClock.h"
+#include "serialTransport.h"
+#include "loopbackTransport.h"
+#include "rttEstimator.h"
+#include "creditWindow.h"
+#include "inventoryFilter.h"
+
+/* A command for pipeline(): its bytes, the length of its answer, and the
+ *  answer once it has come (at most an inventory of 256 slots in hex) */
+#define PIPELINE_REPLY 72
+
+struct pipelinedCommand
+{
+  char bytes[4];
+  size_t length;
+  char reply[PIPELINE_REPLY];
+  size_t replyLength;
+};
+
+/* Slot count of the machine this build drives, e.g. make CXXFLAGS+=-DSODA_SLOTS=48 */
+#ifndef SODA_SLOTS
+#define SODA_SLOTS 8
+#endif
 
 using namespace std;
 
@@ -14,16 +49,31 @@ using namespace std;
  * sodaMachine class: Provides the interface between the other programs
  *                    and the soda machine's MCU.
  *
+ * basicSodaMachine is templated on a machineGeometry (slot count, button
+ * count, inventory encoding); sodaMachine is the one for this build's
+ * SODA_SLOTS. Slot checks and inventory decoding are resolved at compile
+ * time, so larger machines need no runtime branching.
+ *
+ * It is also templated on how it reaches the MCU (TRANSPORT, see
+ * serialTransport.h) and how it tells time (CLOCK, see linkClock.h).
+ * sodaMachine uses the serial port and the system clock;
+ * emulatedSodaMachine talks to an in-process mcuModel on a virtual clock,
+ * so tests and benchmarks need neither a tty nor real waiting.
+ *
  * Functions:
  *
- * - void serialConnect()
- *       Sets up a connection with the MCU via serial port.
+ * - basicSodaMachine( const int descriptor = -1 )
+ *       Connects to the MCU, or with a descriptor, adopts the connection
+ *       an upgrading sodaDaemon handed over.
+ *
+ * - void connect( const int descriptor )
+ *       Sets up a connection with the MCU via the TRANSPORT.
  *
- * - int getSodaInventory()
- *       Returns an int representing inventory. If that number
- *       is displayed in binary, 1 = yes, 0 = no.
- *       Currently returns 0 always because I don't know what the MCU
- *       returns yet.
+ * - inventory getSodaInventory()
+ *       Returns a bitset with bit n set if slot n has soda, through the
+ *       sensor history (see sensorHistory()) unless the MCU pushes its
+ *       inventory. All bits are clear if the MCU's reply could not be
+ *       decoded.
  *
  * - bool hasSoda( const unsigned short slot )
  *       Checks if a single slot has soda.
@@ -33,59 +83,362 @@ using namespace std;
  *       Vends a soda. Returns 0 if that is successful, 1 if that slot is
  *       empty, and -1 on any other error.
  *
+ * - bool setSequencedVends( const bool enable )
+ *       Vends with the MCU's retryable 'W' command, which carries a
+ *       sequence number so that a vend whose answer is lost can be sent
+ *       again without dropping a second can. Returns false if the
+ *       firmware does not support it.
+ *
+ * - bool setPushedEvents( const bool enable )
+ *       Asks the MCU to push button presses and inventory changes as they
+ *       happen (its 'E' command) instead of waiting to be polled. From
+ *       then on getSodaInventory() answers from the pushed inventory and
+ *       button waits send nothing. Returns false if the firmware does not
+ *       support it.
+ *
+ * - bool nextEvent( pushedEvent &event )
+ *       Takes the oldest pushed event, reading whatever the MCU has sent
+ *       without waiting. Returns false if there is none.
+ *
+ * - bool setFlowControl( const bool enable )
+ *       Asks the MCU how much room its receive ring has ('C') and lets
+ *       pipeline() keep that many bytes in flight (see creditWindow.h).
+ *       Returns false, leaving one command at a time, if the firmware
+ *       does not say.
+ *
+ * - size_t pipeline( pipelinedCommand *commands, size_t count,
+ *                    int64_t timeout )
+ *       Sends commands back to back, as fast as the credits and the
+ *       kernel's output queue allow, and reads their answers in order.
+ *       Returns how many were answered, stopping at the first answer not
+ *       in within timeout. At most one 'W' is in flight, so the commands
+ *       from the unanswered one on can all be sent again.
+ *
+ *       Only flowControlBench uses setFlowControl() and pipeline(): the
+ *       daemon's commands go through service(), one at a time (batch
+ *       vends excepted, see setMotorLimit()), and it never asks for
+ *       credits. They are the measured groundwork for pipelining the
+ *       link, not a mode sodaDaemon runs in.
+ *
+ * - bool setMotorLimit( const unsigned limit )
+ *       Lets batch vends ('M' commands, see submit()) run up to limit
+ *       motors at once, or as many as the MCU grants ('L'). Returns
+ *       false, leaving them one at a time, if the firmware does not
+ *       support it. Call it while no batch vend runs.
+ *
  * - int getButtonInput( time_t timeout )
  *       Returns the number of the first button that is pressed during
  *       the timeout period.
  *       Returns -1 if the timeout expires before an input is read.
  *
+ * - unsigned long submit( char command, unsigned short argument,
+ *                         linkPriority priority, int64_t deadline )
+ *       Queues 'S', 'B', 'V' or 'M' (argument: the slot) on the link
+ *       scheduler instead of running it now. 'M' is a vend from a batch:
+ *       with setMotorLimit() it is started without waiting for the motor,
+ *       alongside other 'M's up to the limit, and reported when its own
+ *       answer comes. Deadlines are linkScheduler::now() microseconds; a
+ *       button poll without one gets BUTTON_POLL_LIMIT. Returns the id
+ *       its linkResult will carry.
+ *
+ * - bool service( linkResult &result )
+ *       Does the next bit of work on the link: sends the most urgent
+ *       command, or waits one slice for a button or a running motor.
+ *       Returns true and fills in result when a command completes or is
+ *       dropped at its deadline. Call it whenever pending() is non-zero.
+ *
+ * - size_t pending()
+ *       Commands submitted but not yet reported by service().
+ *
+ * - size_t motorsRunning(), unsigned motorsAllowed()
+ *       Batch vends started and not yet answered, and how many may run
+ *       at once (0: 'M' is a plain vend).
+ *
+ * - bool urgentWaiting()
+ *       True if a non-background command is waiting to be sent. Callers
+ *       with their own queue feed the scheduler one command at a time.
+ *
+ * - const inventory &lastInventory()
+ *       The inventory read by the last 'S' that service() ran.
+ *
+ * - TRANSPORT &getTransport(), CLOCK &getClock()
+ *       For tests and benchmarks to script the emulated MCU and move
+ *       the virtual clock.
+ *
+ * - rttEstimator &roundTrip( const char command )
+ *       The round-trip estimate of 'S' or 'V', e.g. to fix its timeout.
+ *
+ * - inventoryFilter<> &sensorHistory()
+ *       The last INVENTORY_HISTORY inventories the MCU reported, which
+ *       getSodaInventory() answers from: a slot reads empty only once
+ *       they all agree, so one sensor dropout does not refuse a vend.
+ *       configure() it to keep more or fewer (1: every sample as it is);
+ *       its flickers() are the dropouts it hid, per slot. Not used once
+ *       setPushedEvents() succeeds: pushes are debounced by the firmware
+ *       and come only on a change, so there is nothing to filter and no
+ *       later reading to end a hold.
+ *
+ * - creditWindow &flowCredits()
+ *       pipeline()'s window, e.g. to read its stalls, or for a benchmark
+ *       to open it wide.
+ *
+ * - bool exchange( const char *command, size_t length, char *reply,
+ *                  size_t replyLength, rttEstimator &rtt,
+ *                  bool retransmission )
+ *       Sends a command and waits rtt's timeout for its reply. Returns
+ *       false on a timeout.
+ *
+ * - int vendOnce( slot ), int vendSequenced( slot )
+ *       The legacy vend, never repeated, and the retryable one.
+ *
+ * - unsigned char nextSequence()
+ *       The next vend seq, for 'W' and 'M' alike.
+ *
+ * - void startMotor( const linkCommand &command ),
+ *   void sendMotor( runningVend &motor )
+ *       Starts a batch vend, and sends its 'M' (again, after a timeout).
+ *
+ * - bool motorAnswer( linkResult &result )
+ *       Waits one slice, or until a batch vend is overdue, for the answer
+ *       to any of them and fills in result with it. Overdue ones are sent
+ *       again. Returns false if none was answered.
+ *
+ * - bool slotRunning( const unsigned short slot )
+ *       Whether a batch vend from that slot is running.
+ *
+ * - void journalInventory( const inventory &bits, const int64_t duration )
+ *       Records an inventory in the journal, JOURNAL_SLOTS slots a record.
+ *
+ * - bool noSlot( const linkCommand &command, linkResult &result )
+ *       Answers a batch vend from a slot the machine does not have with
+ *       1, as vendSoda() would, without sending it. Returns true.
+ *
+ * - int readBytes( void *buf, size_t length, int64_t deadline )
+ *       Reads until length bytes arrive or the deadline passes. Returns
+ *       the number of bytes read. With pushed events, event frames met
+ *       before the first byte of the reply are taken out of the stream.
+ *
+ * - bool demux( unsigned char byte, bool boundary )
+ *       Feeds one byte to the event frame parser. Returns true if it was
+ *       part of an event frame. A frame can only start at a reply
+ *       boundary: the MCU never pushes one in the middle of an answer.
+ *
+ * - bool receiveEvents( int64_t until ), void flushInput()
+ *       Reads event frames until one arrives or until passes, discarding
+ *       anything else; flushInput() is that without waiting, or a plain
+ *       flush when events are not pushed.
+ *
+ * - int waitButtonEvent( int64_t until )
+ *       A button poll with pushed events: the first button event by then.
+ *
+ * - void queueEvent( const pushedEvent &event ),
+ *   pushedEvent &queuedEvent( size_t i ), void dropEvent( size_t i )
+ *       The event ring: queues an event (dropping the oldest when full),
+ *       the i-th from the oldest, and takes that one out.
+ *
+ * - int pollButton( int64_t until )
+ *       Waits for the reply to a button poll until the given time.
+ *       Returns the button, -1 on a timeout, -2 on line noise.
+ *
  * - inline const bool validSlot ( const short slot )
- *       Returns true if the number is in the interval [0, 7].
+ *       Returns true if the number is in the interval [0, slotCount).
  *
  * Variables:
  *
- * - int fileDes
- *       Holds the file descriptor of the serial port connection opened
- *       in serialConnect().
+ * - TRANSPORT port
+ *       The connection to the MCU opened in connect().
+ *
+ * - CLOCK linkClock
+ *       Timeouts, deadlines and journal durations are measured on it.
  *
  * - bool initComplete
  *       Holds whether or not a serial connection has been intialized
  *       successfully.
  *
- * - termios oldtio
- *       Holds the old terminal IO settings that are overwritten when
- *       serialConnect makes a new connection.
+ * - vendJournal journal
+ *       Structured record of every vend, inventory check and button read,
+ *       kept in JOURNAL_DIR. Query it with sodaJournal.
+ *
+ * - rttEstimator inventoryRtt, vendRtt
+ *       Round-trip estimates, and so timeouts, for each kind of command.
+ *       Inventory queries are repeated on a timeout; vends only with
+ *       sequencedVends, each under the next vendSequence.
+ *
+ * - creditWindow credits
+ *       Bytes pipeline() may have on their way to the MCU.
+ *
+ * - inventoryFilter<> sensors
+ *       The inventories 'S' read, bit-sliced. A vend the MCU answers 'N'
+ *       clears its slot's history: that answer is no sensor reading.
+ *
+ * - vector<runningVend> motors, unsigned motorLimit, int64_t motorsRefused
+ *       Batch vends sent and not yet answered, how many may run at once
+ *       (0: 'M' is a plain vend), and until when none is started because
+ *       the MCU answered one 'L' (no motor free).
  *
- * - termios newtio
- *       Holds the new terminal IO settings that serialConnect uses.
+ * - unsigned char slotSequence[]
+ *       The seq of each slot's last 'M'. The MCU answers a slot's last seq
+ *       again without vending, so the next 'M' to that slot never reuses it.
+ *
+ * - lineLog vendLog
+ *       The text log, LOG_NAME.
+ *
+ * - linkScheduler scheduler
+ *       Commands waiting for the link, earliest deadline first.
+ *
+ * - vector<linkCommand> expired, vector<linkResult> finished
+ *       Commands the scheduler dropped at their deadline, and their
+ *       results until service() reports them. Both keep their capacity,
+ *       so service() allocates nothing once they have grown.
+ *
+ * - linkCommand buttonPoll, bool buttonActive
+ *       The button poll on the link, if any. It is preempted (put back in
+ *       the scheduler and re-sent later) whenever another non-background
+ *       command is waiting, so a long button wait never holds the link.
+ *
+ * - bool pushedEvents
+ *       Whether the MCU pushes events.
+ *
+ * - vector<pushedEvent> events, size_t eventFirst, size_t eventCount
+ *       The events not yet taken: a ring of EVENT_QUEUE, sized by the
+ *       constructor, holding eventCount of them from eventFirst on, so
+ *       that events allocate nothing however many the MCU pushes.
+ *
+ * - inventory pushedInventory, bool inventoryStale
+ *       The inventory as last pushed. It is stale, and 'S' is sent
+ *       again, until the first push or after an event was missed.
+ *
+ * - string frame, int64_t frameFrom, int lastEventSequence
+ *       The event frame being received, when it started, and the seq of
+ *       the last one (-1 for none yet), to notice missed ones.
  \*****************************************************************************/
 
-class sodaMachine
+template< class GEOMETRY, class TRANSPORT = serialTransport,
+          class CLOCK = systemClock >
+class basicSodaMachine
 {
   public:
-    sodaMachine();
-    ~sodaMachine();
+    typedef GEOMETRY geometry;
+    typedef typename GEOMETRY::inventory inventory;
+
+    struct pushedEvent
+    {
+      char kind;                   // 'b' button pressed, 's' inventory changed
+      int button;
+      inventory bits;
+      unsigned mcuTime;            // MCU milliseconds, wrapping at 65536
+      int64_t received;            // on the CLOCK
+    };
+
+    basicSodaMachine( const int descriptor = -1 );
+    ~basicSodaMachine();
 	
-    int getSodaInventory();
+    inventory getSodaInventory();
     int getButtonInput( time_t timeout );
     bool hasSoda( const unsigned short slot );
     int vendSoda( const unsigned short slot );
+    bool setSequencedVends( const bool enable );
+    bool setPushedEvents( const bool enable );
+    bool nextEvent( pushedEvent &event );
+    bool setFlowControl( const bool enable );
+    bool setMotorLimit( const unsigned limit );
+    size_t pipeline( pipelinedCommand *commands, const size_t count,
+                     const int64_t timeout );
+
+    unsigned long submit( const char command, const unsigned short argument,
+                          const linkPriority priority, const int64_t deadline );
+    bool service( linkResult &result );
+    size_t pending() const
+      { return scheduler.waiting() + finished.size() + motors.size() +
+               ( buttonActive ? 1 : 0 ); };
+    size_t motorsRunning() const { return motors.size(); };
+    unsigned motorsAllowed() const { return motorLimit; };
+    bool urgentWaiting() const { return scheduler.urgentWaiting(); };
+    const inventory &lastInventory() const { return cachedInventory; };
+
+    TRANSPORT &getTransport() { return port; };
+    CLOCK &getClock() { return linkClock; };
+    rttEstimator &roundTrip( const char command )
+      { return command == 'S' ? inventoryRtt : vendRtt; };
+    creditWindow &flowCredits() { return credits; };
+    inventoryFilter<GEOMETRY::slotCount> &sensorHistory() { return sensors; };
     
   private:
-    void serialConnect();
-	  inline bool validSlot ( const short slot ) const
-	    { return( slot >= 0 && slot <= 7 ); };
-    
-    int charToInt( const char input );
-    int charToInt( const char msb, const char lsb );
+    struct runningVend
+    {
+      linkCommand command;
+      unsigned char sequence;
+      int attempts;
+      int64_t sent;                // first sent
+      int64_t due;                 // sent again if not answered by then
+    };
+
+    void connect( const int descriptor );
+    int readBytes( void *buf, const size_t length, const int64_t deadline );
+    bool exchange( const char *command, const size_t length, char *reply,
+                   const size_t replyLength, rttEstimator &rtt,
+                   const bool retransmission );
+    void sendCommand( const char *command, const size_t length );
+    int vendOnce( const unsigned short slot );
+    int vendSequenced( const unsigned short slot );
+    unsigned char nextSequence();
+    void startMotor( const linkCommand &command );
+    void sendMotor( runningVend &motor );
+    bool motorAnswer( linkResult &result );
+    bool slotRunning( const unsigned short slot ) const;
+    bool noSlot( const linkCommand &command, linkResult &result );
+    void journalInventory( const inventory &bits, const int64_t duration );
+    int pollButton( const int64_t until );
+    bool startButtonPoll();
+    bool demux( const unsigned char byte, const bool boundary );
+    bool receiveEvents( const int64_t until );
+    void flushInput();
+    int waitButtonEvent( const int64_t until );
+    void queueEvent( const pushedEvent &event );
+    pushedEvent &queuedEvent( const size_t i )
+      { return events[( eventFirst + i ) % events.size()]; };
+    void dropEvent( const size_t i );
+	  static inline bool validSlot ( const short slot )
+	    { return GEOMETRY::validSlot( slot ); };
     
-    int fileDes;
+    TRANSPORT port;
+    CLOCK linkClock;
     bool initComplete;
     
     
-	ofstream vendLog;
-    termios oldtio;
-    termios newtio;
+    lineLog vendLog;
+    vendJournal journal;
+    rttEstimator inventoryRtt;
+    rttEstimator vendRtt;
+    creditWindow credits;
+    inventoryFilter<GEOMETRY::slotCount> sensors;
+    vector<runningVend> motors;
+    unsigned motorLimit;
+    int64_t motorsRefused;
+    unsigned char slotSequence[GEOMETRY::slotCount];
+    bool sequencedVends;
+    unsigned char vendSequence;
+    linkScheduler scheduler;
+    vector<linkCommand> expired;
+    vector<linkResult> finished;
+    linkCommand buttonPoll;
+    bool buttonActive;
+    int64_t buttonStart;
+    inventory cachedInventory;
+    bool pushedEvents;
+    vector<pushedEvent> events;
+    size_t eventFirst;
+    size_t eventCount;
+    inventory pushedInventory;
+    bool inventoryStale;
+    string frame;
+    int64_t frameFrom;
+    int lastEventSequence;
     
 };
 
+typedef basicSodaMachine< machineGeometry<SODA_SLOTS> > sodaMachine;
+typedef basicSodaMachine< machineGeometry<SODA_SLOTS>, loopbackTransport,
+                          virtualClock > emulatedSodaMachine;
+
 #endif
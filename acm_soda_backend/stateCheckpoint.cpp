@@ -0,0 +1,421 @@
+#include "stateCheckpoint.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "linkScheduler.h"
+
+/* Both headers, then both copies of every record */
+#define HEADER_AREA 128
+
+using namespace std;
+
+/* A queued request, with wall-clock arrival and deadline */
+struct queuedPayload
+{
+  uint32_t used;
+  uint32_t reserved;
+  vendRequest request;
+};
+
+static_assert( sizeof(queuedPayload) <= CHECKPOINT_PAYLOAD,
+               "a queued request does not fit in a checkpoint record" );
+static_assert( sizeof(checkpointInventory) <= CHECKPOINT_PAYLOAD &&
+               sizeof(checkpointLink) <= CHECKPOINT_PAYLOAD &&
+               sizeof(slotCounters) <= CHECKPOINT_PAYLOAD,
+               "checkpoint record too large" );
+static_assert( 2 * sizeof(checkpointHeader) <= HEADER_AREA,
+               "checkpoint headers do not fit" );
+
+stateCheckpoint::stateCheckpoint( const unsigned slots )
+{
+  this->slots = slots < CHECKPOINT_MAX_SLOTS ? slots : CHECKPOINT_MAX_SLOTS;
+  records = FIRST_SLOT_RECORD + this->slots + CHECKPOINT_BACKLOG;
+  current.assign( records * CHECKPOINT_PAYLOAD, 0 );
+  generations.assign( records * 2, 0 );
+  digests.assign( records, 0 );
+  digest = 0;
+  for( size_t index = 0; index < records; index++ )
+  {
+    digests[index] = recordDigest( index );
+    digest ^= digests[index];
+  }
+  liveHeader = 1;
+  map = NULL;
+  mapped = 0;
+  committed = 0;
+  found = false;
+  dirty = false;
+  unsynced = false;
+  written = 0;
+  lastSync = 0;
+}
+
+stateCheckpoint::~stateCheckpoint()
+{
+  if( map != NULL )
+    munmap( map, mapped );
+}
+
+/* bool stateCheckpoint::open( const char *path )
+ *
+ * A file of another size was written for another slot count (or is not
+ *  a checkpoint at all); it is resized, and no header will match it.
+ */
+bool stateCheckpoint::open( const char *path )
+{
+  int fd = ::open( path, O_RDWR | O_CREAT | O_CLOEXEC, 0600 );
+  struct stat status;
+  size_t size = HEADER_AREA + records * 2 * sizeof(checkpointRecord);
+
+  if( fd < 0 )
+    return false;
+
+  if( fstat( fd, &status ) != 0 ||
+      ( (size_t)status.st_size != size && ftruncate( fd, size ) != 0 ) )
+  {
+    close( fd );
+    return false;
+  }
+
+  void *area = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+  close( fd );
+  if( area == MAP_FAILED )
+    return false;
+
+  map = (unsigned char *)area;
+  mapped = size;
+  load();
+  return true;
+}
+
+/* void stateCheckpoint::load()
+ *
+ * Tries the newest valid header, then the other. If only the older one
+ *  matches, copies newer than it may be anywhere in the file, so its
+ *  state is written and committed again above the newest generation.
+ */
+void stateCheckpoint::load()
+{
+  int valid[2];
+  int headers = 0;
+  uint64_t newest = 0;
+
+  for( int which = 0; which < 2; which++ )
+  {
+    checkpointHeader *h = header( which );
+
+    if( memcmp( h->magic, CHECKPOINT_MAGIC, sizeof(h->magic) ) == 0 &&
+        h->slots == slots && h->records == records && h->generation > 0 &&
+        h->checksum == checksum( h, offsetof( checkpointHeader, checksum ) ) )
+    {
+      valid[headers++] = which;
+      if( h->generation > newest )
+        newest = h->generation;
+    }
+  }
+  if( headers == 2 &&
+      header( valid[1] )->generation > header( valid[0] )->generation )
+    swap( valid[0], valid[1] );
+
+  found = false;
+  for( int i = 0; i < headers && !found; i++ )
+  {
+    checkpointHeader *h = header( valid[i] );
+
+    if( build( h->generation ) == h->digest )
+    {
+      found = true;
+      committed = h->generation;
+      written = h->written;
+      liveHeader = valid[i];
+    }
+  }
+
+  if( !found )
+  {
+    memset( map, 0, mapped );
+    build( 0 );
+    committed = 0;
+    written = 0;
+    liveHeader = 1;
+    return;
+  }
+
+  if( committed < newest )
+  {
+    committed = newest;
+    for( size_t index = 0; index < records; index++ )
+      write( index );
+    dirty = true;
+    commit( now() );
+  }
+}
+
+/* uint64_t stateCheckpoint::build( const uint64_t generation )
+ *
+ * Reads every record from its newest valid copy no newer than generation
+ *  (zeros if there is none) and returns the digest of the lot. Copies
+ *  that are not valid, or newer, are free to be overwritten.
+ */
+uint64_t stateCheckpoint::build( const uint64_t generation )
+{
+  digest = 0;
+  for( size_t index = 0; index < records; index++ )
+  {
+    int best = -1;
+
+    for( int which = 0; which < 2; which++ )
+    {
+      checkpointRecord *record = copy( index, which );
+      uint64_t &copied = generations[index * 2 + which];
+
+      copied = 0;
+      if( record->index == index && record->generation <= generation &&
+          record->checksum == checksum( &record->index, sizeof(*record) -
+                                        sizeof(record->checksum) ) )
+        copied = record->generation;
+      if( copied != 0 && ( best < 0 || copied > generations[index * 2 + best] ) )
+        best = which;
+    }
+
+    if( best >= 0 )
+      memcpy( &current[index * CHECKPOINT_PAYLOAD], copy( index, best )->payload,
+              CHECKPOINT_PAYLOAD );
+    else
+      memset( &current[index * CHECKPOINT_PAYLOAD], 0, CHECKPOINT_PAYLOAD );
+    digests[index] = recordDigest( index );
+    digest ^= digests[index];
+  }
+  return digest;
+}
+
+bool stateCheckpoint::loadLink( checkpointLink &link ) const
+{
+  memcpy( &link, payload( LINK_RECORD ), sizeof(link) );
+  return link.inventorySmoothed > 0 || link.vendSmoothed > 0;
+}
+
+void stateCheckpoint::saveLink( const checkpointLink &link )
+{
+  save( LINK_RECORD, &link, sizeof(link) );
+}
+
+const slotCounters &stateCheckpoint::counters( const unsigned short slot ) const
+{
+  static const slotCounters none = { 0, 0, 0, 0, 0 };
+
+  if( slot >= slots )
+    return none;
+  return *(const slotCounters *)payload( FIRST_SLOT_RECORD + slot );
+}
+
+void stateCheckpoint::count( const unsigned short slot, const int result,
+                             const int64_t now )
+{
+  if( slot >= slots )
+    return;
+
+  slotCounters counted = counters( slot );
+  if( result == 0 )
+  {
+    counted.vends++;
+    counted.lastVend = now;
+  }
+  else if( result == 1 )
+    counted.empty++;
+  else if( result == LINK_EXPIRED )
+    counted.expired++;
+  else
+    counted.failed++;
+  save( FIRST_SLOT_RECORD + slot, &counted, sizeof(counted) );
+}
+
+/* void stateCheckpoint::loadBacklog( queued, monotonic, wall )
+ *
+ * Turns the saved wall-clock times back into monotonic ones.
+ */
+void stateCheckpoint::loadBacklog( vector<vendRequest> &queued,
+                                   const int64_t monotonic,
+                                   const int64_t wall ) const
+{
+  queued.clear();
+  for( size_t i = 0; i < CHECKPOINT_BACKLOG; i++ )
+  {
+    queuedPayload saved;
+
+    memcpy( &saved, payload( firstQueuedRecord() + i ), sizeof(saved) );
+    if( !saved.used )
+      continue;
+    saved.request.arrival += monotonic - wall;
+    if( saved.request.deadline != 0 )
+      saved.request.deadline += monotonic - wall;
+    queued.push_back( saved.request );
+  }
+}
+
+/* void stateCheckpoint::saveBacklog( queued, monotonic, wall )
+ *
+ * Records that hold the same request as before are not written again.
+ */
+void stateCheckpoint::saveBacklog( const vector<vendRequest> &queued,
+                                   const int64_t monotonic,
+                                   const int64_t wall )
+{
+  for( size_t i = 0; i < CHECKPOINT_BACKLOG; i++ )
+  {
+    queuedPayload saved;
+
+    memset( &saved, 0, sizeof(saved) );
+    if( i < queued.size() )
+    {
+      saved.used = 1;
+      memcpy( &saved.request, &queued[i], sizeof(saved.request) );
+      saved.request.arrival += wall - monotonic;
+      if( saved.request.deadline != 0 )
+        saved.request.deadline += wall - monotonic;
+    }
+    save( firstQueuedRecord() + i, &saved, sizeof(saved) );
+  }
+}
+
+/* void stateCheckpoint::commit( const int64_t now )
+ *
+ * The header is filled in before its checksum, so a header cut short is
+ *  never taken for a commit.
+ */
+void stateCheckpoint::commit( const int64_t now )
+{
+  if( dirty && map != NULL )
+  {
+    checkpointHeader *h = header( 1 - liveHeader );
+
+    h->checksum = 0;
+    __sync_synchronize();
+    memcpy( h->magic, CHECKPOINT_MAGIC, sizeof(h->magic) );
+    h->slots = slots;
+    h->records = records;
+    h->generation = committed + 1;
+    h->written = now;
+    h->digest = digest;
+    h->reserved = 0;
+    __sync_synchronize();
+    h->checksum = checksum( h, offsetof( checkpointHeader, checksum ) );
+
+    liveHeader = 1 - liveHeader;
+    committed++;
+    written = now;
+    unsynced = true;
+  }
+  dirty = false;
+
+  if( unsynced && now - lastSync >= CHECKPOINT_SYNC )
+  {
+    msync( map, mapped, MS_ASYNC );
+    lastSync = now;
+    unsynced = false;
+  }
+}
+
+/* void stateCheckpoint::save( index, data, length )
+ *
+ * Records that did not change are not written, nor their digest redone.
+ */
+void stateCheckpoint::save( const size_t index, const void *data,
+                            const size_t length )
+{
+  unsigned char *saved = &current[index * CHECKPOINT_PAYLOAD];
+
+  if( memcmp( saved, data, length ) == 0 )
+    return;
+  memcpy( saved, data, length );
+
+  digest ^= digests[index];
+  digests[index] = recordDigest( index );
+  digest ^= digests[index];
+  dirty = true;
+
+  if( map != NULL )
+    write( index );
+}
+
+/* void stateCheckpoint::write( const size_t index )
+ *
+ * Into the copy that is not current: the one already written for the
+ *  coming commit, or else the older one. Its checksum goes last.
+ */
+void stateCheckpoint::write( const size_t index )
+{
+  uint64_t *generation = &generations[index * 2];
+  uint64_t coming = committed + 1;
+  int which = generation[1] == coming ? 1 :
+              generation[0] == coming ? 0 :
+              generation[1] < generation[0] ? 1 : 0;
+  checkpointRecord *record = copy( index, which );
+
+  record->checksum = 0;
+  __sync_synchronize();
+  record->index = index;
+  record->generation = coming;
+  memcpy( record->payload, &current[index * CHECKPOINT_PAYLOAD],
+          CHECKPOINT_PAYLOAD );
+  __sync_synchronize();
+  record->checksum = checksum( &record->index,
+                               sizeof(*record) - sizeof(record->checksum) );
+  generation[which] = coming;
+}
+
+checkpointRecord *stateCheckpoint::copy( const size_t index,
+                                         const int which ) const
+{
+  return (checkpointRecord *)( map + HEADER_AREA +
+                               ( index * 2 + which ) * sizeof(checkpointRecord) );
+}
+
+checkpointHeader *stateCheckpoint::header( const int which ) const
+{
+  return (checkpointHeader *)( map + which * ( HEADER_AREA / 2 ) );
+}
+
+/* uint32_t stateCheckpoint::checksum( data, length )
+ *
+ * FNV-1a: enough to tell a torn or stale record from a whole one.
+ */
+uint32_t stateCheckpoint::checksum( const void *data, const size_t length )
+{
+  const unsigned char *bytes = (const unsigned char *)data;
+  uint32_t hash = 2166136261u;
+
+  for( size_t i = 0; i < length; i++ )
+    hash = ( hash ^ bytes[i] ) * 16777619u;
+  return hash;
+}
+
+/* uint64_t stateCheckpoint::recordDigest( const size_t index )
+ *
+ * FNV-1a, 64 bits, of the index and the payload, so that two records
+ *  swapped do not cancel out in the xor.
+ */
+uint64_t stateCheckpoint::recordDigest( const size_t index ) const
+{
+  const unsigned char *bytes = payload( index );
+  uint32_t number = index;
+  uint64_t hash = 14695981039346656037ULL;
+
+  for( size_t i = 0; i < sizeof(number); i++ )
+    hash = ( hash ^ ( ( number >> ( 8 * i ) ) & 0xff ) ) * 1099511628211ULL;
+  for( size_t i = 0; i < CHECKPOINT_PAYLOAD; i++ )
+    hash = ( hash ^ bytes[i] ) * 1099511628211ULL;
+  return hash;
+}
+
+int64_t stateCheckpoint::now()
+{
+  struct timeval tv;
+  gettimeofday( &tv, NULL );
+  return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
@@ -0,0 +1,227 @@
+#ifndef STATECHECKPOINT
+#define STATECHECKPOINT
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <vector>
+
+#include "admissionControl.h"
+
+using namespace std;
+
+/******************************************************************************\
+ * stateCheckpoint class: sodaDaemon's live state in a memory-mapped file,
+ *                        so that a restart (or a crash) does not start
+ *                        from nothing.
+ *
+ * The state is a fixed set of records:
+ *
+ * - link: the round-trip estimates of 'S' and 'V' (see rttEstimator.h)
+ * - inventory: the last one known, and when
+ * - one per slot: vends, empty slots, failures and expired requests
+ * - CHECKPOINT_BACKLOG requests waiting in admission control
+ *
+ * Each record has two copies in the file, each with a checksum and the
+ * generation it was written for. An update writes only the records that
+ * changed, into the copy that is not the current one. commit() then
+ * writes the header that is not the current one, with the new generation,
+ * a digest of every record's contents (kept up to date as records are
+ * saved, not recomputed) and a checksum. On open, each record is read
+ * from its newest valid copy no newer than the newest valid header, and
+ * the result must match that header's digest. So a crash between two
+ * writes leaves the last committed state, and the updates of one commit
+ * (e.g. a whole backlog) are seen all together or not at all.
+ *
+ * Writes go to the page cache, so a daemon crash loses nothing that was
+ * committed. Dirty pages are handed to the kernel every CHECKPOINT_SYNC
+ * (msync( MS_ASYNC )), never waited for. A power cut can lose the last
+ * few seconds, or leave pages of the file older than others. If the
+ * newest state does not match its digest, the one before it (the other
+ * header) is tried; if that does not either, open() starts from nothing.
+ * Either way the daemon revalidates the inventory with the MCU after it
+ * restores it.
+ *
+ * Times in the file are wall-clock microseconds, since monotonic time
+ * restarts with the machine. Queued requests are converted on the way in
+ * and out.
+ *
+ * Functions:
+ *
+ * - bool open( const char *path )
+ *       Maps the file, creating it if needed, and reads the last committed
+ *       state. Returns false if the file cannot be mapped; the checkpoint
+ *       then only lives in memory.
+ *
+ * - bool restored(), int64_t savedAt()
+ *       Whether open() found a committed state, and when it was committed.
+ *
+ * - bool loadLink( checkpointLink &link ), void saveLink( link )
+ * - bool loadInventory( BITS &bits ), void saveInventory( bits, now )
+ *       BITS is a bitset of slotCount bits. loadInventory() returns false
+ *       if none was ever saved.
+ *
+ * - const slotCounters &counters( const unsigned short slot )
+ * - void count( const unsigned short slot, const int result,
+ *               const int64_t now )
+ *       Adds a finished vend, by its result (0, 1, -1 or LINK_EXPIRED).
+ *
+ * - void loadBacklog( vector<vendRequest> &queued, monotonic, wall )
+ * - void saveBacklog( const vector<vendRequest> &queued, monotonic, wall )
+ *       At most CHECKPOINT_BACKLOG requests are kept, the first ones.
+ *
+ * - void commit( const int64_t now )
+ *       Makes the updates since the last commit current. Cheap when there
+ *       are none; the daemon calls it every time round its loop.
+ *
+ * - static int64_t now()
+ *       Wall-clock microseconds.
+ \*****************************************************************************/
+
+#define CHECKPOINT_MAGIC "SODACKP1"
+#define CHECKPOINT_BACKLOG 64       // queued requests kept
+#define CHECKPOINT_MAX_SLOTS 256
+#define CHECKPOINT_PAYLOAD 176      // bytes of a record after its header
+#define CHECKPOINT_SYNC 1000000     // microseconds between msync()s
+
+struct checkpointLink
+{
+  int64_t inventorySmoothed;        // 0 if never sampled
+  int64_t inventoryDeviation;
+  int64_t vendSmoothed;
+  int64_t vendDeviation;
+};
+
+struct slotCounters
+{
+  uint64_t vends;
+  uint64_t empty;
+  uint64_t failed;
+  uint64_t expired;
+  int64_t lastVend;                 // wall-clock, 0 for never
+};
+
+struct checkpointInventory
+{
+  int64_t read;                     // wall-clock, 0 if never read
+  uint64_t bits[CHECKPOINT_MAX_SLOTS / 64];
+};
+
+struct checkpointHeader
+{
+  char magic[8];
+  uint32_t slots;
+  uint32_t records;
+  uint64_t generation;
+  int64_t written;                  // wall-clock
+  uint64_t digest;                  // of every record's index and payload
+  uint32_t reserved;
+  uint32_t checksum;                // of everything before it
+};
+
+struct checkpointRecord
+{
+  uint32_t checksum;                // of everything after it
+  uint32_t index;
+  uint64_t generation;
+  unsigned char payload[CHECKPOINT_PAYLOAD];
+};
+
+class stateCheckpoint
+{
+  public:
+    stateCheckpoint( const unsigned slots );
+    ~stateCheckpoint();
+
+    bool open( const char *path );
+    bool restored() const { return found; };
+    int64_t savedAt() const { return written; };
+
+    bool loadLink( checkpointLink &link ) const;
+    void saveLink( const checkpointLink &link );
+
+    template< class BITS > bool loadInventory( BITS &bits ) const;
+    template< class BITS > void saveInventory( const BITS &bits,
+                                               const int64_t now );
+
+    const slotCounters &counters( const unsigned short slot ) const;
+    void count( const unsigned short slot, const int result,
+                const int64_t now );
+
+    void loadBacklog( vector<vendRequest> &queued, const int64_t monotonic,
+                      const int64_t wall ) const;
+    void saveBacklog( const vector<vendRequest> &queued,
+                      const int64_t monotonic, const int64_t wall );
+
+    void commit( const int64_t now );
+
+    static int64_t now();
+
+  private:
+    stateCheckpoint( const stateCheckpoint & );
+    stateCheckpoint &operator=( const stateCheckpoint & );
+
+    enum { LINK_RECORD, INVENTORY_RECORD, FIRST_SLOT_RECORD };
+
+    size_t firstQueuedRecord() const { return FIRST_SLOT_RECORD + slots; };
+    const unsigned char *payload( const size_t index ) const
+      { return &current[index * CHECKPOINT_PAYLOAD]; };
+    void save( const size_t index, const void *data, const size_t length );
+    void write( const size_t index );
+    checkpointRecord *copy( const size_t index, const int which ) const;
+    checkpointHeader *header( const int which ) const;
+    void load();
+    uint64_t build( const uint64_t generation );
+    uint64_t recordDigest( const size_t index ) const;
+
+    static uint32_t checksum( const void *data, const size_t length );
+
+    unsigned slots;
+    size_t records;
+    vector<unsigned char> current;  // every record's payload, as last saved
+    vector<uint64_t> generations;   // of both copies of every record
+    vector<uint64_t> digests;       // of every record, as last saved
+    uint64_t digest;                // all of them xored together
+    int liveHeader;                 // the header of committed
+    unsigned char *map;             // NULL if not mapped
+    size_t mapped;
+    uint64_t committed;             // 0 for nothing yet
+    bool found;                     // open() read a committed state
+    bool dirty;                     // saved since the last commit
+    bool unsynced;                  // committed since the last msync()
+    int64_t written;
+    int64_t lastSync;
+};
+
+/* bool stateCheckpoint::loadInventory( BITS &bits ) */
+template< class BITS >
+bool stateCheckpoint::loadInventory( BITS &bits ) const
+{
+  checkpointInventory saved;
+
+  memcpy( &saved, payload( INVENTORY_RECORD ), sizeof(saved) );
+  if( saved.read == 0 )
+    return false;
+
+  for( size_t slot = 0; slot < bits.size() && slot < CHECKPOINT_MAX_SLOTS;
+       slot++ )
+    bits[slot] = ( saved.bits[slot / 64] >> ( slot % 64 ) ) & 1;
+  return true;
+}
+
+/* void stateCheckpoint::saveInventory( const BITS &bits, now ) */
+template< class BITS >
+void stateCheckpoint::saveInventory( const BITS &bits, const int64_t now )
+{
+  checkpointInventory saved;
+
+  memset( &saved, 0, sizeof(saved) );
+  saved.read = now;
+  for( size_t slot = 0; slot < bits.size() && slot < CHECKPOINT_MAX_SLOTS;
+       slot++ )
+    if( bits[slot] )
+      saved.bits[slot / 64] |= 1ULL << ( slot % 64 );
+  save( INVENTORY_RECORD, &saved, sizeof(saved) );
+}
+
+#endif
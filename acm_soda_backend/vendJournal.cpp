@@ -0,0 +1,534 @@
+#include "vendJournal.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <vector>
+
+#define JOURNAL_MAGIC "SODAJNL1"
+#define INDEX_NAME "index"
+#define INDEX_STRIDE 256
+#define SEGMENT_TRIES 16             // unusable segments skipped at most
+
+using namespace std;
+
+/* string journalSegmentName( const string &dir, const uint32_t segment )
+ *
+ * Returns the path of segment number <segment> in the journal at <dir>.
+ */
+string journalSegmentName( const string &dir, const uint32_t segment )
+{
+  char name[32];
+  snprintf( name, sizeof(name), "/segment-%08u.jnl", segment );
+  return dir + name;
+}
+
+/* Default constructor:
+ *  - Defaults to 4 MiB or one day per segment, keeping a year of segments
+ *  - The journal does nothing until open() succeeds
+ */
+vendJournal::vendJournal()
+{
+  maxSegmentBytes = 4 * 1024 * 1024;
+  maxSegmentAge = 24 * 60 * 60;
+  maxSegments = 366;
+
+  segmentFd = -1;
+  indexFd = -1;
+  segment = 0;
+  firstSegment = 0;
+  records = 0;
+  segmentCreated = 0;
+  lastTime = 0;
+}
+
+vendJournal::~vendJournal()
+{
+  close();
+}
+
+/* int64_t vendJournal::now()
+ *
+ * Returns the current wall clock time in microseconds.
+ */
+int64_t vendJournal::now()
+{
+  struct timeval tv;
+  gettimeofday( &tv, NULL );
+  return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* bool vendJournal::open( const char *directory )
+ *
+ * - Creates <directory> if it does not exist
+ * - Finds the oldest and newest segments already there
+ * - Opens the index, dropping any entry torn by a crash
+ * - Resumes the newest segment, dropping any torn record, or starts
+ *    segment 0 in an empty journal
+ */
+bool vendJournal::open( const char *directory )
+{
+  DIR *listing;
+  struct dirent *entry;
+  unsigned number;
+  bool found = false;
+  struct stat status;
+
+  close();
+  dir = directory;
+
+  if( mkdir( directory, 0755 ) != 0 && errno != EEXIST )
+    return false;
+
+  if( ( listing = opendir( directory ) ) == NULL )
+    return false;
+
+  while( ( entry = readdir( listing ) ) != NULL )
+  {
+    if( sscanf( entry->d_name, "segment-%8u.jnl", &number ) != 1 )
+      continue;
+
+    if( !found || number < firstSegment )
+      firstSegment = number;
+    if( !found || number > segment )
+      segment = number;
+    found = true;
+  }
+  closedir( listing );
+
+  indexFd = ::open( ( dir + "/" INDEX_NAME ).c_str(),
+                    O_RDWR | O_CREAT | O_APPEND, 0644 );
+  if( indexFd < 0 )
+    return false;
+
+  if( fstat( indexFd, &status ) == 0 )
+    ftruncate( indexFd, status.st_size - status.st_size %
+                        sizeof(journalIndexEntry) );
+
+  if( !found )
+  {
+    firstSegment = 0;
+    if( !openSegment( 0, now() ) )
+    {
+      close();
+      return false;
+    }
+    return true;
+  }
+
+  compactIndex();
+
+  /* Resume the newest segment, or start fresh after it if it is unusable */
+  if( !resumeSegment( segment ) && !openSegment( segment + 1, now() ) )
+  {
+    close();
+    return false;
+  }
+  return true;
+}
+
+/* void vendJournal::close()
+ *
+ * Closes the current segment and the index. Safe to call more than once.
+ */
+void vendJournal::close()
+{
+  if( segmentFd >= 0 )
+    ::close( segmentFd );
+  if( indexFd >= 0 )
+    ::close( indexFd );
+  segmentFd = -1;
+  indexFd = -1;
+}
+
+/* bool vendJournal::resumeSegment( const uint32_t number )
+ *
+ * Opens segment <number> to append to it, dropping any torn record.
+ *  Returns false if it does not exist or is not a segment.
+ */
+bool vendJournal::resumeSegment( const uint32_t number )
+{
+  journalSegmentHeader header;
+  struct stat status;
+
+  segmentFd = ::open( journalSegmentName( dir, number ).c_str(),
+                      O_RDWR | O_APPEND );
+  if( segmentFd < 0 ||
+      pread( segmentFd, &header, sizeof(header), 0 ) != sizeof(header) ||
+      memcmp( header.magic, JOURNAL_MAGIC, sizeof(header.magic) ) != 0 ||
+      header.recordSize != sizeof(journalRecord) ||
+      fstat( segmentFd, &status ) != 0 )
+  {
+    if( segmentFd >= 0 )
+      ::close( segmentFd );
+    segmentFd = -1;
+    return false;
+  }
+
+  segment = number;
+  records = ( status.st_size - sizeof(header) ) / sizeof(journalRecord);
+  ftruncate( segmentFd, sizeof(header) + records * sizeof(journalRecord) );
+  segmentCreated = header.created;
+
+  if( records > 0 )
+  {
+    journalRecord last;
+    if( pread( segmentFd, &last, sizeof(last),
+               sizeof(header) + ( records - 1 ) * sizeof(last) ) ==
+        sizeof(last) && last.time > lastTime )
+      lastTime = last.time;
+  }
+  return true;
+}
+
+/* bool vendJournal::openSegment( uint32_t number, const int64_t created )
+ *
+ * Creates segment <number> and writes its header. Another process sharing
+ *  the journal (sodaCommand and sodaDaemon both write it) may have
+ *  created it first: then it is resumed, never truncated, and one that is
+ *  not a segment is skipped for the next number.
+ */
+bool vendJournal::openSegment( uint32_t number, const int64_t created )
+{
+  journalSegmentHeader header;
+
+  for( unsigned tries = 0; ; tries++, number++ )
+  {
+    segmentFd = ::open( journalSegmentName( dir, number ).c_str(),
+                        O_RDWR | O_CREAT | O_EXCL | O_APPEND, 0644 );
+    if( segmentFd >= 0 )
+      break;
+    if( errno != EEXIST || tries == SEGMENT_TRIES )
+      return false;
+    if( resumeSegment( number ) )
+      return true;
+  }
+
+  memset( &header, 0x00, sizeof(header) );
+  memcpy( header.magic, JOURNAL_MAGIC, sizeof(header.magic) );
+  header.segment = number;
+  header.recordSize = sizeof(journalRecord);
+  header.created = created;
+
+  if( write( segmentFd, &header, sizeof(header) ) != sizeof(header) )
+  {
+    ::close( segmentFd );
+    segmentFd = -1;
+    return false;
+  }
+
+  segment = number;
+  segmentCreated = created;
+  records = 0;
+  return true;
+}
+
+/* void vendJournal::rotate( const int64_t time )
+ *
+ * Closes the current segment, starts the next one and drops segments
+ *  beyond maxSegments.
+ */
+void vendJournal::rotate( const int64_t time )
+{
+  ::close( segmentFd );
+  segmentFd = -1;
+
+  if( openSegment( segment + 1, time ) )
+    removeOldSegments();
+}
+
+/* void vendJournal::removeOldSegments()
+ *
+ * Segments are numbered consecutively, so the oldest ones are simply
+ *  firstSegment, firstSegment + 1, ... Their index entries go with them.
+ */
+void vendJournal::removeOldSegments()
+{
+  bool removed = false;
+
+  while( maxSegments > 0 && segment - firstSegment + 1 > maxSegments )
+  {
+    unlink( journalSegmentName( dir, firstSegment ).c_str() );
+    firstSegment++;
+    removed = true;
+  }
+  if( removed )
+    compactIndex();
+}
+
+/* void vendJournal::compactIndex()
+ *
+ * Drops the index entries of segments before firstSegment, if there are
+ *  any. The index is rewritten and renamed into place, so a reader that
+ *  has the old one mapped keeps a whole index, and another writer finds
+ *  its index unlinked and reopens it (see appendIndex()). An entry that
+ *  writer appends meanwhile is lost, which only makes readers scan from
+ *  an earlier entry.
+ */
+void vendJournal::compactIndex()
+{
+  struct stat status;
+  vector<journalIndexEntry> entries;
+  size_t kept = 0;
+
+  if( fstat( indexFd, &status ) != 0 )
+    return;
+  entries.resize( status.st_size / sizeof(journalIndexEntry) );
+  if( entries.empty() ||
+      pread( indexFd, &entries[0], entries.size() * sizeof(journalIndexEntry),
+             0 ) != (ssize_t)( entries.size() * sizeof(journalIndexEntry) ) ||
+      entries[0].segment >= firstSegment )
+    return;
+
+  for( size_t i = 0; i < entries.size(); i++ )
+    if( entries[i].segment >= firstSegment )
+      entries[kept++] = entries[i];
+
+  string name = dir + "/" INDEX_NAME;
+  string temporary = name + ".new";
+  int fd = ::open( temporary.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_APPEND,
+                   0644 );
+  if( fd < 0 )
+    return;
+  if( ( kept > 0 &&
+        write( fd, &entries[0], kept * sizeof(journalIndexEntry) ) !=
+        (ssize_t)( kept * sizeof(journalIndexEntry) ) ) ||
+      rename( temporary.c_str(), name.c_str() ) != 0 )
+  {
+    ::close( fd );
+    unlink( temporary.c_str() );
+    return;
+  }
+  ::close( indexFd );
+  indexFd = fd;
+}
+
+/* void vendJournal::appendIndex( const int64_t time )
+ *
+ * Adds an index entry pointing at the record about to be written, first
+ *  reopening the index if another process compacted it away.
+ */
+void vendJournal::appendIndex( const int64_t time )
+{
+  journalIndexEntry entry;
+  struct stat status;
+
+  if( fstat( indexFd, &status ) == 0 && status.st_nlink == 0 )
+  {
+    int fd = ::open( ( dir + "/" INDEX_NAME ).c_str(),
+                     O_RDWR | O_CREAT | O_APPEND, 0644 );
+    if( fd >= 0 )
+    {
+      ::close( indexFd );
+      indexFd = fd;
+    }
+  }
+
+  entry.time = time;
+  entry.segment = segment;
+  entry.record = records;
+
+  if( write( indexFd, &entry, sizeof(entry) ) != sizeof(entry) )
+    return;
+}
+
+/* void vendJournal::record( type, slot, value, duration )
+ *
+ * - Stamps the event, never going backwards in time so the segments stay
+ *    sorted even if the wall clock is stepped
+ * - Counts the segment's records from its size, since another process
+ *    may append to it too
+ * - Rotates the segment if it is full or too old
+ * - Indexes the first record of a segment and every INDEX_STRIDE-th after
+ * - Appends the record with a single write()
+ */
+void vendJournal::record( const uint8_t type, const uint16_t slot,
+                          const int32_t value, const uint32_t duration )
+{
+  journalRecord entry;
+  int64_t time = now();
+  struct stat status;
+
+  if( segmentFd < 0 )
+    return;
+
+  if( fstat( segmentFd, &status ) == 0 &&
+      status.st_size >= (off_t)sizeof(journalSegmentHeader) )
+    records = ( status.st_size - sizeof(journalSegmentHeader) ) /
+              sizeof(journalRecord);
+
+  if( time < lastTime )
+    time = lastTime;
+  lastTime = time;
+
+  if( records > 0 &&
+      ( (off_t)( sizeof(journalSegmentHeader) + records * sizeof(entry) ) >=
+          maxSegmentBytes ||
+        time - segmentCreated >= (int64_t)maxSegmentAge * 1000000 ) )
+  {
+    rotate( time );
+    if( segmentFd < 0 )
+      return;
+  }
+
+  if( records % INDEX_STRIDE == 0 )
+    appendIndex( time );
+
+  memset( &entry, 0x00, sizeof(entry) );
+  entry.time = time;
+  entry.duration = duration;
+  entry.value = value;
+  entry.slot = slot;
+  entry.type = type;
+
+  if( write( segmentFd, &entry, sizeof(entry) ) == sizeof(entry) )
+    records++;
+}
+
+journalReader::journalReader()
+{
+  index = NULL;
+  entries = 0;
+  mappedBytes = 0;
+}
+
+journalReader::~journalReader()
+{
+  if( index != NULL )
+    munmap( (void *)index, mappedBytes );
+}
+
+/* bool journalReader::open( const char *directory )
+ *
+ * Maps the journal's index read-only.
+ */
+bool journalReader::open( const char *directory )
+{
+  struct stat status;
+  int fd;
+
+  dir = directory;
+
+  if( ( fd = ::open( ( dir + "/" INDEX_NAME ).c_str(), O_RDONLY ) ) < 0 )
+    return false;
+
+  if( fstat( fd, &status ) != 0 )
+  {
+    ::close( fd );
+    return false;
+  }
+
+  entries = status.st_size / sizeof(journalIndexEntry);
+  mappedBytes = entries * sizeof(journalIndexEntry);
+
+  if( entries > 0 )
+  {
+    void *map = mmap( NULL, mappedBytes, PROT_READ, MAP_SHARED, fd, 0 );
+    if( map == MAP_FAILED )
+    {
+      ::close( fd );
+      return false;
+    }
+    index = (const journalIndexEntry *)map;
+  }
+
+  ::close( fd );
+  return true;
+}
+
+/* unsigned long journalReader::scan( start, end, visit, context )
+ *
+ * - Binary searches the index for the last entry at or before <start>
+ * - Maps segments one at a time from there, visiting records in
+ *    [start, end) and stopping at the first record past <end>
+ * - Segments removed by rotation are skipped
+ */
+unsigned long journalReader::scan( const int64_t start, const int64_t end,
+                                   visitor visit, void *context ) const
+{
+  size_t low = 0, high = entries;
+  uint32_t segment;
+  uint32_t lastSegment;
+  uint32_t record;
+  unsigned long visited = 0;
+
+  if( entries == 0 || start >= end )
+    return 0;
+
+  /* First entry with time > start, then step back one */
+  while( low < high )
+  {
+    size_t middle = low + ( high - low ) / 2;
+    if( index[middle].time <= start )
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  if( low > 0 )
+    low--;
+
+  segment = index[low].segment;
+  record = index[low].record;
+  lastSegment = index[entries - 1].segment;
+
+  for( ; ; segment++, record = 0 )
+  {
+    int fd = ::open( journalSegmentName( dir, segment ).c_str(), O_RDONLY );
+    struct stat status;
+
+    if( fd < 0 )
+    {
+      if( segment < lastSegment )
+        continue;
+      break;
+    }
+
+    if( fstat( fd, &status ) != 0 ||
+        status.st_size <= (off_t)sizeof(journalSegmentHeader) )
+    {
+      ::close( fd );
+      if( segment < lastSegment )
+        continue;
+      break;
+    }
+
+    void *map = mmap( NULL, status.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+    ::close( fd );
+    if( map == MAP_FAILED )
+      break;
+
+    const journalRecord *first = (const journalRecord *)
+      ( (const char *)map + sizeof(journalSegmentHeader) );
+    size_t count = ( status.st_size - sizeof(journalSegmentHeader) ) /
+                   sizeof(journalRecord);
+    bool done = false;
+
+    for( size_t i = record; i < count; i++ )
+    {
+      if( first[i].time >= end )
+      {
+        done = true;
+        break;
+      }
+      if( first[i].time >= start )
+      {
+        visit( first[i], context );
+        visited++;
+      }
+    }
+
+    munmap( map, status.st_size );
+
+    if( done )
+      break;
+  }
+
+  return visited;
+}
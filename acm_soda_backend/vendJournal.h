@@ -0,0 +1,151 @@
+#ifndef VENDJOURNAL
+#define VENDJOURNAL
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <string>
+
+using namespace std;
+
+/******************************************************************************\
+ * vendJournal class: Structured, segmented record of everything the soda
+ *                    machine did. Replaces grepping vendsoda.log.
+ *
+ * On disk the journal is a directory holding:
+ *
+ * - segment-NNNNNNNN.jnl
+ *       A header followed by fixed-size journalRecords in time order.
+ *       A new segment is started when the current one reaches
+ *       maxSegmentBytes or is older than maxSegmentAge seconds. Only the
+ *       newest maxSegments segments are kept. Segments are created
+ *       exclusively, so processes sharing the journal (sodaCommand and
+ *       sodaDaemon) append to a segment the other started rather than
+ *       truncating it.
+ *
+ * - index
+ *       A sparse time index: one journalIndexEntry at the start of every
+ *       segment and every INDEX_STRIDE records after that. Readers mmap it
+ *       and binary search it to find the first segment/record of a time
+ *       range instead of scanning every segment. Entries of removed
+ *       segments are compacted away when they go.
+ *
+ * Functions:
+ *
+ * - bool open( const char *directory )
+ *       Opens (creating if necessary) the journal in directory and resumes
+ *       appending to the newest segment. Returns false if the journal
+ *       could not be opened; record() is then a no-op.
+ *
+ * - void record( uint8_t type, uint16_t slot, int32_t value,
+ *                uint32_t duration )
+ *       Appends one event stamped with the current time. duration is in
+ *       microseconds, 0 if unknown.
+ *
+ * - static int64_t now()
+ *       Microseconds since the epoch.
+ *
+ * journalReader class: Read-only view used by the query tool.
+ *
+ * - bool open( const char *directory )
+ *       Maps the index. Returns false if the journal does not exist.
+ *
+ * - unsigned long scan( int64_t start, int64_t end, visitor, context )
+ *       Calls visitor for every record with start <= time < end, in time
+ *       order. Returns the number of records visited.
+ \*****************************************************************************/
+
+enum journalEvent
+{
+  JOURNAL_START     = 1,  // sodaMachine constructed
+  JOURNAL_STOP      = 2,  // sodaMachine destroyed
+  JOURNAL_VEND      = 3,  // value = vendSoda() result
+  JOURNAL_INVENTORY = 4,  // value = inventory bits of slots slot to
+                          //  slot + JOURNAL_SLOTS - 1, bit 0 first
+  JOURNAL_BUTTON    = 5   // value = button number, -1 on timeout
+};
+
+#define JOURNAL_SLOTS 32             // slots in one JOURNAL_INVENTORY record
+
+struct journalRecord
+{
+  int64_t  time;        // microseconds since the epoch
+  uint32_t duration;    // microseconds spent on the event, 0 if unknown
+  int32_t  value;
+  uint16_t slot;
+  uint8_t  type;        // journalEvent
+  uint8_t  reserved[5];
+};
+
+struct journalIndexEntry
+{
+  int64_t  time;        // time of the first record covered by this entry
+  uint32_t segment;
+  uint32_t record;      // record number within the segment
+};
+
+struct journalSegmentHeader
+{
+  char     magic[8];
+  uint32_t segment;
+  uint32_t recordSize;
+  int64_t  created;
+  char     reserved[8];
+};
+
+class vendJournal
+{
+  public:
+    vendJournal();
+    ~vendJournal();
+
+    bool open( const char *directory );
+    void close();
+    void record( const uint8_t type, const uint16_t slot, const int32_t value,
+                 const uint32_t duration );
+
+    static int64_t now();
+
+    off_t maxSegmentBytes;
+    time_t maxSegmentAge;
+    unsigned maxSegments;
+
+  private:
+    bool openSegment( uint32_t segment, const int64_t created );
+    bool resumeSegment( const uint32_t segment );
+    void rotate( const int64_t time );
+    void removeOldSegments();
+    void compactIndex();
+    void appendIndex( const int64_t time );
+
+    string dir;
+    int segmentFd;
+    int indexFd;
+    uint32_t segment;
+    uint32_t firstSegment;
+    uint32_t records;
+    int64_t segmentCreated;
+    int64_t lastTime;
+};
+
+class journalReader
+{
+  public:
+    typedef void (*visitor)( const journalRecord &record, void *context );
+
+    journalReader();
+    ~journalReader();
+
+    bool open( const char *directory );
+    unsigned long scan( const int64_t start, const int64_t end,
+                        visitor visit, void *context ) const;
+
+  private:
+    string dir;
+    const journalIndexEntry *index;
+    size_t entries;
+    size_t mappedBytes;
+};
+
+string journalSegmentName( const string &dir, const uint32_t segment );
+
+#endif
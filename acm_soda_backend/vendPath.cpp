@@ -0,0 +1,438 @@
+#include "vendPath.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <iostream>
+
+using namespace std;
+
+/* Constructor:
+ *  - The parts of the daemon a vend goes through, and the connections it
+ *     can be answered on
+ *  - defaultDeadline: milliseconds, for requests without deadline=; 0 for
+ *     none
+ */
+vendPath::vendPath( admissionControl &admission, idempotencyCache &keys,
+                    slotSelector &selector, eventBus &bus,
+                    stateCheckpoint &checkpoint, connectionTable &connections,
+                    frontEnd &fronts, const long defaultDeadline )
+  : admission( admission ), keys( keys ), selector( selector ), bus( bus ),
+    checkpoint( checkpoint ), connections( connections ), fronts( fronts ),
+    linkNodes( LINK_NODES ),
+    onLink( ( less<unsigned long>() ), poolAllocator<linkEntry>( &linkNodes ) )
+{
+  this->defaultDeadline = defaultDeadline;
+  pipe.waiting = false;
+  pipe.text = '0';
+  pipe.until = 0;
+  inventoryRead = false;
+  linkUp = true;
+  savedChanges = admission.changes();
+}
+
+/* void vendPath::handleRequest( line, id, client )
+ *
+ * Decodes one request line (see frontEnd::decode()) and admits or answers
+ *  each request in it
+ */
+void vendPath::handleRequest( const char *line, const unsigned long id,
+                              const char *client )
+{
+  vendRequest requests[BATCH_MAX];
+  size_t count;
+  const char *error = frontEnd::decode( line, client, id != FIFO_CONNECTION,
+                                        sodaMachine::geometry::slotCount,
+                                        requests, count );
+
+  if( error != NULL )
+  {
+    if( id == FIFO_CONNECTION )
+      replyPipe( -1 );
+    else
+      reply( id, error );
+    return;
+  }
+
+  for( size_t i = 0; i < count; i++ )
+  {
+    requests[i].connection = id;
+    admitRequest( requests[i] );
+  }
+}
+
+/* void vendPath::admitRequest( vendRequest &request )
+ *
+ * Queues a decoded request or answers it
+ *
+ *  A key already known is not queued again: its result is sent at once,
+ *  or when the vend it names finishes (BUSY if KEY_WAITERS connections
+ *  wait for it already). A product's slot is chosen once, when the
+ *  request is admitted. decode() refuses slots the machine does not have;
+ *  one that got past it anyway is refused here too, before it can reach
+ *  the link scheduler.
+ */
+void vendPath::admitRequest( vendRequest &request )
+{
+  const unsigned long id = request.connection;
+  vendRequest evicted;
+  keyText key;
+
+  if( request.product[0] == '\0' &&
+      !sodaMachine::geometry::validSlot( request.slot ) )
+  {
+    if( id == FIFO_CONNECTION )
+      replyPipe( -1 );
+    else
+      reply( id, "ERR no such slot\n" );
+    return;
+  }
+
+  if( request.key[0] != '\0' )
+  {
+    key = idempotencyCache::makeKey( request.client, request.key );
+    idempotencyEntry *entry = keys.find( key, idempotencyCache::now() );
+
+    if( entry != NULL && request.product[0] != '\0' &&
+        !selector.offers( request.product, entry->slot ) )
+    {
+      reply( id, "ERR key used for another product\n" );
+      return;
+    }
+    if( entry != NULL && request.product[0] == '\0' &&
+        entry->slot != request.slot )
+    {
+      if( id == FIFO_CONNECTION )
+        replyPipe( -1 );
+      else
+        reply( id, "ERR key used for another slot\n" );
+      return;
+    }
+    if( entry != NULL && entry->state == KEY_DONE )
+    {
+      answer( id, entry->result, request.product[0] != '\0' ||
+              request.command == 'M' ? entry->slot : -1 );
+      return;
+    }
+    if( entry != NULL && !keys.attach( *entry, id ) )
+    {
+      busy( id, admission.drainTime(),
+            request.command == 'M' ? request.slot : -1 );
+      return;
+    }
+    if( entry != NULL )
+      return;
+  }
+  else
+    key.text[0] = '\0';
+
+  if( request.product[0] != '\0' )
+  {
+    int chosen = selector.choose( request.product, request.arrival );
+
+    if( chosen == SELECT_UNKNOWN )
+    {
+      reply( id, "ERR unknown product\n" );
+      return;
+    }
+    if( chosen == SELECT_SOLD_OUT || chosen == SELECT_JAMMED )
+    {
+      answer( id, chosen == SELECT_SOLD_OUT ? 1 : -1, -1 );
+      return;
+    }
+    request.slot = chosen;
+  }
+
+  admissionDecision result = admission.admit( request, request.arrival, evicted );
+
+  if( result.admitted && key.text[0] != '\0' )
+    keys.queued( key, request.slot, id, idempotencyCache::now() );
+
+  /* Everyone waiting on an evicted key retries it */
+  if( result.evicted )
+  {
+    keyWaiters waiters;
+
+    waiters.count = 1;
+    waiters.connection[0] = evicted.connection;
+    if( evicted.key[0] != '\0' )
+      keys.forget( idempotencyCache::makeKey( evicted.client, evicted.key ),
+                   waiters );
+    for( size_t j = 0; j < waiters.count; j++ )
+      busy( waiters.connection[j], admission.drainTime(),
+            evicted.command == 'M' ? evicted.slot : -1 );
+  }
+
+  if( !result.admitted )
+    busy( id, result.retryAfter,
+          request.command == 'M' ? request.slot : -1 );
+}
+
+/* bool vendPath::startVend( MACHINE &acmSoda )
+ *
+ * One vend at a time, so that admission control still decides the order
+ *  between clients
+ */
+template< class MACHINE >
+bool vendPath::startVend( MACHINE &acmSoda )
+{
+  vendRequest request;
+
+  if( acmSoda.urgentWaiting() || !admission.next( request ) )
+    return false;
+
+  if( request.deadline == 0 && defaultDeadline > 0 )
+    request.deadline = request.arrival + defaultDeadline * 1000LL;
+  if( request.key[0] != '\0' )
+    keys.started( idempotencyCache::makeKey( request.client, request.key ),
+                  idempotencyCache::now() );
+  onLink[ acmSoda.submit( request.command, request.slot,
+                          LINK_INTERACTIVE, request.deadline ) ] = request;
+  publishVend( "started", request, 0 );
+  return true;
+}
+
+/* bool vendPath::finishVend( const linkResult &done, const int64_t took ) */
+bool vendPath::finishVend( const linkResult &done, const int64_t took )
+{
+  linkTable::iterator found = onLink.find( done.id );
+  if( found == onLink.end() )
+    return false;
+
+  if( done.result != LINK_EXPIRED )
+  {
+    admission.serviced( took );
+    selector.finished( found->second.slot, done.result, done.elapsed,
+                       linkScheduler::now() );
+    publishLink( done.result != -1 );
+  }
+  publishVend( "completed", found->second, done.result );
+  checkpoint.count( found->second.slot, done.result, stateCheckpoint::now() );
+
+  /* A vend from an empty slot is as good as a refresh of that slot */
+  if( done.result == 1 && inventoryRead &&
+      found->second.slot < sodaMachine::geometry::slotCount )
+  {
+    sodaMachine::inventory bits = known;
+    bits.reset( found->second.slot );
+    inventory( bits );
+  }
+
+  int chosen = found->second.product[0] != '\0' ||
+               found->second.command == 'M' ? found->second.slot : -1;
+  if( found->second.key[0] != '\0' )
+  {
+    keyWaiters waiters;
+    keys.finished( idempotencyCache::makeKey( found->second.client,
+                                              found->second.key ),
+                   done.result, idempotencyCache::now(), waiters );
+    for( size_t i = 0; i < waiters.count; i++ )
+      answer( waiters.connection[i], done.result, chosen );
+  }
+  else
+    answer( found->second.connection, done.result, chosen );
+  onLink.erase( found );
+  return true;
+}
+
+/* void vendPath::commit()
+ *
+ * Saves the queue if it changed since the last commit, and commits
+ *  everything saved since then together
+ */
+void vendPath::commit()
+{
+  if( admission.changes() != savedChanges )
+  {
+    savedChanges = admission.changes();
+    admission.waiting( backlog );
+    checkpoint.saveBacklog( backlog, linkScheduler::now(),
+                            stateCheckpoint::now() );
+  }
+  checkpoint.commit( stateCheckpoint::now() );
+}
+
+/* void vendPath::inventory( const sodaMachine::inventory &bits )
+ *
+ * Publishes the slots that changed since the inventory last known, or
+ *  all of it the first time, and keeps it for new subscribers
+ */
+void vendPath::inventory( const sodaMachine::inventory &bits )
+{
+  char all[EVENT_LENGTH];
+  size_t length = snprintf( all, sizeof(all), "inventory all " );
+
+  for( unsigned slot = 0; slot < sodaMachine::geometry::slotCount &&
+       length < sizeof(all) - 1; slot++ )
+    all[length++] = bits.test( slot ) ? '1' : '0';
+  all[length] = '\0';
+
+  if( !inventoryRead )
+    bus.publish( EVENT_INVENTORY, all );
+  else
+    for( unsigned slot = 0; slot < sodaMachine::geometry::slotCount; slot++ )
+      if( bits.test( slot ) != known.test( slot ) )
+      {
+        char text[32];
+        snprintf( text, sizeof(text), "inventory %u %d", slot,
+                  bits.test( slot ) ? 1 : 0 );
+        bus.publish( EVENT_INVENTORY, text );
+      }
+
+  bus.retain( EVENT_INVENTORY, all );
+  known = bits;
+  inventoryRead = true;
+  selector.stock( known );
+  checkpoint.saveInventory( known, stateCheckpoint::now() );
+}
+
+/* void vendPath::submitted( vector<vendRequest> &requests ) */
+void vendPath::submitted( vector<vendRequest> &requests ) const
+{
+  for( linkTable::const_iterator i = onLink.begin(); i != onLink.end(); ++i )
+    requests.push_back( i->second );
+}
+
+/* void vendPath::answer( connection, vendResult, slot )
+ *
+ * Writes the result of a vend to a connection that asked for it, with the
+ *  slot it was chosen from unless that is -1
+ */
+void vendPath::answer( const unsigned long connection, const int vendResult,
+                       const int slot )
+{
+  if( connection == FIFO_CONNECTION )
+    replyPipe( vendResult );
+  else if( vendResult == LINK_EXPIRED )
+    reply( connection, "EXPIRED\n" );
+  else
+  {
+    char text[32];
+    if( slot >= 0 )
+      snprintf( text, sizeof(text), "%d slot=%d\n", vendResult, slot );
+    else
+      snprintf( text, sizeof(text), "%d\n", vendResult );
+    reply( connection, text );
+  }
+}
+
+/* void vendPath::busy( connection, retryAfter, slot )
+ *
+ * Tells a connection to retry in retryAfter milliseconds, naming the slot
+ *  unless that is -1, as a batch vend's answers do
+ */
+void vendPath::busy( const unsigned long connection, const int64_t retryAfter,
+                     const int slot )
+{
+  char text[48];
+
+  if( connection == FIFO_CONNECTION )
+  {
+    replyPipe( -1 );
+    return;
+  }
+  if( slot >= 0 )
+    snprintf( text, sizeof(text), "BUSY %lld slot=%d\n",
+              (long long)retryAfter, slot );
+  else
+    snprintf( text, sizeof(text), "BUSY %lld\n", (long long)retryAfter );
+  reply( connection, text );
+}
+
+/* void vendPath::reply( const unsigned long id, const char *text )
+ *
+ * Writes a response line to a client, if it is still connected
+ */
+void vendPath::reply( const unsigned long id, const char *text )
+{
+  connectionTable::iterator found = connections.find( id );
+
+  if( found == connections.end() )
+  {
+    fronts.reply( id, text );
+    return;
+  }
+  if( write( found->second.fd, text, strlen( text ) ) < 0 )
+    return;
+}
+
+/* void vendPath::replyPipe( const int vendResult )
+ *
+ * Answers a legacy client on PIPE_OUT_NAME
+ *
+ * The web front end reads "1" for a successful vend. If it has not opened
+ *  the pipe yet, the answer waits for retryPipe(), replacing any older
+ *  one: the pipe has one client at a time, and that one's reader is gone.
+ */
+void vendPath::replyPipe( const int vendResult )
+{
+  pipe.waiting = true;
+  pipe.text = vendResult == 0 ? '1' : '0';
+  pipe.until = linkScheduler::now() + PIPE_WAIT;
+  retryPipe();
+}
+
+/* void vendPath::retryPipe()
+ *
+ * Writes the waiting legacy answer if its reader is there now
+ *
+ * The pipe is opened non-blocking, which fails at once (ENXIO) without a
+ *  reader, so the main loop never waits on it. An answer nobody opened
+ *  the pipe for within PIPE_WAIT is dropped.
+ */
+void vendPath::retryPipe()
+{
+  if( !pipe.waiting )
+    return;
+
+  int pipeOut = open( PIPE_OUT_NAME, O_WRONLY | O_NONBLOCK );
+
+  if( pipeOut < 0 )
+  {
+    if( linkScheduler::now() >= pipe.until )
+      pipe.waiting = false;
+    return;
+  }
+
+  pipe.waiting = false;
+  if( write( pipeOut, &pipe.text, 1 ) != 1 )
+    cerr << "sodaDaemon: could not answer the legacy pipe" << endl;
+  close( pipeOut );
+}
+
+/* void vendPath::publishVend( what, request, vendResult )
+ *
+ * "vend started <slot> <client>", or for "completed" also the result
+ */
+void vendPath::publishVend( const char *what, const vendRequest &request,
+                            const int vendResult )
+{
+  char text[96];
+  int length = snprintf( text, sizeof(text), "vend %s %u %s", what,
+                         (unsigned)request.slot, request.client );
+
+  if( strcmp( what, "completed" ) == 0 && vendResult == LINK_EXPIRED )
+    snprintf( text + length, sizeof(text) - length, " EXPIRED" );
+  else if( strcmp( what, "completed" ) == 0 )
+    snprintf( text + length, sizeof(text) - length, " %d", vendResult );
+  bus.publish( EVENT_VEND, text );
+}
+
+/* void vendPath::publishLink( const bool up )
+ *
+ * "link up" or "link down" when that changes. A vend the MCU did not
+ *  confirm counts as the link being down until the next one it does.
+ */
+void vendPath::publishLink( const bool up )
+{
+  if( up == linkUp )
+    return;
+  linkUp = up;
+  bus.publish( EVENT_LINK, up ? "link up" : "link down" );
+  bus.retain( EVENT_LINK, up ? "link up" : "link down" );
+}
+
+/* The daemon's machine, and the emulated one vendPathBench drives */
+template bool vendPath::startVend( sodaMachine &acmSoda );
+template bool vendPath::startVend( emulatedSodaMachine &acmSoda );
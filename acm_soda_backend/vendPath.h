@@ -0,0 +1,156 @@
+#ifndef VENDPATH
+#define VENDPATH
+
+#include <stddef.h>
+#include <stdint.h>
+#include <map>
+#include <vector>
+
+#include "sodaMachine.h"
+#include "admissionControl.h"
+#include "eventBus.h"
+#include "frontEnd.h"
+#include "idempotencyCache.h"
+#include "nodePool.h"
+#include "slotSelector.h"
+#include "stateCheckpoint.h"
+
+using namespace std;
+
+/******************************************************************************\
+ * vendPath class: What sodaDaemon's main loop does with a vend, from its
+ *                 request line to its answer.
+ *
+ * Each step is one call, made by the daemon as the loop comes to it and
+ * by vendPathBench in the same order, so that the bench measures (and
+ * counts the allocations of) the daemon's own code:
+ *
+ * - handleRequest(): a request line is decoded (frontEnd::decode()), and
+ *   each request in it admitted
+ * - admitRequest(): a decoded request, from the line above or from a
+ *   front end, is answered from its key, has its product's slot chosen,
+ *   and goes through admission control
+ * - startVend(): the next admitted request has its key started and goes
+ *   to the link scheduler as an interactive vend
+ * - finishVend(): service() finished a vend; admission control, the
+ *   selector, the checkpoint, the event bus and the key are told, and
+ *   everyone waiting for it answered
+ * - commit(): the queue, if it changed, and everything saved since the
+ *   last commit go to the checkpoint
+ *
+ * Answers go to the connection that asked: the loop's own (connections),
+ * a front end's (fronts.reply()), or the legacy pipe (FIFO_CONNECTION),
+ * whose answer waits for its reader (see retryPipe()).
+ *
+ * Functions:
+ *
+ * - vendPath( admission, keys, selector, bus, checkpoint, connections,
+ *             fronts, defaultDeadline )
+ *       defaultDeadline is in milliseconds, for requests that give none;
+ *       0 for none.
+ *
+ * - void handleRequest( const char *line, const unsigned long id,
+ *                       const char *client )
+ *       A request line from connection id, named client unless it says.
+ *
+ * - void admitRequest( vendRequest &request )
+ *
+ * - template< class MACHINE > bool startVend( MACHINE &acmSoda )
+ *       Submits the next admitted request, unless an urgent command
+ *       waits. Returns false if nothing was submitted.
+ *
+ * - bool finishVend( const linkResult &done, const int64_t took )
+ *       done came from service() after took microseconds. Returns false
+ *       if it was not a vend started here.
+ *
+ * - void commit()
+ *
+ * - void inventory( const sodaMachine::inventory &bits )
+ *       An inventory read from the MCU: published (the slots that changed,
+ *       or all of it the first time), given to the selector and saved.
+ *
+ * - bool inventoryKnown()
+ *
+ * - void submitted( vector<vendRequest> &requests )
+ *       Adds the vends on the link and not yet finished, for an upgrade.
+ *
+ * - bool pipeWaiting(), void retryPipe()
+ *       A legacy answer waits for its reader; retryPipe() tries again.
+ \*****************************************************************************/
+
+#define PIPE_OUT_NAME "pipes/vendsodaout"
+#define FIFO_CONNECTION 0    // connection number of the legacy pipes
+#define PIPE_WAIT 2000000    // microseconds a legacy answer waits for its reader
+#define PIPE_RETRY 10        // milliseconds between looks for the reader
+#define LINK_NODES 16        // vends on the link before the pool grows
+
+/* Vends on the link by linkResult id. It gains and loses an entry with
+ *  every vend, so its nodes are pooled, like the connections'.
+ */
+typedef pair<const unsigned long, vendRequest> linkEntry;
+typedef map< unsigned long, vendRequest, less<unsigned long>,
+             poolAllocator<linkEntry> > linkTable;
+
+class vendPath
+{
+  public:
+    vendPath( admissionControl &admission, idempotencyCache &keys,
+              slotSelector &selector, eventBus &bus,
+              stateCheckpoint &checkpoint, connectionTable &connections,
+              frontEnd &fronts, const long defaultDeadline );
+
+    void handleRequest( const char *line, const unsigned long id,
+                        const char *client );
+    void admitRequest( vendRequest &request );
+    template< class MACHINE > bool startVend( MACHINE &acmSoda );
+    bool finishVend( const linkResult &done, const int64_t took );
+    void commit();
+
+    void inventory( const sodaMachine::inventory &bits );
+    bool inventoryKnown() const { return inventoryRead; };
+    void submitted( vector<vendRequest> &requests ) const;
+
+    bool pipeWaiting() const { return pipe.waiting; };
+    void retryPipe();
+
+  private:
+    vendPath( const vendPath & );
+    vendPath &operator=( const vendPath & );
+
+    void answer( const unsigned long connection, const int vendResult,
+                 const int slot );
+    void busy( const unsigned long connection, const int64_t retryAfter,
+               const int slot );
+    void reply( const unsigned long id, const char *text );
+    void replyPipe( const int vendResult );
+    void publishVend( const char *what, const vendRequest &request,
+                      const int vendResult );
+    void publishLink( const bool up );
+
+    /* The legacy pipe's answer, while nobody has PIPE_OUT_NAME open */
+    struct pipeAnswer
+    {
+      bool waiting;
+      char text;                     // '1' or '0'
+      int64_t until;                 // linkScheduler::now() when given up
+    };
+
+    admissionControl &admission;
+    idempotencyCache &keys;
+    slotSelector &selector;
+    eventBus &bus;
+    stateCheckpoint &checkpoint;
+    connectionTable &connections;
+    frontEnd &fronts;
+    long defaultDeadline;
+    nodePool linkNodes;              // before onLink, which uses it
+    linkTable onLink;
+    pipeAnswer pipe;
+    sodaMachine::inventory known;
+    bool inventoryRead;
+    bool linkUp;
+    unsigned long savedChanges;
+    vector<vendRequest> backlog;
+};
+
+#endif
@@ -0,0 +1,258 @@
+/* vendPathBench.cpp
+ *
+ * Whether sodaDaemon's vend path allocates, and what it costs.
+ *
+ * Every vend goes through sodaDaemon's own steps (see vendPath.h), in
+ *  the order its main loop takes them: the request line is decoded, its
+ *  key looked up and queued and admission control admits it
+ *  (handleRequest()); its key is started (written and synced) and the
+ *  link scheduler sends it to the emulated MCU (startVend()); when
+ *  service() finishes it, the key, the selector, the checkpoint and the
+ *  event bus are told and the answer is written to the client's socket
+ *  (finishVend()); and the queue is committed to the checkpoint
+ *  (commit()). Every other vend asks for a product rather than a slot.
+ *  A subscriber reads the events, and the client its answers.
+ *
+ * It runs twice: with the inventory polled, then with the MCU pushing
+ *  its events (sodaDaemon -p). In that pass a button is pressed during
+ *  every vend, and the loop takes the events from nextEvent() after it
+ *  as the daemon does: inventories go to vendPath::inventory(), presses
+ *  to the subscriber.
+ *
+ * The first WARMUP vends of each pass may allocate: pools grow their
+ *  first slab, and buffers their first size. After them,
+ *  allocationCounter must count no allocation at all; the benchmark says
+ *  how many vends did. Only starting a journal segment allocates, about
+ *  every 80000 vends, so the default run stays within the first one.
+ *
+ * Runs in a scratch directory with a log directory of its own, so the
+ *  vend log, the journal and the key file are written as the daemon's.
+ *  The MCU is on a virtual clock, so the time is that of the code.
+ *
+ * Usage: vendPathBench [vends per pass]
+ *
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include "sodaMachine.h"
+#include "admissionControl.h"
+#include "idempotencyCache.h"
+#include "eventBus.h"
+#include "slotSelector.h"
+#include "stateCheckpoint.h"
+#include "nodePool.h"
+#include "allocationCounter.h"
+#include "frontEnd.h"
+#include "vendPath.h"
+
+#define VEND_COUNT 25000    // each pass
+#define WARMUP 1000
+#define CLIENTS 8
+#define KEY_CAPACITY 4096
+#define CONNECTION 1         // the client's connection number
+
+using namespace std;
+
+double wallSeconds();
+
+int main( int argc, char *argv[] )
+{
+  char scratch[] = "/tmp/vendPathBenchXXXXXX";
+  unsigned long count = argc > 1 ? atol( argv[1] ) : VEND_COUNT;
+  int pair[2];
+  int client[2];
+
+  if( mkdtemp( scratch ) == NULL || chdir( scratch ) != 0 ||
+      mkdir( "log", 0755 ) != 0 )
+  {
+    perror( "vendPathBench: could not make a scratch directory" );
+    return 1;
+  }
+  FILE *products = fopen( "products", "w" );
+  if( products == NULL || socketpair( AF_UNIX, SOCK_STREAM, 0, pair ) != 0 ||
+      socketpair( AF_UNIX, SOCK_STREAM, 0, client ) != 0 )
+  {
+    perror( "vendPathBench: setup" );
+    return 1;
+  }
+  fprintf( products, "cola 0 1 2 3\nwater 4 5\n" );
+  fclose( products );
+
+  emulatedSodaMachine acmSoda;
+  mcuModel &mcu = acmSoda.getTransport().mcu();
+  admissionControl admission( 1e9, 1e9, 16 );
+  idempotencyCache keys( KEY_CAPACITY, 600 * 1000000LL );
+  eventBus bus;
+  slotSelector selector;
+  stateCheckpoint checkpoint( emulatedSodaMachine::geometry::slotCount );
+  nodePool connectionNodes( 1 );
+  connectionTable connections( ( less<unsigned long>() ),
+                     poolAllocator<connectionEntry>( &connectionNodes ) );
+  frontEnd fronts( 0, -1, CONNECTION + 1,
+                   emulatedSodaMachine::geometry::slotCount );
+  vendPath path( admission, keys, selector, bus, checkpoint, connections,
+                 fronts, 0 );
+  clientConnection connection;
+  unsigned long allocating = 0;
+  unsigned long vended = 0;
+  unsigned long sequence = 0;
+
+  mcu.setSlots( emulatedSodaMachine::geometry::slotCount );
+  mcu.pushedEvents = true;
+  for( unsigned slot = 0; slot < emulatedSodaMachine::geometry::slotCount;
+       slot++ )
+    mcu.setStock( slot, 2 * ( WARMUP + count ) + 1 );
+  if( !keys.open( "log/vendkeys" ) || !selector.load( "products" ) ||
+      !checkpoint.open( "log/state" ) )
+  {
+    cerr << "vendPathBench: could not open the key, product or state file"
+         << endl;
+    return 1;
+  }
+  connection.fd = client[1];
+  connection.buffered = 0;
+  snprintf( connection.client, sizeof(connection.client), "bench" );
+  connections[CONNECTION] = connection;
+  bus.add( pair[1] );
+  if( write( pair[0], "SUBSCRIBE all\n", 14 ) != 14 ||
+      !bus.readable( pair[1] ) )
+  {
+    cerr << "vendPathBench: the subscriber was refused" << endl;
+    return 1;
+  }
+
+  for( int pushed = 0; pushed < 2; pushed++ )
+  {
+    unsigned long passAllocating = 0;
+    unsigned long allocations = 0;
+    unsigned long inventories = 0;
+    unsigned long buttons = 0;
+    double start = 0;
+
+    if( pushed && !acmSoda.setPushedEvents( true ) )
+    {
+      cerr << "vendPathBench: the MCU does not push events" << endl;
+      return 1;
+    }
+
+    for( unsigned long i = 0; i < WARMUP + count; i++, sequence++ )
+    {
+      unsigned long before = allocationCount();
+      char line[128];
+      char answer[REPLY_LENGTH];
+      linkResult done;
+      emulatedSodaMachine::pushedEvent event;
+
+      if( i == WARMUP )
+        start = wallSeconds();
+
+      /* The request, as a client sends it; keys are never reused */
+      if( i % 2 == 0 )
+        snprintf( line, sizeof(line), "V %lu key=k%lu client=bench%lu",
+                  i % 8, sequence, i % CLIENTS );
+      else
+        snprintf( line, sizeof(line), "P %s key=k%lu client=bench%lu",
+                  i % 4 == 1 ? "cola" : "water", sequence, i % CLIENTS );
+      path.handleRequest( line, CONNECTION, connection.client );
+
+      /* With pushed events, someone presses a button during every vend */
+      if( pushed )
+        mcu.pressButton( acmSoda.getClock().now(), i % 8 );
+
+      /* Its turn on the link */
+      if( !path.startVend( acmSoda ) )
+      {
+        cerr << "vendPathBench: vend " << i << " was not admitted" << endl;
+        return 1;
+      }
+
+      /* ...and its answer */
+      int64_t serviceStart = linkScheduler::now();
+      while( !acmSoda.service( done ) )
+        ;
+      if( !path.finishVend( done, linkScheduler::now() - serviceStart ) )
+      {
+        cerr << "vendPathBench: vend " << i << " was not finished" << endl;
+        return 1;
+      }
+      path.commit();
+
+      /* The events the MCU pushed meanwhile, taken as the daemon does */
+      while( acmSoda.nextEvent( event ) )
+        if( event.kind == 's' )
+        {
+          path.inventory( event.bits );
+          inventories++;
+        }
+        else if( event.button >= 0 )
+        {
+          char text[32];
+          snprintf( text, sizeof(text), "button %d", event.button );
+          bus.publish( EVENT_BUTTON, text );
+          buttons++;
+        }
+
+      /* "0" or "0 slot=<n>" */
+      ssize_t got = recv( client[0], answer, sizeof(answer), MSG_DONTWAIT );
+      vended += got > 0 && answer[0] == '0';
+
+      /* The subscriber reads its events */
+      char events[1024];
+      bus.writable( pair[1] );
+      while( recv( pair[0], events, sizeof(events), MSG_DONTWAIT ) > 0 )
+        ;
+
+      if( i >= WARMUP && allocationCount() != before )
+      {
+        passAllocating++;
+        allocations += allocationCount() - before;
+      }
+    }
+
+    double wall = wallSeconds() - start;
+
+    cout << ( pushed ? "pushed " : "polled " )
+         << setw(10) << count << " vends  "
+         << setw(10) << fixed << setprecision(0) << count / wall << " vends/s  "
+         << setw(8) << setprecision(2) << wall * 1e6 / count << " us/vend  "
+         << passAllocating << " vends allocated (" << allocations
+         << " allocations)" << endl;
+    allocating += passAllocating;
+    if( pushed && ( inventories == 0 || buttons == 0 ) )
+    {
+      cerr << "vendPathBench: no event was pushed" << endl;
+      return 1;
+    }
+  }
+
+  if( vended != 2 * ( WARMUP + count ) )
+    cout << "  only " << vended << " vends succeeded!" << endl;
+
+  close( pair[0] );
+  close( client[0] );
+  close( client[1] );
+  bus.remove( pair[1] );
+  if( chdir( "/" ) == 0 )
+  {
+    string command = string( "rm -rf " ) + scratch;
+    if( system( command.c_str() ) != 0 )
+      cerr << "vendPathBench: could not remove " << scratch << endl;
+  }
+  return allocating == 0 ? 0 : 1;
+}
+
+/* wallSeconds: real time, for the rate */
+double wallSeconds()
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "accountIndex.h"
+
+#define ACCOUNTS 100000
+#define LOOKUPS 10000000
+
+using namespace std;
+
+/* seconds: monotonic time for the measurements */
+static double seconds() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* accountBench: builds an index of 100k random accounts, then times
+ * lookups of known cards, unknown cards, and known cards while another
+ * thread keeps swapping in freshly built indexes. */
+int main(int argc, char *argv[]) {
+	const char *path = argc > 1 ? argv[1] : "/tmp/accountBench.idx";
+	vector<accountEntry> entries(ACCOUNTS);
+	vector<uint64_t> cards(ACCOUNTS);
+	accountIndexHolder holder;
+	accountEntry found;
+	unsigned long hits = 0;
+	double start;
+
+	srand(1);
+	for(unsigned i = 0; i < ACCOUNTS; i++) {
+		accountEntry &e = entries[i];
+		memset(&e, 0, sizeof(e));
+		// ten digit student IDs, distinct by construction
+		e.card = 1000000000ULL + (uint64_t)i * 7919 + rand() % 7919;
+		e.cardLength = 10;
+		e.account = i + 1;
+		e.balance = rand() % 5000;
+		e.status = (i % 50) ? ACCOUNT_ACTIVE : ACCOUNT_DISABLED;
+		cards[i] = e.card;
+	}
+
+	start = seconds();
+	if(!buildAccountIndex(path, entries, time(NULL))) {
+		fprintf(stderr, "build failed\n");
+		return 1;
+	}
+	printf("built %u accounts in %.1f ms\n", ACCOUNTS,
+	       (seconds() - start) * 1e3);
+
+	start = seconds();
+	holder.reload(path);
+	printf("loaded in %.3f ms\n", (seconds() - start) * 1e3);
+
+	start = seconds();
+	for(unsigned i = 0; i < LOOKUPS; i++)
+		hits += holder.lookup(cards[(i * 2654435761u) % ACCOUNTS], 10, found) &&
+		        found.account != 0;
+	double elapsed = seconds() - start;
+	printf("hits:   %.1f ns/lookup (%lu/%u found)\n",
+	       elapsed * 1e9 / LOOKUPS, hits, LOOKUPS);
+
+	hits = 0;
+	start = seconds();
+	for(unsigned i = 0; i < LOOKUPS; i++)
+		hits += holder.lookup(cards[i % ACCOUNTS] + 1, 10, found);
+	elapsed = seconds() - start;
+	printf("misses: %.1f ns/lookup (%lu false hits)\n",
+	       elapsed * 1e9 / LOOKUPS, hits);
+
+	/* Lookups while the index is being replaced underneath them */
+	atomic<bool> stop(false);
+	unsigned reloads = 0;
+	thread reloader([&]() {
+		while(!stop.load()) {
+			if(holder.reload(path))
+				reloads++;
+			usleep(1000);
+		}
+	});
+
+	hits = 0;
+	start = seconds();
+	for(unsigned i = 0; i < LOOKUPS; i++)
+		hits += holder.lookup(cards[(i * 2654435761u) % ACCOUNTS], 10, found);
+	elapsed = seconds() - start;
+	stop = true;
+	reloader.join();
+	printf("during %u reloads: %.1f ns/lookup (%lu/%u found)\n",
+	       reloads, elapsed * 1e9 / LOOKUPS, hits, LOOKUPS);
+
+	unlink(path);
+	return hits == LOOKUPS ? 0 : 1;
+}
@@ -0,0 +1,300 @@
+#include "accountIndex.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+
+using namespace std;
+
+/* mix: 64-bit finalizer (splitmix64), the only hash the index uses */
+static inline uint64_t mix(uint64_t x) {
+	x += 0x9E3779B97F4A7C15ULL;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	return x ^ (x >> 31);
+}
+
+/* bucketOf / slotOf: where a card's bucket is, and where a bucket's seed
+ * puts the card */
+static inline uint32_t bucketOf(uint64_t card, uint8_t length, uint32_t buckets) {
+	return (uint32_t)(mix(card ^ ((uint64_t)length << 59)) % buckets);
+}
+
+static inline uint32_t slotOf(uint64_t card, uint8_t length, uint32_t seed,
+                              uint32_t slots) {
+	return (uint32_t)(mix(card ^ ((uint64_t)length << 59) ^
+	                      ((uint64_t)seed * 0xD6E8FEB86659FD93ULL)) % slots);
+}
+
+/* cardKey: digits after an optional ';' up to '=', '?' or the end */
+bool cardKey(const char *track, uint64_t &card, uint8_t &length) {
+	card = 0;
+	length = 0;
+
+	if(*track == ';')
+		track++;
+	for(; *track >= '0' && *track <= '9'; track++) {
+		if(++length > 19)
+			return false;
+		card = card * 10 + (*track - '0');
+	}
+	return length > 0;
+}
+
+/* buildAccountIndex: hash and displace
+ *
+ * - about 4 cards per bucket, table 5% larger than the number of cards
+ * - buckets are placed largest first, each trying seeds until all of its
+ *   cards land in free, distinct slots
+ * - duplicate cards never land in distinct slots, so they are found first,
+ *   by sorting, and refused by name
+ */
+bool buildAccountIndex(const char *path, const vector<accountEntry> &entries,
+                       int64_t built) {
+	accountIndexHeader header;
+	uint32_t count = entries.size();
+	uint32_t buckets = count / 4 + 1;
+	uint32_t slots = count + count / 20 + 1;
+	vector<vector<uint32_t> > members(buckets);
+	vector<uint32_t> order(buckets);
+	vector<uint32_t> seeds(buckets, 0);
+	vector<accountEntry> table(slots);
+	vector<bool> taken(slots, false);
+	vector<uint32_t> placed;
+	vector<uint32_t> byCard(count);
+
+	for(uint32_t i = 0; i < count; i++)
+		byCard[i] = i;
+	sort(byCard.begin(), byCard.end(), [&](uint32_t x, uint32_t y) {
+		return entries[x].card != entries[y].card ?
+		       entries[x].card < entries[y].card :
+		       entries[x].cardLength < entries[y].cardLength;
+	});
+	for(uint32_t i = 1; i < count; i++) {
+		const accountEntry &a = entries[byCard[i - 1]];
+		const accountEntry &b = entries[byCard[i]];
+		if(a.card == b.card && a.cardLength == b.cardLength) {
+			fprintf(stderr, "buildAccountIndex: card %0*llu is on accounts "
+			        "%u and %u\n", (int)a.cardLength,
+			        (unsigned long long)a.card, a.account, b.account);
+			return false;
+		}
+	}
+
+	for(uint32_t i = 0; i < count; i++)
+		members[bucketOf(entries[i].card, entries[i].cardLength, buckets)]
+			.push_back(i);
+
+	for(uint32_t b = 0; b < buckets; b++)
+		order[b] = b;
+	sort(order.begin(), order.end(), [&](uint32_t x, uint32_t y) {
+		return members[x].size() > members[y].size();
+	});
+
+	for(uint32_t o = 0; o < buckets && !members[order[o]].empty(); o++) {
+		const vector<uint32_t> &bucket = members[order[o]];
+		uint32_t seed;
+
+		for(seed = 0; seed < 0x00FFFFFF; seed++) {
+			placed.clear();
+			size_t k;
+			for(k = 0; k < bucket.size(); k++) {
+				const accountEntry &e = entries[bucket[k]];
+				uint32_t slot = slotOf(e.card, e.cardLength, seed, slots);
+				if(taken[slot] ||
+				   find(placed.begin(), placed.end(), slot) != placed.end())
+					break;
+				placed.push_back(slot);
+			}
+			if(k == bucket.size())
+				break;
+		}
+		if(seed == 0x00FFFFFF) {
+			fprintf(stderr, "buildAccountIndex: could not place a bucket "
+			        "of %u cards\n", (unsigned)bucket.size());
+			return false;
+		}
+
+		seeds[order[o]] = seed;
+		for(size_t k = 0; k < bucket.size(); k++) {
+			taken[placed[k]] = true;
+			table[placed[k]] = entries[bucket[k]];
+		}
+	}
+
+	for(uint32_t s = 0; s < slots; s++)
+		if(!taken[s]) {
+			memset(&table[s], 0, sizeof(accountEntry));
+			table[s].status = ACCOUNT_EMPTY;
+		}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, ACCOUNT_INDEX_MAGIC, sizeof(header.magic));
+	header.version = ACCOUNT_INDEX_VERSION;
+	header.accounts = count;
+	header.buckets = buckets;
+	header.slots = slots;
+	header.built = built;
+
+	string temporary = string(path) + ".new";
+	FILE *out = fopen(temporary.c_str(), "wb");
+	if(out == NULL)
+		return false;
+
+	size_t seedBytes = buckets * sizeof(uint32_t);
+	char padding[8] = { 0 };
+	bool ok = fwrite(&header, sizeof(header), 1, out) == 1 &&
+	          fwrite(&seeds[0], seedBytes, 1, out) == 1 &&
+	          fwrite(padding, (8 - seedBytes % 8) % 8, 1, out) <= 1 &&
+	          fwrite(&table[0], sizeof(accountEntry), slots, out) == slots;
+	ok = (fflush(out) == 0) && ok && fsync(fileno(out)) == 0;
+	ok = (fclose(out) == 0) && ok;
+
+	if(!ok || rename(temporary.c_str(), path) != 0) {
+		unlink(temporary.c_str());
+		return false;
+	}
+	return true;
+}
+
+accountIndex::accountIndex() : map(NULL), mapSize(0), header(NULL),
+                               seeds(NULL), entries(NULL) {
+}
+
+accountIndex::~accountIndex() {
+	if(map != NULL)
+		munmap(map, mapSize);
+}
+
+/* open: maps an index file and checks that its sizes add up */
+bool accountIndex::open(const char *path) {
+	struct stat status;
+	int fd = ::open(path, O_RDONLY);
+
+	if(fd < 0)
+		return false;
+	if(fstat(fd, &status) != 0 ||
+	   status.st_size < (off_t)sizeof(accountIndexHeader)) {
+		close(fd);
+		return false;
+	}
+
+	mapSize = status.st_size;
+	map = mmap(NULL, mapSize, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED) {
+		map = NULL;
+		return false;
+	}
+
+	const accountIndexHeader *h = (const accountIndexHeader *)map;
+	size_t seedBytes = (size_t)h->buckets * sizeof(uint32_t);
+	size_t entryOffset = sizeof(*h) + seedBytes + (8 - seedBytes % 8) % 8;
+
+	if(memcmp(h->magic, ACCOUNT_INDEX_MAGIC, sizeof(h->magic)) != 0 ||
+	   h->version != ACCOUNT_INDEX_VERSION || h->buckets == 0 ||
+	   h->slots == 0 ||
+	   entryOffset + (size_t)h->slots * sizeof(accountEntry) != mapSize) {
+		munmap(map, mapSize);
+		map = NULL;
+		return false;
+	}
+
+	header = h;
+	seeds = (const uint32_t *)((const char *)map + sizeof(*h));
+	entries = (const accountEntry *)((const char *)map + entryOffset);
+	return true;
+}
+
+/* lookup: the account for a card, or NULL if the card is not indexed */
+const accountEntry *accountIndex::lookup(uint64_t card, uint8_t length) const {
+	if(header == NULL)
+		return NULL;
+
+	uint32_t seed = seeds[bucketOf(card, length, header->buckets)];
+	const accountEntry *e = &entries[slotOf(card, length, seed, header->slots)];
+
+	if(e->status == ACCOUNT_EMPTY || e->card != card || e->cardLength != length)
+		return NULL;
+	return e;
+}
+
+const accountEntry *accountIndex::lookup(const char *track) const {
+	uint64_t card;
+	uint8_t length;
+
+	if(!cardKey(track, card, length))
+		return NULL;
+	return lookup(card, length);
+}
+
+accountIndexHolder::accountIndexHolder() : current(NULL), epoch(0) {
+	readers[0] = 0;
+	readers[1] = 0;
+}
+
+accountIndexHolder::~accountIndexHolder() {
+	delete current.load();
+}
+
+/* reload: maps path and swaps it in; false keeps the current index */
+bool accountIndexHolder::reload(const char *path) {
+	accountIndex *fresh = new accountIndex;
+
+	if(!fresh->open(path)) {
+		delete fresh;
+		return false;
+	}
+
+	accountIndex *old = current.exchange(fresh);
+	unsigned previous = epoch.fetch_add(1);
+
+	// lookups registered in the previous epoch may still hold old
+	while(readers[previous & 1].load() != 0)
+		sched_yield();
+
+	delete old;
+	return true;
+}
+
+/* lookup: copies the card's account out of the live index
+ *
+ * Registers in the current epoch, retrying if reload() flipped it in
+ * between, so that reload() cannot miss this reader. */
+bool accountIndexHolder::lookup(uint64_t card, uint8_t length,
+                                accountEntry &entry) {
+	unsigned e;
+	bool found = false;
+
+	for(;;) {
+		e = epoch.load();
+		readers[e & 1].fetch_add(1);
+		if(epoch.load() == e)
+			break;
+		readers[e & 1].fetch_sub(1);
+	}
+
+	accountIndex *index = current.load();
+	const accountEntry *hit = index ? index->lookup(card, length) : NULL;
+	if(hit != NULL) {
+		entry = *hit;
+		found = true;
+	}
+
+	readers[e & 1].fetch_sub(1);
+	return found;
+}
+
+bool accountIndexHolder::lookup(const char *track, accountEntry &entry) {
+	uint64_t card;
+	uint8_t length;
+
+	if(!cardKey(track, card, length))
+		return false;
+	return lookup(card, length, entry);
+}
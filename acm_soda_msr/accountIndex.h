@@ -0,0 +1,105 @@
+#ifndef ACCOUNTINDEX_H
+#define ACCOUNTINDEX_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+/* accountIndex: card number -> account lookup without touching Django.
+ *
+ * The index is an immutable file built offline from the MachineUser table
+ * (see buildAccountIndex) and memory-mapped by the reader. Cards are found
+ * with a minimal perfect hash ("hash and displace"): the card hashes to a
+ * bucket, the bucket's seed places the card in a slot of its own, and one
+ * comparison rejects cards that are not in the index. A lookup is two
+ * hashes and two memory reads whatever the number of accounts.
+ *
+ * File layout:
+ *   accountIndexHeader
+ *   uint32_t seeds[buckets]
+ *   accountEntry entries[slots]   (8-byte aligned)
+ */
+
+#define ACCOUNT_INDEX_MAGIC "SODAACCT"
+#define ACCOUNT_INDEX_VERSION 1
+
+/* accountEntry.status */
+#define ACCOUNT_ACTIVE   0
+#define ACCOUNT_DISABLED 1
+#define ACCOUNT_EMPTY    0xFF   // unused slot in the table
+
+struct accountEntry {
+	uint64_t card;        // card number digits as an integer
+	uint32_t account;     // MachineUser id
+	int32_t  balance;     // pennies, as of when the index was built
+	uint8_t  cardLength;  // digit count, so leading zeros still matter
+	uint8_t  status;
+	uint8_t  reserved[6];
+};
+
+struct accountIndexHeader {
+	char     magic[8];
+	uint32_t version;
+	uint32_t accounts;
+	uint32_t buckets;
+	uint32_t slots;
+	int64_t  built;       // unix time the snapshot was taken
+};
+
+/* cardKey: parses the card number digits of a track-2 string or a bare
+ * number (";1234=...?" or "1234"). Returns false if there are none or more
+ * than 19. */
+bool cardKey(const char *track, uint64_t &card, uint8_t &length);
+
+/* buildAccountIndex: writes entries as an index file at path, via a
+ * temporary file and rename() so readers never see a partial index. */
+bool buildAccountIndex(const char *path, const std::vector<accountEntry> &entries,
+                       int64_t built);
+
+class accountIndex {
+public:
+	accountIndex();
+	~accountIndex();
+
+	bool open(const char *path);
+	const accountEntry *lookup(uint64_t card, uint8_t length) const;
+	const accountEntry *lookup(const char *track) const;
+
+	uint32_t accounts() const { return header ? header->accounts : 0; }
+	int64_t built() const { return header ? header->built : 0; }
+
+private:
+	accountIndex(const accountIndex &);
+	accountIndex &operator=(const accountIndex &);
+
+	void *map;
+	size_t mapSize;
+	const accountIndexHeader *header;
+	const uint32_t *seeds;
+	const accountEntry *entries;
+};
+
+/* accountIndexHolder: the live index, swapped for a newer one RCU-style.
+ *
+ * Lookups never block: they register in the current epoch, read the
+ * current index and copy the entry out. reload() publishes the new index,
+ * flips the epoch and waits only for lookups that started in the old epoch
+ * before unmapping the old index. One thread reloads at a time. */
+class accountIndexHolder {
+public:
+	accountIndexHolder();
+	~accountIndexHolder();
+
+	bool reload(const char *path);
+	bool lookup(const char *track, accountEntry &entry);
+	bool lookup(uint64_t card, uint8_t length, accountEntry &entry);
+
+private:
+	std::atomic<accountIndex *> current;
+	std::atomic<unsigned> epoch;
+	std::atomic<unsigned> readers[2];
+};
+
+#endif
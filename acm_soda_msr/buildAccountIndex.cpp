@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+#include "accountIndex.h"
+
+using namespace std;
+
+/* buildAccountIndex: builds the reader's account index from a CSV export of
+ * the MachineUser table, one account per line:
+ *
+ *   card,account,balance,active
+ *
+ * card is the number on the card's track 2 (the student ID), balance is in
+ * pennies and active is 1/0 (auth_user.is_active). Lines that do not start
+ * with a card number, like a header, are skipped. For example:
+ *
+ *   sqlite3 -csv soda.db "SELECT m.student_id, m.user_id, m.balance,
+ *       u.is_active FROM api_machineuser m JOIN auth_user u
+ *       ON u.id = m.user_id WHERE m.student_id != ''" > accounts.csv
+ *   buildAccountIndex accounts.csv accounts.idx
+ *
+ * The stripe reader picks up the new index on SIGHUP.
+ */
+int main(int argc, char *argv[]) {
+	vector<accountEntry> entries;
+	char line[256];
+	unsigned skipped = 0;
+
+	if(argc != 3) {
+		fprintf(stderr, "Usage: buildAccountIndex <accounts.csv> <index>\n");
+		return 1;
+	}
+
+	FILE *in = strcmp(argv[1], "-") == 0 ? stdin : fopen(argv[1], "r");
+	if(in == NULL) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	while(fgets(line, sizeof(line), in) != NULL) {
+		accountEntry e;
+		char *field = strchr(line, ',');
+
+		memset(&e, 0, sizeof(e));
+		if(field == NULL) {
+			skipped++;
+			continue;
+		}
+		*field++ = '\0';
+		if(!cardKey(line, e.card, e.cardLength)) {
+			skipped++;
+			continue;
+		}
+
+		e.account = strtoul(field, &field, 10);
+		e.balance = (*field == ',') ? strtol(field + 1, &field, 10) : 0;
+		e.status = (*field == ',' && atoi(field + 1) == 0) ?
+		           ACCOUNT_DISABLED : ACCOUNT_ACTIVE;
+		entries.push_back(e);
+	}
+	if(in != stdin)
+		fclose(in);
+
+	if(!buildAccountIndex(argv[2], entries, time(NULL))) {
+		fprintf(stderr, "Could not build %s\n", argv[2]);
+		return 1;
+	}
+
+	printf("Indexed %u accounts (%u lines skipped) into %s\n",
+	       (unsigned)entries.size(), skipped, argv[2]);
+	return 0;
+}
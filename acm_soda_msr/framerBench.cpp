@@ -0,0 +1,204 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include "msrFramer.h"
+
+#define RECORDS 200000
+#define OLD_BUFFER 256
+
+using namespace std;
+
+/* tally: what came out of a stream, to compare against what went in */
+struct tally {
+	unsigned long counts[MSR_BAD_RESPONSE + 1];
+	unsigned long checked;
+	unsigned long trackBytes;
+};
+
+static double seconds() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static string digits(int count) {
+	string s;
+	for(int i = 0; i < count; i++)
+		s += '0' + rand() % 10;
+	return s;
+}
+
+/* stream: RECORDS records back to back, as a busy reader would send them:
+ * tracks with an LRC, with a CR instead, with a wrong LRC, or cut short by
+ * the next swipe; ACKs, NAKs, response frames, and line noise. */
+static string stream(tally &expected) {
+	string out;
+
+	memset(&expected, 0, sizeof(expected));
+	for(int i = 0; i < RECORDS; i++) {
+		int kind = rand() % 100;
+		string track = ";" + digits(16) + "=" + digits(4 + rand() % 12) + "?";
+		char lrc = msrFramer::trackLrc(track.data(), track.size());
+
+		if(kind < 60) {
+			out += track + lrc;
+			expected.counts[MSR_TRACK]++;
+			expected.checked++;
+			expected.trackBytes += track.size();
+		} else if(kind < 70) {
+			out += track + '\r';
+			expected.counts[MSR_TRACK]++;
+			expected.trackBytes += track.size();
+		} else if(kind < 73) {
+			out += track + (char)(lrc == '0' ? '1' : '0');
+			expected.counts[MSR_BAD_TRACK]++;
+		} else if(kind < 75) {
+			out += track.substr(0, track.size() / 2);
+			expected.counts[MSR_BAD_TRACK]++;
+			out += track + lrc;
+			expected.counts[MSR_TRACK]++;
+			expected.checked++;
+			expected.trackBytes += track.size();
+		} else if(kind < 88) {
+			out += '\x06';
+			expected.counts[MSR_ACK]++;
+		} else if(kind < 90) {
+			out += '\x15';
+			expected.counts[MSR_NAK]++;
+		} else if(kind < 97) {
+			string body = digits(rand() % 8);
+			string frame = "\x60";
+			frame += '\x00';
+			frame += (char)body.size();
+			frame += body;
+			char check = 0;
+			for(size_t j = 0; j < frame.size(); j++)
+				check ^= frame[j];
+			frame += check;
+			frame += '\x03';
+			out += frame;
+			expected.counts[MSR_RESPONSE]++;
+		} else {
+			out += "\r\n";
+			out += (char)(0x80 + rand() % 64);
+		}
+	}
+	return out;
+}
+
+/* frame: the stream through one msrFramer, cut into reads of cut bytes
+ * (1 to -cut bytes at random when cut is negative) */
+static void frame(const string &in, int cut, tally &found) {
+	msrFramer framer;
+	size_t at = 0;
+
+	memset(&found, 0, sizeof(found));
+	while(at < in.size()) {
+		size_t length = cut > 0 ? cut : 1 + rand() % -cut;
+		const char *data = in.data() + at;
+
+		if(length > in.size() - at)
+			length = in.size() - at;
+		at += length;
+		while(length > 0) {
+			msrRecord record;
+			size_t used = framer.feed(data, length, record);
+
+			data += used;
+			length -= used;
+			found.counts[record.type]++;
+			if(record.type == MSR_TRACK) {
+				found.trackBytes += record.size;
+				found.checked += record.checked;
+			}
+		}
+	}
+	msrRecord record;
+	if(framer.flush(record))
+		found.counts[MSR_TRACK]++;
+}
+
+/* oldLoop: what the old stripereader made of the same reads; it cleared
+ * its buffer before each read and took a swipe only if the read began
+ * with ';' and ended with '?' and one more byte */
+static unsigned long oldLoop(const string &in, int cut) {
+	char buffer[OLD_BUFFER + 1];
+	unsigned long swipes = 0;
+	size_t at = 0;
+
+	while(at < in.size()) {
+		size_t length = cut > 0 ? cut : 1 + rand() % -cut;
+
+		if(length > OLD_BUFFER)
+			length = OLD_BUFFER;
+		if(length > in.size() - at)
+			length = in.size() - at;
+		memset(buffer, 0, sizeof(buffer));
+		memcpy(buffer, in.data() + at, length);
+		at += length;
+
+		size_t size = strlen(buffer);
+		if(size >= 2 && buffer[0] == ';' && buffer[size - 2] == '?')
+			swipes++;
+	}
+	return swipes;
+}
+
+static bool same(const tally &a, const tally &b) {
+	return memcmp(a.counts + MSR_TRACK, b.counts + MSR_TRACK,
+	              sizeof(a.counts) - sizeof(a.counts[0])) == 0 &&
+	       a.checked == b.checked && a.trackBytes == b.trackBytes;
+}
+
+/* framerBench: one long reader stream, framed in reads of many sizes.
+ * Every cut must give exactly the records that went in; reports the
+ * throughput for each, and how many tracks the old whole-track-per-read
+ * loop would have found in the same reads. */
+int main() {
+	int cuts[] = { 1, 3, 7, 16, 64, 256, -16, -256, 1 << 30 };
+	tally expected, found;
+	bool good = true;
+
+	srand(1);
+	string in = stream(expected);
+	printf("%lu bytes: %lu tracks (%lu with LRC), %lu bad tracks, "
+	       "%lu answers\n", (unsigned long)in.size(), expected.counts[MSR_TRACK],
+	       expected.checked, expected.counts[MSR_BAD_TRACK],
+	       expected.counts[MSR_ACK] + expected.counts[MSR_NAK] +
+	       expected.counts[MSR_RESPONSE]);
+
+	printf("%-12s %10s %10s %12s %14s\n", "read size", "MB/s", "ns/record",
+	       "records", "old loop found");
+	for(size_t i = 0; i < sizeof(cuts) / sizeof(cuts[0]); i++) {
+		int cut = cuts[i];
+		char name[32];
+		double start, elapsed;
+
+		if(cut < 0)
+			snprintf(name, sizeof(name), "1-%d", -cut);
+		else if(cut >= (int)in.size())
+			snprintf(name, sizeof(name), "all");
+		else
+			snprintf(name, sizeof(name), "%d", cut);
+
+		srand(2);
+		start = seconds();
+		frame(in, cut, found);
+		elapsed = seconds() - start;
+
+		srand(2);
+		unsigned long old = oldLoop(in, cut);
+
+		unsigned long records = 0;
+		for(int type = MSR_TRACK; type <= MSR_BAD_RESPONSE; type++)
+			records += found.counts[type];
+		printf("%-12s %10.1f %10.1f %12lu %14lu%s\n", name,
+		       in.size() / elapsed / 1e6, elapsed * 1e9 / records, records, old,
+		       same(found, expected) ? "" : "  MISMATCH");
+		good = good && same(found, expected);
+	}
+	return good ? 0 : 1;
+}
@@ -0,0 +1,147 @@
+#include "msrFramer.h"
+
+#define STX '\x60'
+#define ETX '\x03'
+#define ACK '\x06'
+#define NAK '\x15'
+#define START_SENTINEL ';'
+#define END_SENTINEL '?'
+
+msrFramer::msrFramer() : noise(0) {
+	reset();
+}
+
+void msrFramer::reset() {
+	state = FRAME_IDLE;
+	size = 0;
+	expected = 0;
+	lrc = 0;
+}
+
+/* feed: runs bytes through until a record is complete or they run out.
+ * Returns the bytes used; record.type is MSR_NONE if none was complete. */
+size_t msrFramer::feed(const char *data, size_t length, msrRecord &record) {
+	record.type = MSR_NONE;
+	record.data = buffer;
+	record.size = 0;
+	record.checked = false;
+
+	for(size_t i = 0; i < length; i++) {
+		char c = data[i];
+
+		switch(state) {
+		case FRAME_IDLE:
+			if(c == START_SENTINEL) {
+				state = FRAME_TRACK;
+				buffer[0] = c;
+				size = 1;
+				lrc = c & 0x0f;
+			} else if(c == STX) {
+				state = FRAME_STATUS;
+				buffer[0] = c;
+				size = 1;
+				lrc = c;
+			} else if(c == ACK || c == NAK) {
+				buffer[0] = c;
+				size = 1;
+				emit(c == ACK ? MSR_ACK : MSR_NAK, record);
+				return i + 1;
+			} else
+				noise++;
+			break;
+
+		case FRAME_TRACK:
+			if(c == START_SENTINEL) {
+				// a swipe cut short; this ';' starts the next one
+				emit(MSR_BAD_TRACK, record);
+				return i;
+			}
+			buffer[size++] = c;
+			lrc ^= c & 0x0f;
+			if(c == END_SENTINEL)
+				state = FRAME_TRACK_LRC;
+			else if(size > MAX_TRACK) {
+				emit(MSR_BAD_TRACK, record);
+				return i + 1;
+			}
+			break;
+
+		case FRAME_TRACK_LRC:
+			// the LRC itself may be ';', so it is tried first
+			if(c == '0' + lrc) {
+				emit(MSR_TRACK, record);
+				record.checked = true;
+				return i + 1;
+			}
+			if(c == START_SENTINEL) {
+				emit(MSR_TRACK, record);
+				return i;
+			}
+			emit(c == '\r' || c == '\n' ? MSR_TRACK : MSR_BAD_TRACK, record);
+			return i + 1;
+
+		case FRAME_STATUS:
+			buffer[size++] = c;
+			lrc ^= c;
+			state = FRAME_LENGTH;
+			break;
+
+		case FRAME_LENGTH:
+			buffer[size++] = c;
+			lrc ^= c;
+			expected = (unsigned char)c;
+			state = expected > 0 ? FRAME_DATA : FRAME_LRC;
+			break;
+
+		case FRAME_DATA:
+			buffer[size++] = c;
+			lrc ^= c;
+			if(--expected == 0)
+				state = FRAME_LRC;
+			break;
+
+		case FRAME_LRC:
+			buffer[size++] = c;
+			lrc ^= c;     // zero if it was right
+			state = FRAME_ETX;
+			break;
+
+		case FRAME_ETX:
+			if(c != ETX) {
+				// not a frame after all; c may start the next record
+				emit(MSR_BAD_RESPONSE, record);
+				return i;
+			}
+			buffer[size++] = c;
+			emit(lrc == 0 ? MSR_RESPONSE : MSR_BAD_RESPONSE, record);
+			return i + 1;
+		}
+	}
+	return length;
+}
+
+/* flush: hands out a track still waiting for its LRC, unchecked */
+bool msrFramer::flush(msrRecord &record) {
+	record.type = MSR_NONE;
+	if(state != FRAME_TRACK_LRC)
+		return false;
+	emit(MSR_TRACK, record);
+	record.checked = false;
+	return true;
+}
+
+char msrFramer::trackLrc(const char *track, size_t size) {
+	uint8_t lrc = 0;
+	for(size_t i = 0; i < size; i++)
+		lrc ^= track[i] & 0x0f;
+	return '0' + lrc;
+}
+
+/* emit: the buffer is a record; the framer starts over */
+void msrFramer::emit(msrRecordType type, msrRecord &record) {
+	record.type = type;
+	record.data = buffer;
+	record.size = size;
+	record.checked = false;
+	reset();
+}
@@ -0,0 +1,96 @@
+#ifndef MSRFRAMER_H
+#define MSRFRAMER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* msrFramer: splits what a stripe reader sends into records, however the
+ * bytes are cut up by read().
+ *
+ * Bytes go through a state machine one at a time, so a record may start
+ * in one read and end in another, and one read may hold several records.
+ * Nothing is cleared or searched again between reads. Records are:
+ *
+ *   MSR_TRACK      ";<track 2>?" and its LRC, the xor of the low nibbles
+ *                  of ';' through '?' plus '0'. A CR or LF in place of the
+ *                  LRC, or the next ';' straight after '?', means the
+ *                  reader sends none, and the track is taken unchecked.
+ *   MSR_BAD_TRACK  a wrong LRC, a track over MAX_TRACK characters, or a
+ *                  new ';' before the '?'
+ *   MSR_ACK, MSR_NAK
+ *   MSR_RESPONSE   0x60 <status> <n> <n bytes> <LRC> ETX, with the LRC the
+ *                  xor of the bytes before it, as the commands are framed
+ *   MSR_BAD_RESPONSE  a wrong LRC or no ETX
+ *
+ * Anything else between records is skipped and counted.
+ *
+ * feed() stops after each record, returning how many bytes it used, so a
+ * caller loops:
+ *
+ *   while(length > 0) {
+ *       size_t used = framer.feed(data, length, record);
+ *       data += used, length -= used;
+ *       if(record.type != MSR_NONE) ...
+ *   }
+ *
+ * record.data points into the framer and is good until the next feed().
+ * A track whose LRC has not come yet is pending(); flush() takes it as it
+ * is, for readers that send nothing after '?'. */
+
+#define MAX_TRACK 40        // track 2 is at most 40 characters
+#define MAX_RECORD 260      // a response of 255 bytes and its framing
+
+enum msrRecordType {
+	MSR_NONE,
+	MSR_TRACK,
+	MSR_BAD_TRACK,
+	MSR_ACK,
+	MSR_NAK,
+	MSR_RESPONSE,
+	MSR_BAD_RESPONSE
+};
+
+struct msrRecord {
+	msrRecordType type;
+	const char *data;   // the whole record, ";...?" for a track
+	size_t size;
+	bool checked;       // a track's LRC was there and right
+};
+
+class msrFramer {
+public:
+	msrFramer();
+
+	void reset();
+	size_t feed(const char *data, size_t length, msrRecord &record);
+	bool pending() const { return state == FRAME_TRACK_LRC; }
+	bool flush(msrRecord &record);
+
+	unsigned long skipped() const { return noise; }
+
+	/* trackLrc: the LRC character for ";...?" */
+	static char trackLrc(const char *track, size_t size);
+
+private:
+	enum frameState {
+		FRAME_IDLE,
+		FRAME_TRACK,
+		FRAME_TRACK_LRC,
+		FRAME_STATUS,
+		FRAME_LENGTH,
+		FRAME_DATA,
+		FRAME_LRC,
+		FRAME_ETX
+	};
+
+	void emit(msrRecordType type, msrRecord &record);
+
+	frameState state;
+	char buffer[MAX_RECORD];
+	size_t size;
+	size_t expected;    // data bytes of a response still to come
+	uint8_t lrc;        // running, of the track nibbles or response bytes
+	unsigned long noise;
+};
+
+#endif
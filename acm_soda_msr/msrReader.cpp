@@ -0,0 +1,389 @@
+#include "msrReader.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <dirent.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <iostream>
+
+using namespace std;
+
+/* Reader commands, as the old stripereader sent them */
+#define READER_OPTIONS "\x04\x53\x11\x01\x10"  // host LED, no envelope
+#define TRACK_2_ONLY   "\x04\x53\x13\x01\x32"
+#define READING_ON     "\x04\x53\x1a\x01\x31"
+#define READING_OFF    "\x04\x53\x1a\x01\x30"
+#define LED_OFF        "\x02\x6c\x30"
+#define LED_GREEN      "\x02\x6c\x31"
+#define LED_RED        "\x02\x6c\x32"
+#define LED_AMBER      "\x02\x6c\x33"
+
+#define STX '\x60'
+#define ETX '\x03'
+
+msrReader::msrReader(const string &path, int fd)
+	: name(path), descriptor(fd), current(READER_CONFIGURING), waiting(false),
+	  due(0) {
+}
+
+msrReader::~msrReader() {
+	close(descriptor);
+}
+
+/* start: configures the reader and turns reading on */
+bool msrReader::start(int64_t now) {
+	queue(READER_OPTIONS, sizeof(READER_OPTIONS) - 1);
+	queue(TRACK_2_ONLY, sizeof(TRACK_2_ONLY) - 1);
+	queue(READING_ON, sizeof(READING_ON) - 1);
+	queue(LED_OFF, sizeof(LED_OFF) - 1);
+	current = READER_CONFIGURING;
+	framer.reset();
+	return advance(now);
+}
+
+/* readable: takes what the reader sent, record by record */
+bool msrReader::readable(int64_t now) {
+	char buf[MAX_INPUT];
+	ssize_t length;
+
+	while((length = read(descriptor, buf, sizeof(buf))) > 0) {
+		const char *data = buf;
+		size_t left = length;
+
+		while(left > 0) {
+			msrRecord record;
+			size_t used = framer.feed(data, left, record);
+
+			data += used;
+			left -= used;
+			if(record.type != MSR_NONE && !take(record, now))
+				return false;
+		}
+	}
+	// with VMIN and VTIME 0 a drained tty reads 0; a hangup is POLLHUP or EIO
+	if(length < 0 && errno != EAGAIN && errno != EINTR)
+		return false;
+
+	if(current == READER_READY && framer.pending())
+		due = now + SWIPE_TAIL;
+	return true;
+}
+
+/* wake: the deadline passed. Hands out the track of a finished swipe. */
+bool msrReader::wake(int64_t now, string &track) {
+	track.clear();
+	if(due == 0 || now < due)
+		return true;
+
+	msrRecord record;
+	if(framer.flush(record) && !take(record, now))
+		return false;
+
+	if(current == READER_SWIPED) {
+		track = swipes.front();
+		swipes.pop_front();
+		current = READER_ANSWERING;
+		queue(READING_OFF, sizeof(READING_OFF) - 1);
+		queue(LED_AMBER, sizeof(LED_AMBER) - 1);
+	}
+
+	// a command nobody answered, or a pause that is over
+	waiting = false;
+	return advance(now);
+}
+
+/* answer: shows whether the card was good, then reads again */
+bool msrReader::answer(bool approved, int64_t now) {
+	if(approved)
+		queue(LED_GREEN, sizeof(LED_GREEN) - 1);
+	else
+		queue(LED_RED, sizeof(LED_RED) - 1);
+	queuePause(LED_HOLD);
+	queue(LED_OFF, sizeof(LED_OFF) - 1);
+	queue(READING_ON, sizeof(READING_ON) - 1);
+	current = READER_ANSWERING;
+
+	if(!waiting && due == 0)
+		return advance(now);
+	return true;
+}
+
+/* configure: raw 38400 baud. Commands contain XON and XOFF bytes, so
+ * flow control and newline translation are off too. */
+bool msrReader::configure(int fd) {
+	struct termios options;
+
+	if(tcgetattr(fd, &options) != 0)
+		return false;
+
+	cfsetispeed(&options, B38400);
+	cfsetospeed(&options, B38400);
+	options.c_cflag |= (CLOCAL | CREAD);
+	options.c_lflag &= ~(ICANON | ECHO | ECHOE | ISIG);
+	options.c_iflag &= ~(IXON | IXOFF | IXANY | ICRNL | INLCR | IGNCR | ISTRIP);
+	options.c_oflag &= ~OPOST;
+	options.c_cc[VMIN] = 0;
+	options.c_cc[VTIME] = 0;
+
+	return tcsetattr(fd, TCSANOW, &options) == 0;
+}
+
+/* queue: a framed command, with the LRC (xor of STX and the command) */
+void msrReader::queue(const char *command, size_t length) {
+	step next;
+	char lrc = STX;
+
+	next.command.reserve(length + 4);
+	next.command += STX;
+	next.command += '\x00';
+	for(size_t i = 0; i < length; i++) {
+		next.command += command[i];
+		lrc ^= command[i];
+	}
+	next.command += lrc;
+	next.command += ETX;
+	next.pause = 0;
+	steps.push_back(next);
+}
+
+void msrReader::queuePause(int64_t pause) {
+	step next;
+	next.pause = pause;
+	steps.push_back(next);
+}
+
+/* advance: starts the next step, or is ready for a card if there is none
+ * (or hands out the next of back-to-back swipes). A write the tty cannot
+ * take now is treated as unanswered. */
+bool msrReader::advance(int64_t now) {
+	if(steps.empty()) {
+		current = swipes.empty() ? READER_READY : READER_SWIPED;
+		due = swipes.empty() ? 0 : now;
+		return true;
+	}
+
+	step next = steps.front();
+	steps.pop_front();
+
+	if(next.command.empty()) {
+		due = now + next.pause;
+		return true;
+	}
+
+	if(write(descriptor, next.command.data(), next.command.size()) < 0 &&
+	   errno != EAGAIN)
+		return false;
+	waiting = true;
+	due = now + COMMAND_TIMEOUT;
+	return true;
+}
+
+/* take: one record from the framer. An answer lets the next command go;
+ * a track is kept to be handed out, and a bad one, while ready, flashes the
+ * red LED. */
+bool msrReader::take(const msrRecord &record, int64_t now) {
+	switch(record.type) {
+	case MSR_ACK:
+	case MSR_NAK:
+	case MSR_RESPONSE:
+	case MSR_BAD_RESPONSE:
+		if(!waiting)
+			return true;
+		waiting = false;
+		return advance(now);
+
+	case MSR_TRACK:
+		if(current == READER_CONFIGURING || swipes.size() >= MAX_SWIPES)
+			return true;
+		swipes.push_back(string(record.data, record.size));
+		if(current == READER_READY) {
+			current = READER_SWIPED;
+			due = now;
+		}
+		return true;
+
+	case MSR_BAD_TRACK:
+		if(current != READER_READY)
+			return true;
+		cerr << "stripereader: " << name << " bad swipe" << endl;
+		queue(LED_RED, sizeof(LED_RED) - 1);
+		queuePause(LED_HOLD);
+		queue(LED_OFF, sizeof(LED_OFF) - 1);
+		current = READER_ANSWERING;
+		return advance(now);
+
+	default:
+		return true;
+	}
+}
+
+readerService::readerService(swipeHandler handler, void *context)
+	: handler(handler), context(context), notify(-1), nextRescan(0) {
+}
+
+readerService::~readerService() {
+	for(size_t i = 0; i < active.size(); i++)
+		delete active[i];
+	if(notify >= 0)
+		close(notify);
+}
+
+/* watch: hot-plug readers in directory whose names match pattern. Returns
+ * false if inotify cannot watch it; it is still rescanned. */
+bool readerService::watch(const char *directory, const char *pattern) {
+	this->directory = directory;
+	this->pattern = pattern;
+	nextRescan = 0;
+
+	if(notify < 0)
+		notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	return notify >= 0 &&
+	       inotify_add_watch(notify, directory, IN_CREATE | IN_DELETE |
+	                         IN_MOVED_TO | IN_MOVED_FROM | IN_ATTRIB) >= 0;
+}
+
+/* add: a device to keep open whenever it exists */
+void readerService::add(const char *path) {
+	devices.push_back(path);
+	nextRescan = 0;
+}
+
+/* step: one round of the loop, waiting at most maxWait milliseconds (-1
+ * for as long as nothing is due). Returns false if poll() fails. */
+bool readerService::step(int maxWait) {
+	int64_t t = now();
+	int64_t wake = nextRescan;
+
+	if(t >= nextRescan) {
+		rescan(t);
+		wake = nextRescan;
+	}
+
+	polled.resize(active.size() + 1);
+	polled[0].fd = notify;
+	polled[0].events = POLLIN;
+	for(size_t i = 0; i < active.size(); i++) {
+		polled[i + 1].fd = active[i]->fd();
+		polled[i + 1].events = POLLIN;
+		if(active[i]->deadline() != 0 && active[i]->deadline() < wake)
+			wake = active[i]->deadline();
+	}
+
+	int64_t timeout = wake > t ? (wake - t + 999) / 1000 : 0;
+	if(maxWait >= 0 && timeout > maxWait)
+		timeout = maxWait;
+
+	int events = poll(&polled[0], polled.size(), timeout);
+	if(events < 0)
+		return errno == EINTR;
+
+	t = now();
+
+	// backwards, so that removing a reader keeps polled[] lined up
+	for(size_t i = active.size(); i-- > 0;) {
+		short revents = polled[i + 1].revents;
+		if(((revents & POLLIN) && !active[i]->readable(t)) ||
+		   (!(revents & POLLIN) && (revents & (POLLHUP | POLLERR | POLLNVAL))))
+			remove(i);
+	}
+
+	for(size_t i = active.size(); i-- > 0;) {
+		string track;
+
+		if(active[i]->deadline() == 0 || t < active[i]->deadline())
+			continue;
+		if(!active[i]->wake(t, track) ||
+		   (!track.empty() &&
+		    !active[i]->answer(handler(active[i]->path(), track, context), t)))
+			remove(i);
+	}
+
+	if(notify >= 0 && (polled[0].revents & POLLIN)) {
+		char buf[4096];
+		while(read(notify, buf, sizeof(buf)) > 0)
+			;
+		rescan(t);
+	}
+	return true;
+}
+
+size_t readerService::ready() const {
+	size_t count = 0;
+	for(size_t i = 0; i < active.size(); i++)
+		if(active[i]->state() == READER_READY)
+			count++;
+	return count;
+}
+
+int64_t readerService::now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* rescan: drops readers whose device is gone and opens new ones */
+void readerService::rescan(int64_t now) {
+	struct stat status;
+
+	nextRescan = now + RESCAN_INTERVAL;
+
+	for(size_t i = active.size(); i-- > 0;)
+		if(stat(active[i]->path().c_str(), &status) != 0)
+			remove(i);
+
+	for(size_t i = 0; i < devices.size(); i++)
+		if(!present(devices[i]))
+			open(devices[i], now);
+
+	if(directory.empty())
+		return;
+
+	DIR *listing = opendir(directory.c_str());
+	struct dirent *entry;
+
+	if(listing == NULL)
+		return;
+	while((entry = readdir(listing)) != NULL) {
+		string path = directory + "/" + entry->d_name;
+		if(fnmatch(pattern.c_str(), entry->d_name, 0) == 0 && !present(path))
+			open(path, now);
+	}
+	closedir(listing);
+}
+
+void readerService::open(const string &path, int64_t now) {
+	int fd = ::open(path.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+
+	if(fd < 0)
+		return;
+	if(!msrReader::configure(fd)) {
+		close(fd);
+		return;
+	}
+
+	msrReader *reader = new msrReader(path, fd);
+	if(!reader->start(now)) {
+		delete reader;
+		return;
+	}
+	active.push_back(reader);
+	cerr << "stripereader: " << path << " added" << endl;
+}
+
+void readerService::remove(size_t i) {
+	cerr << "stripereader: " << active[i]->path() << " removed" << endl;
+	delete active[i];
+	active.erase(active.begin() + i);
+}
+
+bool readerService::present(const string &path) const {
+	for(size_t i = 0; i < active.size(); i++)
+		if(active[i]->path() == path)
+			return true;
+	return false;
+}
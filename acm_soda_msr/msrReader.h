@@ -0,0 +1,148 @@
+#ifndef MSRREADER_H
+#define MSRREADER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <poll.h>
+#include <deque>
+#include <string>
+#include <vector>
+#include "msrFramer.h"
+
+/* msrReader: one magnetic stripe reader, driven without ever blocking.
+ *
+ * Every command the reader gets is framed as the old stripereader sent it
+ * (0x60 0x00 <command> <LRC> ETX). The old code then slept a second and
+ * flushed whatever came back; here the next command goes out as soon as
+ * the reader answers (an ACK, a NAK or a response frame), or after
+ * COMMAND_TIMEOUT if it does not. What the reader sends is split into
+ * records by an msrFramer, so neither answers nor tracks need to arrive in
+ * one read().
+ *
+ * A reader works through a queue of steps, each a command or a pause:
+ *
+ *   configuring   reader options, track 2 only, reading on, LED off
+ *   ready         waiting for a swipe
+ *   swiped        a whole track came in and is handed out at once, with
+ *                 reading off and the amber LED queued. A track whose LRC
+ *                 is missing is taken after SWIPE_TAIL of quiet. Tracks
+ *                 that come back to back (up to MAX_SWIPES) are each
+ *                 handed out in turn; a bad one flashes the red LED.
+ *   answering     answer() queued the green or red LED, a pause of
+ *                 LED_HOLD, LED off and reading on; ready again after
+ *
+ * The caller polls fd() for POLLIN and calls wake() once deadline() has
+ * passed. Both return false when the device is gone (unplugged, or an
+ * error); the reader should then be deleted. */
+
+#define COMMAND_TIMEOUT 1000000   // microseconds a reader has to answer
+#define SWIPE_TAIL 20000          // microseconds of quiet after '?'
+#define LED_HOLD 1000000          // microseconds the green/red LED stays on
+#define MAX_INPUT 256
+#define MAX_SWIPES 4              // tracks kept while one is answered
+
+enum readerState {
+	READER_CONFIGURING,
+	READER_READY,
+	READER_SWIPED,
+	READER_ANSWERING
+};
+
+class msrReader {
+public:
+	msrReader(const std::string &path, int fd);
+	~msrReader();
+
+	bool start(int64_t now);
+	bool readable(int64_t now);
+	bool wake(int64_t now, std::string &track);
+	bool answer(bool approved, int64_t now);
+
+	int fd() const { return descriptor; }
+	const std::string &path() const { return name; }
+	readerState state() const { return current; }
+	int64_t deadline() const { return due; }
+
+	/* configure: raw 38400 baud, nothing waited for in read() */
+	static bool configure(int fd);
+
+private:
+	msrReader(const msrReader &);
+	msrReader &operator=(const msrReader &);
+
+	struct step {
+		std::string command;   // "" for a pause
+		int64_t pause;
+	};
+
+	void queue(const char *command, size_t length);
+	void queuePause(int64_t pause);
+	bool advance(int64_t now);
+	bool take(const msrRecord &record, int64_t now);
+
+	std::string name;
+	int descriptor;
+	readerState current;
+	std::deque<step> steps;
+	bool waiting;              // for the reader to answer a command
+	int64_t due;               // 0 for nothing
+	msrFramer framer;
+	std::deque<std::string> swipes;
+};
+
+/* readerService: every reader of the machine from one poll() loop.
+ *
+ * Readers are the devices given to add() and the entries of a watched
+ * directory that match a pattern (e.g. /dev and ttyUSB*). inotify says
+ * when the directory changes, and the directory is also rescanned every
+ * RESCAN_INTERVAL for devices that could not be opened when they first
+ * appeared (udev sets permissions after creating the node). A reader that
+ * hangs up or fails is closed and opened again when it reappears.
+ *
+ * The loop sleeps until a reader sends something or its next deadline, so
+ * idle readers cost nothing, where one process per reader used to wake
+ * every second each.
+ *
+ * A swipe is passed to the handler, whose answer lights the reader green
+ * (true) or red. */
+
+#define RESCAN_INTERVAL 10000000  // microseconds
+
+typedef bool (*swipeHandler)(const std::string &reader, const std::string &track,
+                             void *context);
+
+class readerService {
+public:
+	readerService(swipeHandler handler, void *context);
+	~readerService();
+
+	bool watch(const char *directory, const char *pattern);
+	void add(const char *path);
+	bool step(int maxWait);
+
+	size_t readers() const { return active.size(); }
+	size_t ready() const;
+
+	static int64_t now();
+
+private:
+	readerService(const readerService &);
+	readerService &operator=(const readerService &);
+
+	void rescan(int64_t now);
+	void open(const std::string &path, int64_t now);
+	void remove(size_t i);
+	bool present(const std::string &path) const;
+
+	swipeHandler handler;
+	void *context;
+	std::vector<msrReader *> active;
+	std::vector<std::string> devices;
+	std::string directory;
+	std::string pattern;
+	int notify;
+	int64_t nextRescan;
+	std::vector<struct pollfd> polled;
+};
+
+#endif
@@ -0,0 +1,235 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <pty.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <termios.h>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include "msrReader.h"
+
+#define READERS 48
+#define SWIPE_SECONDS 20
+#define IDLE_SECONDS 5
+
+using namespace std;
+
+/* standIn: the device end of one pty, playing a stripe reader. It
+ * answers every command with ACK, and swipes a card every 2 to 4 seconds
+ * while reading is on. */
+struct standIn {
+	int master;
+	string link;          // the ttyUSB<n> symlink the service sees
+	string frame;         // command bytes not yet complete
+	bool reading;
+	int64_t swipeAt;      // 0 while not reading
+	int64_t swipedAt;     // 0 while no swipe is waiting for its LED
+};
+
+atomic<bool> stopService(false);
+atomic<size_t> serviceReaders(0), serviceReady(0);
+atomic<unsigned long> approvals(0), steps(0);
+
+/* approve: every card is good */
+static bool approve(const string &, const string &, void *) {
+	approvals++;
+	return true;
+}
+
+/* serve: the service thread; SIGUSR1 gets it out of poll() to stop */
+static void wakeUp(int) {
+}
+
+static void serve(readerService *service) {
+	while(!stopService) {
+		service->step(-1);
+		steps++;
+		serviceReaders = service->readers();
+		serviceReady = service->ready();
+	}
+}
+
+static bool plug(const string &directory, int n, standIn &reader) {
+	int slave;
+	char name[64];
+	struct termios raw;
+
+	if(openpty(&reader.master, &slave, name, NULL, NULL) != 0)
+		return false;
+	cfmakeraw(&raw);
+	tcsetattr(reader.master, TCSANOW, &raw);
+	close(slave);
+	fcntl(reader.master, F_SETFL, O_NONBLOCK);
+
+	reader.link = directory + "/ttyUSB" + to_string(n);
+	reader.frame.clear();
+	reader.reading = false;
+	reader.swipeAt = reader.swipedAt = 0;
+	return symlink(name, reader.link.c_str()) == 0;
+}
+
+static void unplug(standIn &reader) {
+	unlink(reader.link.c_str());
+	close(reader.master);
+	reader.master = -1;
+}
+
+/* command: one whole frame, 0x60 0x00 <n> <n bytes> <LRC> ETX */
+static void command(standIn &reader, const string &frame, int64_t now,
+                    vector<int64_t> &latency) {
+	const char *body = frame.data() + 3;
+
+	if(frame[3] == 0x53 && frame[4] == 0x1a) {
+		reader.reading = frame[6] == 0x31;
+		reader.swipeAt = reader.reading ? now + 2000000 + rand() % 2000000 : 0;
+	}
+	if(body[0] == 0x6c && body[1] == 0x31 && reader.swipedAt != 0) {
+		latency.push_back(now - reader.swipedAt);
+		reader.swipedAt = 0;
+	}
+	if(write(reader.master, "\x06", 1) != 1)
+		perror("readerBench: write");
+}
+
+static void play(vector<standIn> &readers, int64_t until, bool swipe,
+                 vector<int64_t> &latency) {
+	vector<struct pollfd> polled(readers.size());
+	string card = ";6011000990139424=2512?";
+
+	card += msrFramer::trackLrc(card.data(), card.size());
+
+	for(int64_t now = readerService::now(); now < until;
+	    now = readerService::now()) {
+		for(size_t i = 0; i < readers.size(); i++) {
+			polled[i].fd = readers[i].master;
+			polled[i].events = POLLIN;
+		}
+		poll(&polled[0], polled.size(), 10);
+		now = readerService::now();
+
+		for(size_t i = 0; i < readers.size(); i++) {
+			standIn &reader = readers[i];
+			char buf[256];
+			ssize_t length;
+
+			if(reader.master < 0)
+				continue;
+			while((length = read(reader.master, buf, sizeof(buf))) > 0) {
+				reader.frame.append(buf, length);
+				while(reader.frame.size() >= 4 &&
+				      reader.frame.size() >= (size_t)reader.frame[2] + 5) {
+					size_t size = reader.frame[2] + 5;
+					command(reader, reader.frame.substr(0, size), now, latency);
+					reader.frame.erase(0, size);
+				}
+			}
+
+			if(swipe && reader.swipeAt != 0 && now >= reader.swipeAt) {
+				if(write(reader.master, card.data(), card.size()) < 0)
+					perror("readerBench: write");
+				reader.swipeAt = 0;
+				reader.swipedAt = now;
+			}
+		}
+	}
+}
+
+static double threadSeconds(clockid_t clock) {
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* waitFor: until the service has count readers (ready ones if ready),
+ * playing the stand-ins meanwhile. Returns the milliseconds it took. */
+static double waitFor(vector<standIn> &readers, size_t count, bool ready) {
+	vector<int64_t> unused;
+	int64_t start = readerService::now();
+
+	while((ready ? serviceReady : serviceReaders) != count &&
+	      readerService::now() < start + 30000000)
+		play(readers, readerService::now() + 1000, false, unused);
+	return (readerService::now() - start) / 1000.0;
+}
+
+/* readerBench: READERS stand-in readers behind one readerService thread.
+ * Times swipe-to-green-LED latency and the service's CPU use while every
+ * reader swipes, hot-plug detection, and CPU use while all are idle. */
+int main(int argc, char *argv[]) {
+	int count = argc > 1 ? atoi(argv[1]) : READERS;
+	char scratch[] = "/tmp/readerBenchXXXXXX";
+	vector<standIn> readers(count);
+	vector<int64_t> latency;
+	readerService service(approve, NULL);
+	clockid_t serviceClock;
+	double cpu, wall;
+
+	if(mkdtemp(scratch) == NULL) {
+		perror("readerBench: mkdtemp");
+		return 1;
+	}
+	for(int i = 0; i < count; i++)
+		if(!plug(scratch, i, readers[i])) {
+			perror("readerBench: pty");
+			return 1;
+		}
+
+	signal(SIGUSR1, wakeUp);
+	service.watch(scratch, "ttyUSB*");
+	thread serviceThread(serve, &service);
+	pthread_getcpuclockid(serviceThread.native_handle(), &serviceClock);
+
+	printf("%d readers configured in %.0f ms\n", count,
+	       waitFor(readers, count, true));
+
+	unsigned long before = approvals;
+	cpu = threadSeconds(serviceClock);
+	wall = SWIPE_SECONDS;
+	play(readers, readerService::now() + SWIPE_SECONDS * 1000000LL, true,
+	     latency);
+	cpu = threadSeconds(serviceClock) - cpu;
+	sort(latency.begin(), latency.end());
+	if(!latency.empty())
+		printf("swipes: %lu approved in %.0f s, swipe to green LED p50 %.2f ms, "
+		       "p99 %.2f ms, max %.2f ms\n", approvals - before, wall,
+		       latency[latency.size() / 2] / 1000.0,
+		       latency[latency.size() * 99 / 100] / 1000.0,
+		       latency.back() / 1000.0);
+	printf("service CPU while swiping: %.2f%% of one core\n", 100 * cpu / wall);
+
+	// settle, so that no LED is still on
+	waitFor(readers, count, true);
+
+	for(int i = 0; i < count; i += 2)
+		unplug(readers[i]);
+	printf("unplugged %d: noticed in %.0f ms\n", (count + 1) / 2,
+	       waitFor(readers, count / 2, false));
+	for(int i = 0; i < count; i += 2)
+		plug(scratch, count + i, readers[i]);
+	printf("plugged %d new: ready in %.0f ms\n", (count + 1) / 2,
+	       waitFor(readers, count, true));
+
+	unsigned long idleSteps = steps;
+	cpu = threadSeconds(serviceClock);
+	sleep(IDLE_SECONDS);
+	cpu = threadSeconds(serviceClock) - cpu;
+	printf("idle: %.1f wake-ups/s with %d readers, service CPU %.3f%%\n",
+	       (steps - idleSteps) / (double)IDLE_SECONDS, count,
+	       100 * cpu / IDLE_SECONDS);
+
+	stopService = true;
+	pthread_kill(serviceThread.native_handle(), SIGUSR1);
+	serviceThread.join();
+	for(int i = 0; i < count; i++)
+		unplug(readers[i]);
+	rmdir(scratch);
+	return 0;
+}
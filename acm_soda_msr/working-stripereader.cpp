@@ -1,174 +1,92 @@
 #include <string>
 #include <iostream>
-#include <strings.h>
-#include <fcntl.h>
-#include <termios.h>
 #include <stdio.h>
-#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "accountIndex.h"
+#include "msrReader.h"
 
-#define DEBUG 0
+#define ACCOUNT_INDEX "accounts.idx"
+#define READER_DIRECTORY "/dev"
+#define READER_PATTERN "ttyUSB*"
 
 using namespace std;
 
-/* getlrc: calculates LRC of commands, which is computed by xor of all bytes */
-char getlrc(string buf) {
-	char lrc='\x60';
-	for(int i=0; i<buf.size(); i++) {
-		lrc ^= buf[i];
-	}
-	return lrc;
-}
-
-/* send: send command string on serial FD */
-void send(int fd, string in) {
-	char lrc;
-	const char ETX='\x03';
-  const int BUFFER_SIZE = 256;
-  char input_buffer[BUFFER_SIZE];
-
-	char buf[BUFFER_SIZE];
-	int size=2;
-	char *inptr;
-	int nbytes;
-	bzero(input_buffer, BUFFER_SIZE);
+/* accounts: the card index, swapped for a newer one on SIGHUP */
+accountIndexHolder accounts;
+volatile sig_atomic_t reloadAccounts = 1;
 
-	buf[0] = '\x60';
-	buf[1] = '\x00';
-
-	if(in.size()+2 >= BUFFER_SIZE) {
-		// command too long, abort.
-		return;
-	}
-	for(int i=0; i<in.size(); i++) {
-		buf[size] = in[i];
-		size++;
-	}
-
-	// calculate the LRC, append the ETX character
-	lrc=getlrc(in);
-	buf[size] = lrc;
-	size++;
-	buf[size] = ETX;
-	size++;
+void hangup(int) {
+	reloadAccounts = 1;
+}
 
-#if DEBUG
-	cout << size << endl;
-	for(int i=0; i<size; i++) {
-		cout << hex << (int)buf[i] << " ";
-	}
-	cout << dec << endl;
-#endif
+/* swiped: looks the card up and tells the reader whether it is good */
+bool swiped(const string &reader, const string &track, void *) {
+	accountEntry account;
 
-	// send and wait for an exorbinantly long time
-	write(fd, buf, size);
-	usleep(1000000);
-#if DEBUG
-	// read and show the serial buffer
-	read(fd, input_buffer, BUFFER_SIZE);
-	for(int i=0; i<BUFFER_SIZE; i++) {
-		cout << hex << (int)input_buffer[i] << dec << " ";
-		if(input_buffer[i] == '\x03') {
-			i=BUFFER_SIZE;
-		}
-	}
-	cout << endl;
-#endif
-	// flush anything remaining in buffers
-	tcflush(fd, TCIOFLUSH);
+	cout << reader << " " << track << endl;
+	return accounts.lookup(track.c_str(), account) &&
+	       account.status == ACCOUNT_ACTIVE && account.balance > 0;
 }
 
-/* main: program loop: set up reader, read data */
+/* main: every reader from one loop
+ *
+ * stripereader [-i index] [-w directory] [-m pattern] [device...]
+ *
+ * Readers are the devices named, and the entries of -w (default /dev)
+ * matching -m (default ttyUSB*), as they come and go. A plain file as the
+ * only argument is the index, as before -i. */
 int main(int argc, char *argv[]) {
-  string buf;
-  const int BUFFER_SIZE = 256;
-  char input_buffer[BUFFER_SIZE];
-	int fd;
-	struct termios options;
-	char *inptr;
-	int nbytes;
-
-	/* open the port */
-	fd = open("/dev/ttyUSB0", O_RDWR | O_NOCTTY | O_NDELAY);
-	fcntl(fd, F_SETFL, 0);
-
-	/* get the current options */
-	tcgetattr(fd, &options);
-
-	/* set raw input, 1 second timeout */
-	cfsetispeed(&options, B38400);
-	options.c_cflag |= (CLOCAL | CREAD);
-	options.c_lflag &= ~(ICANON | ECHO | ECHOE | ISIG);
-	options.c_oflag &= ~OPOST;
-	options.c_cc[VMIN] = 0;
-	options.c_cc[VTIME] = 10;
-
-	// Set Reader Option, LED Controlled by Host, No MSR Data Envelope,
-	// Standard Decoder
-	buf="\x04\x53\x11\x01\x10";
-	send(fd, buf);
+	const char *indexPath = ACCOUNT_INDEX;
+	const char *directory = READER_DIRECTORY;
+	const char *pattern = READER_PATTERN;
+	readerService readers(swiped, NULL);
+	struct stat status;
+	int option;
+
+	while((option = getopt(argc, argv, "i:w:m:")) != -1) {
+		switch(option) {
+		case 'i':
+			indexPath = optarg;
+			break;
+		case 'w':
+			directory = optarg;
+			break;
+		case 'm':
+			pattern = optarg;
+			break;
+		default:
+			cerr << "Usage: stripereader [-i index] [-w directory] "
+			     << "[-m pattern] [device...]" << endl;
+			return 1;
+		}
+	}
 
-	// Set Track Selection, Track 2 Only
-  buf="\x04\x53\x13\x01\x32";
-	send(fd, buf);
+	if(argc - optind == 1 && stat(argv[optind], &status) == 0 &&
+	   S_ISREG(status.st_mode))
+		indexPath = argv[optind++];
+	for(; optind < argc; optind++)
+		readers.add(argv[optind]);
 
-	// Set MSR Reading Enable
-	buf="\x04\x53\x1a\x01\x31";
-	send(fd, buf);
+	signal(SIGHUP, hangup);
 
-	// Set LED Command, LED OFF
-	buf="\x02\x6c\x30";
-	send(fd, buf);
+	if(!readers.watch(directory, pattern))
+		cerr << "Cannot watch " << directory << ", looking every "
+		     << RESCAN_INTERVAL / 1000000 << " seconds instead" << endl;
 
 	while(1) {
-		bzero(input_buffer, BUFFER_SIZE);
-
-		if(read(fd, input_buffer, sizeof(input_buffer))) {
-			if(input_buffer[0] != ';' || input_buffer[strlen(input_buffer)-2] != '?')
-				continue;
-			cout << input_buffer << endl;
-
-			// Set MSR Reading Disable
-			buf="\x04\x53\x1a\x01\x30";
-			send(fd, buf);
-
-			// Set LED Command, LED Amber
-			buf="\x02\x6c\x33";
-			send(fd, buf);
-
-			// Query account here
-#if DEBUG
-			for(int i=0; i<BUFFER_SIZE; i++) {
-				cout << hex << (int)input_buffer[i] << dec << " ";
-				if(input_buffer[i] == '\x03') {
-					i=BUFFER_SIZE;
-				}
-			}
-			cout << endl;
-#endif
-
-			if (1) { // Account OK
-				// Set LED Command, LED Green
-				buf="\x02\x6c\x31";
-				send(fd, buf);
-			}
-			else { // Account invalid/NSF
-				// Set LED Command, LED Red
-				buf="\x02\x6c\x32";
-				send(fd, buf);
-			}
-			usleep(1000000);
-
-			// Set LED Command, LED Off
-			buf="\x02\x6c\x30";
-			send(fd, buf);
+		if(reloadAccounts) {
+			reloadAccounts = 0;
+			if(!accounts.reload(indexPath))
+				cerr << "Could not load account index " << indexPath << endl;
+		}
 
-			// Set MSR Reading Enable
-			buf="\x04\x53\x1a\x01\x31";
-			send(fd, buf);
+		if(!readers.step(-1)) {
+			perror("stripereader: poll");
+			return 1;
 		}
 	}
 
-	close(fd);
-
 	return 0;
 }